@@ -19,11 +19,13 @@
 
 #include <array>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <string>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 
@@ -33,6 +35,10 @@ namespace thestral {
 
 typedef boost::system::error_code ec_type;
 
+/// Result of parsing a packet from buffered bytes.
+THESTRAL_DEFINE_ENUM(ParseResult, uint8_t, (kOk, 0), (kIncomplete, 1),
+                     (kInvalid, 2));
+
 /// Base class of all transport types. A transport object represents an
 /// established connection and provides interfaces to asynchronously talk to the
 /// remote peer.
@@ -41,7 +47,10 @@ class TransportBase {
   typedef std::function<void(const ec_type&, std::size_t)> ReadCallbackType;
   typedef std::function<void(const ec_type&, std::size_t)> WriteCallbackType;
   typedef std::function<void(const ec_type&)> CloseCallbackType;
+  typedef std::function<void(const ec_type&)> WaitCallbackType;
   typedef std::uint_fast64_t IdType;
+  /// Buffers written one after another by a single gathering write.
+  typedef std::vector<boost::asio::const_buffer> ConstBufferSequence;
 
   TransportBase() : id_(GetNextId()) {}
   virtual ~TransportBase() {}
@@ -62,6 +71,21 @@ class TransportBase {
   /// Starts an asynchronous writing opeation.
   virtual void StartWrite(const boost::asio::const_buffers_1& buf,
                           const WriteCallbackType& callback) = 0;
+  /// Starts writing several buffers as if they were one, with a single
+  /// `writev()` where the transport can, and completes once all of them are
+  /// written. The sequence may go away after this returns, the data may not.
+  /// The default implementation copies the buffers into one unless there is
+  /// only one.
+  virtual void StartWrite(const ConstBufferSequence& buffers,
+                          const WriteCallbackType& callback);
+  /// Starts waiting until data is available for reading, without consuming
+  /// it, so that callers don't have to provide a buffer before there is
+  /// something to read. The default implementation completes immediately,
+  /// which is always allowed: a following read simply may not complete at
+  /// once.
+  virtual void StartWaitReadable(const WaitCallbackType& callback) {
+    callback(ec_type());
+  }
   /// Starts an asynchronous closing opeation.
   /// The transport should be closed by the one who "owns" it currently, i.e.
   /// * the object who created it, if the transport is in the middle of
@@ -69,6 +93,13 @@ class TransportBase {
   /// * the object who is using it, if the transport has been established
   /// If a transport has been closed, it should not be passed to other objects.
   virtual void StartClose(const CloseCallbackType& callback) = 0;
+  /// Starts shutting down the sending side, so that the peer sees the end
+  /// of stream while data can still be read from it. Transports that can't
+  /// be half-closed complete with `operation_not_supported`, and should be
+  /// closed by the caller instead.
+  virtual void StartShutdownSend(const CloseCallbackType& callback) {
+    callback(boost::asio::error::operation_not_supported);
+  }
 
   /// Convenience function for constructing and reading into a buffer.
   template <
@@ -96,7 +127,9 @@ class TransportBase {
   template <typename T,
             typename std::enable_if<
                 !(std::is_same<T, boost::asio::const_buffers_1&>::value ||
-                  std::is_convertible<T, boost::asio::const_buffers_1>::value),
+                  std::is_convertible<T, boost::asio::const_buffers_1>::value ||
+                  std::is_same<typename std::decay<T>::type,
+                               ConstBufferSequence>::value),
                 int>::type = 0>
   void StartWrite(T&& data, const WriteCallbackType& callback) {
     // asio::buffer() may create a `mutable_buffers_1`, which is not implicitly
@@ -173,6 +206,15 @@ class UpstreamFactoryBase {
   /// Returns a pointer to the `io_service` bound with this factory.
   virtual std::shared_ptr<boost::asio::io_service> get_io_service_ptr()
       const = 0;
+
+  /// Returns whether a failed request tells the upstream itself is in
+  /// trouble, e.g. cannot be connected, rather than the endpoint requested
+  /// being unreachable through it.
+  virtual bool IsUpstreamFailure(const ec_type&) const { return true; }
+  /// Returns whether the result of a request tells how the upstream is
+  /// doing, which is not the case if it succeeds before the request is
+  /// carried out.
+  virtual bool CanHealthCheck() const { return true; }
 };
 
 /// Base class of servers. The server understands the downstream protocol.
@@ -183,6 +225,11 @@ class ServerBase {
   virtual ~ServerBase() {}
   /// Starts the server.
   virtual void Start() = 0;
+  /// Stops accepting new connections. Sessions already established go on.
+  virtual void Stop() {}
+  /// Returns the number of sessions in progress. It may be called from any
+  /// thread.
+  virtual std::size_t CountSessions() const { return 0; }
 };
 
 /// Base class of transferable packet classes. As a convention, a subclass
@@ -192,6 +239,13 @@ class ServerBase {
 /// static void StartCreateFrom(const std::shared_ptr<TransportBase>& transport,
 ///                             const CreateCallbackType& callback);
 /// ```
+/// A subclass may also implement parsing from buffered bytes as follows, which
+/// is required to read it with PacketReader. On success, `n_consumed` is set to
+/// the size of the packet.
+/// ```cpp
+/// ParseResult ParseFrom(const char* data, std::size_t size,
+///                       std::size_t* n_consumed);
+/// ```
 class PacketBase {
  public:
   /// Writes the packet into the transport object asynchronously. The default
@@ -203,7 +257,11 @@ class PacketBase {
   /// implementation always returns `true`.
   virtual bool Validate() const { return true; }
   /// Returns a string representation of the packet.
-  virtual std::string Serialize() const = 0;
+  std::string Serialize() const;
+  /// Appends the string representation of the packet to `data`, so that
+  /// packets sent together are serialized into one buffer without
+  /// intermediate strings.
+  virtual void SerializeTo(std::string* data) const = 0;
 };
 
 /// Class template for packets with two consecutive parts, a header and a body.
@@ -223,8 +281,10 @@ struct PacketWithHeader : PacketBase {
   static void StartCreateFrom(const std::shared_ptr<TransportBase>& transport,
                               const CreateCallbackType& callback);
 
+  ParseResult ParseFrom(const char* data, std::size_t size,
+                        std::size_t* n_consumed);
   bool Validate() const override;
-  std::string Serialize() const override;
+  void SerializeTo(std::string* data) const override;
 };
 
 template <typename Header, typename Body>
@@ -255,8 +315,25 @@ void PacketWithHeader<Header, Body>::StartCreateFrom(
 }
 
 template <typename Header, typename Body>
-std::string PacketWithHeader<Header, Body>::Serialize() const {
-  return header.Serialize() + body.Serialize();
+ParseResult PacketWithHeader<Header, Body>::ParseFrom(const char* data,
+                                                      std::size_t size,
+                                                      std::size_t* n_consumed) {
+  std::size_t header_size = 0;
+  std::size_t body_size = 0;
+  auto result = header.ParseFrom(data, size, &header_size);
+  if (result == ParseResult::kOk) {
+    result = body.ParseFrom(data + header_size, size - header_size, &body_size);
+  }
+  if (result == ParseResult::kOk) {
+    *n_consumed = header_size + body_size;
+  }
+  return result;
+}
+
+template <typename Header, typename Body>
+void PacketWithHeader<Header, Body>::SerializeTo(std::string* data) const {
+  header.SerializeTo(data);
+  body.SerializeTo(data);
 }
 
 /// Class template for fixed size packet. The subclasses only need to implement
@@ -272,7 +349,9 @@ class PacketWithSize : public PacketBase {
   static void StartCreateFrom(std::shared_ptr<TransportBase> transport,
                               const CreateCallbackType& callback);
 
-  std::string Serialize() const override;
+  ParseResult ParseFrom(const char* data, std::size_t size,
+                        std::size_t* n_consumed);
+  void SerializeTo(std::string* data) const override;
   /// Writes the bytes representation to a pre-allocated memory area.
   virtual void ToBytes(char* data) const = 0;
   /// Fills the packet fields from bytes.
@@ -295,10 +374,118 @@ void PacketWithSize<PacketType, N>::StartCreateFrom(
 }
 
 template <typename PacketType, size_t N>
-std::string PacketWithSize<PacketType, N>::Serialize() const {
-  std::string data(N, '\0');
-  ToBytes(&data[0]);
-  return data;
+ParseResult PacketWithSize<PacketType, N>::ParseFrom(const char* data,
+                                                     std::size_t size,
+                                                     std::size_t* n_consumed) {
+  if (size < N) {
+    return ParseResult::kIncomplete;
+  }
+  FromBytes(data);
+  *n_consumed = N;
+  return ParseResult::kOk;
+}
+
+template <typename PacketType, size_t N>
+void PacketWithSize<PacketType, N>::SerializeTo(std::string* data) const {
+  auto offset = data->size();
+  data->resize(offset + N);
+  ToBytes(&(*data)[offset]);
+}
+
+/// Reads packets from a transport through a small buffer. Each read takes
+/// whatever bytes are available, so packets arriving together, e.g. pipelined
+/// by the peer, are parsed without further reads. Bytes left in the buffer
+/// after the last packet can be taken with TakeBuffered().
+class PacketReader : public std::enable_shared_from_this<PacketReader> {
+ public:
+  /// Size of the buffer, which limits the size of a single packet.
+  constexpr static std::size_t kBufferSize = 0x400;
+
+  PacketReader(const PacketReader&) = delete;
+  PacketReader& operator=(const PacketReader&) = delete;
+
+  static std::shared_ptr<PacketReader> New(
+      const std::shared_ptr<TransportBase>& transport) {
+    return std::shared_ptr<PacketReader>(new PacketReader(transport));
+  }
+
+  /// Returns the transport this reader reads from.
+  const std::shared_ptr<TransportBase>& GetTransport() const {
+    return transport_;
+  }
+
+  /// Reads a packet. Buffered bytes are parsed first and the transport is
+  /// read only if they are insufficient, in which case the callback may be
+  /// called before this function returns. Malformed packets are reported with
+  /// `errc::protocol_error`.
+  template <typename PacketType>
+  void StartReadPacket(const typename PacketType::CreateCallbackType& callback);
+
+  /// Returns whether there are bytes read but not consumed by any packet.
+  bool HasBuffered() const { return begin_ != end_; }
+
+  /// Returns the bytes that have been read but not consumed by any packet and
+  /// removes them from the buffer.
+  std::string TakeBuffered() {
+    std::string data(buf_.data() + begin_, end_ - begin_);
+    begin_ = end_ = 0;
+    return data;
+  }
+
+ private:
+  explicit PacketReader(const std::shared_ptr<TransportBase>& transport)
+      : transport_(transport) {}
+
+  const std::shared_ptr<TransportBase> transport_;
+  std::array<char, kBufferSize> buf_;
+  /// Range of the buffered bytes not yet consumed.
+  std::size_t begin_ = 0;
+  std::size_t end_ = 0;
+};
+
+template <typename PacketType>
+void PacketReader::StartReadPacket(
+    const typename PacketType::CreateCallbackType& callback) {
+  PacketType packet;
+  std::size_t n_consumed = 0;
+  switch (packet.ParseFrom(buf_.data() + begin_, end_ - begin_, &n_consumed)) {
+    case ParseResult::kOk:
+      begin_ += n_consumed;
+      callback(ec_type(), packet);
+      return;
+    case ParseResult::kInvalid:
+      callback(boost::system::errc::make_error_code(
+                   boost::system::errc::protocol_error),
+               PacketType());
+      return;
+    default:  // incomplete, read some more bytes
+      break;
+  }
+
+  if (begin_ > 0) {  // move the partial packet to the front
+    std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+    end_ -= begin_;
+    begin_ = 0;
+  }
+  if (end_ == buf_.size()) {
+    callback(boost::system::errc::make_error_code(
+                 boost::system::errc::message_size),
+             PacketType());
+    return;
+  }
+
+  auto self = shared_from_this();
+  transport_->StartRead(
+      buf_.data() + end_, buf_.size() - end_,
+      [self, callback](const ec_type& ec, std::size_t bytes_read) {
+        if (ec || bytes_read == 0) {
+          callback(ec ? ec : boost::asio::error::eof, PacketType());
+          return;
+        }
+        self->end_ += bytes_read;
+        self->StartReadPacket<PacketType>(callback);
+      },
+      true /* allow short read */);
 }
 
 }  // namespace thestral
@@ -0,0 +1,95 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines a pool of size-classed buffers bound to an io_service.
+#ifndef THESTRAL_BUFFER_POOL_H_
+#define THESTRAL_BUFFER_POOL_H_
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace thestral {
+
+/// A pool of buffers, implemented as an `io_service` service so that every
+/// `io_service` owns exactly one pool. Buffers come in a few size classes and
+/// are recycled instead of being freed. The pool is not thread-safe. It should
+/// only be used by handlers running on its `io_service`, which is the case
+/// when every `io_service` is run by a single thread.
+class BufferPool : public boost::asio::io_service::service {
+ public:
+  /// A buffer borrowed from a pool. It goes back to the pool on destruction or
+  /// when Release() is called.
+  class Buffer {
+   public:
+    Buffer() = default;
+    Buffer(Buffer&& other) { *this = std::move(other); }
+    Buffer& operator=(Buffer&& other);
+    ~Buffer() { Release(); }
+
+    char* data() const { return data_.get(); }
+    std::size_t size() const { return size_; }
+    std::size_t size_class() const { return size_class_; }
+    explicit operator bool() const { return data_ != nullptr; }
+
+    /// Returns the buffer to the pool.
+    void Release();
+
+   private:
+    friend class BufferPool;
+
+    BufferPool* pool_ = nullptr;
+    std::size_t size_class_ = 0;
+    std::size_t size_ = 0;
+    std::unique_ptr<char[]> data_;
+  };
+
+  /// Number of size classes.
+  constexpr static std::size_t kNumSizeClasses = 3;
+
+  static boost::asio::io_service::id id;
+
+  explicit BufferPool(boost::asio::io_service& io_service)
+      : boost::asio::io_service::service(io_service) {}
+
+  /// Returns the size in bytes of buffers of a given size class.
+  static std::size_t GetSizeOfClass(std::size_t size_class);
+
+  /// Takes a buffer of a given size class from the pool. A new buffer will be
+  /// allocated if there is no idle one.
+  Buffer Acquire(std::size_t size_class);
+
+  /// Returns the number of idle buffers of a given size class.
+  std::size_t GetIdleCount(std::size_t size_class) const {
+    return free_lists_[size_class].size();
+  }
+
+ private:
+  /// Maximum number of idle buffers kept in each size class. Buffers returned
+  /// beyond this limit are freed, so that a burst doesn't pin its peak memory.
+  constexpr static std::size_t kMaxIdleBuffersPerClass = 64;
+
+  void shutdown_service() override {}
+  void Return(std::size_t size_class, std::unique_ptr<char[]>&& data);
+
+  std::array<std::vector<std::unique_ptr<char[]>>, kNumSizeClasses>
+      free_lists_;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_BUFFER_POOL_H_
@@ -17,9 +17,12 @@
 #ifndef THESTRAL_COMMON_H_
 #define THESTRAL_COMMON_H_
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
-#include <sstream>
+#include <iterator>
+#include <memory>
 #include <string>
 
 #include <boost/asio/ip/address.hpp>
@@ -65,41 +68,177 @@ namespace thestral {
 THESTRAL_DEFINE_ENUM(AddressType, uint8_t, (kIPv4, 0x1), (kDomainName, 0x3),
                      (kIPv6, 0x4));
 
+/// Host part of an Address, i.e. the raw bytes of an IP address or a domain
+/// name. It mimics the parts of `std::string` used on hosts, but keeps up to
+/// kInlineSize bytes, which covers IP addresses and most domain names, inside
+/// the object so that copying an Address around does not allocate.
+class AddressHost {
+ public:
+  /// Maximum number of bytes stored without allocating.
+  constexpr static std::size_t kInlineSize = 43;
+
+  AddressHost() = default;
+  AddressHost(std::size_t size, char c) { resize(size, c); }
+  AddressHost(const char* data, std::size_t size) { assign(data, size); }
+  AddressHost(const char* str)  // NOLINT(runtime/explicit)
+      : AddressHost(str, std::strlen(str)) {}
+  AddressHost(const std::string& str)  // NOLINT(runtime/explicit)
+      : AddressHost(str.data(), str.size()) {}
+  AddressHost(const AddressHost& other)
+      : AddressHost(other.data(), other.size_) {}
+  AddressHost(AddressHost&& other) noexcept { *this = std::move(other); }
+
+  AddressHost& operator=(const AddressHost& other) {
+    if (this != &other) {
+      assign(other.data(), other.size_);
+    }
+    return *this;
+  }
+
+  AddressHost& operator=(AddressHost&& other) noexcept {
+    if (this == &other) {
+      return *this;
+    }
+    if (other.heap_) {
+      heap_ = std::move(other.heap_);
+      capacity_ = other.capacity_;
+      size_ = other.size_;
+      other.capacity_ = kInlineSize;
+      other.size_ = 0;
+      other.inline_[0] = '\0';
+    } else {
+      assign(other.inline_, other.size_);
+    }
+    return *this;
+  }
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const char* data() const { return heap_ ? heap_.get() : inline_; }
+  char* data() { return heap_ ? heap_.get() : inline_; }
+  /// Returns the bytes followed by a null character, like `std::string`.
+  const char* c_str() const { return data(); }
+
+  char& operator[](std::size_t index) { return data()[index]; }
+  const char& operator[](std::size_t index) const { return data()[index]; }
+  char back() const { return data()[size_ - 1]; }
+
+  const char* begin() const { return data(); }
+  const char* end() const { return data() + size_; }
+  const char* cbegin() const { return begin(); }
+  const char* cend() const { return end(); }
+
+  /// Copies at most `count` bytes to `dest` and returns the number copied.
+  std::size_t copy(char* dest, std::size_t count) const {
+    count = std::min(count, size());
+    std::memcpy(dest, data(), count);
+    return count;
+  }
+
+  /// Resizes the host, filling new bytes with `c`.
+  void resize(std::size_t size, char c = '\0') {
+    Reserve(size);
+    if (size > size_) {
+      std::memset(data() + size_, c, size - size_);
+    }
+    size_ = static_cast<uint16_t>(size);
+    data()[size_] = '\0';
+  }
+
+  void assign(const char* bytes, std::size_t size) {
+    Reserve(size);
+    std::memmove(data(), bytes, size);
+    size_ = static_cast<uint16_t>(size);
+    data()[size_] = '\0';
+  }
+
+  /// Assigns the bytes in `[first, last)`, of any character-like type.
+  template <typename Iterator>
+  void assign(Iterator first, Iterator last) {
+    Reserve(static_cast<std::size_t>(std::distance(first, last)));
+    auto last_byte = std::transform(first, last, data(), [](char c) {
+      return c;
+    });
+    size_ = static_cast<uint16_t>(last_byte - data());
+    data()[size_] = '\0';
+  }
+
+  explicit operator std::string() const { return std::string(data(), size_); }
+
+  bool operator==(const AddressHost& other) const {
+    return size_ == other.size_ &&
+           std::memcmp(data(), other.data(), size_) == 0;
+  }
+  bool operator!=(const AddressHost& other) const { return !(*this == other); }
+
+ private:
+  /// Makes room for `size` bytes and a null character, keeping the content.
+  void Reserve(std::size_t size) {
+    if (size <= capacity_) {
+      return;
+    }
+    std::unique_ptr<char[]> heap(new char[size + 1]);
+    std::memcpy(heap.get(), data(), size_ + 1u);
+    heap_ = std::move(heap);
+    capacity_ = static_cast<uint16_t>(size);
+  }
+
+  uint16_t size_ = 0;
+  uint16_t capacity_ = kInlineSize;  ///< Excluding the null character
+  char inline_[kInlineSize + 1] = {};
+  std::unique_ptr<char[]> heap_;
+};
+
+inline bool operator==(const std::string& lhs, const AddressHost& rhs) {
+  return lhs.size() == rhs.size() &&
+         std::memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
+}
+
+inline bool operator==(const AddressHost& lhs, const std::string& rhs) {
+  return rhs == lhs;
+}
+
+template <typename C, typename T>
+std::basic_ostream<C, T>& operator<<(std::basic_ostream<C, T>& os,
+                                     const AddressHost& host) {
+  os.write(host.data(), static_cast<std::streamsize>(host.size()));
+  return os;
+}
+
 /// Address type used across the program.
 struct Address {
+  /// Text form of an Address held in a fixed buffer, so that formatting one
+  /// for logs does not allocate. Long domain names are truncated.
+  struct Formatted {
+    /// Enough for `[IPv6]:port` and host names of common lengths.
+    constexpr static std::size_t kMaxSize = 128;
+
+    const char* c_str() const { return buffer; }
+
+    char buffer[kMaxSize];
+  };
+
   AddressType type = AddressType::kIPv4;  ///< Type of the address
-  std::string host{0, 0, 0, 0};           ///< Host string of the address
+  AddressHost host = AddressHost(4, 0);   ///< Host bytes of the address
   uint16_t port = 0;                      ///< Port number of the address
 
   bool operator==(const Address& other) const {
     return type == other.type && host == other.host && port == other.port;
   }
 
-  std::string ToString() const {
-    std::ostringstream buf;
-    switch (type) {
-      case AddressType::kIPv4: {
-        boost::asio::ip::address_v4::bytes_type bytes;
-        host.copy(reinterpret_cast<char*>(bytes.data()), bytes.size());
-        boost::asio::ip::address_v4 addr(bytes);
-        buf << addr.to_string() << ':' << port;
-        break;
-      }
-      case AddressType::kIPv6: {
-        boost::asio::ip::address_v6::bytes_type bytes;
-        host.copy(reinterpret_cast<char*>(bytes.data()), bytes.size());
-        boost::asio::ip::address_v6 addr(bytes);
-        buf << '[' << addr.to_string() << "]:" << port;
-        break;
-      }
-      case AddressType::kDomainName: {
-        buf << host << ':' << port;
-        break;
-      }
-      default:
-        buf << "UNKNOWN ADDRESS TYPE";
-    }
-    return buf.str();
+  /// Formats the address as `host:port`, without allocating.
+  Formatted Format() const;
+  /// Returns the address as `host:port`, never truncated, unlike Format().
+  std::string ToString() const;
+
+  /// Converts an IP address to its asio counterpart. Returns an unspecified
+  /// address if the address is a domain name.
+  boost::asio::ip::address ToAsioAddress() const;
+
+  /// Converts an IP address to an asio endpoint of the given type.
+  template <typename EndpointType>
+  EndpointType ToAsioEndpoint() const {
+    return EndpointType(ToAsioAddress(), port);
   }
 
   /// Creates an Address from an asio endpoint. The type of the returned object
@@ -0,0 +1,129 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines a relay copying data between transports through pooled buffers.
+#ifndef THESTRAL_COPY_RELAY_H_
+#define THESTRAL_COPY_RELAY_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#include <boost/asio.hpp>
+
+#include "base.h"
+#include "buffer_pool.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "timing_wheel.h"
+#include "trace.h"
+
+namespace thestral {
+
+/// Relays data from one transport to another in a single direction by reading
+/// into a buffer and writing it out. It works with any kind of transports.
+///
+/// A buffer is taken from the BufferPool of the `io_service` only after the
+/// source becomes readable, and is returned as soon as the data has been
+/// written, so an idle relay holds no buffer at all. The size class of the
+/// buffer adapts to the traffic: it grows while reads keep filling the buffer
+/// up and shrinks when they only use a small part of it.
+///
+/// The relay keeps itself alive until done and hands only `this` to the
+/// transports, so that their callbacks fit in `std::function` without
+/// allocating, and neither does a relay iteration on plain TCP or SSL
+/// transports, whose handlers use HandlerMemory.
+///
+/// A shaped relay waits on the ShapingScheduler of the `io_service` for its
+/// buckets to have tokens each time the source becomes readable, leaving the
+/// data in the source meanwhile, and reads no more than what is granted.
+class CopyRelay : public std::enable_shared_from_this<CopyRelay> {
+ public:
+  typedef std::function<void(const ec_type&)> DoneCallbackType;
+
+  CopyRelay(const CopyRelay&) = delete;
+  CopyRelay& operator=(const CopyRelay&) = delete;
+
+  static std::shared_ptr<CopyRelay> New(
+      const std::shared_ptr<TransportBase>& from,
+      const std::shared_ptr<TransportBase>& to,
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
+    return std::shared_ptr<CopyRelay>(new CopyRelay(from, to, io_service_ptr));
+  }
+
+  /// Starts relaying. The callback will be called once, either when the source
+  /// reaches EOF (with `boost::asio::error::eof`) or when an error occurs.
+  void Start(const DoneCallbackType& callback);
+
+  /// Sets the counter of the bytes relayed, which must outlive the relay.
+  void SetByteCounter(const metrics::Counter* counter) {
+    byte_counter_ = counter;
+  }
+  /// Sets the timer to touch whenever data is relayed. The relay keeps it until
+  /// done.
+  void SetIdleTimer(const std::shared_ptr<TimingWheel::Timer>& timer) {
+    idle_timer_ = timer;
+  }
+  /// Sets the trace to record `event` in once the first bytes are relayed.
+  /// The relay keeps it until then.
+  void SetTrace(const std::shared_ptr<trace::Trace>& trace,
+                trace::Event event) {
+    trace_ = trace;
+    trace_event_ = event;
+  }
+  /// Sets the buckets of the limits of the relay, which it keeps until done.
+  void SetRateLimit(const std::shared_ptr<const BucketSet>& buckets) {
+    buckets_ = buckets;
+  }
+
+ private:
+  CopyRelay(const std::shared_ptr<TransportBase>& from,
+            const std::shared_ptr<TransportBase>& to,
+            const std::shared_ptr<boost::asio::io_service>& io_service_ptr)
+      : from_(from),
+        to_(to),
+        io_service_ptr_(io_service_ptr),
+        pool_(boost::asio::use_service<BufferPool>(*io_service_ptr)) {}
+
+  void WaitReadable();
+  /// Reads at most `max_bytes`.
+  void DoRead(std::size_t max_bytes);
+  void DoWrite(std::size_t n_bytes);
+  void Finish(const ec_type& ec);
+
+  const std::shared_ptr<TransportBase> from_;
+  const std::shared_ptr<TransportBase> to_;
+  /// Keeps the `io_service`, and therefore the pool, alive.
+  const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+  BufferPool& pool_;
+  /// The buffer in use, which is empty while waiting for data.
+  BufferPool::Buffer buffer_;
+  /// Size class of the next buffer to acquire.
+  std::size_t size_class_ = 0;
+  /// Bytes granted by the buckets and bytes asked for by the read pending.
+  std::size_t n_granted_ = 0;
+  std::size_t n_requested_ = 0;
+  DoneCallbackType callback_;
+  /// The relay itself, held from Start() until done.
+  std::shared_ptr<CopyRelay> self_;
+  const metrics::Counter* byte_counter_ = nullptr;
+  std::shared_ptr<TimingWheel::Timer> idle_timer_;
+  std::shared_ptr<const BucketSet> buckets_;
+  std::shared_ptr<trace::Trace> trace_;
+  trace::Event trace_event_ = trace::Event::kFirstByteUp;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_COPY_RELAY_H_
@@ -17,14 +17,19 @@
 #ifndef THESTRAL_DIRECT_UPSTREAM_H_
 #define THESTRAL_DIRECT_UPSTREAM_H_
 
+#include <chrono>
 #include <memory>
 
 #include <boost/asio.hpp>
 
 #include "base.h"
 #include "common.h"
+#include "dns_cache.h"
+#include "happy_eyeballs.h"
 #include "logging.h"
+#include "route_table.h"
 #include "tcp_transport.h"
+#include "trace.h"
 
 namespace thestral {
 
@@ -45,19 +50,44 @@ class DirectTcpUpstreamFactory
     return transport_factory_->get_io_service_ptr();
   }
 
+  /// Records the DNS resolution and the connection in the current trace.
   void StartRequest(const Address& address,
                     const RequestCallbackType& callback) override;
 
+  /// Any failure is about the endpoint requested, there being no upstream
+  /// to connect to first.
+  bool IsUpstreamFailure(const ec_type&) const override { return false; }
+
+  /// Sets the delay between connection attempts to different addresses of a
+  /// domain name.
+  void SetAttemptDelay(HappyEyeballsConnector::ClockType::duration delay) {
+    attempt_delay_ = delay;
+  }
+
+  /// Sets the routes whose network rules are checked again against the
+  /// resolved addresses of domain names, which are dropped if denied. A
+  /// request is refused with `access_denied` if all of them are.
+  void SetRoutes(const std::shared_ptr<const RouteTable>& routes) {
+    routes_ = routes;
+  }
+
+  /// Returns the cache used for resolving domain names.
+  const std::shared_ptr<DnsCache>& GetDnsCache() const { return dns_cache_; }
+
  private:
   static logging::Logger LOG;
 
   DirectTcpUpstreamFactory(
       const std::shared_ptr<TcpTransportFactory>& transport_factory)
       : transport_factory_(transport_factory),
-        resolver_(*transport_factory->get_io_service_ptr()) {}
+        dns_cache_(DnsCache::New(transport_factory->get_io_service_ptr())) {}
 
   const std::shared_ptr<TcpTransportFactory> transport_factory_;
-  boost::asio::ip::tcp::resolver resolver_;
+  const std::shared_ptr<DnsCache> dns_cache_;
+  std::shared_ptr<const RouteTable> routes_;
+  /// The delay recommended by RFC 8305.
+  HappyEyeballsConnector::ClockType::duration attempt_delay_ =
+      std::chrono::milliseconds(250);
 };
 
 }  // namespace thestral
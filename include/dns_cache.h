@@ -0,0 +1,160 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines a cache of DNS resolution results.
+#ifndef THESTRAL_DNS_CACHE_H_
+#define THESTRAL_DNS_CACHE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "base.h"
+#include "logging.h"
+
+namespace thestral {
+
+/// Threads running the blocking lookups of all the DnsCache instances of the
+/// process, so that their number doesn't grow with the workers. A lookup
+/// stuck in `getaddrinfo()` can't be interrupted, so the threads are never
+/// joined: the pool lives until the process exits.
+class DnsResolverPool {
+ public:
+  /// Called on a thread of the pool with an `io_service` of the thread, to
+  /// create resolvers with.
+  typedef std::function<void(boost::asio::io_service&)> TaskType;
+
+  DnsResolverPool(const DnsResolverPool&) = delete;
+  DnsResolverPool& operator=(const DnsResolverPool&) = delete;
+
+  /// Returns the pool of the process.
+  static DnsResolverPool& Get();
+
+  /// Starts threads until there are at least `n_threads`. Thread-safe.
+  void Reserve(std::size_t n_threads);
+  /// Runs a task on one of the threads. Thread-safe.
+  void Post(const TaskType& task);
+  /// Returns the number of threads. Thread-safe.
+  std::size_t GetThreadCount();
+
+ private:
+  DnsResolverPool() = default;
+
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable task_ready_;
+  std::deque<TaskType> tasks_;
+  std::size_t n_threads_ = 0;
+};
+
+/// Resolves host names and caches the results, both successful and failed
+/// ones, for a while. Concurrent lookups of the same host share a single query,
+/// and the least recently used entries are dropped when the cache is full.
+///
+/// Queries are run by the threads of DnsResolverPool with blocking
+/// `getaddrinfo()`, so that up to that number of slow lookups can be in flight
+/// without delaying the others, unlike `ip::tcp::resolver` which runs every
+/// lookup on the same hidden thread. The results are delivered on the
+/// `io_service` of the cache, and the cache is not thread-safe otherwise.
+/// Destroying the cache doesn't wait for its queries, whose results are
+/// dropped.
+class DnsCache : public std::enable_shared_from_this<DnsCache> {
+ public:
+  typedef std::chrono::steady_clock ClockType;
+  typedef std::function<void(const ec_type&,
+                             const std::vector<boost::asio::ip::address>&)>
+      ResolveCallbackType;
+
+  DnsCache(const DnsCache&) = delete;
+  DnsCache& operator=(const DnsCache&) = delete;
+
+  static std::shared_ptr<DnsCache> New(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
+    return std::shared_ptr<DnsCache>(new DnsCache(io_service_ptr));
+  }
+
+  /// Sets the maximum number of cached hosts.
+  void SetMaxEntries(std::size_t max_entries) { max_entries_ = max_entries; }
+  /// Sets how long successful results are cached. The system resolver doesn't
+  /// tell the TTL of the records, so a fixed one is used.
+  void SetPositiveTtl(ClockType::duration ttl) { positive_ttl_ = ttl; }
+  /// Sets how long failures are cached.
+  void SetNegativeTtl(ClockType::duration ttl) { negative_ttl_ = ttl; }
+  /// Sets the number of resolver threads the pool should have at least,
+  /// which is shared by the caches of all workers. Takes effect on the next
+  /// lookup.
+  void SetResolverThreads(std::size_t n_threads) { n_threads_ = n_threads; }
+
+  /// Resolves a host name. The callback is called before this function returns
+  /// if the result is cached.
+  void StartResolve(const std::string& host,
+                    const ResolveCallbackType& callback);
+
+  /// Returns the number of cached hosts, including those being resolved.
+  std::size_t GetEntryCount() const { return entries_.size(); }
+
+ private:
+  static logging::Logger LOG;
+
+  struct Entry {
+    std::vector<boost::asio::ip::address> addresses;
+    ec_type ec;
+    ClockType::time_point expiry;
+    bool is_resolving = false;
+    /// Callbacks waiting for the query in flight.
+    std::vector<ResolveCallbackType> waiters;
+    /// Position in @ref lru_.
+    std::list<std::string>::iterator lru_iter;
+  };
+
+  explicit DnsCache(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr)
+      : io_service_ptr_(io_service_ptr) {}
+
+  /// Runs a query on a thread of the resolver pool.
+  void StartQuery(const std::string& host);
+  void HandleQuery(const std::string& host, const ec_type& ec,
+                   const std::vector<boost::asio::ip::address>& addresses);
+  /// Drops the least recently used entries not being resolved.
+  void Evict();
+
+  const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+  std::size_t max_entries_ = 4096;
+  ClockType::duration positive_ttl_ = std::chrono::minutes(1);
+  ClockType::duration negative_ttl_ = std::chrono::seconds(5);
+  std::size_t n_threads_ = 4;
+
+  std::unordered_map<std::string, Entry> entries_;
+  /// Host names, the most recently used first.
+  std::list<std::string> lru_;
+
+  /// Keeps the `io_service` of the cache running while queries are in flight.
+  std::unique_ptr<boost::asio::io_service::work> pending_work_;
+  std::size_t n_pending_queries_ = 0;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_DNS_CACHE_H_
@@ -0,0 +1,161 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines recycled memory for the handlers of asynchronous operations.
+#ifndef THESTRAL_HANDLER_MEMORY_H_
+#define THESTRAL_HANDLER_MEMORY_H_
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <boost/version.hpp>
+
+namespace thestral {
+
+namespace impl {
+
+/// The storage behind a HandlerMemory.
+struct HandlerMemoryBlock {
+  /// Size of the storage, enough for the operations of sockets and SSL streams
+  /// along with their handlers.
+  constexpr static std::size_t kSize = 256;
+
+  void* Allocate(std::size_t size) {
+    if (!is_in_use && size <= kSize) {
+      is_in_use = true;
+      return &storage;
+    }
+    return ::operator new(size);
+  }
+
+  void Deallocate(void* pointer) {
+    if (pointer == &storage) {
+      is_in_use = false;
+    } else {
+      ::operator delete(pointer);
+    }
+  }
+
+  std::aligned_storage<kSize>::type storage;
+  bool is_in_use = false;
+};
+
+/// An allocator handing out a HandlerMemoryBlock, as the associated allocator
+/// of an AllocatingHandler.
+template <typename T>
+class HandlerAllocator {
+ public:
+  typedef T value_type;
+
+  explicit HandlerAllocator(HandlerMemoryBlock* block) : block_(block) {}
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U>& other) : block_(other.block_) {}
+
+  T* allocate(std::size_t n) {
+    return static_cast<T*>(block_->Allocate(sizeof(T) * n));
+  }
+  void deallocate(T* pointer, std::size_t) { block_->Deallocate(pointer); }
+
+  template <typename U>
+  bool operator==(const HandlerAllocator<U>& other) const {
+    return block_ == other.block_;
+  }
+  template <typename U>
+  bool operator!=(const HandlerAllocator<U>& other) const {
+    return block_ != other.block_;
+  }
+
+ private:
+  template <typename U>
+  friend class HandlerAllocator;
+
+  HandlerMemoryBlock* block_;
+};
+
+}  // namespace impl
+
+/// Memory for the handler of one asynchronous operation at a time, recycled
+/// across operations so that a chain of them, like the reads of a transport,
+/// allocates nothing once started. asio frees the memory of an operation
+/// before calling its handler, so the handler can start the next operation on
+/// the same memory. An operation that doesn't fit, or that is started while
+/// another one holds the memory, falls back to the heap.
+///
+/// Handlers are bound to the memory with MakeAllocatingHandler(). They keep it
+/// alive, so that the owner of the memory may go away with operations still
+/// queued.
+class HandlerMemory {
+ public:
+  HandlerMemory() : block_(std::make_shared<impl::HandlerMemoryBlock>()) {}
+  HandlerMemory(const HandlerMemory&) = delete;
+  HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+  const std::shared_ptr<impl::HandlerMemoryBlock>& GetBlock() const {
+    return block_;
+  }
+
+ private:
+  const std::shared_ptr<impl::HandlerMemoryBlock> block_;
+};
+
+/// A handler whose operation is allocated from a HandlerMemory, through the
+/// associated allocator of asio, or the allocation hooks before Boost 1.66,
+/// which has no associated allocators.
+template <typename Handler>
+class AllocatingHandler {
+ public:
+  typedef impl::HandlerAllocator<Handler> allocator_type;
+
+  AllocatingHandler(const HandlerMemory& memory, Handler handler)
+      : block_(memory.GetBlock()), handler_(std::move(handler)) {}
+
+  allocator_type get_allocator() const noexcept {
+    return allocator_type(block_.get());
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+#if BOOST_VERSION < 106600
+  friend void* asio_handler_allocate(std::size_t size,
+                                     AllocatingHandler* handler) {
+    return handler->block_->Allocate(size);
+  }
+  friend void asio_handler_deallocate(void* pointer, std::size_t,
+                                      AllocatingHandler* handler) {
+    handler->block_->Deallocate(pointer);
+  }
+#endif
+
+ private:
+  std::shared_ptr<impl::HandlerMemoryBlock> block_;
+  Handler handler_;
+};
+
+/// Binds a handler to a HandlerMemory.
+template <typename Handler>
+AllocatingHandler<typename std::decay<Handler>::type> MakeAllocatingHandler(
+    const HandlerMemory& memory, Handler&& handler) {
+  return AllocatingHandler<typename std::decay<Handler>::type>(
+      memory, std::forward<Handler>(handler));
+}
+
+}  // namespace thestral
+#endif  // THESTRAL_HANDLER_MEMORY_H_
@@ -0,0 +1,95 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines a connector racing connection attempts to several endpoints.
+#ifndef THESTRAL_HAPPY_EYEBALLS_H_
+#define THESTRAL_HAPPY_EYEBALLS_H_
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "base.h"
+#include "logging.h"
+#include "tcp_transport.h"
+
+namespace thestral {
+
+/// Connects to one of several endpoints of a host as described in RFC 8305
+/// (Happy Eyeballs). Attempts are started one after another with a fixed
+/// delay, or as soon as the previous one fails, alternating between IPv6 and
+/// IPv4 endpoints. The first established connection wins and the other
+/// attempts are aborted.
+class HappyEyeballsConnector
+    : public std::enable_shared_from_this<HappyEyeballsConnector> {
+ public:
+  typedef TcpTransportFactory::ConnectCallbackType ConnectCallbackType;
+  typedef std::chrono::steady_clock ClockType;
+
+  HappyEyeballsConnector(const HappyEyeballsConnector&) = delete;
+  HappyEyeballsConnector& operator=(const HappyEyeballsConnector&) = delete;
+
+  static std::shared_ptr<HappyEyeballsConnector> New(
+      const std::shared_ptr<TcpTransportFactory>& transport_factory,
+      const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+      ClockType::duration attempt_delay) {
+    return std::shared_ptr<HappyEyeballsConnector>(new HappyEyeballsConnector(
+        transport_factory, endpoints, attempt_delay));
+  }
+
+  /// Reorders endpoints so that address families alternate, IPv6 first,
+  /// keeping the order within each family.
+  static std::vector<boost::asio::ip::tcp::endpoint> SortEndpoints(
+      const std::vector<boost::asio::ip::tcp::endpoint>& endpoints);
+
+  /// Starts connecting. The callback will be called once, with the winning
+  /// transport or with the error of the last failed attempt.
+  void Start(const ConnectCallbackType& callback);
+
+ private:
+  static logging::Logger LOG;
+
+  HappyEyeballsConnector(
+      const std::shared_ptr<TcpTransportFactory>& transport_factory,
+      const std::vector<boost::asio::ip::tcp::endpoint>& endpoints,
+      ClockType::duration attempt_delay)
+      : transport_factory_(transport_factory),
+        endpoints_(SortEndpoints(endpoints)),
+        attempt_delay_(attempt_delay),
+        cancel_functions_(endpoints_.size()),
+        timer_(*transport_factory->get_io_service_ptr()) {}
+
+  void StartNextAttempt();
+  void HandleAttempt(std::size_t index, const ec_type& ec,
+                     const std::shared_ptr<TransportBase>& transport);
+
+  const std::shared_ptr<TcpTransportFactory> transport_factory_;
+  const std::vector<boost::asio::ip::tcp::endpoint> endpoints_;
+  const ClockType::duration attempt_delay_;
+  /// Aborts the attempt to each endpoint, empty if not in progress.
+  std::vector<TcpTransportFactory::CancelFunctionType> cancel_functions_;
+  boost::asio::steady_timer timer_;
+  std::size_t next_attempt_ = 0;
+  std::size_t n_pending_attempts_ = 0;
+  bool is_done_ = false;
+  ConnectCallbackType callback_;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_HAPPY_EYEBALLS_H_
@@ -17,7 +17,10 @@
 #ifndef THESTRAL_LOG_H_
 #define THESTRAL_LOG_H_
 
+#include <atomic>
+#include <chrono>
 #include <cstdarg>
+#include <cstddef>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -33,12 +36,30 @@ class Logger;
 enum class Level { DEBUG, INFO, WARN, ERROR, FATAL };
 
 namespace impl {
+
+/// The lowest level of records compiled in. Records of lower levels are
+/// optimized out along with their arguments if logged by the macros below.
+#if defined(THESTRAL_NO_DEBUG_LOG)
+constexpr Level kMinCompiledLevel = Level::INFO;
+#else
+constexpr Level kMinCompiledLevel = Level::DEBUG;
+#endif
+
+/// The lowest level of all added sinks, or one above FATAL if there is none.
+extern std::atomic<int> g_min_sink_level;
+/// Recomputes `g_min_sink_level`. Called whenever sinks or their levels change.
+void UpdateMinSinkLevel();
+
 /// A record of logging. A LogRecord is comprised of a Level and a collection of
 /// attributes with string keys.
 class LogRecord {
  public:
+  /// Creates an empty record, which is only useful to be assigned to.
+  LogRecord() : level_(Level::DEBUG) {}
   LogRecord(Level level, const std::map<std::string, std::string>& attributes)
       : level_(level), attributes_(attributes) {}
+  LogRecord(Level level, std::map<std::string, std::string>&& attributes)
+      : level_(level), attributes_(std::move(attributes)) {}
 
   /// Sets an attribute of the log record.
   void SetAttribute(const std::string& name, const std::string& value) {
@@ -73,7 +94,10 @@ class LogSinkBase {
   /// Returns the level of the sink.
   Level GetLevel() const { return level_; }
   /// Sets the level of the sink.
-  void SetLevel(Level level) { level_ = level; }
+  void SetLevel(Level level) {
+    level_ = level;
+    UpdateMinSinkLevel();
+  }
 
   /// Sets the format string of the sink. Patterns like `"{attr_name}"` in the
   /// format will be replaced with the attribute values of key `attr_name` in
@@ -84,6 +108,8 @@ class LogSinkBase {
   /// Pushes a log record into the sink. If the level of record is not lower
   /// than the level of the sink, the record will be stored using StoreRecord().
   void PushRecord(const LogRecord& record);
+  /// Writes out the records stored but still buffered, if any.
+  virtual void Flush() {}
 
  protected:
   /// Component of the compiled format string. A component can generate a string
@@ -121,6 +147,32 @@ impl::LogSinkBase& add_stderr_log_sink();
 /// Adds a customized log sink.
 impl::LogSinkBase& add_log_sink(std::unique_ptr<impl::LogSinkBase> sink);
 
+/// What to do with a log record when the queue of asynchronous logging is
+/// full.
+enum class OverflowPolicy {
+  DROP,  ///< discards the record, and reports the number of discarded ones
+  BLOCK  ///< waits for the logging thread to make room for it
+};
+
+/// Options of asynchronous logging.
+struct AsyncOptions {
+  /// Maximum number of records waiting for the logging thread, rounded up to
+  /// a power of 2.
+  std::size_t queue_size = 8192;
+  /// Maximum time records stay buffered in the sinks.
+  std::chrono::milliseconds flush_interval{1000};
+  OverflowPolicy overflow_policy = OverflowPolicy::DROP;
+};
+
+/// Starts storing log records into the sinks on a background thread instead
+/// of the threads creating them. Records of level FATAL are still stored
+/// before the creating thread goes on, after all the records queued before
+/// them. Neither this function nor stop_async_logging() can be called while
+/// other threads are logging, and the sinks should all be added beforehand.
+void start_async_logging(const AsyncOptions& options);
+/// Stores the queued records and stops the background thread, if any.
+void stop_async_logging();
+
 class FatalEvent : public std::runtime_error {
  public:
   FatalEvent() : std::runtime_error("a fatal event is logged") {}
@@ -137,16 +189,24 @@ class Logger {
     ~LogRecordProxy() throw(FatalEvent);
     LogRecordProxy& SetAttribute(const std::string& name,
                                  const std::string& value) {
-      record_.SetAttribute(name, value);
+      if (is_enabled_) {
+        record_.SetAttribute(name, value);
+      }
       return *this;
     }
 
    private:
     friend class Logger;
     impl::LogRecord record_;
+    /// Whether any sink will store the record.
+    bool is_enabled_;
 
     explicit LogRecordProxy(impl::LogRecord&& record)
-        : record_(std::move(record)) {}
+        : record_(std::move(record)), is_enabled_(true) {}
+    /// Creates a proxy of a record no sink will store.
+    explicit LogRecordProxy(Level level)
+        : record_(level, std::map<std::string, std::string>()),
+          is_enabled_(false) {}
   };
 
   explicit Logger(const std::string& name);
@@ -159,6 +219,14 @@ class Logger {
   /// inherit this attribute.
   void SetAttribute(const std::string& name, const std::string& value);
 
+  /// Returns whether any sink will store records of a given level. Records
+  /// of disabled levels are not even formatted.
+  static bool IsEnabled(Level level) {
+    return level >= impl::kMinCompiledLevel &&
+           static_cast<int>(level) >=
+               impl::g_min_sink_level.load(std::memory_order_relaxed);
+  }
+
   /// Create a log with the given level and message. The message will be
   /// formated using the standard C-style formating syntax. When a log record is
   /// created, some attributes will be added automatically: `logger_name` is the
@@ -181,4 +249,23 @@ class Logger {
 
 }  // namespace logging
 }  // namespace thestral
+
+/// Logs with a Logger only if the level is enabled, without evaluating the
+/// arguments otherwise, e.g. `THESTRAL_LOG_DEBUG(LOG, "value: %d", Get());`.
+#define THESTRAL_LOG(logger, level, method, ...)                         \
+  do {                                                                   \
+    if (::thestral::logging::Logger::IsEnabled(                          \
+            ::thestral::logging::Level::level)) {                        \
+      (logger).method(__VA_ARGS__);                                      \
+    }                                                                    \
+  } while (0)
+#define THESTRAL_LOG_DEBUG(logger, ...) \
+  THESTRAL_LOG(logger, DEBUG, Debug, __VA_ARGS__)
+#define THESTRAL_LOG_INFO(logger, ...) \
+  THESTRAL_LOG(logger, INFO, Info, __VA_ARGS__)
+#define THESTRAL_LOG_WARN(logger, ...) \
+  THESTRAL_LOG(logger, WARN, Warn, __VA_ARGS__)
+#define THESTRAL_LOG_ERROR(logger, ...) \
+  THESTRAL_LOG(logger, ERROR, Error, __VA_ARGS__)
+
 #endif  // THESTRAL_LOG_H_
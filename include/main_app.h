@@ -18,21 +18,114 @@
 #ifndef THESTRAL_MAIN_APP_H_
 #define THESTRAL_MAIN_APP_H_
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/property_tree/ptree.hpp>
 
+#include "base.h"
+#include "logging.h"
+#include "ssl.h"
+#include "tcp_transport.h"
+
 namespace thestral {
+
+/// Loads the config file and runs its servers until asked to exit. Signals are
+/// handled as follows.
+/// - `SIGHUP` re-reads the config file. New connections go to the servers
+///   created from it, while established sessions stay on the old ones until
+///   they end. Listening sockets on unchanged endpoints are carried over, so
+///   no connection is refused meanwhile. The `workers`, `handshake_pool` and
+///   `log` options are not reloaded.
+/// - `SIGTERM` and `SIGINT` start draining: the servers stop accepting and the
+///   process exits once the sessions have ended, or after `drain_timeout`. A
+///   second one exits at once.
+/// - `SIGUSR1` writes the traces recorded so far to `trace.dump_file`.
+/// - `SIGUSR2` starts a new process from the same executable and command line,
+///   passing it the listening sockets, and then drains like `SIGTERM` once the
+///   new process has started its servers. If it dies or takes too long to do
+///   so, the old process goes on accepting. This upgrades the binary without a
+///   window refusing connections.
 class MainApp {
  public:
-  explicit MainApp(const boost::property_tree::ptree& config)
-      : config_(config) {}
+  /// @param config_file_name Path of the config file, read again on reload.
+  /// @param command_line Arguments of the process, `argv[0]` included, with
+  /// which a new process is started on `SIGUSR2`.
+  MainApp(const std::string& config_file_name,
+          const std::vector<std::string>& command_line);
 
-  void Run() const;
+  void Run();
 
  private:
+  static logging::Logger LOG;
+
+  /// A server of a worker along with the transport factory accepting for it.
+  struct Listener {
+    std::string address;
+    uint16_t port;
+    unsigned int worker;
+    std::shared_ptr<TcpTransportFactory> transport_factory;
+    std::shared_ptr<ServerBase> server;
+  };
+
   void SetUpLoggingOrDie() const;
+  /// Creates the listeners of every worker from a config without starting
+  /// them. Throws on an invalid config.
+  std::vector<Listener> MakeListeners(
+      const boost::property_tree::ptree& config) const;
+  /// Hands the listening sockets inherited from the previous process to the
+  /// listeners on the same endpoints.
+  void AdoptInheritedSockets();
+  /// Runs `task` on the thread of a worker and waits for it to finish.
+  void RunOnWorker(unsigned int worker, const std::function<void()>& task);
 
+  void WaitForSignal();
+  void DumpTraces();
+  /// Replaces the listeners with those of the re-read config file. The old
+  /// config stays in effect if the new one is invalid.
+  void Reload();
+  /// Starts a new process taking over the listening sockets, then drains once
+  /// it is ready.
+  void Handoff();
+  void StartDrain();
+  /// Exits when no session is left or the drain timeout is reached, or else
+  /// checks again later.
+  void CheckDrained();
+  /// Releases the retired listeners with no session left, and checks the
+  /// others again later.
+  void CheckRetired();
+  void Exit();
+
+  const std::string config_file_name_;
+  const std::vector<std::string> command_line_;
+  /// Path of the running executable, started again on handoff.
+  std::string executable_;
   boost::property_tree::ptree config_;
+  std::chrono::seconds drain_timeout_{30};
+
+  /// Runs on the main thread, handling the signals.
+  boost::asio::io_service control_service_;
+  boost::asio::signal_set signals_;
+  boost::asio::steady_timer drain_timer_;
+  boost::asio::steady_timer retire_timer_;
+  std::chrono::steady_clock::time_point drain_deadline_;
+  bool is_draining_ = false;
+
+  std::vector<std::shared_ptr<boost::asio::io_service>> io_services_;
+  /// Keeps the workers running while they have nothing to do, e.g. between two
+  /// generations of listeners.
+  std::vector<std::unique_ptr<boost::asio::io_service::work>> works_;
+  /// Shared by the SSL transport factories of all workers, if configured.
+  std::shared_ptr<ssl::HandshakePool> handshake_pool_;
+  std::vector<Listener> listeners_;
+  /// Listeners replaced by a reload which still have sessions to drain.
+  std::vector<Listener> retired_listeners_;
 };
-}  // namespace thestral
 
+}  // namespace thestral
 #endif  // ifndef THESTRAL_MAIN_APP_H_
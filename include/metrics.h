@@ -0,0 +1,161 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Defines metrics about the behavior of the program, exposed in the text
+/// format of Prometheus.
+#ifndef THESTRAL_METRICS_H_
+#define THESTRAL_METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace thestral {
+namespace metrics {
+
+namespace impl {
+
+/// Maximum number of values of all the metrics.
+constexpr std::size_t kMaxSlots = 256;
+
+/// Values of all the metrics updated by a single thread. Only that thread
+/// writes them, so updating a value needs no read-modify-write operation.
+/// Scrapes sum the values of all threads up.
+struct ThreadSlots {
+  std::atomic<uint64_t> values[kMaxSlots];
+};
+
+/// Registers the slots of the calling thread. They are never freed, so that
+/// the values survive the thread.
+ThreadSlots* NewThreadSlots();
+
+extern thread_local ThreadSlots* t_slots;
+
+inline void Add(std::size_t slot, uint64_t n) {
+  if (!t_slots) {
+    t_slots = NewThreadSlots();
+  }
+  auto& value = t_slots->values[slot];
+  value.store(value.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed);
+}
+
+/// Returns the sum of a slot over all threads.
+uint64_t Sum(std::size_t slot);
+
+/// Base class of metrics. A metric registers itself on construction and
+/// should have static storage duration.
+class MetricBase {
+ public:
+  /// @param labels Labels of the samples, e.g. `side="client"`. Metrics with
+  /// the same name are rendered together, so they should only differ in
+  /// labels.
+  MetricBase(const std::string& name, const std::string& help,
+             const std::string& labels, std::size_t n_slots);
+  MetricBase(const MetricBase&) = delete;
+  MetricBase& operator=(const MetricBase&) = delete;
+  virtual ~MetricBase() = default;
+
+  const std::string& GetName() const { return name_; }
+  const std::string& GetHelp() const { return help_; }
+  virtual const char* GetType() const = 0;
+  /// Appends the samples to `out` in the text format.
+  virtual void Render(std::string* out) const = 0;
+
+ protected:
+  /// Returns the labels enclosed in braces, with `extra` appended.
+  std::string FormatLabels(const std::string& extra = "") const;
+
+  const std::string name_;
+  const std::string help_;
+  const std::string labels_;
+  const std::size_t first_slot_;
+};
+
+}  // namespace impl
+
+/// A value that only goes up.
+class Counter : public impl::MetricBase {
+ public:
+  Counter(const std::string& name, const std::string& help,
+          const std::string& labels = "")
+      : MetricBase(name, help, labels, 1) {}
+
+  void Increment(uint64_t n = 1) const { impl::Add(first_slot_, n); }
+  uint64_t GetValue() const { return impl::Sum(first_slot_); }
+
+  const char* GetType() const override { return "counter"; }
+  void Render(std::string* out) const override;
+};
+
+/// A value that goes up and down. It can be incremented and decremented by
+/// different threads.
+class Gauge : public impl::MetricBase {
+ public:
+  Gauge(const std::string& name, const std::string& help,
+        const std::string& labels = "")
+      : MetricBase(name, help, labels, 2) {}
+
+  void Increment() const { impl::Add(first_slot_, 1); }
+  void Decrement() const { impl::Add(first_slot_ + 1, 1); }
+  /// Increments the gauge and returns a token decrementing it on destruction.
+  std::shared_ptr<void> Track() const;
+  int64_t GetValue() const;
+
+  const char* GetType() const override { return "gauge"; }
+  void Render(std::string* out) const override;
+};
+
+/// Distribution of durations.
+class Histogram : public impl::MetricBase {
+ public:
+  typedef std::chrono::steady_clock ClockType;
+
+  /// @param bounds Upper bounds of the buckets in seconds, in increasing order.
+  Histogram(const std::string& name, const std::string& help,
+            const std::vector<double>& bounds, const std::string& labels = "");
+
+  /// Returns bounds suitable for network latencies, from 1ms to 10s.
+  static std::vector<double> LatencyBounds();
+
+  void Observe(ClockType::duration duration) const;
+  /// Observes the time elapsed since `start`.
+  void ObserveSince(ClockType::time_point start) const {
+    Observe(ClockType::now() - start);
+  }
+  /// Returns the number of observations.
+  uint64_t GetCount() const;
+
+  const char* GetType() const override { return "histogram"; }
+  void Render(std::string* out) const override;
+
+ private:
+  const std::vector<double> bounds_;
+  /// Bounds in nanoseconds, for comparing without conversion.
+  std::vector<uint64_t> bounds_ns_;
+  // slots: one per bucket, one for the overflow bucket, and the sum in ns
+};
+
+/// Returns all the metrics in the text format of Prometheus.
+std::string RenderText();
+
+}  // namespace metrics
+}  // namespace thestral
+#endif  // THESTRAL_METRICS_H_
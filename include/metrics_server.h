@@ -0,0 +1,78 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Defines the HTTP server exposing the metrics.
+#ifndef THESTRAL_METRICS_SERVER_H_
+#define THESTRAL_METRICS_SERVER_H_
+
+#include <memory>
+#include <string>
+
+#include "base.h"
+#include "logging.h"
+#include "tcp_transport.h"
+
+namespace thestral {
+
+/// A minimal HTTP server answering `GET /metrics` with the metrics in the text
+/// format of Prometheus, and `GET /traces` with the traces of the sampled
+/// sessions. Every response closes the connection.
+class MetricsServer : public ServerBase,
+                      public std::enable_shared_from_this<MetricsServer> {
+ public:
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  /// Maximum size of a request, including the headers.
+  static constexpr std::size_t kMaxRequestSize = 8192;
+
+  /// Factory method to create a MetricsServer listening on a given tcp
+  /// endpoint.
+  static std::shared_ptr<MetricsServer> New(
+      const std::string& bind_address, uint16_t bind_port,
+      const std::shared_ptr<TcpTransportFactory>& transport_factory) {
+    return std::shared_ptr<MetricsServer>(
+        new MetricsServer(bind_address, bind_port, transport_factory));
+  }
+
+  void Start() override;
+  void Stop() override { transport_factory_->StopAccepting(); }
+
+ private:
+  static logging::Logger LOG;
+
+  MetricsServer(const std::string& bind_address, uint16_t bind_port,
+                const std::shared_ptr<TcpTransportFactory>& transport_factory)
+      : bind_address_(bind_address),
+        bind_port_(bind_port),
+        transport_factory_(transport_factory) {}
+
+  bool HandleNewConnection(const ec_type& ec,
+                           const std::shared_ptr<TransportBase>& transport);
+  /// Reads until the end of the request headers, appending to `request`.
+  void ReceiveRequest(const std::shared_ptr<TransportBase>& transport,
+                      const std::shared_ptr<std::string>& request);
+  /// Replies to a complete request and closes the transport.
+  void HandleRequest(const std::shared_ptr<TransportBase>& transport,
+                     const std::string& request);
+
+  const std::string bind_address_;
+  const uint16_t bind_port_;
+  const std::shared_ptr<TcpTransportFactory> transport_factory_;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_METRICS_SERVER_H_
@@ -0,0 +1,308 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines a protocol multiplexing streams over a single transport.
+///
+/// A session starts with the client sending kPreface, followed by frames in
+/// both directions. Each frame is a FrameHeader followed by `length` bytes of
+/// payload. Streams are opened by the client only, and the data it sends first
+/// on a stream need not wait for any reply, so opening a stream costs no round
+/// trip. Each direction of a stream has a window of kInitialWindow bytes,
+/// which the receiver extends with kWindowUpdate frames as the data is
+/// consumed. A server about to stop sends kGoAway, after which it resets any
+/// stream opened, and the client opens no more streams on the session. A
+/// kPing carries 8 bytes of payload, which the peer echoes in a kPong.
+#ifndef THESTRAL_MUX_H_
+#define THESTRAL_MUX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "base.h"
+#include "common.h"
+#include "logging.h"
+#include "timing_wheel.h"
+
+namespace thestral {
+namespace mux {
+
+THESTRAL_DEFINE_ENUM(FrameType, uint8_t, (kOpen, 0x1), (kData, 0x2),
+                     (kFin, 0x3), (kReset, 0x4), (kWindowUpdate, 0x5),
+                     (kGoAway, 0x6), (kPing, 0x7), (kPong, 0x8));
+
+/// Header of a frame. Multi-byte fields are in network byte order.
+struct FrameHeader : PacketWithSize<FrameHeader, 8> {
+  constexpr static std::size_t kSize = 8;
+
+  FrameType type = FrameType::kData;
+  // data[1] is reserved
+  uint16_t length = 0;  ///< Size of the payload.
+  uint32_t stream_id = 0;
+
+  void FromBytes(const char* data) override;
+  void ToBytes(char* data) const override;
+};
+
+class MuxSession;
+
+/// A stream carried by a MuxSession. At most one read, one wait and one write
+/// may be pending at a time.
+///
+/// On the client side, the stream expects the peer to answer with a SOCKS
+/// response before any data. The response is stripped from the data read, and
+/// an error response fails the stream with its response code.
+class MuxStream : public TransportBase,
+                  public std::enable_shared_from_this<MuxStream> {
+ public:
+  MuxStream(const MuxStream&) = delete;
+  MuxStream& operator=(const MuxStream&) = delete;
+  ~MuxStream() override;
+
+  Address GetLocalAddress() const override;
+  Address GetRemoteAddress() const override;
+
+  void StartRead(const boost::asio::mutable_buffers_1& buf,
+                 const ReadCallbackType& callback,
+                 bool allow_short_read = false) override;
+  void StartWrite(const boost::asio::const_buffers_1& buf,
+                  const WriteCallbackType& callback) override;
+  void StartWaitReadable(const WaitCallbackType& callback) override;
+  void StartClose(const CloseCallbackType& callback) override;
+  void StartShutdownSend(const CloseCallbackType& callback) override;
+
+  using TransportBase::StartRead;
+  using TransportBase::StartWrite;
+  using TransportBase::StartClose;
+
+  /// Returns the id of the stream within its session.
+  uint32_t GetStreamId() const { return stream_id_; }
+
+ private:
+  friend class MuxSession;
+
+  MuxStream(const std::shared_ptr<MuxSession>& session, uint32_t stream_id,
+            bool expect_response);
+
+  /// Queues `data` on a stream just opened, within the initial window.
+  void SendInitialData(const std::string& data);
+  /// Handles the payload of a kData frame. Returns `false` if the peer has
+  /// sent more than the window allows.
+  bool HandleData(const char* data, std::size_t size);
+  void HandleFin();
+  void HandleWindowUpdate(uint32_t increment);
+  /// Fails all pending and later operations with `ec`, dropping the data
+  /// buffered.
+  void HandleError(const ec_type& ec);
+
+  /// Extracts the SOCKS response from the first bytes received.
+  void ParseResponse();
+  void ContinueRead();
+  void ContinueWrite();
+  void NotifyReadable();
+  /// Marks `n_bytes` as consumed, announcing window updates when needed.
+  void Consume(std::size_t n_bytes);
+  void CompleteRead(const ec_type& ec);
+  /// Resets the stream on the peer and fails it with `ec`.
+  void Abort(const ec_type& ec);
+  /// Removes the stream from its session if not yet removed.
+  void Detach(bool reset);
+
+  const std::shared_ptr<MuxSession> session_;
+  const uint32_t stream_id_;
+  const std::shared_ptr<void> active_token_;
+
+  // receiving side
+  std::deque<std::string> recv_chunks_;
+  std::size_t recv_offset_ = 0;  ///< Offset into the first chunk.
+  std::size_t recv_size_ = 0;    ///< Bytes buffered in all chunks.
+  uint32_t recv_window_;
+  uint32_t recv_consumed_ = 0;  ///< Bytes consumed but not announced.
+  bool fin_received_ = false;
+  bool expect_response_;
+  std::string response_buf_;
+
+  boost::asio::mutable_buffers_1 read_buf_{nullptr, 0};
+  std::size_t n_read_ = 0;
+  bool allow_short_read_ = false;
+  ReadCallbackType read_callback_;
+  WaitCallbackType wait_callback_;
+
+  // sending side
+  uint32_t send_window_;
+  bool fin_sent_ = false;
+  const char* write_data_ = nullptr;
+  std::size_t write_size_ = 0;
+  std::size_t n_framed_ = 0;  ///< Bytes of the pending write queued already.
+  WriteCallbackType write_callback_;
+
+  bool is_closed_ = false;
+  bool is_detached_ = false;
+  ec_type error_;
+};
+
+/// A session carrying many MuxStreams over a single transport. The session is
+/// not thread-safe and should be used on its `io_service` only. It is kept
+/// alive by its own reading and by its streams, and ends when the transport
+/// fails or Close() is called, which fails all of its streams.
+class MuxSession : public std::enable_shared_from_this<MuxSession> {
+ public:
+  typedef std::function<void(const std::shared_ptr<MuxStream>&)>
+      AcceptCallbackType;
+
+  /// Window of each direction of a stream when it is opened.
+  constexpr static uint32_t kInitialWindow = 256 * 1024;
+  /// Maximum size of the payload of a frame.
+  constexpr static std::size_t kMaxFramePayload = 16 * 1024;
+  /// Bytes sent by the client before any frame.
+  static const char kPreface[8];
+
+  MuxSession(const MuxSession&) = delete;
+  MuxSession& operator=(const MuxSession&) = delete;
+
+  /// Creates the client side of a session over an established transport.
+  static std::shared_ptr<MuxSession> NewClient(
+      const std::shared_ptr<TransportBase>& transport,
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
+    return std::shared_ptr<MuxSession>(
+        new MuxSession(transport, io_service_ptr, nullptr));
+  }
+  /// Creates the server side of a session over an established transport.
+  /// `callback` is called with each stream opened by the client.
+  static std::shared_ptr<MuxSession> NewServer(
+      const std::shared_ptr<TransportBase>& transport,
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+      const AcceptCallbackType& callback) {
+    return std::shared_ptr<MuxSession>(
+        new MuxSession(transport, io_service_ptr, callback));
+  }
+
+  /// Sets the number of streams a client may have open at once on a server
+  /// session, beyond which the streams it opens are reset. Zero (default)
+  /// means no limit.
+  void SetMaxStreams(std::size_t max_streams) { max_streams_ = max_streams; }
+  /// Makes a client session ping the server once it has received nothing for
+  /// `interval`, and close if nothing arrives for another `interval` after
+  /// that, so that a dead session is replaced rather than swallowing streams.
+  /// Zero (default) disables pinging. It should be set before Start().
+  void SetPingInterval(TimingWheel::ClockType::duration interval) {
+    ping_interval_ = interval;
+  }
+  /// Sets the timer of the handshake of a server session, which the session
+  /// keeps until the preface of the client has arrived.
+  void SetHandshakeTimer(const std::shared_ptr<TimingWheel::Timer>& timer) {
+    handshake_timer_ = timer;
+  }
+
+  /// Starts the session.
+  void Start();
+  /// Closes the transport and fails all streams.
+  void Close();
+  /// Tells the client to open no more streams on a server session, resetting
+  /// those opened from now on. The streams already open go on, and the session
+  /// is closed once the last of them is gone.
+  void GoAway();
+
+  /// Opens a stream on the client side, sending `initial_data` right after
+  /// the opening frame. It never fails immediately: if the session has ended,
+  /// the stream fails on its first operation.
+  std::shared_ptr<MuxStream> OpenStream(const std::string& initial_data);
+
+  /// Returns whether the session has ended.
+  bool IsClosed() const { return is_closed_; }
+  /// Returns whether more streams can be opened on the session. A session
+  /// running out of stream ids, or told to go away by the server, is closed
+  /// once its last stream is gone.
+  bool CanOpenStream() const {
+    return !is_closed_ && !is_going_away_ && next_stream_id_ <= kMaxStreamId;
+  }
+  /// Returns the number of open streams.
+  std::size_t GetStreamCount() const { return streams_.size(); }
+  /// Returns the id of the underlying transport.
+  TransportBase::IdType GetId() const { return transport_->GetId(); }
+
+ private:
+  friend class MuxStream;
+  typedef std::function<void(const ec_type&)> SentCallbackType;
+
+  static logging::Logger LOG;
+
+  constexpr static uint32_t kMaxStreamId = 0x7fffffff;
+
+  MuxSession(const std::shared_ptr<TransportBase>& transport,
+             const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+             const AcceptCallbackType& accept_callback);
+
+  /// Queues a frame, and calls `callback` if not empty once it is written.
+  void SendFrame(FrameType type, uint32_t stream_id, const char* payload,
+                 std::size_t size, const SentCallbackType& callback = nullptr);
+  void DoWrite();
+  void DoRead();
+  /// Starts the timer sending a ping, or closing the session if the last one
+  /// has gone unanswered.
+  void StartPingTimer();
+  /// Handles the frames in the reading buffer. Returns `false` on protocol
+  /// errors.
+  bool HandleFrames();
+  bool HandleFrame(const FrameHeader& header, const char* payload);
+  /// Removes a stream, resetting it on the peer if `reset` is true.
+  void RemoveStream(uint32_t stream_id, bool reset);
+  /// Closes the session once the frames queued are written, if it has gone
+  /// away or run out of stream ids, and its last stream is gone.
+  void CloseIfDrained();
+  void HandleError(const ec_type& ec);
+
+  const std::shared_ptr<TransportBase> transport_;
+  const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+  const AcceptCallbackType accept_callback_;
+  const std::shared_ptr<void> active_token_;
+  const Address local_address_;
+  const Address remote_address_;
+  std::unordered_map<uint32_t, std::weak_ptr<MuxStream>> streams_;
+  uint32_t next_stream_id_ = 1;
+  std::size_t max_streams_ = 0;
+  TimingWheel::ClockType::duration ping_interval_{0};
+  TimingWheel::Timer ping_timer_;
+  /// Whether a ping has been sent and nothing has been received since.
+  bool is_ping_pending_ = false;
+  std::shared_ptr<TimingWheel::Timer> handshake_timer_;
+  bool preface_received_;
+  bool is_going_away_ = false;
+  /// Whether the session is closed once the write in progress is done.
+  bool is_closing_ = false;
+  bool is_closed_ = false;
+
+  std::vector<char> read_buf_;
+  std::size_t read_end_ = 0;
+
+  /// Frames queued while a write is in progress, written together next.
+  std::string pending_;
+  std::vector<SentCallbackType> pending_callbacks_;
+  std::string writing_;
+  std::vector<SentCallbackType> writing_callbacks_;
+  bool is_writing_ = false;
+};
+
+}  // namespace mux
+}  // namespace thestral
+
+#endif  // THESTRAL_MUX_H_
@@ -0,0 +1,116 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines the upstream factory carrying requests over multiplexed sessions.
+#ifndef THESTRAL_MUX_UPSTREAM_H_
+#define THESTRAL_MUX_UPSTREAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "base.h"
+#include "logging.h"
+#include "mux.h"
+#include "tcp_transport.h"
+#include "timing_wheel.h"
+
+namespace thestral {
+namespace mux {
+
+/// Upstream factory opening a stream on one of a few long-lived MuxSessions
+/// to another thestral instance for each request. The SOCKS request is sent
+/// as the first data of the stream and the stream is returned at once, so a
+/// failure of the request shows up as an error on the stream rather than of
+/// the request itself. Requests only wait when no session is established.
+/// The factory is not thread-safe and should be used on its `io_service` only.
+class MuxTcpUpstreamFactory
+    : public UpstreamFactoryBase,
+      public std::enable_shared_from_this<MuxTcpUpstreamFactory> {
+ public:
+  MuxTcpUpstreamFactory(const MuxTcpUpstreamFactory&) = delete;
+  MuxTcpUpstreamFactory& operator=(const MuxTcpUpstreamFactory&) = delete;
+
+  /// Creates a factory with a given TcpTransportFactory.
+  static std::shared_ptr<MuxTcpUpstreamFactory> New(
+      const std::shared_ptr<TcpTransportFactory>& transport_factory,
+      const std::string& upstream_host, uint16_t upstream_port) {
+    return std::shared_ptr<MuxTcpUpstreamFactory>(new MuxTcpUpstreamFactory(
+        transport_factory, upstream_host, upstream_port));
+  }
+
+  void StartRequest(const Address& endpoint,
+                    const RequestCallbackType& callback) override;
+
+  std::shared_ptr<boost::asio::io_service> get_io_service_ptr() const override {
+    return transport_factory_->get_io_service_ptr();
+  }
+
+  /// Requests succeed at once on an established session, so only a session
+  /// failing to be established shows up.
+  bool CanHealthCheck() const override { return false; }
+
+  /// Sets the number of sessions kept to the upstream, 1 by default. Requests
+  /// go to the session with the fewest streams.
+  void SetSessionCount(std::size_t n_sessions) { n_sessions_ = n_sessions; }
+  /// Sets the interval of MuxSession::SetPingInterval() of the sessions, so
+  /// that those gone silent are closed and replaced. Zero (default) disables
+  /// pinging.
+  void SetPingInterval(TimingWheel::ClockType::duration interval) {
+    ping_interval_ = interval;
+  }
+
+ private:
+  static logging::Logger LOG;
+
+  MuxTcpUpstreamFactory(
+      const std::shared_ptr<TcpTransportFactory>& transport_factory,
+      const std::string& upstream_host, uint16_t upstream_port)
+      : transport_factory_(transport_factory),
+        upstream_host_(upstream_host),
+        upstream_port_(upstream_port),
+        resolver_(*transport_factory->get_io_service_ptr()) {}
+
+  /// Resolves the upstream host and connects a new session.
+  void StartSession();
+  void ConnectEndpoint(boost::asio::ip::tcp::resolver::iterator iter);
+  void HandleSession(const ec_type& ec,
+                     const std::shared_ptr<TransportBase>& transport);
+  /// Opens a stream for a request on the least loaded session.
+  void OpenStream(const Address& endpoint,
+                  const RequestCallbackType& callback);
+
+  const std::shared_ptr<TcpTransportFactory> transport_factory_;
+  const std::string upstream_host_;
+  const uint16_t upstream_port_;
+  boost::asio::ip::tcp::resolver resolver_;
+  std::size_t n_sessions_ = 1;
+  TimingWheel::ClockType::duration ping_interval_{0};
+  std::size_t n_connecting_ = 0;
+  std::vector<std::shared_ptr<MuxSession>> sessions_;
+  /// Requests waiting for a session to be established.
+  std::vector<std::pair<Address, RequestCallbackType>> waiters_;
+};
+
+}  // namespace mux
+}  // namespace thestral
+
+#endif  // THESTRAL_MUX_UPSTREAM_H_
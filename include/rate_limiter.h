@@ -0,0 +1,168 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines the token buckets limiting the rate of relayed data.
+#ifndef THESTRAL_RATE_LIMITER_H_
+#define THESTRAL_RATE_LIMITER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "common.h"
+
+namespace thestral {
+
+/// A token bucket refilled at a fixed rate of bytes per second, up to its
+/// burst size. Consuming more tokens than available puts the bucket into
+/// debt, which has to be paid off by the refill before it has tokens again, so
+/// the rate holds on average even though each read may take more than the
+/// tokens left. Thread-safe.
+class TokenBucket {
+ public:
+  typedef std::chrono::steady_clock ClockType;
+
+  /// Smallest burst size, so that slow buckets still allow useful reads.
+  constexpr static uint64_t kMinBurst = 4096;
+
+  /// Creates a full bucket. The burst size is a tenth of a second of the rate.
+  explicit TokenBucket(uint64_t rate);
+
+  uint64_t GetRate() const { return rate_; }
+  uint64_t GetBurst() const { return burst_; }
+
+  /// Returns zero if the bucket has tokens, or else the time until it has.
+  ClockType::duration GetDelay();
+  /// Takes `n_bytes` tokens, or gives them back if negative.
+  void Consume(int64_t n_bytes);
+
+ private:
+  void Refill(ClockType::time_point now);
+
+  const uint64_t rate_;
+  const uint64_t burst_;
+  std::mutex mutex_;
+  double tokens_;
+  ClockType::time_point last_refill_;
+};
+
+/// The buckets all the data of a session take tokens from.
+class BucketSet {
+ public:
+  /// Adds a bucket, which may be shared with other sets.
+  void Add(const std::shared_ptr<TokenBucket>& bucket);
+  bool IsEmpty() const { return buckets_.empty(); }
+
+  /// Returns the largest number of bytes to read at once, which keeps the
+  /// debt of the buckets in check.
+  std::size_t GetQuantum() const { return quantum_; }
+  /// Returns zero if all the buckets have tokens, or else the time until they
+  /// have.
+  TokenBucket::ClockType::duration GetDelay() const;
+  /// Takes tokens from all the buckets, or gives them back if negative.
+  void Consume(int64_t n_bytes) const;
+
+ private:
+  /// The largest read when there is no limit smaller than it.
+  constexpr static std::size_t kMaxQuantum = 16384;
+
+  std::vector<std::shared_ptr<TokenBucket>> buckets_;
+  std::size_t quantum_ = kMaxQuantum;
+};
+
+/// Hands out the buckets of new sessions: one for each session, one shared by
+/// all the sessions of a client IP and a global one, each only if it has a
+/// limit. Thread-safe, so that one limiter serves all workers.
+class RateLimiter {
+ public:
+  /// Creates a limiter of the given rates in bytes per second, zero for no
+  /// limit. `global_bucket` may be `nullptr`.
+  RateLimiter(uint64_t session_rate, uint64_t client_rate,
+              const std::shared_ptr<TokenBucket>& global_bucket)
+      : session_rate_(session_rate),
+        client_rate_(client_rate),
+        global_bucket_(global_bucket) {}
+
+  /// Returns the buckets of a new session from `client`, or `nullptr` if there
+  /// is no limit at all. The bucket of a client lives as long as its sessions.
+  std::shared_ptr<const BucketSet> StartSession(const Address& client);
+
+ private:
+  const uint64_t session_rate_;
+  const uint64_t client_rate_;
+  const std::shared_ptr<TokenBucket> global_bucket_;
+  std::mutex mutex_;
+  /// Buckets of the clients by their host bytes.
+  std::unordered_map<std::string, std::weak_ptr<TokenBucket>> client_buckets_;
+  /// Size of `client_buckets_` at which the expired entries are dropped.
+  std::size_t prune_size_ = 64;
+};
+
+/// Schedules the reads of shaped relays on an `io_service`, which wait for
+/// their buckets to have tokens before reading. Waiting relays are granted
+/// reads in the order they started waiting, one quantum at a time, so the
+/// sessions sharing a bucket take turns rather than the busiest one taking
+/// the most. Like TimingWheel, a single timer serves all the waiters, and the
+/// scheduler should only be used by handlers running on its `io_service`.
+class ShapingScheduler : public boost::asio::io_service::service {
+ public:
+  /// Called with the number of bytes granted to read, which have been taken
+  /// from the buckets. Those not read should be given back.
+  typedef std::function<void(std::size_t)> GrantCallbackType;
+
+  static boost::asio::io_service::id id;
+
+  explicit ShapingScheduler(boost::asio::io_service& io_service)
+      : boost::asio::io_service::service(io_service), timer_(io_service) {}
+
+  /// Grants a read once all of `buckets` have tokens. `buckets` must outlive
+  /// the wait. The callback is called right away if they already have tokens
+  /// and no relay is waiting, or else in turn.
+  void StartAcquire(const BucketSet& buckets,
+                    const GrantCallbackType& callback);
+
+  /// Returns the number of relays waiting for tokens.
+  std::size_t GetWaitingCount() const { return waiters_.size(); }
+
+ private:
+  struct Waiter {
+    const BucketSet* buckets;
+    GrantCallbackType callback;
+  };
+
+  void shutdown_service() override;
+
+  void ScheduleWakeup(TokenBucket::ClockType::duration delay);
+  void HandleWakeup();
+
+  std::deque<Waiter> waiters_;
+  boost::asio::steady_timer timer_;
+  /// Expiry of the pending timer, if any.
+  TokenBucket::ClockType::time_point wakeup_time_ =
+      TokenBucket::ClockType::time_point::max();
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_RATE_LIMITER_H_
@@ -0,0 +1,140 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines the rules routing requests by their destinations.
+#ifndef THESTRAL_ROUTE_TABLE_H_
+#define THESTRAL_ROUTE_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+namespace thestral {
+
+/// Rules deciding what to do with a request by its destination. A rule
+/// matches an IP network, a domain along with its subdomains, or any host,
+/// optionally on a range of ports, and the first matching rule in the order of
+/// adding decides. A network only matches destinations given as IP
+/// addresses, as domain names are not resolved for routing, unless the
+/// addresses they are resolved to are looked up again once known.
+///
+/// The rules are compiled into tries as they are added: a binary trie for
+/// each IP version and a trie of domain labels from the right, so that a
+/// lookup takes time linear in the length of the destination rather than in
+/// the number of rules. The table is not modified by lookups, so a table can
+/// be shared by threads once built.
+class RouteTable {
+ public:
+  /// What to do with a request: one of the values below, or else the index of
+  /// an upstream to send it to, defined by the user of the table.
+  typedef int Target;
+  /// Sends the request to the default upstream.
+  constexpr static Target kAllow = -1;
+  /// Rejects the request.
+  constexpr static Target kDeny = -2;
+
+  /// An inclusive range of ports.
+  struct PortRange {
+    uint16_t first = 0;
+    uint16_t last = 65535;
+  };
+
+  RouteTable();
+
+  /// Adds a rule matching the IP addresses of `network`, in the form of
+  /// `10.0.0.0/8` or a single address. Returns `false` if it can't be parsed.
+  bool AddNetworkRule(const std::string& network, PortRange ports,
+                      Target target);
+  /// Adds a rule matching `domain` and its subdomains, case-insensitively. A
+  /// leading dot is ignored.
+  void AddDomainRule(const std::string& domain, PortRange ports,
+                     Target target);
+  /// Adds a rule matching every destination.
+  void AddAnyRule(PortRange ports, Target target);
+  /// Sets the target of destinations matching no rule, `kAllow` by default.
+  void SetDefault(Target target) { default_target_ = target; }
+
+  /// Returns the target of the first rule matching `address`.
+  Target Lookup(const Address& address) const;
+  /// Returns the target of the first rule matching either `address` or
+  /// `resolved`, an IP address it has been resolved to, so that the networks
+  /// apply to domain names too.
+  Target Lookup(const Address& address, const Address& resolved) const;
+  /// Returns whether any network rule has been added.
+  bool HasNetworkRules() const { return has_network_rules_; }
+
+  std::size_t GetRuleCount() const { return rules_.size(); }
+
+ private:
+  constexpr static uint32_t kNone = UINT32_MAX;
+
+  struct Rule {
+    PortRange ports;
+    Target target;
+  };
+  /// An entry of the list of rules attached to a node, in the order of adding.
+  struct RuleRef {
+    uint32_t rule;
+    uint32_t next;
+  };
+  struct RuleList {
+    uint32_t first = kNone;
+    uint32_t last = kNone;
+  };
+  struct IpNode {
+    uint32_t children[2] = {kNone, kNone};
+    RuleList rules;
+  };
+  struct DomainNode {
+    uint32_t parent;
+    std::string label;  ///< In lower case
+    RuleList rules;
+  };
+
+  /// Returns the index of the first rule matching `address`, or kNone.
+  uint32_t MatchAddress(const Address& address) const;
+  /// Attaches a new rule to `list`.
+  void AddRule(RuleList* list, PortRange ports, Target target);
+  /// Updates `best` with the first rule of `list` matching `port` if it comes
+  /// before the current one.
+  void MatchRules(const RuleList& list, uint16_t port, uint32_t* best) const;
+  uint32_t MatchIp(const std::vector<IpNode>& trie, const unsigned char* bytes,
+                   std::size_t n_bits, uint16_t port) const;
+  uint32_t MatchDomain(const AddressHost& host, uint16_t port) const;
+  /// Returns the child of a domain node with a label, or kNone.
+  uint32_t FindDomainChild(uint32_t parent, const char* label,
+                           std::size_t size) const;
+  static uint64_t HashLabel(uint32_t parent, const char* label,
+                            std::size_t size);
+
+  std::vector<Rule> rules_;
+  std::vector<RuleRef> rule_refs_;
+  RuleList any_rules_;
+  std::vector<IpNode> ipv4_trie_;
+  std::vector<IpNode> ipv6_trie_;
+  /// Node 0 is the root, the parent of top-level domains.
+  std::vector<DomainNode> domain_nodes_;
+  /// Children of the domain nodes by HashLabel() of their parent and label.
+  std::unordered_multimap<uint64_t, uint32_t> domain_children_;
+  Target default_target_ = kAllow;
+  bool has_network_rules_ = false;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_ROUTE_TABLE_H_
@@ -30,7 +30,8 @@
 namespace thestral {
 namespace socks {
 
-THESTRAL_DEFINE_ENUM(AuthMethod, uint8_t, (kNoAuth, 0x0),
+/// `kTraceId` is private to thestral, see AuthMethodList::AddTraceId().
+THESTRAL_DEFINE_ENUM(AuthMethod, uint8_t, (kNoAuth, 0x0), (kTraceId, 0x88),
                      (kNotSupported, 0xff));
 
 THESTRAL_DEFINE_ENUM(Command, uint8_t, (kConnect, 0x1), (kBind, 0x2),
@@ -53,7 +54,18 @@ struct AuthMethodList : PacketBase {
   static void StartCreateFrom(const std::shared_ptr<TransportBase>& transport,
                               const CreateCallbackType& callback);
 
-  std::string Serialize() const override;
+  ParseResult ParseFrom(const char* data, std::size_t size,
+                        std::size_t* n_consumed);
+  void SerializeTo(std::string* data) const override;
+
+  /// Appends the ID of a trace to the methods, as `kTraceId` followed by the
+  /// eight bytes of the ID in network order, so that the next hop traces the
+  /// session under the same ID. Servers other than thestral take the bytes
+  /// for methods, so it should only be sent to thestral servers.
+  void AddTraceId(uint64_t id);
+  /// Removes the trace ID from the end of the methods, returning it, or zero
+  /// if there is none.
+  uint64_t TakeTraceId();
 };
 
 struct AuthMethodSelectPacket : PacketWithSize<AuthMethodSelectPacket, 2> {
@@ -116,7 +128,11 @@ struct SocksAddress : Address, PacketBase {
   static void StartCreateFrom(const std::shared_ptr<TransportBase>& transport,
                               const CreateCallbackType& callback);
 
-  std::string Serialize() const override;
+  /// Parses an address from bytes. An unknown address type results in
+  /// ParseResult::kInvalid.
+  ParseResult ParseFrom(const char* data, std::size_t size,
+                        std::size_t* n_consumed);
+  void SerializeTo(std::string* data) const override;
 
  private:
   static void StartReadDomain(const std::shared_ptr<SocksAddress>& packet,
@@ -139,7 +155,8 @@ class SocksCategory : public boost::system::error_category {
   }
 };
 
-static inline const SocksCategory& GetSocksCategory() {
+// not static, so that all translation units share the same category
+inline const SocksCategory& GetSocksCategory() {
   static SocksCategory category;
   return category;
 }
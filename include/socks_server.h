@@ -17,16 +17,27 @@
 #ifndef THESTRAL_SOCKS_SERVER_H_
 #define THESTRAL_SOCKS_SERVER_H_
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 
 #include "base.h"
+#include "copy_relay.h"
 #include "logging.h"
+#include "metrics.h"
+#include "mux.h"
+#include "rate_limiter.h"
+#include "route_table.h"
 #include "socks.h"
+#include "socks_udp.h"
 #include "socks_upstream.h"
+#include "splice_relay.h"
 #include "tcp_transport.h"
+#include "timing_wheel.h"
+#include "trace.h"
 
 namespace thestral {
 namespace socks {
@@ -49,15 +60,75 @@ class SocksTcpServer : public ServerBase,
   }
 
   void Start() override;
+  /// Stops accepting, and tells the MuxSessions of the server to go away so
+  /// that their clients open new streams elsewhere.
+  void Stop() override;
+  /// Counts relaying sessions and UDP associations. Connections still in
+  /// their handshake are not counted.
+  std::size_t CountSessions() const override { return n_sessions_; }
 
- private:
-  /// Buffer size when relaying data. A large buffer would result in memory
-  /// inefficiency when there are lots of connection, while a small buffer might
-  /// lead to increase in delay.
-  constexpr static size_t kRelayBufferSize = 0x4000;
+  typedef TimingWheel::ClockType::duration DurationType;
 
+  /// Sets the time allowed from accepting a connection to receiving its SOCKS
+  /// request, or the preface of a MuxSession, which applies to each of its
+  /// streams too. Zero (default) means no limit.
+  void SetHandshakeTimeout(DurationType timeout) {
+    handshake_timeout_ = timeout;
+  }
+  /// Sets the time allowed for establishing the upstream connection of a
+  /// request, after which the downstream gets a `kTtlExpired` response. Zero
+  /// (default) means no limit.
+  void SetConnectTimeout(DurationType timeout) { connect_timeout_ = timeout; }
+  /// Sets the time after which a session relaying nothing in either direction
+  /// is closed. Zero (default) means no limit.
+  void SetIdleTimeout(DurationType timeout) { idle_timeout_ = timeout; }
+  /// Sets whether accepted connections carry MuxSessions, opened by
+  /// MuxTcpUpstreamFactory, instead of SOCKS connections. Each stream of a
+  /// session is served as a SOCKS connection past the auth negotiation.
+  void SetMultiplexing(bool multiplexing) { multiplexing_ = multiplexing; }
+  /// Sets the number of streams each MuxSession may have open at once, see
+  /// MuxSession::SetMaxStreams(). Zero (default) means no limit.
+  void SetMaxStreams(std::size_t max_streams) { max_streams_ = max_streams; }
+  /// Sets whether UDP ASSOCIATE requests are served. Datagrams are relayed by
+  /// this server directly, so they are only served if the upstream is a
+  /// DirectTcpUpstreamFactory, lest they bypass a chain of proxies.
+  void SetUdpAssociate(bool udp_associate);
+  /// Sets the rules deciding where CONNECT requests go. Requests routed to an
+  /// upstream index go to `upstreams[index]`, and `kAllow` ones go to the
+  /// default upstream of the server. Datagrams of UDP associations are only
+  /// relayed to `kAllow` destinations.
+  void SetRoutes(
+      const std::shared_ptr<const RouteTable>& routes,
+      const std::vector<std::shared_ptr<UpstreamFactoryBase>>& upstreams) {
+    routes_ = routes;
+    routed_upstreams_ = upstreams;
+  }
+  /// Sets the limiter handing out the buckets of relay sessions, whose data in
+  /// both directions take tokens from them. Shaped sessions are always relayed
+  /// by CopyRelay, as splicing is out of its reach. Datagrams of UDP
+  /// associations take tokens too, and are dropped while there are none.
+  void SetRateLimiter(const std::shared_ptr<RateLimiter>& rate_limiter) {
+    rate_limiter_ = rate_limiter;
+  }
+
+ private:
   static logging::Logger LOG;
 
+  /// State shared by the relays of a session, released when both are done.
+  struct RelaySession {
+    /// Keeps the session counted as active.
+    std::shared_ptr<void> active_token;
+    TimingWheel::Timer idle_timer;
+    /// Buckets of the rate limits, `nullptr` if the session is not shaped.
+    std::shared_ptr<const BucketSet> buckets;
+    /// Trace of the session, `nullptr` if it is not traced.
+    std::shared_ptr<trace::Trace> trace;
+    /// Number of directions which have reached the end of stream.
+    int n_finished = 0;
+    /// Whether both transports have been closed.
+    bool is_closed = false;
+  };
+
   SocksTcpServer(
       const std::string& bind_address, uint16_t bind_port,
       const std::shared_ptr<TcpTransportFactory>& server_transport_factory,
@@ -67,28 +138,108 @@ class SocksTcpServer : public ServerBase,
         server_transport_factory_(server_transport_factory),
         upstream_factory_(upstream_factory) {}
 
+  /// Returns a token keeping a session counted, both by CountSessions() and
+  /// by the active sessions gauge, until it is destroyed.
+  std::shared_ptr<void> TrackSession();
   /// Receives and replies auth packet on a new connection. Returns `false` when
   /// there is no need to accept more connections.
   bool HandleNewConnection(const ec_type& ec,
                            const std::shared_ptr<TransportBase>& transport);
+  /// Serves a stream of a MuxSession accepted by the server.
+  void HandleNewStream(const std::shared_ptr<TransportBase>& stream);
+  /// Starts a timer closing `transport` after `timeout`. Returns `nullptr` if
+  /// `timeout` is zero.
+  std::shared_ptr<TimingWheel::Timer> StartTimeout(
+      DurationType timeout, const std::shared_ptr<TransportBase>& transport,
+      const char* stage);
   /// Receives the request packet from the client and performs some checks.
+  /// `reply_prefix` holds the replies not yet sent to the client, which will
+  /// be sent along with the SOCKS response. `timer` is the handshake timer,
+  /// and `trace` the trace of the session, if any.
   void ReceiveRequestPacket(const ec_type& ec,
-                            const std::shared_ptr<TransportBase>& transport);
-  /// Establishes the upstream connection from a given request.
+                            const std::shared_ptr<PacketReader>& reader,
+                            const std::string& reply_prefix,
+                            const std::shared_ptr<TimingWheel::Timer>& timer,
+                            const std::shared_ptr<trace::Trace>& trace);
+  /// Establishes the upstream connection from a given request, through the
+  /// upstream it is routed to. `early_data` are bytes the client sent right
+  /// after the request.
   void HandleRequest(RequestPacket request,
-                     const std::shared_ptr<TransportBase>& transport);
+                     const std::shared_ptr<TransportBase>& transport,
+                     const std::string& early_data,
+                     const std::string& reply_prefix,
+                     const std::shared_ptr<trace::Trace>& trace);
+  /// Opens a SocksUdpAssociation for a UDP ASSOCIATE request, which lives as
+  /// long as `transport`.
+  void HandleUdpAssociate(const RequestPacket& request,
+                          const std::shared_ptr<TransportBase>& transport,
+                          const std::string& reply_prefix);
+  /// Waits for the control connection of an association to close, discarding
+  /// anything read from it, then closes the association.
+  static void WatchControl(
+      const std::shared_ptr<TransportBase>& transport,
+      const std::shared_ptr<SocksUdpAssociation>& association,
+      const std::shared_ptr<void>& active_token);
+  /// Starts relaying in both directions, forwarding `early_data` to the
+  /// upstream first.
+  void StartRelays(const std::shared_ptr<TransportBase>& downstream,
+                   const std::shared_ptr<TransportBase>& upstream,
+                   const std::string& early_data,
+                   const std::shared_ptr<trace::Trace>& trace);
   /// Sends a ResponsePacket with a response code to the client than close the
   /// transport.
   void ResponseError(ResponseCode response_code,
-                     const std::shared_ptr<TransportBase>& transport);
+                     const std::shared_ptr<TransportBase>& transport,
+                     const std::string& reply_prefix);
+  /// Sends a ResponsePacket to the client, preceded by `reply_prefix` in the
+  /// same write.
+  void SendResponse(const ResponsePacket& response,
+                    const std::shared_ptr<TransportBase>& transport,
+                    const std::string& reply_prefix,
+                    const TransportBase::WriteCallbackType& callback);
   /// Relays data from a transport to another transport in a single direction.
+  /// `session` is held until the relay is done, the bytes relayed are counted
+  /// by `byte_counter`, and the first of them are recorded as `first_byte` in
+  /// the trace of the session.
   void StartRelay(const std::shared_ptr<TransportBase>& from,
-                  const std::shared_ptr<TransportBase>& to);
+                  const std::shared_ptr<TransportBase>& to,
+                  const std::shared_ptr<RelaySession>& session,
+                  const metrics::Counter& byte_counter,
+                  trace::Event first_byte);
+  /// Relays data in a single direction with SpliceRelay. Returns `false`
+  /// without doing anything if splicing is not possible for the transports.
+  bool StartSpliceRelay(const std::shared_ptr<TransportBase>& from,
+                        const std::shared_ptr<TransportBase>& to,
+                        const std::shared_ptr<RelaySession>& session,
+                        const metrics::Counter& byte_counter,
+                        trace::Event first_byte);
+  /// Handles the end of the relay from `from` to `to`. The end of stream is
+  /// passed on by shutting down the sending side of `to`, leaving the other
+  /// direction running, and both transports are closed once both directions
+  /// are finished or either of them fails.
+  static void HandleRelayDone(const ec_type& ec,
+                              const std::shared_ptr<TransportBase>& from,
+                              const std::shared_ptr<TransportBase>& to,
+                              const std::shared_ptr<RelaySession>& session);
 
-  const std::string& bind_address_;
+  const std::string bind_address_;
   const uint16_t bind_port_;
   const std::shared_ptr<TcpTransportFactory> server_transport_factory_;
   const std::shared_ptr<UpstreamFactoryBase> upstream_factory_;
+  DurationType handshake_timeout_{0};
+  DurationType connect_timeout_{0};
+  DurationType idle_timeout_{0};
+  bool multiplexing_ = false;
+  std::size_t max_streams_ = 0;
+  bool udp_associate_ = false;
+  std::shared_ptr<const RouteTable> routes_;
+  std::vector<std::shared_ptr<UpstreamFactoryBase>> routed_upstreams_;
+  std::shared_ptr<RateLimiter> rate_limiter_;
+  /// Resolves the domain names of datagrams, created on the first association.
+  std::shared_ptr<DnsCache> udp_dns_cache_;
+  /// Multiplexed sessions accepted, told to go away on Stop().
+  std::vector<std::weak_ptr<mux::MuxSession>> mux_sessions_;
+  std::atomic<std::size_t> n_sessions_{0};
 };
 
 }  // namespace socks
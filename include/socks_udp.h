@@ -0,0 +1,227 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines the UDP relay serving SOCKS UDP ASSOCIATE requests.
+#ifndef THESTRAL_SOCKS_UDP_H_
+#define THESTRAL_SOCKS_UDP_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/asio.hpp>
+
+#include "base.h"
+#include "common.h"
+#include "dns_cache.h"
+#include "logging.h"
+#include "rate_limiter.h"
+#include "route_table.h"
+#include "timing_wheel.h"
+
+namespace thestral {
+namespace socks {
+
+/// Header of a SOCKS UDP datagram, pointing into the datagram itself.
+struct UdpHeaderView {
+  uint8_t fragment = 0;
+  AddressType type = AddressType::kIPv4;
+  /// Bytes of the IP address, or the domain name.
+  const char* host = nullptr;
+  std::size_t host_size = 0;
+  uint16_t port = 0;
+  /// Size of the whole header, after which the payload follows.
+  std::size_t size = 0;
+};
+
+/// Size of the header of a datagram relayed from an IPv6 address, the largest
+/// one written by WriteUdpHeader().
+constexpr std::size_t kMaxUdpHeaderSize = 22;
+
+/// Parses the header of a SOCKS UDP datagram without copying anything.
+ParseResult ParseUdpHeader(const char* data, std::size_t size,
+                           UdpHeaderView* header);
+/// Writes the header of a datagram relayed from `endpoint` to `data`, which has
+/// room for kMaxUdpHeaderSize bytes. Returns the size of the header.
+std::size_t WriteUdpHeader(const boost::asio::ip::udp::endpoint& endpoint,
+                           char* data);
+/// Returns the IP address of an Address, or an unspecified one for a domain
+/// name. IPv4-mapped IPv6 addresses are returned as IPv4 ones.
+boost::asio::ip::address ToIpAddress(const Address& address);
+
+namespace impl {
+
+/// Buffers for handling datagrams in batches, shared by all associations of an
+/// `io_service`, each of which handles a batch at a time.
+class UdpBatchBuffers : public boost::asio::io_service::service {
+ public:
+  /// Maximum number of datagrams received or sent at once.
+  constexpr static std::size_t kBatchSize = 16;
+  /// Size of each receiving buffer, enough for a datagram of any size and for
+  /// the segments coalesced by GRO.
+  constexpr static std::size_t kBufferSize = 0x10000;
+
+  /// A datagram to send, the header and the payload of which are sent
+  /// together without being copied into one buffer.
+  struct OutgoingDatagram {
+    boost::asio::ip::udp::endpoint endpoint;
+    std::array<char, kMaxUdpHeaderSize> header;
+    std::size_t header_size = 0;
+    const char* payload = nullptr;
+    std::size_t payload_size = 0;
+  };
+
+  static boost::asio::io_service::id id;
+
+  explicit UdpBatchBuffers(boost::asio::io_service& io_service)
+      : boost::asio::io_service::service(io_service) {}
+
+  /// Returns the `i`-th receiving buffer, allocated on first use.
+  char* GetBuffer(std::size_t i);
+
+  std::array<boost::asio::ip::udp::endpoint, kBatchSize> sources;
+  std::array<std::size_t, kBatchSize> sizes;
+  /// Size of the segments coalesced into each datagram received, which equals
+  /// its size without GRO.
+  std::array<std::size_t, kBatchSize> segment_sizes;
+  std::array<OutgoingDatagram, kBatchSize> outgoing;
+  std::size_t n_outgoing = 0;
+
+ private:
+  void shutdown_service() override {}
+
+  std::unique_ptr<char[]> buffers_;
+};
+
+}  // namespace impl
+
+/// A UDP association of a SOCKS client, relaying datagrams between the client
+/// and any targets through a UDP socket of its own. Datagrams from the address
+/// of the client are unwrapped and sent to the targets in their headers, and
+/// the others are wrapped and sent to the client. The association lives until
+/// Close() is called, which the server does when the TCP connection of the
+/// request closes.
+///
+/// Datagrams are received and sent in batches, with `recvmmsg()` and
+/// `sendmmsg()` where available, plus GRO on Linux. Fragmented datagrams are
+/// dropped, as are the ones which can't be sent right away. The association is
+/// not thread-safe and should be used on its `io_service` only.
+///
+/// As datagrams are sent from this host, those to destinations the routes deny
+/// or send to another upstream are dropped, and so are those arriving while the
+/// buckets of the rate limits are empty, since UDP has no flow control to hold
+/// them back.
+class SocksUdpAssociation
+    : public std::enable_shared_from_this<SocksUdpAssociation> {
+ public:
+  SocksUdpAssociation(const SocksUdpAssociation&) = delete;
+  SocksUdpAssociation& operator=(const SocksUdpAssociation&) = delete;
+
+  /// Creates an association resolving domain names with `dns_cache`.
+  static std::shared_ptr<SocksUdpAssociation> New(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+      const std::shared_ptr<DnsCache>& dns_cache) {
+    return std::shared_ptr<SocksUdpAssociation>(
+        new SocksUdpAssociation(io_service_ptr, dns_cache));
+  }
+
+  /// Opens the socket on `bind_address` for the client sending from
+  /// `client_endpoint`. A zero port accepts the first port the client sends
+  /// from.
+  ec_type Open(const boost::asio::ip::address& bind_address,
+               const boost::asio::ip::udp::endpoint& client_endpoint);
+  /// Returns the endpoint the client should send datagrams to.
+  boost::asio::ip::udp::endpoint GetLocalEndpoint() const;
+  /// Starts relaying.
+  void Start();
+  /// Stops relaying and closes the socket.
+  void Close();
+
+  /// Sets the timer to touch whenever datagrams are relayed. The association
+  /// keeps it until closed.
+  void SetIdleTimer(const std::shared_ptr<TimingWheel::Timer>& timer) {
+    idle_timer_ = timer;
+  }
+  /// Sets the routes deciding which destinations datagrams may be sent to.
+  /// Domain names are looked up along with the addresses they resolve to.
+  void SetRoutes(const std::shared_ptr<const RouteTable>& routes) {
+    routes_ = routes;
+  }
+  /// Sets the buckets the datagrams in both directions take tokens from.
+  void SetRateLimit(const std::shared_ptr<const BucketSet>& buckets) {
+    buckets_ = buckets;
+  }
+
+ private:
+  static logging::Logger LOG;
+
+  SocksUdpAssociation(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+      const std::shared_ptr<DnsCache>& dns_cache)
+      : io_service_ptr_(io_service_ptr),
+        socket_(*io_service_ptr),
+        dns_cache_(dns_cache),
+        batch_(boost::asio::use_service<impl::UdpBatchBuffers>(
+            *io_service_ptr)) {}
+
+  void WaitReadable();
+  void HandleReadable(const ec_type& ec);
+  /// Receives a batch of datagrams into the buffers of `batch_`. Returns the
+  /// number of datagrams received.
+  std::size_t ReceiveBatch();
+  void HandleDatagram(const boost::asio::ip::udp::endpoint& source,
+                      const char* data, std::size_t size);
+  void RelayFromClient(const char* data, std::size_t size);
+  void RelayFromTarget(const boost::asio::ip::udp::endpoint& source,
+                       const char* data, std::size_t size);
+  /// Returns the next slot of the outgoing datagrams, sending the queued ones
+  /// if there is no room.
+  impl::UdpBatchBuffers::OutgoingDatagram& NextOutgoing();
+  void SendBatch();
+  /// Returns whether the routes let a datagram to `endpoint` be sent from
+  /// here. `host` is the domain name it was resolved from, if any.
+  bool IsRouted(const char* host, std::size_t host_size,
+                const boost::asio::ip::udp::endpoint& endpoint) const;
+  /// Takes tokens for a datagram from the buckets. Returns `false` if they
+  /// are empty, in which case the datagram should be dropped.
+  bool ConsumeTokens(std::size_t size);
+  /// Sends a datagram to a host name once it is resolved.
+  void ResolveAndSend(const std::string& host, uint16_t port,
+                      const std::shared_ptr<std::string>& payload);
+
+  const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+  boost::asio::ip::udp::socket socket_;
+  const std::shared_ptr<DnsCache> dns_cache_;
+  impl::UdpBatchBuffers& batch_;
+  std::shared_ptr<TimingWheel::Timer> idle_timer_;
+  std::shared_ptr<const RouteTable> routes_;
+  std::shared_ptr<const BucketSet> buckets_;
+  boost::asio::ip::udp::endpoint client_endpoint_;
+  bool is_closed_ = false;
+  /// The host name resolved last, so that its datagrams need no lookup.
+  std::string last_host_;
+  boost::asio::ip::address last_host_address_;
+  /// Numbers of datagrams in the batch being handled, for the metrics.
+  std::size_t n_upstream_ = 0;
+  std::size_t n_downstream_ = 0;
+  std::size_t n_dropped_ = 0;
+};
+
+}  // namespace socks
+}  // namespace thestral
+
+#endif  // THESTRAL_SOCKS_UDP_H_
@@ -17,11 +17,13 @@
 #ifndef THESTRAL_SOCKS_UPSTREAM_H_
 #define THESTRAL_SOCKS_UPSTREAM_H_
 
-#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
-#include <mutex>
 #include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 
@@ -30,8 +32,15 @@
 #include "logging.h"
 #include "socks.h"
 #include "tcp_transport.h"
+#include "trace.h"
+#include "transport_pool.h"
 
 namespace thestral {
+
+namespace testing {
+class TestSocksTcpUpstreamFactory;
+}  // namespace testing
+
 namespace socks {
 
 namespace impl {
@@ -57,10 +66,23 @@ class SocksTransportWrapper : public TransportBase {
     wrapped_->StartWrite(buf, callback);
   }
 
+  void StartWrite(const ConstBufferSequence& buffers,
+                  const WriteCallbackType& callback) override {
+    wrapped_->StartWrite(buffers, callback);
+  }
+
+  void StartWaitReadable(const WaitCallbackType& callback) override {
+    wrapped_->StartWaitReadable(callback);
+  }
+
   void StartClose(const CloseCallbackType& callback) override {
     wrapped_->StartClose(callback);
   }
 
+  void StartShutdownSend(const CloseCallbackType& callback) override {
+    wrapped_->StartShutdownSend(callback);
+  }
+
   IdType GetId() const override { return wrapped_->GetId(); }
 
   /// Constructs a wrapper around a pointer to a transport.
@@ -77,7 +99,9 @@ class SocksTransportWrapper : public TransportBase {
 
 }  // namespace impl
 
-/// Upstream factory for the TCP part of SOCKS protocol.
+/// Upstream factory for the TCP part of SOCKS protocol. The upstream host is
+/// resolved asynchronously and connections fail over across its addresses.
+/// The factory is not thread-safe and should be used on its `io_service` only.
 class SocksTcpUpstreamFactory
     : public UpstreamFactoryBase,
       public std::enable_shared_from_this<SocksTcpUpstreamFactory> {
@@ -85,6 +109,8 @@ class SocksTcpUpstreamFactory
   SocksTcpUpstreamFactory(const SocksTcpUpstreamFactory&) = delete;
   SocksTcpUpstreamFactory& operator=(const SocksTcpUpstreamFactory&) = delete;
 
+  typedef std::chrono::steady_clock ClockType;
+
   /// Creates a factory with a given TcpTransportFactory.
   static std::shared_ptr<SocksTcpUpstreamFactory> New(
       const std::shared_ptr<TcpTransportFactory>& transport_factory,
@@ -93,6 +119,8 @@ class SocksTcpUpstreamFactory
         transport_factory, upstream_host, upstream_port));
   }
 
+  /// Records the resolution of the upstream host and the connection in the
+  /// current trace, and forwards its ID if enabled.
   void StartRequest(const Address& endpoint,
                     const RequestCallbackType& callback) override;
 
@@ -100,7 +128,43 @@ class SocksTcpUpstreamFactory
     return transport_factory_->get_io_service_ptr();
   }
 
+  /// Errors replied by the server are about the endpoint requested.
+  bool IsUpstreamFailure(const ec_type& ec) const override {
+    return ec.category() != error::GetSocksCategory();
+  }
+
+  /// Sets whether to send the auth request and the SOCKS request in a single
+  /// write without waiting for the auth reply in between, which saves a round
+  /// trip. It is only safe when the upstream is known to accept no-auth
+  /// requests, e.g. another thestral instance.
+  void SetFastChaining(bool fast_chaining) { fast_chaining_ = fast_chaining; }
+
+  /// Sets whether to forward the ID of the trace of a session to the upstream,
+  /// which then traces the session under the same ID. Like fast chaining, it
+  /// is only safe when the upstream is another thestral instance.
+  void SetTraceForwarding(bool forwarding) { trace_forwarding_ = forwarding; }
+
+  /// Sets how long the resolved addresses of the upstream host are used before
+  /// being refreshed. Requests made after that keep using them until the
+  /// refresh completes.
+  void SetResolveTtl(ClockType::duration ttl) { resolve_ttl_ = ttl; }
+
+  /// Keeps up to `max_size` connections to the upstream established in
+  /// advance, each of which is closed after being idle for `idle_timeout`.
+  /// It should be shorter than the handshake timeout of the upstream, which
+  /// closes the connections it has accepted without receiving a request.
+  void SetPool(std::size_t max_size,
+               TransportPool::ClockType::duration idle_timeout) {
+    pool_ = TransportPool::New(transport_factory_, max_size, idle_timeout);
+  }
+
  private:
+  typedef std::function<void(const ec_type&)> ResolveCallbackType;
+
+  /// Delay before retrying a failed resolution.
+  constexpr static ClockType::duration kResolveRetryDelay =
+      std::chrono::seconds(10);
+
   static logging::Logger LOG;
 
   /// The transport factory for creating connections to the upstream host.
@@ -108,29 +172,92 @@ class SocksTcpUpstreamFactory
   const std::string upstream_host_;
   const uint16_t upstream_port_;
 
-  /// The cached upstream endpoint to avoid DNS query every time.
-  boost::asio::ip::tcp::endpoint upstream_endpoint_;
-  /// The flag indicating if @ref upstream_endpoint_ has been initialized.
-  std::atomic_bool is_upstream_endpoint_init_{false};
-  /// The mutex used when initializing @ref upstream_endpoint_.
-  std::mutex upstream_endpoint_init_mtx_;
+  boost::asio::ip::tcp::resolver resolver_;
+  /// The resolved upstream endpoints, cached to avoid DNS query every time.
+  std::vector<boost::asio::ip::tcp::endpoint> upstream_endpoints_;
+  /// Index of the endpoint to try first, i.e. the last one connected.
+  std::size_t preferred_endpoint_ = 0;
+  /// When @ref upstream_endpoints_ should be refreshed.
+  ClockType::time_point endpoints_expiry_;
+  ClockType::duration resolve_ttl_ = std::chrono::minutes(5);
+  bool is_resolving_ = false;
+  /// Requests waiting for the first resolution to complete.
+  std::vector<ResolveCallbackType> resolve_waiters_;
+  bool fast_chaining_ = false;
+  bool trace_forwarding_ = false;
+  /// Pre-established connections to the upstream, if enabled.
+  std::shared_ptr<TransportPool> pool_;
+
+  friend class testing::TestSocksTcpUpstreamFactory;
 
   SocksTcpUpstreamFactory(
       const std::shared_ptr<TcpTransportFactory>& transport_factory,
       const std::string& upstream_host, uint16_t upstream_port)
       : transport_factory_(transport_factory),
         upstream_host_(upstream_host),
-        upstream_port_(upstream_port) {}
+        upstream_port_(upstream_port),
+        resolver_(*transport_factory->get_io_service_ptr()) {}
+
+  /// Resolves the upstream host asynchronously unless it is being resolved.
+  void StartResolve();
+  void HandleResolve(const ec_type& ec,
+                     boost::asio::ip::tcp::resolver::iterator iter);
+  /// Connects to the upstream, or takes a pooled connection, falling back to
+  /// a new connection if the pooled one fails before the upstream replies.
+  /// `trace` is the trace of the request, if any.
+  void ConnectUpstream(const Address& endpoint,
+                       const RequestCallbackType& callback,
+                       const std::shared_ptr<trace::Trace>& trace);
+  /// Connects to the resolved endpoints one by one until one succeeds.
+  void ConnectEndpoint(const Address& endpoint,
+                       const RequestCallbackType& callback,
+                       const std::shared_ptr<trace::Trace>& trace,
+                       std::size_t n_tried);
 
+  /// Sends the requests on an established connection, either one by one or
+  /// all at once in fast chaining mode.
+  void SendRequests(const Address& endpoint,
+                    const std::shared_ptr<TransportBase>& transport,
+                    const RequestCallbackType& callback,
+                    const std::shared_ptr<trace::Trace>& trace) const;
   void SendAuthRequest(const Address& endpoint,
                        const std::shared_ptr<TransportBase>& transport,
-                       const RequestCallbackType& callback) const;
+                       const RequestCallbackType& callback,
+                       const std::shared_ptr<trace::Trace>& trace) const;
+  /// Returns the auth request, carrying the ID of `trace` if it is forwarded.
+  AuthMethodList MakeAuthRequest(
+      const std::shared_ptr<trace::Trace>& trace) const;
+  void ReceiveAuthReply(const Address& endpoint,
+                        const std::shared_ptr<TransportBase>& transport,
+                        const RequestCallbackType& callback) const;
   void SendSocksRequest(const Address& endpoint,
                         const std::shared_ptr<TransportBase>& transport,
                         const RequestCallbackType& callback) const;
+  void ReceiveSocksResponse(const Address& endpoint,
+                            const std::shared_ptr<TransportBase>& transport,
+                            const RequestCallbackType& callback) const;
 };
 
 }  // namespace socks
+
+namespace testing {
+/// This class is a friend of SocksTcpUpstreamFactory and tests that need to
+/// access its private members should use it.
+class TestSocksTcpUpstreamFactory {
+ public:
+  /// Makes `upstream` use `endpoints` as the resolved addresses of the
+  /// upstream host, e.g. for a host with several addresses.
+  static void SetUpstreamEndpoints(
+      const std::shared_ptr<socks::SocksTcpUpstreamFactory>& upstream,
+      const std::vector<boost::asio::ip::tcp::endpoint>& endpoints) {
+    upstream->upstream_endpoints_ = endpoints;
+    upstream->preferred_endpoint_ = 0;
+    upstream->endpoints_expiry_ =
+        socks::SocksTcpUpstreamFactory::ClockType::time_point::max();
+  }
+};
+}  // namespace testing
+
 }  // namespace thestral
 
 #endif /* ifndef THESTRAL_SOCKS_UPSTREAM_H_ */
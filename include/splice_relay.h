@@ -0,0 +1,130 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines a zero-copy relay between plain TCP transports.
+#ifndef THESTRAL_SPLICE_RELAY_H_
+#define THESTRAL_SPLICE_RELAY_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "base.h"
+#include "handler_memory.h"
+#include "logging.h"
+#include "metrics.h"
+#include "timing_wheel.h"
+#include "tcp_transport.h"
+#include "trace.h"
+
+namespace thestral {
+
+/// Relays data from one transport to another in a single direction without
+/// copying it into user space. The data is moved through a pipe with
+/// `splice(2)`, so it is only available on Linux and only for transports whose
+/// bytes on the wire are exactly the bytes of the stream, i.e.
+/// impl::TcpTransportImpl, or SSL transports offloaded to kernel TLS in the
+/// direction concerned.
+class SpliceRelay : public std::enable_shared_from_this<SpliceRelay> {
+ public:
+  typedef std::function<void(const ec_type&)> DoneCallbackType;
+
+  SpliceRelay(const SpliceRelay&) = delete;
+  SpliceRelay& operator=(const SpliceRelay&) = delete;
+  ~SpliceRelay();
+
+  /// Returns whether data from `from` to `to` can be relayed with splice.
+  static bool IsApplicable(const std::shared_ptr<TransportBase>& from,
+                           const std::shared_ptr<TransportBase>& to);
+
+  /// Creates a relay from `from` to `to`. Returns `nullptr` and sets
+  /// `error_code` if splice is not applicable to the transports or the
+  /// intermediate pipe cannot be created.
+  static std::shared_ptr<SpliceRelay> New(
+      const std::shared_ptr<TransportBase>& from,
+      const std::shared_ptr<TransportBase>& to,
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+      ec_type& error_code);
+
+  /// Starts relaying. The callback will be called once, either when the source
+  /// reaches EOF and all the data has been written to the destination (with
+  /// `boost::asio::error::eof`), or when an error occurs.
+  void Start(const DoneCallbackType& callback);
+
+  /// Sets the counter of the bytes relayed, which must outlive the relay.
+  void SetByteCounter(const metrics::Counter* counter) {
+    byte_counter_ = counter;
+  }
+  /// Sets the timer to touch whenever data is relayed. The relay keeps it until
+  /// done.
+  void SetIdleTimer(const std::shared_ptr<TimingWheel::Timer>& timer) {
+    idle_timer_ = timer;
+  }
+  /// Sets the trace to record `event` in once the first bytes are relayed.
+  /// The relay keeps it until then.
+  void SetTrace(const std::shared_ptr<trace::Trace>& trace,
+                trace::Event event) {
+    trace_ = trace;
+    trace_event_ = event;
+  }
+
+ private:
+  /// Maximum number of bytes moved by a single splice call.
+  constexpr static size_t kSpliceChunkSize = 0x10000;
+  /// Maximum number of splice calls in one wakeup before yielding to other
+  /// handlers of the `io_service`.
+  constexpr static int kMaxSplicesPerWakeup = 16;
+
+  static logging::Logger LOG;
+
+  SpliceRelay(const std::shared_ptr<TcpTransport>& from,
+              const std::shared_ptr<TcpTransport>& to,
+              const std::shared_ptr<boost::asio::io_service>& io_service_ptr)
+      : from_(from), to_(to), io_service_ptr_(io_service_ptr) {}
+
+  /// Moves as much data as possible without blocking, then waits for the
+  /// sockets to become ready again.
+  void DoTransfer();
+  /// Reads through the source transport instead of splicing, which is how
+  /// records the kernel cannot splice get handled by OpenSSL.
+  void ReadThrough();
+  void WaitReadable();
+  void WaitWritable();
+  void Finish(const ec_type& ec);
+
+  const std::shared_ptr<TcpTransport> from_;
+  const std::shared_ptr<TcpTransport> to_;
+  const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+  /// Read end and write end of the intermediate pipe.
+  int pipe_[2] = {-1, -1};
+  /// Number of bytes in the pipe not yet written to the destination.
+  size_t n_pending_ = 0;
+  /// Buffer of the data read through the source transport.
+  std::vector<char> read_through_buf_;
+  DoneCallbackType callback_;
+  const metrics::Counter* byte_counter_ = nullptr;
+  std::shared_ptr<TimingWheel::Timer> idle_timer_;
+  std::shared_ptr<trace::Trace> trace_;
+  trace::Event trace_event_ = trace::Event::kFirstByteUp;
+  /// Memory for the handler of the wait or the transfer pending, of which
+  /// there is one at a time.
+  HandlerMemory handler_memory_;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_SPLICE_RELAY_H_
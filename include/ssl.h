@@ -17,16 +17,35 @@
 #ifndef THESTRAL_SSL_H_
 #define THESTRAL_SSL_H_
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 
 #include "base.h"
+#include "handler_memory.h"
 #include "logging.h"
 #include "tcp_transport.h"
+#include "timing_wheel.h"
+#include "trace.h"
+
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS)
+// records can be encrypted and decrypted by the kernel
+#define THESTRAL_HAVE_KTLS
+#endif
 
 namespace thestral {
 namespace ssl {
@@ -34,7 +53,111 @@ namespace ssl {
 class SslTransportFactoryBuilder;
 class SslTransportFactoryImpl;
 
+/// Threads doing the SSL handshakes of factories, so that a burst of new
+/// connections doesn't hold up the sessions relayed by the threads of the
+/// factories. Each thread runs an `io_service` of its own, onto which the
+/// socket of a connection is moved for the handshake, and from which it is
+/// moved back to the `io_service` of its factory afterwards.
+class HandshakePool {
+ public:
+  HandshakePool(const HandshakePool&) = delete;
+  HandshakePool& operator=(const HandshakePool&) = delete;
+  ~HandshakePool() { Stop(); }
+
+  /// Starts the threads.
+  /// @param max_pending The largest number of handshakes in the pool at once,
+  /// beyond which new ones are refused rather than queued.
+  static std::shared_ptr<HandshakePool> New(unsigned int n_threads,
+                                            std::size_t max_pending) {
+    return std::shared_ptr<HandshakePool>(
+        new HandshakePool(n_threads, max_pending));
+  }
+
+  /// Takes a place for a handshake and returns the `io_service` to run it
+  /// on, or `nullptr` if the pool is full. Thread-safe.
+  boost::asio::io_service* Acquire();
+  /// Gives back the place taken by Acquire(). Thread-safe.
+  void Release() { --n_pending_; }
+  std::size_t GetPendingCount() const { return n_pending_; }
+
+  /// Stops the threads, dropping the handshakes in the pool.
+  void Stop();
+
+ private:
+  HandshakePool(unsigned int n_threads, std::size_t max_pending);
+
+  const std::size_t max_pending_;
+  std::vector<std::unique_ptr<boost::asio::io_service>> io_services_;
+  std::vector<std::unique_ptr<boost::asio::io_service::work>> works_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> n_pending_{0};
+  std::atomic<unsigned int> next_{0};
+  std::atomic<bool> is_stopped_{false};
+};
+
 namespace impl {
+
+/// Sessions established with upstream servers, keyed by their endpoints, so
+/// that later connections to the same endpoint can be resumed. Thread-safe,
+/// as sessions may be issued during handshakes in a HandshakePool.
+class ClientSessionCache {
+ public:
+  /// Returns the session of an endpoint, or `nullptr` if there is none.
+  std::shared_ptr<SSL_SESSION> Get(
+      const boost::asio::ip::tcp::endpoint& endpoint) const;
+  /// Stores a session of an endpoint, replacing the previous one.
+  void Put(const boost::asio::ip::tcp::endpoint& endpoint,
+           SSL_SESSION* session);
+
+ private:
+  /// Maximum number of endpoints to keep sessions for.
+  constexpr static std::size_t kMaxSessions = 1024;
+
+  mutable std::mutex mutex_;
+  std::map<boost::asio::ip::tcp::endpoint, std::shared_ptr<SSL_SESSION>>
+      sessions_;
+};
+
+/// Keys for encrypting session tickets. They are derived from a secret and the
+/// current time, so that every context sharing the secret, e.g. those of
+/// different workers, uses the same keys without coordination. Keys rotate
+/// at a given interval and tickets encrypted with the previous key are still
+/// accepted, and renewed.
+class TicketKeyRing {
+ public:
+  /// Size of the secret in bytes.
+  constexpr static std::size_t kSecretSize = 32;
+  typedef std::array<unsigned char, kSecretSize> SecretType;
+
+  TicketKeyRing(const SecretType& secret, std::chrono::seconds interval)
+      : secret_(secret), interval_(interval) {}
+
+  /// Installs the key ring into an SSL context. The key ring must outlive it.
+  void InstallInto(SSL_CTX* ssl_ctx);
+
+  /// Returns the secret shared by all contexts of this process by default.
+  static const SecretType& GetProcessSecret();
+
+ private:
+  struct Key {
+    std::array<unsigned char, 16> name;
+    std::array<unsigned char, 32> aes_key;
+    std::array<unsigned char, 32> hmac_key;
+  };
+
+  Key DeriveKey(uint64_t epoch) const;
+  uint64_t GetCurrentEpoch() const;
+  /// Finds the key by its name. Returns 1 if it is the current key, 2 if it is
+  /// the previous one, which means that the ticket should be renewed, or 0 if
+  /// there is no such key.
+  int FindKey(const unsigned char* name, Key* key) const;
+
+  friend struct TicketKeyCallbacks;
+
+  const SecretType secret_;
+  const std::chrono::seconds interval_;
+};
+
 /// A TcpTransport wrapping SSL protocol.
 class SslTransportImpl : public TcpTransport,
                          public std::enable_shared_from_this<SslTransportImpl> {
@@ -44,8 +167,16 @@ class SslTransportImpl : public TcpTransport,
                  bool allow_short_read = false) override;
   void StartWrite(const boost::asio::const_buffers_1& buf,
                   const WriteCallbackType& callback) override;
+  /// Copies the buffers into one, so that they are sent in as few records as
+  /// possible rather than at least one record each.
+  void StartWrite(const ConstBufferSequence& buffers,
+                  const WriteCallbackType& callback) override;
   void StartClose(const CloseCallbackType& callback) override;
   using TransportBase::StartClose;
+  void StartShutdownSend(const CloseCallbackType& callback) override;
+  // StartWaitReadable() is not overridden: asio keeps encrypted bytes read
+  // from the socket in its own buffer, so neither the socket becoming readable
+  // nor SSL_pending() tells whether a record is available.
 
   Address GetLocalAddress() const override {
     return Address::FromAsioEndpoint(ssl_sock_.next_layer().local_endpoint());
@@ -59,13 +190,102 @@ class SslTransportImpl : public TcpTransport,
     return ssl_sock_.next_layer();
   }
 
+  bool IsPlainForReading() override;
+  bool IsPlainForWriting() override;
+
+  /// Returns whether the handshake resumed a previous session.
+  bool IsSessionReused() {
+    return SSL_session_reused(ssl_sock_.native_handle()) != 0;
+  }
+
+  /// Returns whether records sent are encrypted by the kernel.
+  bool IsKernelTlsSendActive();
+  /// Returns whether records received are decrypted by the kernel.
+  bool IsKernelTlsReceiveActive();
+
  private:
   friend class SslTransportFactoryImpl;
 
+  typedef std::function<int()> SslOperationType;
+  typedef std::function<void(const ec_type&, int)> SslCallbackType;
+
+  /// @param on_socket Whether OpenSSL should work on the socket directly
+  /// instead of through the buffers of `ssl_sock_`, so that it can hand the
+  /// records over to the kernel after the handshake.
   SslTransportImpl(boost::asio::io_service& io_service,
-                   boost::asio::ssl::context& ssl_ctx);
+                   boost::asio::ssl::context& ssl_ctx, bool on_socket);
 
+  void StartHandshake(boost::asio::ssl::stream_base::handshake_type type,
+                      const std::function<void(const ec_type&)>& callback);
+  /// Moves the socket onto another `io_service`, on which the handlers of the
+  /// transport run from then on. Must be called with nothing in flight, from
+  /// the `io_service` the socket is on.
+  void MoveTo(boost::asio::io_service& io_service, ec_type& error_code);
+  void Handshake(boost::asio::ssl::stream_base::handshake_type type,
+                 ec_type& error_code);
+  /// Attaches the SSL object to the connected socket. Only used if OpenSSL
+  /// works on the socket directly.
+  void AttachToSocket(boost::asio::ssl::stream_base::handshake_type type,
+                      ec_type& error_code);
+
+  /// Runs an operation on the SSL object attached to the socket, waiting for
+  /// the socket whenever OpenSSL asks to, until it succeeds or fails. Only
+  /// used if OpenSSL works on the socket directly.
+  void StartSslOperation(const SslOperationType& operation,
+                         const SslCallbackType& callback);
+  /// Returns the error of a failed SSL operation, given `errno` as it was
+  /// right after the operation.
+  ec_type GetSslError(int result, int sys_errno);
+  /// Reads or writes on the SSL object attached to the socket, like
+  /// StartSslOperation() but with the state kept in @ref ssl_read_ or
+  /// @ref ssl_write_, so that nothing is allocated once the transport is
+  /// relaying.
+  void StartSslRead(const boost::asio::mutable_buffers_1& buf,
+                    std::size_t n_transferred, const ReadCallbackType& callback,
+                    bool allow_short_read);
+  void StartSslWrite(const boost::asio::const_buffers_1& buf,
+                     std::size_t n_transferred,
+                     const WriteCallbackType& callback);
+  void ContinueSslRead();
+  void ContinueSslWrite();
+  /// Waits for the socket as OpenSSL asks to after a failed SSL_read() or
+  /// SSL_write(), or completes it with the error.
+  void WaitForSslIo(int result, int sys_errno, bool is_read);
+  /// Calls back the read or the write from the `io_service`.
+  void FinishSslIo(bool is_read, const ec_type& ec);
+
+  /// Resumes the session cached for an endpoint, if any, and arranges for the
+  /// new session to be cached when the server issues it.
+  void PrepareClientSession(
+      const std::shared_ptr<ClientSessionCache>& session_cache,
+      const boost::asio::ip::tcp::endpoint& endpoint);
+  /// Called by OpenSSL when a new session is issued by the server.
+  static int HandleNewSession(SSL* ssl, SSL_SESSION* session);
+
+  /// The `io_service` of the socket, changed by MoveTo().
+  boost::asio::io_service* io_service_;
   boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_sock_;
+  std::shared_ptr<ClientSessionCache> session_cache_;
+  boost::asio::ip::tcp::endpoint session_key_;
+  const bool on_socket_;
+
+  /// A read or a write in flight on the SSL object attached to the socket.
+  struct SslIo {
+    char* data = nullptr;
+    std::size_t size = 0;
+    std::size_t n_transferred = 0;
+    bool allow_short_read = false;
+    ReadCallbackType callback;
+  };
+  SslIo ssl_read_;
+  SslIo ssl_write_;
+  /// Memory for the handlers of reads and of writes, with at most one of each
+  /// in flight.
+  HandlerMemory read_memory_;
+  HandlerMemory write_memory_;
+  /// The buffers of the gathering write in flight, copied into one. Its
+  /// capacity is kept for the next one.
+  std::string gathered_;
 };
 
 /// Factory for creating TcpTransport with SSL support.
@@ -80,6 +300,9 @@ class SslTransportFactoryImpl
                    const AcceptCallbackType& callback) override;
   void StartConnect(EndpointType endpoint,
                     const ConnectCallbackType& callback) override;
+  /// Records the connection and the handshake in the current trace.
+  CancelFunctionType StartCancelableConnect(
+      EndpointType endpoint, const ConnectCallbackType& callback) override;
   std::shared_ptr<TransportBase> TryConnect(
       boost::asio::ip::tcp::resolver::iterator& iter,
       ec_type& error_code) override;
@@ -93,14 +316,39 @@ class SslTransportFactoryImpl
 
   SslTransportFactoryImpl(
       const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
-      boost::asio::ssl::context&& ssl_ctx)
-      : io_service_ptr_(io_service_ptr), ssl_ctx_(std::move(ssl_ctx)) {}
+      boost::asio::ssl::context&& ssl_ctx,
+      const std::shared_ptr<TicketKeyRing>& ticket_key_ring,
+      const std::shared_ptr<ClientSessionCache>& session_cache,
+      bool kernel_tls);
 
-  void DoAccept(const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
-                const AcceptCallbackType& callback);
+  /// Performs the handshake of an accepted connection, which is closed if it
+  /// fails.
+  void StartHandshake(const std::shared_ptr<SslTransportImpl>& transport,
+                      const FinishCallbackType& callback);
+  /// Performs a handshake in the handshake pool if there is one, or else on
+  /// the `io_service` of this factory, closing the socket on `timeout` unless
+  /// it is zero. Calls back on the `io_service` of this factory. Returns a
+  /// function aborting the handshake, to be called on that `io_service` too.
+  CancelFunctionType RunHandshake(
+      const std::shared_ptr<SslTransportImpl>& transport,
+      boost::asio::ssl::stream_base::handshake_type type,
+      TimingWheel::ClockType::duration timeout,
+      const std::function<void(const ec_type&)>& callback);
+  /// Logs which directions of an established transport are offloaded.
+  void LogKernelTls(SslTransportImpl& transport) const;
 
   const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
   boost::asio::ssl::context ssl_ctx_;
+  /// Referenced by the context, which is why it is kept here.
+  const std::shared_ptr<TicketKeyRing> ticket_key_ring_;
+  /// Sessions to resume when connecting, or `nullptr` if disabled.
+  const std::shared_ptr<ClientSessionCache> session_cache_;
+  /// Whether transports are created in the kernel TLS mode.
+  const bool kernel_tls_;
+  /// Time allowed for handshakes of accepted connections, zero for no limit.
+  TimingWheel::ClockType::duration handshake_timeout_{0};
+  /// Threads doing the handshakes, `nullptr` to do them on `io_service_ptr_`.
+  std::shared_ptr<HandshakePool> handshake_pool_;
   static logging::Logger LOG;
 };
 }  // namespace impl
@@ -126,10 +374,59 @@ class SslTransportFactoryBuilder {
   /// well.
   SslTransportFactoryBuilder& SetVerifyPeer(bool verify);
   SslTransportFactoryBuilder& SetVerifyHost(const std::string& host);
+  /// Sets if session tickets should be issued to clients. Enabled by default.
+  SslTransportFactoryBuilder& SetSessionTickets(bool enable);
+  /// Encrypts session tickets with keys rotating at a given interval, instead
+  /// of a fixed key of the context. The keys are derived from a secret, which
+  /// is shared by the whole process unless loaded by LoadTicketKeyFile().
+  SslTransportFactoryBuilder& SetTicketKeyRotation(
+      std::chrono::seconds interval);
+  /// Derives the ticket key secret from the content of a file, so that
+  /// instances sharing it can resume sessions issued by each other.
+  SslTransportFactoryBuilder& LoadTicketKeyFile(const std::string& file);
+  /// Sets if sessions with upstream servers should be cached and resumed.
+  SslTransportFactoryBuilder& SetSessionCache(bool enable);
+  /// Sets if the records of established transports should be encrypted and
+  /// decrypted by the kernel (kTLS), which also allows relaying them with
+  /// SpliceRelay. Only the directions the kernel accepts the negotiated cipher
+  /// for are offloaded; the others fall back to OpenSSL. Ignored if
+  /// IsKernelTlsSupported() returns `false`.
+  SslTransportFactoryBuilder& SetKernelTls(bool enable);
+  /// Sets the ciphers of TLS 1.2 and below, in the format of `ciphers(1)`.
+  SslTransportFactoryBuilder& SetCipherList(const std::string& ciphers);
+  /// Sets the cipher suites of TLS 1.3, e.g.
+  /// `TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256`. Ignored if TLS 1.3
+  /// is not supported by this build.
+  SslTransportFactoryBuilder& SetCipherSuites(const std::string& suites);
+  /// Sets the groups (curves) for key exchange in order of preference, e.g.
+  /// `X25519:P-256`.
+  SslTransportFactoryBuilder& SetGroups(const std::string& groups);
+  /// Sets the minimum protocol version, e.g. `TLS1_3_VERSION`. TLS 1.0 and
+  /// below are never allowed.
+  SslTransportFactoryBuilder& SetMinProtocolVersion(int version);
+  /// Sets the time allowed for the handshake of an accepted connection, after
+  /// which the connection is closed. Zero (default) means no limit.
+  SslTransportFactoryBuilder& SetHandshakeTimeout(
+      TimingWheel::ClockType::duration timeout);
+  /// Sets the threads doing the handshakes, both of accepted and of outgoing
+  /// connections, instead of the thread of the factory. Handshakes refused
+  /// by a full pool fail with `resource_unavailable_try_again`.
+  SslTransportFactoryBuilder& SetHandshakePool(
+      const std::shared_ptr<HandshakePool>& pool);
+  /// Returns whether this build is capable of kernel TLS. Whether the running
+  /// kernel is capable is only known after handshakes.
+  static bool IsKernelTlsSupported();
 
  private:
   boost::asio::ssl::context ssl_ctx_;
   bool used_;
+  impl::TicketKeyRing::SecretType ticket_key_secret_;
+  /// Interval of the ticket key rotation, zero if disabled.
+  std::chrono::seconds ticket_key_interval_{0};
+  bool session_cache_enabled_ = false;
+  bool kernel_tls_enabled_ = false;
+  TimingWheel::ClockType::duration handshake_timeout_{0};
+  std::shared_ptr<HandshakePool> handshake_pool_;
 };
 
 }  // namespace ssl
@@ -17,12 +17,19 @@
 #ifndef THESTRAL_TCP_TRANSPORT_H_
 #define THESTRAL_TCP_TRANSPORT_H_
 
+#include <chrono>
+#include <cstddef>
+#include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include "base.h"
 #include "common.h"
+#include "handler_memory.h"
 #include "logging.h"
 
 namespace thestral {
@@ -30,18 +37,93 @@ namespace thestral {
 namespace testing {
 class TestTcpTransportFactory;
 }
+namespace impl {
+struct AcceptState;
+}
 
 /// Base class of transport on plain TCP protocol.
 class TcpTransport : public TransportBase {
  public:
   /// Returns a reference to the underlying tcp socket.
   virtual boost::asio::ip::tcp::socket& GetUnderlyingSocket() = 0;
+
+  /// Returns whether the bytes read from the underlying socket are exactly the
+  /// bytes of the stream, so that they can be taken from the socket directly.
+  virtual bool IsPlainForReading() { return false; }
+  /// Returns whether the bytes written to the underlying socket become exactly
+  /// the bytes of the stream, so that they can be put to the socket directly.
+  virtual bool IsPlainForWriting() { return false; }
+
+  /// Keeps the connection counted against the AcceptLimits of the factory
+  /// which accepted it, until the transport is destroyed.
+  void SetAcceptToken(const std::shared_ptr<void>& token) {
+    accept_token_ = token;
+  }
+
+ private:
+  std::shared_ptr<void> accept_token_;
+};
+
+/// Socket options of the TCP connections of a factory. Zero or empty ones are
+/// left to the defaults of the system.
+struct TcpOptions {
+  /// Length of the queue of pending connections of listening sockets.
+  int backlog = 0;
+  /// Enables TCP Fast Open. For listening sockets, it is the number of
+  /// pending Fast Open requests. For connecting ones, any non-zero value makes
+  /// the connection complete at once, so that the first write rides in the
+  /// SYN once the peer has handed out a cookie, and connection failures only
+  /// surface on that write.
+  int fast_open = 0;
+  /// Enables `SO_KEEPALIVE` with the given idle time in seconds, along with
+  /// the interval and the number of probes if set.
+  int keepalive_idle = 0;
+  int keepalive_interval = 0;
+  int keepalive_count = 0;
+  /// `SO_SNDBUF` and `SO_RCVBUF`, in bytes.
+  int send_buffer = 0;
+  int receive_buffer = 0;
+  /// `TCP_NOTSENT_LOWAT`, in bytes.
+  int notsent_lowat = 0;
+  /// `TCP_CONGESTION`, e.g. "bbr".
+  std::string congestion;
+};
+
+/// Limits of the connections accepted by a factory, zero for no limit. While
+/// either is reached, the factory stops accepting and leaves new connections
+/// in the backlog of the listening sockets.
+struct AcceptLimits {
+  /// Connections accepted and not yet destroyed.
+  std::size_t max_connections = 0;
+  /// Connections accepted but not yet handed over, i.e. in their SSL
+  /// handshake.
+  std::size_t max_handshakes = 0;
 };
 
 /// Base class of transport factory for TcpTransport.
 class TcpTransportFactory
     : public TransportFactoryBase<boost::asio::ip::tcp::endpoint> {
  public:
+  typedef std::function<void()> CancelFunctionType;
+  typedef std::function<std::shared_ptr<TcpTransport>()> NewTransportType;
+  typedef std::function<void(const ec_type&,
+                             const std::shared_ptr<TransportBase>&)>
+      FinishCallbackType;
+  /// Completes an accepted connection, e.g. with a handshake, then calls back
+  /// with the transport to hand over or an error.
+  typedef std::function<void(const std::shared_ptr<TcpTransport>&,
+                             const FinishCallbackType&)>
+      FinishAcceptType;
+
+  /// Connects like StartConnect() and returns a function aborting the attempt,
+  /// in which case the callback will be called with `operation_aborted`. The
+  /// default implementation can't abort anything.
+  virtual CancelFunctionType StartCancelableConnect(
+      EndpointType endpoint, const ConnectCallbackType& callback) {
+    StartConnect(endpoint, callback);
+    return []() {};
+  }
+
   /// Synchronously tries connecting to a remote peer with a set of resolver
   /// results.
   /// @param iter An iterator reference to the resolver result set. It will be
@@ -54,9 +136,78 @@ class TcpTransportFactory
   static std::shared_ptr<TcpTransportFactory> New(
       const std::shared_ptr<boost::asio::io_service>& io_service_ptr);
 
+  /// Sets whether listening sockets should be opened with `SO_REUSEPORT`, so
+  /// that several factories, typically running on different threads, can
+  /// accept connections on the same endpoint. The kernel then distributes
+  /// incoming connections among them.
+  void SetReusePort(bool reuse_port) { reuse_port_ = reuse_port; }
+  /// Sets the socket options of the connections made from now on and of the
+  /// listening sockets opened or adopted by the next StartAccept(). Accepted
+  /// connections inherit the options from their listening sockets.
+  void SetTcpOptions(const TcpOptions& options) { tcp_options_ = options; }
+  const TcpOptions& GetTcpOptions() const { return tcp_options_; }
+  /// Sets the limits of the connections accepted from now on.
+  void SetAcceptLimits(const AcceptLimits& limits);
+  const AcceptLimits& GetAcceptLimits() const;
+
+  /// Makes the next StartAccept() take over the given listening sockets, for
+  /// example those of a factory being replaced or inherited from another
+  /// process, instead of opening a new one. The endpoint passed to
+  /// StartAccept() then only tells their protocol.
+  void AdoptListeningSockets(const std::vector<int>& sockets) {
+    adopted_sockets_ = sockets;
+  }
+  /// Returns the native handles of the sockets this factory is listening on.
+  std::vector<int> GetListeningSockets() const;
+  /// Closes all listening sockets of this factory. The pending accepts end
+  /// with `operation_aborted`.
+  virtual void StopAccepting();
+
  protected:
   friend class testing::TestTcpTransportFactory;
 
+  TcpTransportFactory();
+
+  /// Starts an impl::AcceptLoop on each acceptor from OpenAcceptors(), which
+  /// accepts into transports from `new_transport` and hands them to
+  /// `callback` once `finish` is done with them. `finish` may be empty.
+  void StartAcceptLoops(boost::asio::io_service& io_service,
+                        const EndpointType& endpoint,
+                        const NewTransportType& new_transport,
+                        const FinishAcceptType& finish,
+                        const AcceptCallbackType& callback);
+  /// Starts an impl::AcceptLoop on a single acceptor from OpenAcceptors().
+  void StartAcceptLoop(
+      boost::asio::io_service& io_service,
+      const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
+      const NewTransportType& new_transport, const FinishAcceptType& finish,
+      const AcceptCallbackType& callback);
+
+  /// Opens an acceptor listening on a given endpoint with the socket options
+  /// of this factory.
+  std::shared_ptr<boost::asio::ip::tcp::acceptor> OpenAcceptor(
+      boost::asio::io_service& io_service, const EndpointType& endpoint);
+  /// Returns the acceptors StartAccept() should use: the adopted sockets if
+  /// there are any, or else a new one listening on `endpoint`.
+  std::vector<std::shared_ptr<boost::asio::ip::tcp::acceptor>> OpenAcceptors(
+      boost::asio::io_service& io_service, const EndpointType& endpoint);
+  /// Opens `socket` for connecting to `endpoint` and applies the options of
+  /// this factory. `warning` is set if an option can't be applied, which
+  /// leaves the socket usable, while `error_code` is set if it can't be
+  /// opened at all.
+  void OpenConnectingSocket(
+      boost::asio::ip::tcp::socket::lowest_layer_type& socket,
+      const EndpointType& endpoint, ec_type& error_code,
+      ec_type& warning) const;
+
+  bool reuse_port_ = false;
+  TcpOptions tcp_options_;
+  std::vector<int> adopted_sockets_;
+  /// Acceptors returned by OpenAcceptors(), alive as long as they accept.
+  std::vector<std::weak_ptr<boost::asio::ip::tcp::acceptor>> acceptors_;
+  /// Shared by the accept loops and the connections they accepted.
+  const std::shared_ptr<impl::AcceptState> accept_state_;
+
   /// A weak pointer to the last created acceptor **for testing purposes only**.
   std::weak_ptr<boost::asio::ip::tcp::acceptor> last_acceptor_;
 };
@@ -75,6 +226,108 @@ struct TestTcpTransportFactory {
 
 namespace impl {
 
+class AcceptLoop;
+
+/// Counts the connections accepted by a factory against its AcceptLimits and
+/// holds the accept loops paused by them. Like the loops, it should only be
+/// used on the `io_service` of the factory.
+struct AcceptState {
+  /// Returns whether the limits allow accepting one more connection.
+  bool CanAccept() const;
+  /// Resumes the paused loops if the limits allow.
+  void Resume();
+
+  AcceptLimits limits;
+  std::size_t n_connections = 0;
+  std::size_t n_handshakes = 0;
+  std::vector<std::shared_ptr<AcceptLoop>> paused_loops;
+};
+
+/// Accepts connections on a listening socket for a TcpTransportFactory. On
+/// each wakeup, it goes on accepting the connections already queued, up to
+/// kMaxAcceptsPerWakeup, without waiting for the reactor again. Accepting
+/// goes on while accepted connections are being finished, e.g. with SSL
+/// handshakes, so that a slow client doesn't hold up the others.
+///
+/// Running out of descriptors or memory makes the loop retry after a delay,
+/// growing up to kMaxBackoff, instead of giving up, while other failures to
+/// accept a single connection are only logged. Only errors of the listening
+/// socket itself end the loop, and are passed to the callback.
+class AcceptLoop : public std::enable_shared_from_this<AcceptLoop> {
+ public:
+  typedef TcpTransportFactory::AcceptCallbackType AcceptCallbackType;
+  typedef TcpTransportFactory::NewTransportType NewTransportType;
+  typedef TcpTransportFactory::FinishCallbackType FinishCallbackType;
+  typedef TcpTransportFactory::FinishAcceptType FinishAcceptType;
+
+  /// Largest number of connections accepted in one wakeup.
+  constexpr static int kMaxAcceptsPerWakeup = 16;
+  /// Delays before accepting again after running out of resources.
+  constexpr static std::chrono::milliseconds kMinBackoff{50};
+  constexpr static std::chrono::milliseconds kMaxBackoff{1000};
+
+  AcceptLoop(const AcceptLoop&) = delete;
+  AcceptLoop& operator=(const AcceptLoop&) = delete;
+
+  static std::shared_ptr<AcceptLoop> New(
+      boost::asio::io_service& io_service,
+      const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
+      const std::shared_ptr<AcceptState>& state,
+      const NewTransportType& new_transport, const FinishAcceptType& finish,
+      const AcceptCallbackType& callback) {
+    return std::shared_ptr<AcceptLoop>(new AcceptLoop(
+        io_service, acceptor, state, new_transport, finish, callback));
+  }
+
+  void Start();
+  /// Continues a loop paused by the limits, from the `io_service`.
+  void Resume();
+  /// Ends a paused loop as if its pending accept were aborted.
+  void Abort();
+
+ private:
+  static logging::Logger LOG;
+
+  AcceptLoop(boost::asio::io_service& io_service,
+             const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
+             const std::shared_ptr<AcceptState>& state,
+             const NewTransportType& new_transport,
+             const FinishAcceptType& finish,
+             const AcceptCallbackType& callback)
+      : io_service_(io_service),
+        acceptor_(acceptor),
+        state_(state),
+        new_transport_(new_transport),
+        finish_(finish),
+        callback_(callback),
+        backoff_timer_(io_service) {}
+
+  void DoAccept();
+  void HandleAccept(const ec_type& ec,
+                    const std::shared_ptr<TcpTransport>& transport);
+  /// Handles a failure to accept. Returns whether to accept again right away.
+  bool HandleError(const ec_type& ec);
+  void HandleConnection(const std::shared_ptr<TcpTransport>& transport);
+  /// Hands a connection, or the error finishing it, to the callback.
+  void Deliver(const ec_type& ec,
+               const std::shared_ptr<TransportBase>& transport);
+  void Stop();
+
+  boost::asio::io_service& io_service_;
+  const std::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+  const std::shared_ptr<AcceptState> state_;
+  const NewTransportType new_transport_;
+  const FinishAcceptType finish_;
+  const AcceptCallbackType callback_;
+  /// A transport left by a drain finding no connection, for the next accept.
+  std::shared_ptr<TcpTransport> spare_transport_;
+  boost::asio::steady_timer backoff_timer_;
+  std::chrono::milliseconds backoff_{0};
+  /// Whether the acceptor is in the non-blocking mode, so that it can drain.
+  bool can_drain_ = false;
+  bool is_stopped_ = false;
+};
+
 /// Implementation of TcpTransport on plain tcp protocol.
 class TcpTransportImpl : public TcpTransport {
  public:
@@ -85,12 +338,18 @@ class TcpTransportImpl : public TcpTransport {
                  bool allow_short_read = false) override;
   void StartWrite(const boost::asio::const_buffers_1& buf,
                   const WriteCallbackType& callback) override;
+  void StartWrite(const ConstBufferSequence& buffers,
+                  const WriteCallbackType& callback) override;
+  void StartWaitReadable(const WaitCallbackType& callback) override;
   void StartClose(const CloseCallbackType& callback) override;
   using TransportBase::StartClose;
+  void StartShutdownSend(const CloseCallbackType& callback) override;
 
   boost::asio::ip::tcp::socket& GetUnderlyingSocket() override {
     return socket_;
   }
+  bool IsPlainForReading() override { return true; }
+  bool IsPlainForWriting() override { return true; }
 
  private:
   friend class TcpTransportFactoryImpl;
@@ -98,6 +357,10 @@ class TcpTransportImpl : public TcpTransport {
   explicit TcpTransportImpl(boost::asio::io_service& io_service);
 
   boost::asio::ip::tcp::socket socket_;
+  /// Memory for the handlers of reads, including waits, and of writes. There
+  /// is at most one of each in flight.
+  HandlerMemory read_memory_;
+  HandlerMemory write_memory_;
 };
 
 /// Implementation of TcpTransportFactory on plain tcp protocol.
@@ -118,6 +381,8 @@ class TcpTransportFactoryImpl
                    const AcceptCallbackType& callback) override;
   void StartConnect(EndpointType endpoint,
                     const ConnectCallbackType& callback) override;
+  CancelFunctionType StartCancelableConnect(
+      EndpointType endpoint, const ConnectCallbackType& callback) override;
   std::shared_ptr<TransportBase> TryConnect(
       boost::asio::ip::tcp::resolver::iterator& iter,
       ec_type& error_code) override;
@@ -126,20 +391,21 @@ class TcpTransportFactoryImpl
     return io_service_ptr_;
   }
 
- private:
+ protected:
   explicit TcpTransportFactoryImpl(
       const std::shared_ptr<boost::asio::io_service>& io_service_ptr)
       : io_service_ptr_(io_service_ptr) {}
 
-  std::shared_ptr<TcpTransportImpl> NewTransport() const {
+  /// Creates a transport to accept or connect with, which is how the
+  /// subclasses put other implementations of TcpTransport behind this one.
+  virtual std::shared_ptr<TcpTransport> NewTransport() const {
     return std::shared_ptr<TcpTransportImpl>(
         new TcpTransportImpl(*io_service_ptr_));
   }
 
-  void DoAccept(const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
-                const AcceptCallbackType& callback);
-
   const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+
+ private:
   static logging::Logger LOG;
 };
 
@@ -0,0 +1,126 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Defines a hashed timing wheel bound to an io_service.
+#ifndef THESTRAL_TIMING_WHEEL_H_
+#define THESTRAL_TIMING_WHEEL_H_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace thestral {
+
+/// Coarse timeouts for a large number of connections, implemented as an
+/// `io_service` service so that every `io_service` owns exactly one wheel.
+/// Timers are kept in intrusive lists hashed by their expiry tick, so starting
+/// and cancelling a timer is O(1) and a single `steady_timer` drives all of
+/// them. Like BufferPool, the wheel is not thread-safe and should only be used
+/// by handlers running on its `io_service`.
+///
+/// Timers expire up to two ticks (kTickInterval) late. Postponing a timer with
+/// Timer::Touch() only records the new expiry, the timer is moved when its old
+/// slot comes around, which makes it cheap enough to call on every read.
+class TimingWheel : public boost::asio::io_service::service {
+  struct Entry;
+
+ public:
+  typedef std::chrono::steady_clock ClockType;
+  typedef std::function<void()> CallbackType;
+
+  /// Resolution of the wheel.
+  constexpr static ClockType::duration kTickInterval =
+      std::chrono::milliseconds(100);
+  /// Number of slots of the wheel. Timers further than a full turn simply stay
+  /// in their slot for more turns.
+  constexpr static std::size_t kNumSlots = 512;
+
+  /// A timer scheduled on a wheel. It is cancelled on destruction or when
+  /// Cancel() is called.
+  class Timer {
+   public:
+    Timer() = default;
+    Timer(Timer&& other) { *this = std::move(other); }
+    Timer& operator=(Timer&& other);
+    ~Timer();
+
+    /// Returns whether the timer is still pending.
+    bool IsPending() const;
+    /// Restarts the timeout from now, using the last tick of the wheel as the
+    /// current time.
+    void Touch();
+    /// Cancels the timer. The callback won't be called after this returns.
+    void Cancel();
+
+   private:
+    friend class TimingWheel;
+
+    std::unique_ptr<Entry> entry_;
+  };
+
+  static boost::asio::io_service::id id;
+
+  explicit TimingWheel(boost::asio::io_service& io_service);
+
+  /// Schedules `callback` to be called, on the `io_service`, once `timeout`
+  /// has passed without the returned timer being touched or cancelled.
+  Timer Start(ClockType::duration timeout, const CallbackType& callback);
+
+  /// Returns the number of pending timers.
+  std::size_t GetPendingCount() const { return n_pending_; }
+
+ private:
+  struct Entry {
+    Entry* prev = nullptr;
+    Entry* next = nullptr;
+    /// The wheel of a pending timer, `nullptr` if it is not pending.
+    TimingWheel* wheel = nullptr;
+    uint64_t timeout_ticks = 0;
+    uint64_t expiry_tick = 0;
+    CallbackType callback;
+  };
+
+  void shutdown_service() override;
+
+  Entry& GetSlot(uint64_t tick) { return slots_[tick % kNumSlots]; }
+  /// Appends a timer to a list, which is either a slot or `expired_`.
+  void Link(Entry* entry, Entry& list);
+  void Unlink(Entry* entry);
+  /// Returns the tick the current time falls in.
+  uint64_t GetCurrentTick() const;
+  void ScheduleTick();
+  void HandleTick();
+
+  const ClockType::time_point start_time_;
+  /// Last tick processed.
+  uint64_t current_tick_ = 0;
+  /// Sentinels of the circular lists of the slots.
+  std::array<Entry, kNumSlots> slots_;
+  /// Sentinel of the timers expired but not yet called back.
+  Entry expired_;
+  std::size_t n_pending_ = 0;
+  boost::asio::steady_timer tick_timer_;
+  bool is_ticking_ = false;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_TIMING_WHEEL_H_
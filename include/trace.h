@@ -0,0 +1,122 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines the sampled tracing of sessions and its flight recorder.
+#ifndef THESTRAL_TRACE_H_
+#define THESTRAL_TRACE_H_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "common.h"
+
+namespace thestral {
+namespace trace {
+
+/// Points in the life of a session, in the order they usually happen.
+THESTRAL_DEFINE_ENUM(Event, uint8_t, (kAccept, 0), (kGreeting, 1),
+                     (kRequest, 2), (kDnsDone, 3), (kConnected, 4),
+                     (kTlsDone, 5), (kReady, 6), (kFirstByteUp, 7),
+                     (kFirstByteDown, 8), (kClose, 9));
+
+constexpr std::size_t kNumEvents = 10;
+/// Number of traces kept by the recorder of each thread, the oldest of which
+/// are overwritten.
+constexpr std::size_t kRecorderSize = 512;
+/// Longest description kept by the recorder, in bytes.
+constexpr std::size_t kMaxDescriptionSize = 128;
+
+/// Traces one in `n` sessions accepted by each thread, or none if `n` is zero
+/// (default), in which case traces forwarded by previous hops are ignored too.
+/// Thread-safe.
+void SetSampling(unsigned int n);
+/// Returns whether sessions are traced at all.
+bool IsEnabled();
+
+/// Timeline of a session, written to the recorder of the thread destroying
+/// it. A trace is shared by whatever takes part in the session, e.g. the
+/// server, the upstream factories and the relays, and only the first time of
+/// each event is kept. Like the sessions, a trace should be used on a single
+/// thread at a time.
+class Trace {
+ public:
+  typedef std::chrono::steady_clock ClockType;
+
+  Trace(const Trace&) = delete;
+  Trace& operator=(const Trace&) = delete;
+  ~Trace();
+
+  /// Starts tracing a session accepted at `accept_time` if it is sampled, or
+  /// else returns `nullptr`.
+  static std::shared_ptr<Trace> StartSampled(ClockType::time_point accept_time);
+  /// Starts tracing a session under the ID forwarded by the previous hop,
+  /// whether it is sampled or not, or returns `nullptr` if tracing is off.
+  static std::shared_ptr<Trace> StartForwarded(
+      uint64_t id, ClockType::time_point accept_time);
+
+  uint64_t GetId() const { return id_; }
+  /// Takes the ID forwarded by the previous hop, so that the timelines of
+  /// both hops can be joined.
+  void SetForwardedId(uint64_t id) {
+    id_ = id;
+    is_forwarded_ = true;
+  }
+  /// Records the time of `event`, unless it has been recorded already.
+  void Record(Event event);
+  /// Sets what the session is about, e.g. its client and target, truncated
+  /// to kMaxDescriptionSize.
+  void SetDescription(const std::string& description);
+
+ private:
+  Trace(uint64_t id, bool is_forwarded, ClockType::time_point accept_time);
+
+  uint64_t id_;
+  bool is_forwarded_;
+  const ClockType::time_point accept_time_;
+  const std::chrono::system_clock::time_point wall_time_;
+  /// Nanoseconds since the accept plus one, zero for events not reached.
+  std::array<uint64_t, kNumEvents> offsets_;
+  std::string description_;
+};
+
+/// Makes a trace the current one of the thread while in scope, so that the
+/// upstream and transport factories called meanwhile can pick it up with
+/// Current(), without it going through their interfaces. Scopes nest.
+class Scope {
+ public:
+  explicit Scope(const std::shared_ptr<Trace>& trace);
+  ~Scope();
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+ private:
+  std::shared_ptr<Trace> previous_;
+};
+
+/// Returns the trace of the innermost Scope of the thread, or `nullptr`.
+const std::shared_ptr<Trace>& Current();
+
+/// Returns the traces recorded by all threads, oldest first, one per line
+/// with the times of the events in microseconds since the accept.
+std::string RenderText();
+
+}  // namespace trace
+}  // namespace thestral
+#endif  // THESTRAL_TRACE_H_
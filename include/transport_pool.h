@@ -0,0 +1,109 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines a pool of pre-established transports.
+#ifndef THESTRAL_TRANSPORT_POOL_H_
+#define THESTRAL_TRANSPORT_POOL_H_
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "base.h"
+#include "logging.h"
+#include "tcp_transport.h"
+
+namespace thestral {
+
+/// A pool of transports connected to a single endpoint in advance, so that a
+/// new session doesn't have to wait for the connection, and the TLS handshake
+/// if any, to be established. The pool refills itself in the background
+/// whenever a transport is taken. Expired transports are closed but only
+/// replaced on the next use.
+///
+/// The pool is not thread-safe and should be used on its `io_service` only.
+class TransportPool : public std::enable_shared_from_this<TransportPool> {
+ public:
+  typedef std::chrono::steady_clock ClockType;
+
+  TransportPool(const TransportPool&) = delete;
+  TransportPool& operator=(const TransportPool&) = delete;
+
+  /// Creates a pool of at most `max_size` transports made by a given factory.
+  /// Idle transports are closed after `idle_timeout`, before the peer would
+  /// give up on them.
+  static std::shared_ptr<TransportPool> New(
+      const std::shared_ptr<TcpTransportFactory>& transport_factory,
+      std::size_t max_size, ClockType::duration idle_timeout) {
+    return std::shared_ptr<TransportPool>(
+        new TransportPool(transport_factory, max_size, idle_timeout));
+  }
+
+  /// Sets the endpoint to connect to and starts filling the pool. Transports
+  /// connected to a previous endpoint are closed.
+  void Start(const boost::asio::ip::tcp::endpoint& endpoint);
+
+  /// Takes an idle transport from the pool. Returns `nullptr` if there is none
+  /// ready, in which case the caller should connect by itself.
+  std::shared_ptr<TransportBase> Take();
+
+  /// Returns the number of idle transports in the pool.
+  std::size_t GetIdleCount() const { return idle_.size(); }
+
+ private:
+  static logging::Logger LOG;
+
+  struct IdleTransport {
+    std::shared_ptr<TransportBase> transport;
+    ClockType::time_point expiry;
+  };
+
+  TransportPool(const std::shared_ptr<TcpTransportFactory>& transport_factory,
+                std::size_t max_size, ClockType::duration idle_timeout)
+      : transport_factory_(transport_factory),
+        max_size_(max_size),
+        idle_timeout_(idle_timeout),
+        expiry_timer_(*transport_factory->get_io_service_ptr()) {}
+
+  /// Starts connecting until the pool would be full.
+  void Refill();
+  void HandleConnect(const ec_type& ec,
+                     const std::shared_ptr<TransportBase>& transport,
+                     unsigned int generation);
+  /// Closes the expired transports and schedules the next check.
+  void ExpireIdle();
+  void ScheduleExpiry();
+
+  const std::shared_ptr<TcpTransportFactory> transport_factory_;
+  const std::size_t max_size_;
+  const ClockType::duration idle_timeout_;
+  boost::asio::ip::tcp::endpoint endpoint_;
+  /// Incremented whenever the endpoint changes, so that connections to the
+  /// previous one are dropped when they complete.
+  unsigned int generation_ = 0;
+  bool started_ = false;
+  /// Idle transports, the oldest first.
+  std::deque<IdleTransport> idle_;
+  std::size_t n_connecting_ = 0;
+  boost::asio::steady_timer expiry_timer_;
+  bool expiry_scheduled_ = false;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_TRANSPORT_POOL_H_
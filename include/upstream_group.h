@@ -0,0 +1,163 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines an upstream factory spreading requests over several upstreams.
+#ifndef THESTRAL_UPSTREAM_GROUP_H_
+#define THESTRAL_UPSTREAM_GROUP_H_
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "base.h"
+#include "common.h"
+#include "logging.h"
+
+namespace thestral {
+
+/// Upstream factory spreading requests over a group of member upstreams. A
+/// member whose requests keep failing is ejected for a while, during which
+/// requests go to the other members. A request failing on a member is retried
+/// once on another one. Only failures of the member itself count, as told by
+/// UpstreamFactoryBase::IsUpstreamFailure(), so not a SOCKS reply refusing
+/// the destination, nor the destination of a direct member being unreachable.
+///
+/// Members can also be health checked by requesting a known destination
+/// through them periodically. A failed check counts like a failed request,
+/// and a successful one brings an ejected member back at once. Members whose
+/// requests succeed before being carried out, such as mux upstreams, are not
+/// checked, see UpstreamFactoryBase::CanHealthCheck().
+///
+/// The group is not thread-safe and should be used on its `io_service` only.
+class UpstreamGroup : public UpstreamFactoryBase,
+                      public std::enable_shared_from_this<UpstreamGroup> {
+ public:
+  UpstreamGroup(const UpstreamGroup&) = delete;
+  UpstreamGroup& operator=(const UpstreamGroup&) = delete;
+
+  typedef std::chrono::steady_clock ClockType;
+
+  /// How a member is picked for a request, among those not ejected.
+  enum class Policy {
+    /// The member with the fewest requests and sessions in progress.
+    kLeastOutstanding,
+    /// Of two members picked at random, the one with the lower connect
+    /// latency, so that a slow member gets less but still some traffic.
+    kPowerOfTwoChoices,
+  };
+
+  static std::shared_ptr<UpstreamGroup> New(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+      Policy policy) {
+    return std::shared_ptr<UpstreamGroup>(
+        new UpstreamGroup(io_service_ptr, policy));
+  }
+
+  /// Adds a member upstream, which should run on the same `io_service`.
+  /// `name` identifies it in logs.
+  void AddMember(const std::string& name,
+                 const std::shared_ptr<UpstreamFactoryBase>& upstream);
+
+  /// Ejects a member for `ejection_time` once `max_failures` of its requests
+  /// in a row have failed. Zero `max_failures` disables ejection. Defaults to
+  /// 3 failures and 30 seconds.
+  void SetEjection(std::size_t max_failures,
+                   ClockType::duration ejection_time) {
+    max_failures_ = max_failures;
+    ejection_time_ = ejection_time;
+  }
+
+  /// Checks every member each `interval` by requesting `target` through it.
+  /// A check not done within `timeout` fails.
+  void SetHealthCheck(const Address& target, ClockType::duration interval,
+                      ClockType::duration timeout);
+
+  void StartRequest(const Address& endpoint,
+                    const RequestCallbackType& callback) override;
+
+  std::shared_ptr<boost::asio::io_service> get_io_service_ptr() const override {
+    return io_service_ptr_;
+  }
+
+  /// The error comes from one of the members, so it counts if a member would
+  /// count it.
+  bool IsUpstreamFailure(const ec_type& ec) const override;
+
+  /// Returns the number of members not ejected at the moment.
+  std::size_t CountAvailableMembers() const;
+
+ private:
+  static logging::Logger LOG;
+
+  /// Weight of a new sample in the moving average of the connect latency.
+  constexpr static double kLatencyWeight = 0.2;
+  constexpr static std::size_t kNoMember = static_cast<std::size_t>(-1);
+
+  struct Member {
+    std::string name;
+    std::shared_ptr<UpstreamFactoryBase> upstream;
+    /// Requests and established sessions in progress.
+    std::size_t n_outstanding = 0;
+    /// Moving average of the time successful requests took, in seconds. Zero
+    /// until the first one.
+    double connect_latency = 0;
+    /// Requests failed in a row.
+    std::size_t n_failures = 0;
+    /// Time until which the member is skipped.
+    ClockType::time_point ejected_until;
+    bool is_checking = false;
+  };
+
+  UpstreamGroup(const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+                Policy policy);
+
+  /// Picks a member for a request, other than `excluded` if possible. When
+  /// every member is ejected, picks the one coming back first rather than
+  /// failing the request.
+  std::size_t PickMember(std::size_t excluded);
+  void StartMemberRequest(std::size_t index, const Address& endpoint,
+                          const RequestCallbackType& callback, bool can_retry);
+  void RecordSuccess(std::size_t index, ClockType::duration latency);
+  void RecordFailure(std::size_t index);
+  void ScheduleHealthCheck();
+  void CheckMember(std::size_t index);
+
+  const std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+  const Policy policy_;
+  std::vector<Member> members_;
+  /// Scratch list of the members a request can go to.
+  std::vector<std::size_t> candidates_;
+  /// Where the next search for the least outstanding member starts, so that
+  /// ties are spread over the members.
+  std::size_t next_member_ = 0;
+  std::minstd_rand random_;
+
+  std::size_t max_failures_ = 3;
+  ClockType::duration ejection_time_ = std::chrono::seconds(30);
+
+  Address check_target_;
+  ClockType::duration check_interval_{0};
+  ClockType::duration check_timeout_{0};
+  boost::asio::steady_timer check_timer_;
+};
+
+}  // namespace thestral
+#endif  // THESTRAL_UPSTREAM_GROUP_H_
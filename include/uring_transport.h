@@ -0,0 +1,345 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Defines the TcpTransport doing its I/O through io_uring.
+#ifndef THESTRAL_URING_TRANSPORT_H_
+#define THESTRAL_URING_TRANSPORT_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "base.h"
+#include "logging.h"
+#include "tcp_transport.h"
+
+struct io_uring_sqe;
+
+namespace thestral {
+
+/// Creates transport factories whose transports submit their reads and writes
+/// to an io_uring of their `io_service` rather than waiting for readiness.
+/// The requests made by all the handlers of one round of the `io_service` are
+/// submitted with a single system call, and the completions are reaped from
+/// shared memory without any. Listening sockets accept with a multishot
+/// request instead of one request per connection, unless AcceptLimits are
+/// set, which need the accepting to pause.
+///
+/// The transports are plain ones, so that SpliceRelay still takes over when
+/// both ends of a session are plain.
+class UringTransportFactory {
+ public:
+  /// Returns whether io_uring is supported by this build and by the kernel.
+  static bool IsSupported();
+
+  static std::shared_ptr<TcpTransportFactory> New(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr);
+};
+
+namespace impl {
+
+/// A ring of an `io_service`, shared by all its transports. Like the other
+/// services, it should only be used by handlers running on its `io_service`.
+class IoUring : public boost::asio::io_service::service {
+ public:
+  /// A request in flight, or more than one for multishot requests.
+  class Operation {
+   public:
+    virtual ~Operation() {}
+
+    /// Called on the `io_service` for each completion, with the result of the
+    /// request, which is a negative `errno` on failure, and whether more
+    /// completions are to come.
+    virtual void Complete(int result, bool has_more) = 0;
+
+    /// Returns whether any request of this operation is in flight.
+    bool IsPending() const { return keep_alive_ != nullptr; }
+
+   private:
+    friend class IoUring;
+
+    /// Keeps the owner of the operation alive while its requests are in
+    /// flight, as the kernel may write into the memory of the owner.
+    std::shared_ptr<void> keep_alive_;
+    Operation* prev_ = nullptr;
+    Operation* next_ = nullptr;
+  };
+
+  /// Number of submissions the ring holds before they have to be submitted.
+  constexpr static unsigned kQueueDepth = 256;
+  /// Largest number of sockets installed in the fixed file table, further
+  /// limited by `RLIMIT_NOFILE`.
+  constexpr static unsigned kMaxFixedFiles = 4096;
+
+  static boost::asio::io_service::id id;
+
+  explicit IoUring(boost::asio::io_service& io_service);
+  ~IoUring();
+
+  /// Returns the error making the ring unusable, from setting it up or from
+  /// shutting down the service.
+  const ec_type& GetError() const { return error_; }
+
+  /// Returns a zeroed submission of `opcode` made with `op`, which is kept
+  /// alive with `owner` until its last completion. All the submissions
+  /// prepared before returning to the `io_service` are submitted together.
+  io_uring_sqe* Prepare(Operation* op, std::uint8_t opcode,
+                        const std::shared_ptr<void>& owner);
+  /// Asks the kernel to cancel the pending requests of `op`, which then
+  /// complete with `ECANCELED` unless they are done already.
+  void Cancel(Operation* op);
+  /// Submits the prepared submissions now, rather than once the handlers
+  /// before returning to the `io_service` are done.
+  void Submit();
+
+  /// Installs a socket into the fixed file table, so that requests on it can
+  /// skip looking up the descriptor. Returns its index in the table, or -1 if
+  /// the table is full or unavailable.
+  int RegisterFile(int fd);
+  /// Removes a socket from the fixed file table, without which the kernel
+  /// keeps it open. Returns whether it is removed. The index is not reused
+  /// until ReleaseFile(), as submissions prepared but not yet submitted may
+  /// still name it.
+  bool UnregisterFile(int index);
+  /// Frees an index removed by UnregisterFile(), once no submission naming
+  /// it is left.
+  void ReleaseFile(int index);
+
+ private:
+  static logging::Logger LOG;
+
+  void shutdown_service() override;
+
+  void Setup();
+  void Close();
+  /// Returns the next free submission, submitting the prepared ones first if
+  /// the queue is full.
+  io_uring_sqe* GetSubmission();
+  /// Completes the operations of the completions in the ring.
+  void Reap();
+  /// Waits for the eventfd of the ring to be signaled by a completion.
+  void StartWait();
+
+  boost::asio::io_service& io_service_;
+  ec_type error_;
+  int ring_fd_ = -1;
+  void* sq_ring_ = nullptr;
+  std::size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  std::size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_head_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  unsigned* sq_flags_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  void* cqes_ = nullptr;
+  /// Submissions prepared but not yet submitted.
+  unsigned n_prepared_ = 0;
+  bool is_submit_scheduled_ = false;
+
+  /// Signaled by the kernel on completions.
+  boost::asio::posix::stream_descriptor event_fd_;
+  bool is_waiting_ = false;
+  /// Operations with requests in flight, the list of which is walked when the
+  /// service shuts down.
+  Operation* pending_ops_ = nullptr;
+  /// Requests submitted and not yet completed, including cancellations.
+  std::size_t n_in_flight_ = 0;
+
+  /// Free indexes of the fixed file table, empty if it isn't registered.
+  std::vector<int> free_files_;
+};
+
+/// Implementation of TcpTransport with its reads and writes made through
+/// IoUring. Connecting and the other operations still use the socket, which
+/// is installed into the fixed file table on the first read or write.
+class UringTransportImpl
+    : public TcpTransport,
+      public std::enable_shared_from_this<UringTransportImpl> {
+ public:
+  ~UringTransportImpl();
+
+  Address GetLocalAddress() const override;
+  Address GetRemoteAddress() const override;
+  void StartRead(const boost::asio::mutable_buffers_1& buf,
+                 const ReadCallbackType& callback,
+                 bool allow_short_read = false) override;
+  void StartWrite(const boost::asio::const_buffers_1& buf,
+                  const WriteCallbackType& callback) override;
+  void StartWrite(const ConstBufferSequence& buffers,
+                  const WriteCallbackType& callback) override;
+  void StartWaitReadable(const WaitCallbackType& callback) override;
+  void StartClose(const CloseCallbackType& callback) override;
+  using TransportBase::StartClose;
+  void StartShutdownSend(const CloseCallbackType& callback) override;
+
+  boost::asio::ip::tcp::socket& GetUnderlyingSocket() override {
+    return socket_;
+  }
+  bool IsPlainForReading() override { return true; }
+  bool IsPlainForWriting() override { return true; }
+
+ private:
+  friend class UringTransportFactoryImpl;
+
+  /// Receives until the buffer is full, or once if short reads are allowed.
+  class ReadOperation : public IoUring::Operation {
+   public:
+    explicit ReadOperation(UringTransportImpl* transport)
+        : transport_(transport) {}
+    void Complete(int result, bool has_more) override;
+
+    char* data = nullptr;
+    std::size_t size = 0;
+    std::size_t n_read = 0;
+    bool allow_short_read = false;
+    ReadCallbackType callback;
+
+   private:
+    UringTransportImpl* const transport_;
+  };
+
+  /// Polls until readable.
+  class WaitOperation : public IoUring::Operation {
+   public:
+    void Complete(int result, bool has_more) override;
+
+    WaitCallbackType callback;
+  };
+
+  /// Sends until all the buffers are written.
+  class WriteOperation : public IoUring::Operation {
+   public:
+    explicit WriteOperation(UringTransportImpl* transport)
+        : transport_(transport) {}
+    void Complete(int result, bool has_more) override;
+
+    /// The buffers not yet written start from `first`.
+    std::vector<iovec> iovecs;
+    std::size_t first = 0;
+    std::size_t n_written = 0;
+    msghdr message;
+    WriteCallbackType callback;
+
+   private:
+    UringTransportImpl* const transport_;
+  };
+
+  explicit UringTransportImpl(boost::asio::io_service& io_service);
+
+  /// Prepares a submission on the socket of the transport.
+  io_uring_sqe* Prepare(IoUring::Operation* op, std::uint8_t opcode);
+  void SubmitRead();
+  void SubmitWrite();
+  void UnregisterFile();
+
+  boost::asio::io_service& io_service_;
+  IoUring& ring_;
+  boost::asio::ip::tcp::socket socket_;
+  /// Index in the fixed file table, or -1 if the socket isn't installed.
+  int file_index_ = -1;
+  /// Index the socket has been removed from, freed once the operations which
+  /// may name it are done, or -1.
+  int unregistered_index_ = -1;
+  /// Whether installing the socket has been tried.
+  bool is_file_registered_ = false;
+  ReadOperation read_op_;
+  WaitOperation wait_op_;
+  WriteOperation write_op_;
+};
+
+/// Implementation of TcpTransportFactory with UringTransportImpl.
+class UringTransportFactoryImpl : public TcpTransportFactoryImpl {
+ public:
+  static std::shared_ptr<UringTransportFactoryImpl> New(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
+    return std::shared_ptr<UringTransportFactoryImpl>(
+        new UringTransportFactoryImpl(io_service_ptr));
+  }
+
+  void StartAccept(EndpointType endpoint,
+                   const AcceptCallbackType& callback) override;
+  void StopAccepting() override;
+
+ private:
+  /// Accepts connections with a multishot request on a listening socket.
+  class AcceptOperation
+      : public IoUring::Operation,
+        public std::enable_shared_from_this<AcceptOperation> {
+   public:
+    AcceptOperation(
+        const std::shared_ptr<UringTransportFactoryImpl>& factory,
+        const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
+        const AcceptCallbackType& callback)
+        : factory_(factory),
+          acceptor_(acceptor),
+          callback_(callback),
+          retry_timer_(*factory->io_service_ptr_) {
+      ec_type ec;
+      protocol_ = acceptor->local_endpoint(ec).protocol();
+    }
+
+    void Start();
+    /// Stops after the callback gave up accepting.
+    void Stop();
+    /// Ends accepting as if the pending accept were aborted.
+    void Abort();
+    void Complete(int result, bool has_more) override;
+    /// Accepts with an impl::AcceptLoop instead, e.g. for kernels without
+    /// multishot accepts.
+    void StartAcceptLoop();
+
+   private:
+    const std::shared_ptr<UringTransportFactoryImpl> factory_;
+    const std::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+    const AcceptCallbackType callback_;
+    /// Protocol of the accepted sockets.
+    boost::asio::ip::tcp protocol_ = boost::asio::ip::tcp::v4();
+    /// Delays submitting again after an error, e.g. out of descriptors.
+    boost::asio::steady_timer retry_timer_;
+    bool has_accepted_ = false;
+    bool is_stopped_ = false;
+  };
+
+  explicit UringTransportFactoryImpl(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr)
+      : TcpTransportFactoryImpl(io_service_ptr) {}
+
+  std::shared_ptr<TcpTransport> NewTransport() const override {
+    return std::shared_ptr<UringTransportImpl>(
+        new UringTransportImpl(*io_service_ptr_));
+  }
+
+  std::vector<std::weak_ptr<AcceptOperation>> accept_ops_;
+  static logging::Logger LOG;
+};
+
+}  // namespace impl
+}  // namespace thestral
+
+#endif  // THESTRAL_URING_TRANSPORT_H_
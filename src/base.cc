@@ -34,10 +34,34 @@ TransportBase::IdType TransportBase::GetNextId() {
   return next_id++;
 }
 
+void TransportBase::StartWrite(const ConstBufferSequence& buffers,
+                               const WriteCallbackType& callback) {
+  if (buffers.size() == 1) {
+    StartWrite(boost::asio::const_buffers_1(buffers.front()), callback);
+    return;
+  }
+  auto data = std::make_shared<std::string>();
+  data->reserve(boost::asio::buffer_size(buffers));
+  for (const auto& buffer : buffers) {
+    data->append(boost::asio::buffer_cast<const char*>(buffer),
+                 boost::asio::buffer_size(buffer));
+  }
+  StartWrite(*data, [callback, data](const ec_type& ec, size_t bytes_written) {
+    callback(ec, bytes_written);
+  });
+}
+
+std::string PacketBase::Serialize() const {
+  std::string data;
+  SerializeTo(&data);
+  return data;
+}
+
 void PacketBase::StartWriteTo(
     const std::shared_ptr<TransportBase>& transport,
     const TransportBase::WriteCallbackType& callback) const {
-  auto data = std::make_shared<std::string>(Serialize());
+  auto data = std::make_shared<std::string>();
+  SerializeTo(data.get());
   transport->StartWrite(  // capture `data` to ensure it outlives this function
       *data, [callback, data](const ec_type& ec, size_t bytes_written) {
         callback(ec, bytes_written);
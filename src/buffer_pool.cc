@@ -0,0 +1,85 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements a pool of size-classed buffers bound to an io_service.
+#include "buffer_pool.h"
+
+#include <utility>
+
+namespace thestral {
+
+constexpr std::size_t BufferPool::kNumSizeClasses;
+constexpr std::size_t BufferPool::kMaxIdleBuffersPerClass;
+
+boost::asio::io_service::id BufferPool::id;
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) {
+  if (this != &other) {
+    Release();
+    pool_ = other.pool_;
+    size_class_ = other.size_class_;
+    size_ = other.size_;
+    data_ = std::move(other.data_);
+    other.pool_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+void BufferPool::Buffer::Release() {
+  if (pool_ && data_) {
+    pool_->Return(size_class_, std::move(data_));
+  }
+  pool_ = nullptr;
+  size_ = 0;
+  data_.reset();
+}
+
+std::size_t BufferPool::GetSizeOfClass(std::size_t size_class) {
+  static const std::array<std::size_t, kNumSizeClasses> kSizes{
+      {0x1000, 0x4000, 0x10000}};
+  return kSizes[size_class < kNumSizeClasses ? size_class
+                                             : kNumSizeClasses - 1];
+}
+
+BufferPool::Buffer BufferPool::Acquire(std::size_t size_class) {
+  if (size_class >= kNumSizeClasses) {
+    size_class = kNumSizeClasses - 1;
+  }
+
+  Buffer buffer;
+  buffer.pool_ = this;
+  buffer.size_class_ = size_class;
+  buffer.size_ = GetSizeOfClass(size_class);
+
+  auto& free_list = free_lists_[size_class];
+  if (free_list.empty()) {
+    buffer.data_.reset(new char[buffer.size_]);
+  } else {
+    buffer.data_ = std::move(free_list.back());
+    free_list.pop_back();
+  }
+  return buffer;
+}
+
+void BufferPool::Return(std::size_t size_class,
+                        std::unique_ptr<char[]>&& data) {
+  auto& free_list = free_lists_[size_class];
+  if (free_list.size() < kMaxIdleBuffersPerClass) {
+    free_list.push_back(std::move(data));
+  }
+}
+
+}  // namespace thestral
@@ -0,0 +1,81 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the common types.
+#include "common.h"
+
+#include <arpa/inet.h>
+
+#include <cstdio>
+#include <string>
+
+namespace thestral {
+
+namespace ip = boost::asio::ip;
+
+Address::Formatted Address::Format() const {
+  Formatted result;
+  auto buffer = result.buffer;
+  auto size = sizeof(result.buffer);
+  switch (type) {
+    case AddressType::kIPv4:
+    case AddressType::kIPv6: {
+      // short hosts are padded with zeros, as asio bytes would be
+      unsigned char bytes[16] = {};
+      char ip_text[INET6_ADDRSTRLEN] = {};
+      host.copy(reinterpret_cast<char*>(bytes), sizeof(bytes));
+      if (type == AddressType::kIPv4) {
+        inet_ntop(AF_INET, bytes, ip_text, sizeof(ip_text));
+        std::snprintf(buffer, size, "%s:%u", ip_text, port);
+      } else {
+        inet_ntop(AF_INET6, bytes, ip_text, sizeof(ip_text));
+        std::snprintf(buffer, size, "[%s]:%u", ip_text, port);
+      }
+      break;
+    }
+    case AddressType::kDomainName:
+      std::snprintf(buffer, size, "%.*s:%u", static_cast<int>(host.size()),
+                    host.data(), port);
+      break;
+    default:
+      std::snprintf(buffer, size, "UNKNOWN ADDRESS TYPE");
+  }
+  return result;
+}
+
+std::string Address::ToString() const {
+  if (type != AddressType::kDomainName) {
+    return Format().c_str();  // IP addresses always fit
+  }
+  std::string result(host.data(), host.size());
+  result += ':';
+  result += std::to_string(port);
+  return result;
+}
+
+ip::address Address::ToAsioAddress() const {
+  if (type == AddressType::kIPv4) {
+    ip::address_v4::bytes_type bytes{};
+    host.copy(reinterpret_cast<char*>(bytes.data()), bytes.size());
+    return ip::address_v4(bytes);
+  } else if (type == AddressType::kIPv6) {
+    ip::address_v6::bytes_type bytes{};
+    host.copy(reinterpret_cast<char*>(bytes.data()), bytes.size());
+    return ip::address_v6(bytes);
+  }
+  return ip::address();
+}
+
+}  // namespace thestral
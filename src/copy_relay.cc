@@ -0,0 +1,111 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements a relay copying data between transports through pooled buffers.
+#include "copy_relay.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace thestral {
+
+void CopyRelay::Start(const DoneCallbackType& callback) {
+  callback_ = callback;
+  self_ = shared_from_this();
+  WaitReadable();
+}
+
+void CopyRelay::WaitReadable() {
+  from_->StartWaitReadable([this](const ec_type& ec) {
+    if (ec) {
+      Finish(ec);
+    } else if (buckets_) {
+      boost::asio::use_service<ShapingScheduler>(*io_service_ptr_)
+          .StartAcquire(*buckets_,
+                        [this](std::size_t n_granted) { DoRead(n_granted); });
+    } else {
+      DoRead(SIZE_MAX);
+    }
+  });
+}
+
+void CopyRelay::DoRead(std::size_t max_bytes) {
+  buffer_ = pool_.Acquire(size_class_);
+  n_granted_ = max_bytes;
+  n_requested_ = std::min(buffer_.size(), max_bytes);
+  from_->StartRead(
+      buffer_.data(), n_requested_,
+      [this](const ec_type& ec, std::size_t bytes_read) {
+        if (buckets_) {
+          // give back what was granted but not read
+          buckets_->Consume(-static_cast<int64_t>(n_granted_ - bytes_read));
+        }
+        if (bytes_read == 0 || ec) {
+          buffer_.Release();
+          Finish(ec ? ec : boost::asio::error::eof);
+        } else {
+          DoWrite(bytes_read);
+        }
+      },
+      true /* allow short read */);
+}
+
+void CopyRelay::DoWrite(std::size_t n_bytes) {
+  if (byte_counter_) {
+    byte_counter_->Increment(n_bytes);
+  }
+  if (trace_) {
+    trace_->Record(trace_event_);
+    trace_.reset();
+  }
+  if (idle_timer_) {
+    idle_timer_->Touch();
+  }
+
+  // pick the size class for the next read according to this one, unless it
+  // was cut short by the rate limit
+  if (n_bytes == buffer_.size()) {
+    if (size_class_ + 1 < BufferPool::kNumSizeClasses) {
+      ++size_class_;
+    }
+  } else if (size_class_ > 0 && n_requested_ == buffer_.size() &&
+             n_bytes <= BufferPool::GetSizeOfClass(size_class_ - 1) / 2) {
+    --size_class_;
+  }
+
+  to_->StartWrite(buffer_.data(), n_bytes,
+                  [this](const ec_type& ec, std::size_t) {
+                    buffer_.Release();
+                    if (ec) {
+                      Finish(ec);
+                    } else {
+                      WaitReadable();
+                    }
+                  });
+}
+
+void CopyRelay::Finish(const ec_type& ec) {
+  if (!callback_) {
+    return;
+  }
+  idle_timer_.reset();
+  buckets_.reset();
+  DoneCallbackType callback;
+  callback.swap(callback_);  // make sure it is called only once
+  auto self = std::move(self_);  // released once this returns
+  callback(ec);
+}
+
+}  // namespace thestral
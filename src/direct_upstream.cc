@@ -16,6 +16,8 @@
 /// Implements the upstream for direct access.
 #include "direct_upstream.h"
 
+#include <vector>
+
 namespace ip = boost::asio::ip;
 
 namespace thestral {
@@ -23,48 +25,75 @@ namespace thestral {
 logging::Logger DirectTcpUpstreamFactory::LOG("DirectTcpUpstreamFactory");
 
 void DirectTcpUpstreamFactory::StartRequest(
-    const Address& address, const RequestCallbackType& callback) {
-  LOG.Info("sending request to %s", address.ToString().c_str());
+    const Address& address, const RequestCallbackType& request_callback) {
+  THESTRAL_LOG_INFO(LOG, "sending request to %s", address.Format().c_str());
+  const auto& trace = trace::Current();
+  auto callback = request_callback;
+  if (trace) {
+    callback = [trace, request_callback](
+                   const ec_type& ec,
+                   const std::shared_ptr<TransportBase>& transport) {
+      if (!ec) {
+        trace->Record(trace::Event::kConnected);
+      }
+      request_callback(ec, transport);
+    };
+  }
   switch (address.type) {
     case AddressType::kDomainName: {
-      ip::tcp::resolver::query query(
-          address.host, std::to_string(address.port),
-          ip::tcp::resolver::query::address_configured |
-              ip::tcp::resolver::query::numeric_service);
       auto self = shared_from_this();
-      LOG.Debug("resolving address %s", address.host.c_str());
-      resolver_.async_resolve(
-          query, [self, address, callback](const ec_type& ec,
-                                           ip::tcp::resolver::iterator iter) {
+      THESTRAL_LOG_DEBUG(LOG, "resolving address %s", address.host.c_str());
+      dns_cache_->StartResolve(
+          std::string(address.host),
+          [self, address, callback, trace](
+              const ec_type& ec,
+              const std::vector<ip::address>& resolved_addresses) {
+            if (trace) {
+              trace->Record(trace::Event::kDnsDone);
+            }
+            // for a transport factory doing TLS
+            trace::Scope trace_scope(trace);
             if (ec) {
               self->LOG.Error("failed to resolve address %s, reason: %s",
                               address.host.c_str(), ec.message().c_str());
               callback(ec, nullptr);
+              return;
+            }
+
+            std::vector<ip::tcp::endpoint> endpoints;
+            for (const auto& resolved_address : resolved_addresses) {
+              ip::tcp::endpoint endpoint(resolved_address, address.port);
+              if (self->routes_ &&
+                  self->routes_->Lookup(address,
+                                        Address::FromAsioEndpoint(endpoint)) ==
+                      RouteTable::kDeny) {
+                LOG.Warn("address %s of %s denied by the routes",
+                         resolved_address.to_string().c_str(),
+                         address.Format().c_str());
+                continue;
+              }
+              endpoints.push_back(endpoint);
+            }
+            if (endpoints.empty()) {
+              callback(boost::asio::error::make_error_code(
+                           boost::asio::error::access_denied),
+                       nullptr);
+            } else if (endpoints.size() == 1) {
+              self->transport_factory_->StartConnect(endpoints.front(),
+                                                     callback);
             } else {
-              // more than one results?
-              self->transport_factory_->StartConnect(*iter, callback);
+              HappyEyeballsConnector::New(self->transport_factory_, endpoints,
+                                          self->attempt_delay_)
+                  ->Start(callback);
             }
           });
       break;
     }
-    case AddressType::kIPv4: {
-      ip::address_v4::bytes_type address_bytes;
-      std::copy(address.host.cbegin(), address.host.cend(),
-                address_bytes.begin());
-      ip::address_v4 asio_addr(address_bytes);
+    case AddressType::kIPv4:
+    case AddressType::kIPv6:
       transport_factory_->StartConnect(
-          ip::tcp::endpoint(asio_addr, address.port), callback);
+          address.ToAsioEndpoint<ip::tcp::endpoint>(), callback);
       break;
-    }
-    case AddressType::kIPv6: {
-      ip::address_v6::bytes_type address_bytes;
-      std::copy(address.host.cbegin(), address.host.cend(),
-                address_bytes.begin());
-      ip::address_v6 asio_addr(address_bytes);
-      transport_factory_->StartConnect(
-          ip::tcp::endpoint(asio_addr, address.port), callback);
-      break;
-    }
     default:
       // unknown address type
       // TODO(richardtsai): report error to the callback
@@ -0,0 +1,191 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements a cache of DNS resolution results.
+#include "dns_cache.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "metrics.h"
+
+namespace thestral {
+
+namespace ip = boost::asio::ip;
+
+namespace {
+const metrics::Histogram kResolveLatency(
+    "thestral_dns_resolve_seconds", "Time taken to resolve a host name.",
+    metrics::Histogram::LatencyBounds(), "resolver=\"cache\"");
+}  // anonymous namespace
+
+DnsResolverPool& DnsResolverPool::Get() {
+  // never destroyed, as the threads may still be running at exit
+  static auto pool = new DnsResolverPool;
+  return *pool;
+}
+
+void DnsResolverPool::Reserve(std::size_t n_threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (; n_threads_ < n_threads; ++n_threads_) {
+    std::thread([this]() { Run(); }).detach();
+  }
+}
+
+void DnsResolverPool::Post(const TaskType& task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(task);
+  }
+  task_ready_.notify_one();
+}
+
+std::size_t DnsResolverPool::GetThreadCount() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return n_threads_;
+}
+
+void DnsResolverPool::Run() {
+  boost::asio::io_service io_service;
+  for (;;) {
+    TaskType task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_ready_.wait(lock, [this]() { return !tasks_.empty(); });
+      task.swap(tasks_.front());
+      tasks_.pop_front();
+    }
+    task(io_service);
+  }
+}
+
+logging::Logger DnsCache::LOG("DnsCache");
+
+void DnsCache::StartResolve(const std::string& host,
+                            const ResolveCallbackType& callback) {
+  auto iter = entries_.find(host);
+  if (iter == entries_.end()) {
+    iter = entries_.emplace(host, Entry()).first;
+    lru_.push_front(host);
+    iter->second.lru_iter = lru_.begin();
+  } else {
+    lru_.splice(lru_.begin(), lru_, iter->second.lru_iter);
+  }
+
+  auto& entry = iter->second;
+  if (entry.is_resolving) {
+    entry.waiters.push_back(callback);
+    return;
+  }
+  if (!entry.addresses.empty() || entry.ec) {
+    if (ClockType::now() < entry.expiry) {
+      THESTRAL_LOG_DEBUG(LOG, "cache hit for %s", host.c_str());
+      callback(entry.ec, entry.addresses);
+      return;
+    }
+  }
+
+  entry.is_resolving = true;
+  entry.waiters.push_back(callback);
+  Evict();  // never drops `entry`, which is being resolved
+  StartQuery(host);
+}
+
+void DnsCache::StartQuery(const std::string& host) {
+  auto& pool = DnsResolverPool::Get();
+  pool.Reserve(std::max<std::size_t>(n_threads_, 1));
+
+  THESTRAL_LOG_DEBUG(LOG, "resolving %s", host.c_str());
+  if (n_pending_queries_++ == 0) {
+    pending_work_.reset(new boost::asio::io_service::work(*io_service_ptr_));
+  }
+  // only a weak pointer goes to the resolver thread, so that the cache is
+  // never destroyed there, and the queries of a destroyed cache are skipped
+  std::weak_ptr<DnsCache> weak_self = shared_from_this();
+  auto io_service_ptr = io_service_ptr_;
+  pool.Post([weak_self, io_service_ptr,
+             host](boost::asio::io_service& resolver_service) {
+    if (weak_self.expired()) {
+      return;
+    }
+    auto start = metrics::Histogram::ClockType::now();
+    ip::tcp::resolver resolver(resolver_service);
+    ip::tcp::resolver::query query(
+        host, "0", ip::tcp::resolver::query::address_configured |
+                       ip::tcp::resolver::query::numeric_service);
+    ec_type ec;
+    std::vector<ip::address> addresses;
+    for (auto iter = resolver.resolve(query, ec);
+         iter != ip::tcp::resolver::iterator(); ++iter) {
+      auto address = iter->endpoint().address();
+      if (std::find(addresses.cbegin(), addresses.cend(), address) ==
+          addresses.cend()) {
+        addresses.push_back(address);
+      }
+    }
+    if (!ec && addresses.empty()) {
+      ec = boost::asio::error::host_not_found;
+    }
+    kResolveLatency.ObserveSince(start);
+    io_service_ptr->post([weak_self, host, ec, addresses]() {
+      if (auto self = weak_self.lock()) {
+        self->HandleQuery(host, ec, addresses);
+      }
+    });
+  });
+}
+
+void DnsCache::HandleQuery(const std::string& host, const ec_type& ec,
+                           const std::vector<ip::address>& addresses) {
+  if (--n_pending_queries_ == 0) {
+    pending_work_.reset();
+  }
+
+  auto iter = entries_.find(host);
+  if (iter == entries_.end()) {  // shouldn't happen, as it is being resolved
+    return;
+  }
+
+  auto& entry = iter->second;
+  if (ec) {
+    THESTRAL_LOG_DEBUG(LOG, "failed to resolve %s, reason: %s", host.c_str(),
+                       ec.message().c_str());
+  }
+  entry.ec = ec;
+  entry.addresses = addresses;
+  entry.expiry = ClockType::now() + (ec ? negative_ttl_ : positive_ttl_);
+  entry.is_resolving = false;
+
+  std::vector<ResolveCallbackType> waiters;
+  waiters.swap(entry.waiters);
+  for (const auto& waiter : waiters) {
+    waiter(ec, addresses);  // `entry` may be evicted by now
+  }
+  Evict();
+}
+
+void DnsCache::Evict() {
+  auto lru_iter = lru_.end();
+  while (entries_.size() > max_entries_ && lru_iter != lru_.begin()) {
+    --lru_iter;
+    auto iter = entries_.find(*lru_iter);
+    if (!iter->second.is_resolving) {
+      entries_.erase(iter);
+      lru_iter = lru_.erase(lru_iter);
+    }
+  }
+}
+
+}  // namespace thestral
@@ -0,0 +1,115 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements a connector racing connection attempts to several endpoints.
+#include "happy_eyeballs.h"
+
+namespace thestral {
+
+namespace ip = boost::asio::ip;
+
+logging::Logger HappyEyeballsConnector::LOG("HappyEyeballsConnector");
+
+std::vector<ip::tcp::endpoint> HappyEyeballsConnector::SortEndpoints(
+    const std::vector<ip::tcp::endpoint>& endpoints) {
+  std::vector<ip::tcp::endpoint> v6, v4, sorted;
+  for (const auto& endpoint : endpoints) {
+    (endpoint.address().is_v6() ? v6 : v4).push_back(endpoint);
+  }
+  for (std::size_t i = 0; i < v6.size() || i < v4.size(); ++i) {
+    if (i < v6.size()) {
+      sorted.push_back(v6[i]);
+    }
+    if (i < v4.size()) {
+      sorted.push_back(v4[i]);
+    }
+  }
+  return sorted;
+}
+
+void HappyEyeballsConnector::Start(const ConnectCallbackType& callback) {
+  callback_ = callback;
+  if (endpoints_.empty()) {
+    is_done_ = true;
+    callback_(boost::asio::error::host_not_found, nullptr);
+    return;
+  }
+  StartNextAttempt();
+}
+
+void HappyEyeballsConnector::StartNextAttempt() {
+  auto index = next_attempt_++;
+  auto self = shared_from_this();
+  THESTRAL_LOG_DEBUG(LOG, "attempt #%zu to %s, port: %u", index,
+                     endpoints_[index].address().to_string().c_str(),
+                     endpoints_[index].port());
+  ++n_pending_attempts_;
+  cancel_functions_[index] = transport_factory_->StartCancelableConnect(
+      endpoints_[index],
+      [self, index](const ec_type& ec,
+                    const std::shared_ptr<TransportBase>& transport) {
+        self->HandleAttempt(index, ec, transport);
+      });
+
+  if (next_attempt_ < endpoints_.size()) {
+    // give the attempt a head start before racing the next one. Canceling
+    // the timer doesn't stop a handler already queued, so it starts the next
+    // attempt only if no other has started since.
+    auto next = next_attempt_;
+    timer_.expires_from_now(attempt_delay_);
+    timer_.async_wait([self, next](const ec_type& ec) {
+      if (!ec && !self->is_done_ && self->next_attempt_ == next) {
+        self->StartNextAttempt();
+      }
+    });
+  }
+}
+
+void HappyEyeballsConnector::HandleAttempt(
+    std::size_t index, const ec_type& ec,
+    const std::shared_ptr<TransportBase>& transport) {
+  --n_pending_attempts_;
+  cancel_functions_[index] = nullptr;
+  if (is_done_) {  // another attempt has won
+    if (transport) {
+      transport->StartClose();
+    }
+    return;
+  }
+
+  if (ec) {
+    THESTRAL_LOG_DEBUG(LOG, "attempt #%zu failed, reason: %s", index,
+                       ec.message().c_str());
+    if (next_attempt_ < endpoints_.size()) {
+      timer_.cancel();  // no need to wait any longer
+      StartNextAttempt();
+    } else if (n_pending_attempts_ == 0) {
+      is_done_ = true;
+      callback_(ec, nullptr);
+    }
+    return;
+  }
+
+  is_done_ = true;
+  timer_.cancel();
+  for (auto& cancel : cancel_functions_) {
+    if (cancel) {
+      cancel();
+    }
+  }
+  callback_(ec, transport);
+}
+
+}  // namespace thestral
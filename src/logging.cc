@@ -16,12 +16,17 @@
 /// Implements logging facility.
 #include "logging.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <thread>
 
 #if defined(THESTRAL_USE_BOOST_REGEX)
 #include <boost/regex.hpp>
@@ -53,6 +58,28 @@ std::string level_to_string(Level level) {
   }
 }
 
+std::string FormatTime(std::time_t t) {
+  // formatted once a second per thread
+  thread_local std::time_t last_time = 0;
+  thread_local std::string last_result;
+  if (t == last_time && !last_result.empty()) {
+    return last_result;
+  }
+
+  char time_buf[64];
+  std::tm tm;
+  // std::localtime() is not thread-safe
+#if defined(_WIN32)
+  localtime_s(&tm, &t);
+#else
+  localtime_r(&t, &tm);
+#endif
+  std::strftime(time_buf, sizeof(time_buf), "%x %X", &tm);
+  last_time = t;
+  last_result = time_buf;
+  return last_result;
+}
+
 std::string LogSinkBase::CompiledFormatPart::GetStringFromMap(
     const std::map<std::string, std::string>& map) const {
   if (is_constant_) {
@@ -78,9 +105,11 @@ class FileLogSink : public LogSinkBase {
     for (auto& p : compiled_format_) {
       ofs_ << p.GetStringFromMap(record.GetAttributes());
     }
-    ofs_ << std::endl;
+    ofs_ << '\n';  // flushed by Flush(), possibly after a batch of records
   }
 
+  void Flush() override { ofs_.flush(); }
+
  private:
   std::ofstream ofs_;
 };
@@ -91,8 +120,10 @@ class StdErrLogSink : public LogSinkBase {
     for (auto& p : compiled_format_) {
       std::cerr << p.GetStringFromMap(record.GetAttributes());
     }
-    std::cerr << std::endl;
+    std::cerr << '\n';
   }
+
+  void Flush() override { std::cerr.flush(); }
 };
 
 void LogSinkBase::SetFormat(const std::string& format) {
@@ -124,24 +155,243 @@ void LogSinkBase::PushRecord(const LogRecord& record) {
 }
 
 std::vector<std::unique_ptr<LogSinkBase>> g_log_sinks;
+std::atomic<int> g_min_sink_level{static_cast<int>(Level::FATAL) + 1};
+
+void UpdateMinSinkLevel() {
+  int min_level = static_cast<int>(Level::FATAL) + 1;
+  for (auto& sink : g_log_sinks) {
+    min_level = std::min(min_level, static_cast<int>(sink->GetLevel()));
+  }
+  g_min_sink_level.store(min_level, std::memory_order_relaxed);
+}
+
+/// Stores records into all the sinks and flushes them. The sinks are locked
+/// incrementally, which ensures records are in the same order in all sinks.
+/// But be cautious about the order of locking to avoid deadlock!
+void StoreIntoSinks(const LogRecord* records, std::size_t n_records) {
+  std::vector<std::unique_lock<std::mutex>> lock_guards;
+  for (auto& sink : g_log_sinks) {
+    lock_guards.emplace_back(sink->GetMutex());
+    for (std::size_t i = 0; i < n_records; ++i) {
+      sink->PushRecord(records[i]);
+    }
+    sink->Flush();
+  }
+}
+
+/// A bounded queue of log records, which can be pushed by multiple threads
+/// without locking and popped by a single thread. Every cell has a sequence
+/// number telling whether it is ready to be written or read in the current
+/// round.
+class RecordQueue {
+ public:
+  explicit RecordQueue(std::size_t capacity)
+      : capacity_(RoundUpCapacity(capacity)), cells_(new Cell[capacity_]) {
+    for (std::size_t i = 0; i < capacity_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /// Pushes a record if the queue is not full. The record is left untouched
+  /// if not pushed.
+  bool TryPush(LogRecord&& record) {
+    auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto& cell = cells_[pos & (capacity_ - 1)];
+      auto seq = cell.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          cell.record = std::move(record);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // the cell of the last round is not yet read
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// Pops a record if the queue is not empty. Must only be called by one
+  /// thread.
+  bool TryPop(LogRecord& record) {
+    auto& cell = cells_[dequeue_pos_ & (capacity_ - 1)];
+    auto seq = cell.sequence.load(std::memory_order_acquire);
+    if (seq != dequeue_pos_ + 1) {
+      return false;
+    }
+    record = std::move(cell.record);
+    cell.sequence.store(dequeue_pos_ + capacity_, std::memory_order_release);
+    ++dequeue_pos_;
+    return true;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    LogRecord record;
+  };
+
+  static std::size_t RoundUpCapacity(std::size_t capacity) {
+    std::size_t result = 2;
+    while (result < capacity) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const std::size_t capacity_;
+  std::unique_ptr<Cell[]> cells_;
+  std::atomic<std::size_t> enqueue_pos_{0};
+  std::size_t dequeue_pos_ = 0;
+};
+
+/// The background thread storing log records and the queue feeding it.
+class AsyncPipeline {
+ public:
+  explicit AsyncPipeline(const AsyncOptions& options)
+      : options_(options), queue_(options.queue_size) {
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  /// Stores all queued records before returning.
+  ~AsyncPipeline() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stopping_ = true;
+    }
+    wakeup_cv_.notify_one();
+    thread_.join();
+  }
+
+  void Push(LogRecord&& record) {
+    while (!queue_.TryPush(std::move(record))) {
+      if (options_.overflow_policy == OverflowPolicy::DROP) {
+        n_dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      WakeUp();
+      std::this_thread::yield();
+    }
+    n_pushed_.fetch_add(1);
+    if (is_sleeping_.load()) {
+      WakeUp();
+    }
+  }
+
+  /// Waits until all the records pushed so far are stored.
+  void WaitDrained() {
+    auto target = n_pushed_.load(std::memory_order_acquire);
+    WakeUp();
+    std::unique_lock<std::mutex> lock(mtx_);
+    drained_cv_.wait(lock, [this, target]() { return n_stored_ >= target; });
+  }
+
+ private:
+  /// Maximum number of records stored while holding the locks of the sinks.
+  constexpr static std::size_t kMaxBatchSize = 256;
+
+  void WakeUp() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    wakeup_cv_.notify_one();
+  }
+
+  void Run() {
+    std::vector<LogRecord> batch(kMaxBatchSize);
+    for (;;) {
+      std::size_t n_records = 0;
+      while (n_records < kMaxBatchSize && queue_.TryPop(batch[n_records])) {
+        ++n_records;
+      }
+      if (n_records > 0) {
+        StoreIntoSinks(batch.data(), n_records);
+        std::lock_guard<std::mutex> lock(mtx_);
+        n_stored_ += n_records;
+        drained_cv_.notify_all();
+      }
+      if (auto n_dropped = n_dropped_.exchange(0)) {
+        ReportDropped(n_dropped);
+        continue;
+      }
+      if (n_records == kMaxBatchSize) {
+        continue;  // likely more to come
+      }
+
+      std::unique_lock<std::mutex> lock(mtx_);
+      if (stopping_ && n_stored_ == n_pushed_.load(std::memory_order_acquire)) {
+        return;
+      }
+      is_sleeping_.store(true);
+      // a record pushed right before may not have seen the flag
+      if (n_stored_ == n_pushed_.load()) {
+        wakeup_cv_.wait_for(lock, options_.flush_interval);
+      }
+      is_sleeping_.store(false);
+    }
+  }
+
+  void ReportDropped(std::size_t n_dropped) {
+    std::map<std::string, std::string> attributes{
+        {"logger_name", "logging"},
+        {"level", level_to_string(Level::WARN)},
+        {"time", FormatTime(std::time(nullptr))},
+        {"message", std::to_string(n_dropped) +
+                        " log records dropped as the queue is full"}};
+    LogRecord record(Level::WARN, std::move(attributes));
+    StoreIntoSinks(&record, 1);
+  }
+
+  const AsyncOptions options_;
+  RecordQueue queue_;
+  std::atomic<uint64_t> n_pushed_{0};
+  std::atomic<std::size_t> n_dropped_{0};
+  std::atomic<bool> is_sleeping_{false};
+
+  std::mutex mtx_;
+  std::condition_variable wakeup_cv_;
+  std::condition_variable drained_cv_;
+  /// Guarded by `mtx_`, as well as the following.
+  uint64_t n_stored_ = 0;
+  bool stopping_ = false;
+
+  std::thread thread_;
+};
+
+constexpr std::size_t AsyncPipeline::kMaxBatchSize;
+
+/// Destroyed before the sinks, which it stores the remaining records into.
+std::unique_ptr<AsyncPipeline> g_async_pipeline;
 
 }  // namespace impl
 
+void start_async_logging(const AsyncOptions& options) {
+  stop_async_logging();
+  impl::g_async_pipeline.reset(new impl::AsyncPipeline(options));
+}
+
+void stop_async_logging() { impl::g_async_pipeline.reset(); }
+
 impl::LogSinkBase& add_file_log_sink(const std::string& filename,
                                      bool truncate) {
   impl::g_log_sinks.emplace_back(new impl::FileLogSink(
       filename, std::ios_base::out |
                     (truncate ? std::ios_base::trunc : std::ios_base::app)));
+  impl::UpdateMinSinkLevel();
   return *impl::g_log_sinks.back();
 }
 
 impl::LogSinkBase& add_stderr_log_sink() {
   impl::g_log_sinks.emplace_back(new impl::StdErrLogSink());
+  impl::UpdateMinSinkLevel();
   return *impl::g_log_sinks.back();
 }
 
 impl::LogSinkBase& add_log_sink(std::unique_ptr<impl::LogSinkBase> sink) {
   impl::g_log_sinks.emplace_back(std::move(sink));
+  impl::UpdateMinSinkLevel();
   return *impl::g_log_sinks.back();
 }
 
@@ -159,6 +409,10 @@ std::string Logger::GetName() const { return attributes_.at("logger_name"); }
 
 Logger::LogRecordProxy Logger::Log(Level level, const char* format,
                                    va_list args) const {
+  if (!IsEnabled(level)) {
+    return LogRecordProxy(level);
+  }
+
   // we may need to call vsnprintf twice, but a va_list can be used only once
   va_list args_clone;
   va_copy(args_clone, args);
@@ -175,25 +429,28 @@ Logger::LogRecordProxy Logger::Log(Level level, const char* format,
 
   auto attributes = attributes_;
   attributes["message"] = buf.get();
-
-  char time_buf[64];
-  std::time_t t = std::time(nullptr);
-  std::strftime(time_buf, sizeof(time_buf), "%x %X", std::localtime(&t));
-  attributes["time"] = time_buf;
-
+  attributes["time"] = impl::FormatTime(std::time(nullptr));
   attributes["level"] = impl::level_to_string(level);
 
-  return LogRecordProxy(impl::LogRecord(level, attributes));
+  return LogRecordProxy(impl::LogRecord(level, std::move(attributes)));
 }
 
 Logger::LogRecordProxy::~LogRecordProxy() throw(FatalEvent) {
-  // the incremental locking here ensures records are in the same order in all
-  // sinks. But be cautious about the order of locking to avoid deadlock!
-  std::vector<std::unique_lock<std::mutex>> lock_guards;
-  for (auto& sink : impl::g_log_sinks) {
-    lock_guards.emplace_back(sink->GetMutex());
-    sink->PushRecord(record_);
+  if (!is_enabled_) {
+    if (record_.GetLevel() == Level::FATAL) {
+      throw FatalEvent();
+    }
+    return;
+  }
+  if (impl::g_async_pipeline && record_.GetLevel() != Level::FATAL) {
+    impl::g_async_pipeline->Push(std::move(record_));
+    return;
+  }
+  if (impl::g_async_pipeline) {
+    // make sure the fatal record follows the queued ones and is stored
+    impl::g_async_pipeline->WaitDrained();
   }
+  impl::StoreIntoSinks(&record_, 1);
 
   // Throwing in dtor is normally bad. But we required the users not to hold the
   // proxy object. So it should be okay here.
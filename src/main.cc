@@ -16,9 +16,7 @@
 #include <cstdlib>
 #include <iostream>
 #include <string>
-
-#include <boost/property_tree/info_parser.hpp>
-#include <boost/property_tree/ptree.hpp>
+#include <vector>
 
 #include "main_app.h"
 
@@ -71,10 +69,8 @@ print_usage_and_exit:
 int main(int argc, char* argv[]) {
   auto args = ParseCommandLineOrDie(argc, argv);
 
-  boost::property_tree::ptree config;
-  boost::property_tree::read_info(args.config_file_name, config);
-
-  thestral::MainApp app(config);
+  thestral::MainApp app(args.config_file_name,
+                        std::vector<std::string>(argv, argv + argc));
   app.Run();
 
   return EXIT_SUCCESS;
@@ -14,38 +14,66 @@
 
 /// @file
 /// Implements \ref thestral::MainApp.
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/property_tree/info_parser.hpp>
 
 #include "direct_upstream.h"
 #include "logging.h"
 #include "main_app.h"
+#include "metrics_server.h"
+#include "mux_upstream.h"
+#include "rate_limiter.h"
+#include "route_table.h"
 #include "socks_server.h"
 #include "socks_upstream.h"
 #include "ssl.h"
 #include "tcp_transport.h"
+#include "trace.h"
+#include "upstream_group.h"
+#include "uring_transport.h"
 
 namespace thestral {
 namespace pt = boost::property_tree;
 
 namespace {
 
-template <typename T>
-[[noreturn]] void DieOf(const T& reason) {
-  std::cerr << reason << std::endl;
-  std::exit(EXIT_FAILURE);
-}
+/// Raised on an invalid config. The process exits on it at startup, while a
+/// reload keeps the config in effect.
+class ConfigError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
 
-template <typename T0, typename T1, typename... T>
-[[noreturn]] void DieOf(const T0& reason0, const T1& reason1,
-                        const T&... reasons) {
-  std::cerr << reason0;
-  DieOf(reason1, reasons...);
+template <typename... T>
+[[noreturn]] void DieOf(const T&... reasons) {
+  std::ostringstream message;
+  (void)std::initializer_list<int>{(message << reasons, 0)...};
+  throw ConfigError(message.str());
 }
 
 logging::Level ParseLevelOrDie(const std::string& level_str) {
@@ -67,14 +95,280 @@ logging::Level ParseLevelOrDie(const std::string& level_str) {
   DieOf("unknown logging level in config file: ", level_str);
 }
 
+bool GetBoolOrDie(const pt::ptree& config, const std::string& key,
+                  bool default_value) {
+  auto val = config.get_optional<std::string>(key);
+  if (!val) {
+    return default_value;
+  }
+  if (*val == "true") {
+    return true;
+  }
+  if (*val == "false") {
+    return false;
+  }
+  DieOf("unknown value of option \"", key, "\": ", *val);
+}
+
+int ParseProtocolVersionOrDie(const std::string& version_str) {
+  if (version_str == "tlsv1.1") {
+    return TLS1_1_VERSION;
+  }
+  if (version_str == "tlsv1.2") {
+    return TLS1_2_VERSION;
+  }
+#if defined(TLS1_3_VERSION)
+  if (version_str == "tlsv1.3") {
+    return TLS1_3_VERSION;
+  }
+#endif
+  DieOf("unknown ssl protocol version in config file: ", version_str);
+}
+
+/// Logs the warnings about configs that are accepted nevertheless.
+logging::Logger CONFIG_LOG("Config");
+
+/// Seconds a server waits for the SOCKS request of an accepted connection,
+/// unless configured otherwise.
+constexpr int kDefaultHandshakeTimeout = 10;
+
+/// Returns a timeout in the `timeouts` block of a server, in seconds. Zero
+/// disables the timeout.
+std::chrono::seconds GetTimeoutOrDie(const pt::ptree& server_config,
+                                     const std::string& key,
+                                     int default_seconds) {
+  auto seconds = server_config.get<int>("timeouts." + key, default_seconds);
+  if (seconds < 0) {
+    DieOf("invalid ", key, " timeout in config file: ", seconds);
+  }
+  return std::chrono::seconds(seconds);
+}
+
+/// Returns a rate in the `rate_limit` block of a config, in bytes per second.
+/// Zero means no limit.
+uint64_t GetRateLimitOrDie(const pt::ptree& config, const std::string& key) {
+  auto rate = config.get<int64_t>("rate_limit." + key, 0);
+  if (rate < 0) {
+    DieOf("invalid ", key, " rate limit in config file: ", rate);
+  }
+  return static_cast<uint64_t>(rate);
+}
+
+/// Returns a limit in the `limits` block of a server config, divided among
+/// the workers, each of which accepts on its own. Zero means no limit.
+std::size_t GetAcceptLimitOrDie(const pt::ptree& config, const std::string& key,
+                                unsigned int n_workers) {
+  auto limit = config.get<int64_t>("limits." + key, 0);
+  if (limit < 0) {
+    DieOf("invalid ", key, " limit in config file: ", limit);
+  }
+  return (static_cast<std::size_t>(limit) + n_workers - 1) / n_workers;
+}
+
+unsigned int GetWorkerCountOrDie(const pt::ptree& config) {
+  auto n_workers = config.get<int>("workers", 1);
+  if (n_workers < 0) {
+    DieOf("invalid number of workers in config file: ", n_workers);
+  }
+  if (n_workers == 0) {  // one worker per hardware thread
+    n_workers = static_cast<int>(std::thread::hardware_concurrency());
+  }
+  return n_workers > 0 ? static_cast<unsigned int>(n_workers) : 1;
+}
+
+/// Returns the threads doing the TLS handshakes of all workers, or `nullptr`
+/// if they are done by the workers themselves.
+std::shared_ptr<ssl::HandshakePool> MakeHandshakePoolOrDie(
+    const pt::ptree& config) {
+  auto pool_config = config.get_child_optional("handshake_pool");
+  if (!pool_config) {
+    return nullptr;
+  }
+  auto n_threads = pool_config->get<int>("threads", 1);
+  auto max_pending = pool_config->get<int64_t>("max_pending", 1024);
+  if (n_threads <= 0 || max_pending <= 0) {
+    DieOf("invalid threads or max_pending of the handshake pool");
+  }
+  return ssl::HandshakePool::New(static_cast<unsigned int>(n_threads),
+                                 static_cast<std::size_t>(max_pending));
+}
+
+std::chrono::seconds GetDrainTimeoutOrDie(const pt::ptree& config) {
+  auto seconds = config.get<int>("drain_timeout", 30);
+  if (seconds < 0) {
+    DieOf("invalid drain_timeout in config file: ", seconds);
+  }
+  return std::chrono::seconds(seconds);
+}
+
+/// Returns one in how many sessions are traced, zero for none.
+unsigned int GetTraceSamplingOrDie(const pt::ptree& config) {
+  auto sampling = config.get<int>("trace.sample", 0);
+  if (sampling < 0) {
+    DieOf("invalid trace sample in config file: ", sampling);
+  }
+  return static_cast<unsigned int>(sampling);
+}
+
+pt::ptree LoadConfigOrDie(const std::string& config_file_name) {
+  pt::ptree config;
+  try {
+    pt::read_info(config_file_name, config);
+  } catch (const pt::ptree_error& e) {
+    DieOf("failed to read config file ", config_file_name, ": ", e.what());
+  }
+  return config;
+}
+
+/// Environment variable passing the listening sockets to the process taking
+/// over, as `fd,port,address` entries separated by `;`.
+constexpr const char* kListenSocketsVariable = "THESTRAL_LISTEN_SOCKETS";
+
+/// Listening sockets by the address and port of their servers in the config.
+typedef std::map<std::pair<std::string, uint16_t>, std::vector<int>> SocketMap;
+
+SocketMap TakeInheritedSockets() {
+  SocketMap sockets;
+  auto value = std::getenv(kListenSocketsVariable);
+  if (!value) {
+    return sockets;
+  }
+  std::istringstream entries(value);
+  std::string entry;
+  while (std::getline(entries, entry, ';')) {
+    auto port_begin = entry.find(',');
+    auto address_begin = entry.find(',', port_begin + 1);
+    if (port_begin == std::string::npos ||
+        address_begin == std::string::npos) {
+      continue;
+    }
+    auto fd = std::atoi(entry.substr(0, port_begin).c_str());
+    auto port = std::atoi(
+        entry.substr(port_begin + 1, address_begin - port_begin - 1).c_str());
+    sockets[std::make_pair(entry.substr(address_begin + 1),
+                           static_cast<uint16_t>(port))]
+        .push_back(fd);
+  }
+  unsetenv(kListenSocketsVariable);
+  return sockets;
+}
+
+/// Environment variable passing the process taking over the pipe on which it
+/// tells the old one that its servers have started.
+constexpr const char* kReadyPipeVariable = "THESTRAL_READY_PIPE";
+
+/// Time the old process waits for the new one to start its servers.
+constexpr std::chrono::seconds kHandoffTimeout(30);
+
+/// Tells the process handing off to this one, if any, that the servers have
+/// started and it can stop accepting.
+void NotifyHandoffReady() {
+  auto value = std::getenv(kReadyPipeVariable);
+  if (!value) {
+    return;
+  }
+  auto fd = std::atoi(value);
+  unsetenv(kReadyPipeVariable);
+  int status = 0;
+  ssize_t n_written;
+  do {
+    n_written = write(fd, &status, sizeof(status));
+  } while (n_written < 0 && errno == EINTR);
+  close(fd);
+}
+
+std::string FormatSockets(const SocketMap& sockets) {
+  std::string value;
+  for (const auto& entry : sockets) {
+    for (auto fd : entry.second) {
+      if (!value.empty()) {
+        value.push_back(';');
+      }
+      value.append(std::to_string(fd) + ',' +
+                   std::to_string(entry.first.second) + ',' +
+                   entry.first.first);
+    }
+  }
+  return value;
+}
+
+/// Closes the file descriptors in `[first, last]`. Runs in a forked child, so
+/// only async-signal-safe calls are made.
+void CloseFds(int first, int last) {
+#if defined(SYS_close_range)
+  if (syscall(SYS_close_range, static_cast<unsigned int>(first),
+              static_cast<unsigned int>(last), 0) == 0) {
+    return;
+  }
+#endif
+  for (int fd = first; fd <= last; ++fd) {
+    close(fd);
+  }
+}
+
+/// Closes every file descriptor but the standard streams and the sorted
+/// `kept` ones, below `max_fd`.
+void CloseFdsExcept(const std::vector<int>& kept, int max_fd) {
+  int first = STDERR_FILENO + 1;
+  for (auto fd : kept) {
+    if (fd > first) {
+      CloseFds(first, fd - 1);
+    }
+    first = fd + 1;
+  }
+  if (first < max_fd) {
+    CloseFds(first, max_fd - 1);
+  }
+}
+
+/// Returns the options in the `tcp` block of a server or an upstream.
+TcpOptions ParseTcpOptionsOrDie(const pt::ptree& config, bool is_server) {
+  TcpOptions options;
+  auto tcp_config = config.get_child_optional("tcp");
+  if (!tcp_config) {
+    return options;
+  }
+  auto get_size = [&tcp_config](const std::string& key) {
+    auto value = tcp_config->get<int>(key, 0);
+    if (value < 0) {
+      DieOf("invalid ", key, " of tcp options in config file: ", value);
+    }
+    return value;
+  };
+  if (is_server) {
+    options.backlog = get_size("backlog");
+    options.fast_open = get_size("fast_open");  // the queue length
+  } else {
+    options.fast_open = GetBoolOrDie(*tcp_config, "fast_open", false);
+  }
+  options.keepalive_idle = get_size("keepalive.idle");
+  options.keepalive_interval = get_size("keepalive.interval");
+  options.keepalive_count = get_size("keepalive.count");
+  options.send_buffer = get_size("send_buffer");
+  options.receive_buffer = get_size("receive_buffer");
+  options.notsent_lowat = get_size("notsent_lowat");
+  options.congestion = tcp_config->get<std::string>("congestion", "");
+  return options;
+}
+
 std::shared_ptr<TcpTransportFactory> MakeTcpTransportFactoryOrDie(
     pt::ptree config, bool is_server,
-    const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+    const std::shared_ptr<ssl::HandshakePool>& handshake_pool) {
+  std::shared_ptr<TcpTransportFactory> factory;
   auto ssl_iter = config.find("ssl");
+  bool use_io_uring = GetBoolOrDie(config, "tcp.io_uring", false);
+  if (use_io_uring && !UringTransportFactory::IsSupported()) {
+    DieOf("io_uring is not supported by this build or the kernel");
+  }
   if (ssl_iter == config.not_found()) {
-    return TcpTransportFactory::New(io_service_ptr);
+    factory = use_io_uring ? UringTransportFactory::New(io_service_ptr)
+                           : TcpTransportFactory::New(io_service_ptr);
 
   } else {
+    if (use_io_uring) {
+      DieOf("io_uring is only supported without ssl");
+    }
     auto ssl_config = ssl_iter->second;
     ssl::SslTransportFactoryBuilder builder;
     if (auto val = ssl_config.get_optional<std::string>("ca")) {
@@ -111,22 +405,336 @@ std::shared_ptr<TcpTransportFactory> MakeTcpTransportFactoryOrDie(
       }
     }
 
-    return builder.Build(io_service_ptr);
+    if (auto val = ssl_config.get_optional<std::string>("ciphers")) {
+      builder.SetCipherList(*val);
+    }
+    if (auto val = ssl_config.get_optional<std::string>("ciphersuites")) {
+      builder.SetCipherSuites(*val);
+    }
+    if (auto val = ssl_config.get_optional<std::string>("groups")) {
+      builder.SetGroups(*val);
+    }
+    if (auto val = ssl_config.get_optional<std::string>("min_version")) {
+      builder.SetMinProtocolVersion(ParseProtocolVersionOrDie(*val));
+    }
+
+    if (GetBoolOrDie(ssl_config, "kernel_tls", false)) {
+      if (!ssl::SslTransportFactoryBuilder::IsKernelTlsSupported()) {
+        DieOf("kernel_tls is not supported by this build");
+      }
+      builder.SetKernelTls(true);
+    }
+
+    if (is_server) {
+      builder.SetHandshakeTimeout(GetTimeoutOrDie(config, "handshake",
+                                                  kDefaultHandshakeTimeout));
+      builder.SetSessionTickets(
+          GetBoolOrDie(ssl_config, "session_tickets", true));
+      auto rotation = ssl_config.get<int>("ticket_key_rotation", 3600);
+      if (rotation < 0) {
+        DieOf("invalid ticket_key_rotation in config file: ", rotation);
+      }
+      builder.SetTicketKeyRotation(std::chrono::seconds(rotation));
+      if (auto val = ssl_config.get_optional<std::string>("ticket_key_file")) {
+        builder.LoadTicketKeyFile(*val);
+      }
+    } else {
+      builder.SetSessionCache(GetBoolOrDie(ssl_config, "session_cache", true));
+    }
+    builder.SetHandshakePool(handshake_pool);
+
+    factory = builder.Build(io_service_ptr);
+  }
+  factory->SetTcpOptions(ParseTcpOptionsOrDie(config, is_server));
+  return factory;
+}
+
+/// Makes the upstream of a config. The direct upstreams in it check the
+/// resolved addresses of domain names against the networks of `routes`, if
+/// any.
+std::shared_ptr<UpstreamFactoryBase> MakeUpstreamFactoryOrDie(
+    pt::ptree config,
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+    const std::shared_ptr<ssl::HandshakePool>& handshake_pool,
+    const std::shared_ptr<const RouteTable>& routes);
+
+UpstreamGroup::Policy ParseGroupPolicyOrDie(const std::string& policy_str) {
+  if (policy_str == "least_outstanding") {
+    return UpstreamGroup::Policy::kLeastOutstanding;
+  }
+  if (policy_str == "power_of_two_choices") {
+    return UpstreamGroup::Policy::kPowerOfTwoChoices;
+  }
+  DieOf("unknown policy of the upstream group: ", policy_str);
+}
+
+std::shared_ptr<UpstreamGroup> MakeUpstreamGroupOrDie(
+    const pt::ptree& config,
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+    const std::shared_ptr<ssl::HandshakePool>& handshake_pool,
+    const std::shared_ptr<const RouteTable>& routes) {
+  auto group = UpstreamGroup::New(
+      io_service_ptr, ParseGroupPolicyOrDie(config.get<std::string>(
+                          "policy", "least_outstanding")));
+  auto member_iter = config.equal_range("member");
+  for (auto i = member_iter.first; i != member_iter.second; ++i) {
+    auto name = i->second.data();
+    if (auto address = i->second.get_optional<std::string>("address")) {
+      name += " " + *address + ":" + i->second.get<std::string>("port", "");
+    }
+    group->AddMember(name, MakeUpstreamFactoryOrDie(i->second, io_service_ptr,
+                                                    handshake_pool, routes));
+  }
+  if (member_iter.first == member_iter.second) {
+    DieOf("no member provided for the upstream group");
+  }
+
+  auto max_failures = config.get<int>("max_failures", 3);
+  auto ejection_time = config.get<int>("ejection_time", 30);
+  if (max_failures < 0 || ejection_time < 0) {
+    DieOf("invalid max_failures or ejection_time of the upstream group");
+  }
+  group->SetEjection(static_cast<std::size_t>(max_failures),
+                     std::chrono::seconds(ejection_time));
+
+  if (auto check_config = config.get_child_optional("health_check")) {
+    auto host = check_config->get<std::string>("address");
+    auto port = check_config->get<uint16_t>("port");
+    auto interval = check_config->get<int>("interval", 10);
+    auto timeout = check_config->get<int>("timeout", 5);
+    if (interval <= 0 || timeout <= 0) {
+      DieOf("invalid health_check interval or timeout of the upstream group");
+    }
+    Address target;
+    ec_type ec;
+    auto ip_address = boost::asio::ip::address::from_string(host, ec);
+    if (ec) {
+      target.type = AddressType::kDomainName;
+      target.host = host;
+      target.port = port;
+    } else {
+      target = Address::FromAsioEndpoint(
+          boost::asio::ip::tcp::endpoint(ip_address, port));
+    }
+    group->SetHealthCheck(target, std::chrono::seconds(interval),
+                          std::chrono::seconds(timeout));
+  }
+  return group;
+}
+
+/// Routes of a server, compiled once and shared by its listeners on all
+/// workers, which build their own upstreams from the configs.
+struct ServerRoutes {
+  std::shared_ptr<const RouteTable> table;
+  std::vector<pt::ptree> upstream_configs;
+};
+
+/// Parses a port number or an inclusive range like `8000-9000`.
+RouteTable::PortRange ParsePortRangeOrDie(const std::string& port_str) {
+  const char* begin = port_str.c_str();
+  char* end;
+  auto first = std::strtoul(begin, &end, 10);
+  auto last = first;
+  if (end != begin && *end == '-') {
+    begin = end + 1;
+    last = std::strtoul(begin, &end, 10);
+  }
+  if (end == begin || *end != '\0' || first > last || last > 65535) {
+    DieOf("invalid port of a route rule: ", port_str);
+  }
+  RouteTable::PortRange ports;
+  ports.first = static_cast<uint16_t>(first);
+  ports.last = static_cast<uint16_t>(last);
+  return ports;
+}
+
+/// Reads the entries of a rule file, one per line. Blank lines and lines
+/// starting with `#` are skipped.
+std::vector<std::string> ReadRuleFileOrDie(const std::string& file_name) {
+  std::ifstream file(file_name);
+  if (!file) {
+    DieOf("unable to open the route rule file ", file_name);
+  }
+  std::vector<std::string> entries;
+  std::string line;
+  while (std::getline(file, line)) {
+    auto begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string::npos || line[begin] == '#') {
+      continue;
+    }
+    auto end = line.find_last_not_of(" \t\r");
+    entries.push_back(line.substr(begin, end - begin + 1));
+  }
+  return entries;
+}
+
+RouteTable::Target ParseRouteTargetOrDie(
+    const std::string& target_str,
+    const std::map<std::string, RouteTable::Target>& upstream_names) {
+  if (target_str == "allow") {
+    return RouteTable::kAllow;
+  }
+  if (target_str == "deny") {
+    return RouteTable::kDeny;
+  }
+  auto iter = upstream_names.find(target_str);
+  if (iter == upstream_names.end()) {
+    DieOf("unknown target of a route rule: ", target_str);
+  }
+  return iter->second;
+}
+
+ServerRoutes MakeRoutesOrDie(const pt::ptree& config) {
+  ServerRoutes routes;
+  std::map<std::string, RouteTable::Target> upstream_names;
+  if (auto upstreams_config = config.get_child_optional("upstreams")) {
+    for (const auto& upstream_config : *upstreams_config) {
+      auto target = static_cast<RouteTable::Target>(
+          routes.upstream_configs.size());
+      if (!upstream_names.emplace(upstream_config.first, target).second) {
+        DieOf("duplicated route upstream: ", upstream_config.first);
+      }
+      routes.upstream_configs.push_back(upstream_config.second);
+    }
+  }
+
+  auto table = std::make_shared<RouteTable>();
+  table->SetDefault(ParseRouteTargetOrDie(
+      config.get<std::string>("default", "allow"), upstream_names));
+  auto rule_iter = config.equal_range("rule");
+  for (auto i = rule_iter.first; i != rule_iter.second; ++i) {
+    auto target = ParseRouteTargetOrDie(i->second.data(), upstream_names);
+    std::vector<RouteTable::PortRange> port_ranges;
+    std::vector<std::string> networks, domains;
+    for (const auto& entry : i->second) {
+      if (entry.first == "port") {
+        port_ranges.push_back(ParsePortRangeOrDie(entry.second.data()));
+      } else if (entry.first == "network") {
+        networks.push_back(entry.second.data());
+      } else if (entry.first == "domain") {
+        domains.push_back(entry.second.data());
+      } else if (entry.first == "network_file") {
+        auto entries = ReadRuleFileOrDie(entry.second.data());
+        networks.insert(networks.end(), entries.begin(), entries.end());
+      } else if (entry.first == "domain_file") {
+        auto entries = ReadRuleFileOrDie(entry.second.data());
+        domains.insert(domains.end(), entries.begin(), entries.end());
+      } else {
+        DieOf("unknown option of a route rule: ", entry.first);
+      }
+    }
+    if (port_ranges.empty()) {
+      port_ranges.emplace_back();
+    }
+
+    // a rule matches when any of its hosts and any of its ports match
+    for (const auto& ports : port_ranges) {
+      for (const auto& network : networks) {
+        if (!table->AddNetworkRule(network, ports, target)) {
+          DieOf("invalid network of a route rule: ", network);
+        }
+      }
+      for (const auto& domain : domains) {
+        table->AddDomainRule(domain, ports, target);
+      }
+      if (networks.empty() && domains.empty()) {
+        table->AddAnyRule(ports, target);
+      }
+    }
   }
+  routes.table = table;
+  return routes;
 }
 
 std::shared_ptr<UpstreamFactoryBase> MakeUpstreamFactoryOrDie(
     pt::ptree config,
-    const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
-  auto transport_factory = MakeTcpTransportFactoryOrDie(config, false, io_service_ptr);
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+    const std::shared_ptr<ssl::HandshakePool>& handshake_pool,
+    const std::shared_ptr<const RouteTable>& routes) {
+  if (config.data() == "group") {
+    return MakeUpstreamGroupOrDie(config, io_service_ptr, handshake_pool,
+                                  routes);
+  }
+
+  auto transport_factory = MakeTcpTransportFactoryOrDie(
+      config, false, io_service_ptr, handshake_pool);
   if (config.data() == "direct") {
-    return DirectTcpUpstreamFactory::New(transport_factory);
+    auto upstream = DirectTcpUpstreamFactory::New(transport_factory);
+    if (auto delay = config.get_optional<int>("attempt_delay")) {
+      if (*delay < 0) {
+        DieOf("invalid attempt_delay of the direct upstream: ", *delay);
+      }
+      upstream->SetAttemptDelay(std::chrono::milliseconds(*delay));
+    }
+    if (routes && routes->HasNetworkRules()) {
+      upstream->SetRoutes(routes);
+    }
+    if (auto cache_config = config.get_child_optional("dns_cache")) {
+      auto size = cache_config->get<int>("size", 4096);
+      auto ttl = cache_config->get<int>("ttl", 60);
+      auto negative_ttl = cache_config->get<int>("negative_ttl", 5);
+      auto threads = cache_config->get<int>("threads", 4);
+      if (size <= 0 || ttl < 0 || negative_ttl < 0 || threads <= 0) {
+        DieOf("invalid dns_cache options of the direct upstream");
+      }
+      const auto& dns_cache = upstream->GetDnsCache();
+      dns_cache->SetMaxEntries(static_cast<std::size_t>(size));
+      dns_cache->SetPositiveTtl(std::chrono::seconds(ttl));
+      dns_cache->SetNegativeTtl(std::chrono::seconds(negative_ttl));
+      dns_cache->SetResolverThreads(static_cast<std::size_t>(threads));
+    }
+    return upstream;
 
   } else if (config.data() == "socks") {
     auto upstream_host = config.get<std::string>("address");
     auto upstream_port = config.get<uint16_t>("port");
-    return socks::SocksTcpUpstreamFactory::New(transport_factory, upstream_host,
-                                               upstream_port);
+    auto upstream = socks::SocksTcpUpstreamFactory::New(
+        transport_factory, upstream_host, upstream_port);
+    upstream->SetFastChaining(GetBoolOrDie(config, "fast_chaining", false));
+    upstream->SetTraceForwarding(
+        GetBoolOrDie(config, "forward_trace", false));
+    if (auto ttl = config.get_optional<int>("resolve_ttl")) {
+      if (*ttl < 0) {
+        DieOf("invalid upstream resolve_ttl in config file: ", *ttl);
+      }
+      upstream->SetResolveTtl(std::chrono::seconds(*ttl));
+    }
+    if (auto pool_config = config.get_child_optional("pool")) {
+      auto size = pool_config->get<int>("size", 4);
+      // shorter than the default handshake timeout of the upstream, which
+      // closes the idle connections otherwise
+      auto idle_timeout = pool_config->get<int>("idle_timeout", 5);
+      if (size <= 0 || idle_timeout <= 0) {
+        DieOf("invalid upstream pool size or idle timeout in config file");
+      }
+      if (idle_timeout >= kDefaultHandshakeTimeout) {
+        CONFIG_LOG.Warn(
+            "upstream pool idle_timeout %d is not shorter than the default "
+            "handshake timeout of %d, requests may have to retry on new "
+            "connections if the upstream is thestral",
+            idle_timeout, kDefaultHandshakeTimeout);
+      }
+      upstream->SetPool(static_cast<std::size_t>(size),
+                        std::chrono::seconds(idle_timeout));
+    }
+    return upstream;
+
+  } else if (config.data() == "mux") {
+    auto upstream_host = config.get<std::string>("address");
+    auto upstream_port = config.get<uint16_t>("port");
+    auto upstream = mux::MuxTcpUpstreamFactory::New(
+        transport_factory, upstream_host, upstream_port);
+    auto n_sessions = config.get<int>("sessions", 1);
+    if (n_sessions <= 0) {
+      DieOf("invalid number of sessions of the mux upstream: ", n_sessions);
+    }
+    upstream->SetSessionCount(static_cast<std::size_t>(n_sessions));
+    auto ping_interval = config.get<int>("ping_interval", 15);
+    if (ping_interval < 0) {
+      DieOf("invalid ping interval of the mux upstream: ", ping_interval);
+    }
+    upstream->SetPingInterval(std::chrono::seconds(ping_interval));
+    return upstream;
 
   } else {
     DieOf("unknown upstream type: ", config.data());
@@ -135,39 +743,562 @@ std::shared_ptr<UpstreamFactoryBase> MakeUpstreamFactoryOrDie(
 
 }  // anonymous namespace
 
-void MainApp::Run() const {
-  SetUpLoggingOrDie();
+logging::Logger MainApp::LOG("MainApp");
+
+MainApp::MainApp(const std::string& config_file_name,
+                 const std::vector<std::string>& command_line)
+    : config_file_name_(config_file_name),
+      command_line_(command_line),
+      signals_(control_service_, SIGHUP, SIGTERM, SIGINT),
+      drain_timer_(control_service_),
+      retire_timer_(control_service_) {
+  signals_.add(SIGUSR1);
+  signals_.add(SIGUSR2);
+  // the path, rather than the file, so that an upgraded binary is picked up
+  char path[PATH_MAX];
+  auto size = readlink("/proc/self/exe", path, sizeof(path));
+  executable_ = size > 0 ? std::string(path, static_cast<std::size_t>(size))
+                         : command_line_.front();
+}
 
-  auto server_iter = config_.equal_range("server");
+void MainApp::Run() {
+  try {
+    config_ = LoadConfigOrDie(config_file_name_);
+    SetUpLoggingOrDie();
+
+    // Every worker thread runs its own io_service with its own set of servers
+    // and upstreams, listening on the same endpoints with SO_REUSEPORT. A
+    // session stays on the thread accepting it, so nothing on the relay path
+    // is shared between threads.
+    auto n_workers = GetWorkerCountOrDie(config_);
+    for (unsigned int worker = 0; worker < n_workers; ++worker) {
+      io_services_.push_back(std::make_shared<boost::asio::io_service>());
+      works_.emplace_back(
+          new boost::asio::io_service::work(*io_services_.back()));
+    }
+    handshake_pool_ = MakeHandshakePoolOrDie(config_);
+    listeners_ = MakeListeners(config_);
+    drain_timeout_ = GetDrainTimeoutOrDie(config_);
+    trace::SetSampling(GetTraceSamplingOrDie(config_));
+  } catch (const ConfigError& e) {
+    std::cerr << e.what() << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+#if defined(SIGPIPE)
+  // asio sends with MSG_NOSIGNAL, but splice(2) and the socket writes of
+  // OpenSSL under kernel TLS raise SIGPIPE on a connection closed by the peer
+  std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+  AdoptInheritedSockets();
+  for (const auto& listener : listeners_) {
+    listener.server->Start();
+  }
+  NotifyHandoffReady();
+  WaitForSignal();
+
+  std::vector<std::thread> threads;
+  for (const auto& io_service_ptr : io_services_) {
+    threads.emplace_back([io_service_ptr]() { io_service_ptr->run(); });
+  }
+  control_service_.run();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (handshake_pool_) {
+    handshake_pool_->Stop();
+  }
+}
+
+std::vector<MainApp::Listener> MainApp::MakeListeners(
+    const pt::ptree& config) const {
+  auto server_iter = config.equal_range("server");
   if (server_iter.first == server_iter.second) {
     DieOf("no server configuration provided in the config file");
   }
 
-  auto io_service_ptr = std::make_shared<boost::asio::io_service>();
+  std::shared_ptr<TokenBucket> global_bucket;
+  if (auto global_rate = GetRateLimitOrDie(config, "global")) {
+    global_bucket = std::make_shared<TokenBucket>(global_rate);
+  }
 
-  // It shouldn't be necessary to maintain the server objects here as
-  // ServerBase.Start() will manage the lifetime of themselves. But we still
-  // hold pointers to them since we may need to operate on them (to support, for
-  // example, more graceful shutdown) in the future.
-  std::vector<std::shared_ptr<ServerBase>> servers;
+  // the routes and the rate limiters of each server are made just once
+  std::vector<ServerRoutes> server_routes;
+  std::vector<std::shared_ptr<RateLimiter>> rate_limiters;
   for (auto i = server_iter.first; i != server_iter.second; ++i) {
     if (i->second.data() != "socks") {
       DieOf("unknown server type: ", i->second.data());
     }
+    if (auto route_config = i->second.get_child_optional("route")) {
+      server_routes.push_back(MakeRoutesOrDie(*route_config));
+    } else {
+      server_routes.emplace_back();
+    }
+    auto session_rate = GetRateLimitOrDie(i->second, "session");
+    auto client_rate = GetRateLimitOrDie(i->second, "client");
+    if (session_rate != 0 || client_rate != 0 || global_bucket) {
+      rate_limiters.push_back(std::make_shared<RateLimiter>(
+          session_rate, client_rate, global_bucket));
+    } else {
+      rate_limiters.emplace_back();
+    }
+  }
+
+  std::vector<Listener> listeners;
+  auto n_workers = static_cast<unsigned int>(io_services_.size());
+  for (unsigned int worker = 0; worker < n_workers; ++worker) {
+    const auto& io_service_ptr = io_services_[worker];
+    std::size_t index = 0;
+    for (auto i = server_iter.first; i != server_iter.second; ++i, ++index) {
+      const auto& routes = server_routes[index];
+
+      auto address = i->second.get<std::string>("address");
+      auto port = i->second.get<uint16_t>("port");
+      auto transport_factory = MakeTcpTransportFactoryOrDie(
+          i->second, true, io_service_ptr, handshake_pool_);
+      transport_factory->SetReusePort(n_workers > 1);
+      AcceptLimits limits;
+      limits.max_connections =
+          GetAcceptLimitOrDie(i->second, "max_connections", n_workers);
+      limits.max_handshakes =
+          GetAcceptLimitOrDie(i->second, "max_handshakes", n_workers);
+      transport_factory->SetAcceptLimits(limits);
+      auto upstream_config = i->second.get_child("upstream");
+      auto upstream = MakeUpstreamFactoryOrDie(upstream_config, io_service_ptr,
+                                               handshake_pool_, routes.table);
+
+      auto server = socks::SocksTcpServer::New(address, port,
+                                               transport_factory, upstream);
+      server->SetHandshakeTimeout(GetTimeoutOrDie(i->second, "handshake",
+                                                  kDefaultHandshakeTimeout));
+      server->SetConnectTimeout(GetTimeoutOrDie(i->second, "connect", 30));
+      server->SetIdleTimeout(GetTimeoutOrDie(i->second, "idle", 0));
+      server->SetMultiplexing(GetBoolOrDie(i->second, "multiplexing", false));
+      auto max_streams = i->second.get<int>("max_streams", 128);
+      if (max_streams < 0) {
+        DieOf("invalid max_streams of the server: ", max_streams);
+      }
+      server->SetMaxStreams(static_cast<std::size_t>(max_streams));
+      server->SetUdpAssociate(GetBoolOrDie(i->second, "udp_associate", false));
+      if (routes.table) {
+        std::vector<std::shared_ptr<UpstreamFactoryBase>> routed_upstreams;
+        for (const auto& routed_config : routes.upstream_configs) {
+          routed_upstreams.push_back(
+              MakeUpstreamFactoryOrDie(routed_config, io_service_ptr,
+                                       handshake_pool_, routes.table));
+        }
+        server->SetRoutes(routes.table, routed_upstreams);
+      }
+      server->SetRateLimiter(rate_limiters[index]);
+      listeners.push_back({address, port, worker, transport_factory, server});
+    }
+  }
 
-    auto address = i->second.get<std::string>("address");
-    auto port = i->second.get<uint16_t>("port");
-    auto transport_factory =
-        MakeTcpTransportFactoryOrDie(i->second, true, io_service_ptr);
-    auto upstream_config = i->second.get_child("upstream");
-    auto upstream = MakeUpstreamFactoryOrDie(upstream_config, io_service_ptr);
+  // the metrics are shared by all workers, so a single endpoint serves them
+  auto metrics_iter = config.find("metrics");
+  if (metrics_iter != config.not_found()) {
+    auto address =
+        metrics_iter->second.get<std::string>("address", "127.0.0.1");
+    auto port = metrics_iter->second.get<uint16_t>("port", 9100);
+    auto transport_factory = TcpTransportFactory::New(io_services_.front());
+    listeners.push_back(
+        {address, port, 0, transport_factory,
+         MetricsServer::New(address, port, transport_factory)});
+  }
+  return listeners;
+}
 
-    servers.emplace_back(
-        socks::SocksTcpServer::New(address, port, transport_factory, upstream));
-    servers.back()->Start();
+void MainApp::AdoptInheritedSockets() {
+  auto inherited = TakeInheritedSockets();
+  for (const auto& listener : listeners_) {
+    auto iter = inherited.find(std::make_pair(listener.address, listener.port));
+    if (iter == inherited.end()) {
+      continue;
+    }
+    // spread the sockets over the workers, sharing them if there are fewer
+    const auto& sockets = iter->second;
+    std::vector<int> adopted;
+    for (auto i = listener.worker; i < sockets.size();
+         i += static_cast<unsigned int>(io_services_.size())) {
+      adopted.push_back(sockets[i]);
+    }
+    if (adopted.empty()) {
+      auto fd = dup(sockets[listener.worker % sockets.size()]);
+      if (fd < 0) {
+        LOG.Error("failed to share a listening socket, reason: %s",
+                  std::strerror(errno));
+        continue;
+      }
+      adopted.push_back(fd);
+    }
+    THESTRAL_LOG_INFO(LOG, "taking over %zu listening sockets on %s, port: %u",
+                      adopted.size(), listener.address.c_str(), listener.port);
+    listener.transport_factory->AdoptListeningSockets(adopted);
   }
 
-  io_service_ptr->run();
+  // those of the endpoints no longer configured
+  for (const auto& entry : inherited) {
+    auto is_adopted = std::any_of(
+        listeners_.cbegin(), listeners_.cend(),
+        [&entry](const Listener& listener) {
+          return listener.address == entry.first.first &&
+                 listener.port == entry.first.second;
+        });
+    if (!is_adopted) {
+      for (auto fd : entry.second) {
+        close(fd);
+      }
+    }
+  }
+}
+
+void MainApp::RunOnWorker(unsigned int worker,
+                          const std::function<void()>& task) {
+  std::promise<void> done;
+  io_services_[worker]->post([&task, &done]() {
+    task();
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+void MainApp::WaitForSignal() {
+  signals_.async_wait([this](const ec_type& ec, int signal_number) {
+    if (ec) {
+      return;
+    }
+    THESTRAL_LOG_INFO(LOG, "received signal %d", signal_number);
+    if (signal_number == SIGHUP) {
+      if (!is_draining_) {
+        Reload();
+      }
+    } else if (signal_number == SIGUSR1) {
+      DumpTraces();
+    } else if (signal_number == SIGUSR2) {
+      if (!is_draining_) {
+        Handoff();
+      }
+    } else {
+      StartDrain();
+    }
+    if (!control_service_.stopped()) {
+      WaitForSignal();
+    }
+  });
+}
+
+void MainApp::DumpTraces() {
+  auto file_name =
+      config_.get<std::string>("trace.dump_file", "/tmp/thestral.traces");
+  std::ofstream file(file_name, std::ios::trunc);
+  file << trace::RenderText();
+  if (!file) {
+    LOG.Error("failed to dump the traces to %s", file_name.c_str());
+    return;
+  }
+  THESTRAL_LOG_INFO(LOG, "traces dumped to %s", file_name.c_str());
+}
+
+void MainApp::Reload() {
+  THESTRAL_LOG_INFO(LOG, "reloading %s", config_file_name_.c_str());
+  pt::ptree config;
+  std::vector<Listener> listeners;
+  std::chrono::seconds drain_timeout;
+  unsigned int trace_sampling;
+  try {
+    config = LoadConfigOrDie(config_file_name_);
+    listeners = MakeListeners(config);
+    drain_timeout = GetDrainTimeoutOrDie(config);
+    trace_sampling = GetTraceSamplingOrDie(config);
+  } catch (const std::exception& e) {
+    LOG.Error("failed to reload the config, keeping the current one: %s",
+              e.what());
+    return;
+  }
+
+  // The new servers take over the listening sockets of the old ones on the
+  // same endpoints. A server failing to start leaves the old one in place.
+  std::vector<Listener> old_listeners;
+  old_listeners.swap(listeners_);
+  std::vector<bool> is_started(listeners.size(), false);
+  std::vector<bool> is_kept(old_listeners.size(), false);
+  for (unsigned int worker = 0; worker < io_services_.size(); ++worker) {
+    RunOnWorker(worker, [&, worker]() {
+      for (std::size_t i = 0; i < listeners.size(); ++i) {
+        const auto& listener = listeners[i];
+        if (listener.worker != worker) {
+          continue;
+        }
+        auto old = std::find_if(
+            old_listeners.cbegin(), old_listeners.cend(),
+            [&listener](const Listener& old_listener) {
+              return old_listener.worker == listener.worker &&
+                     old_listener.address == listener.address &&
+                     old_listener.port == listener.port;
+            });
+        if (old != old_listeners.cend()) {
+          std::vector<int> sockets;
+          for (auto fd : old->transport_factory->GetListeningSockets()) {
+            auto new_fd = dup(fd);
+            if (new_fd >= 0) {
+              sockets.push_back(new_fd);
+            }
+          }
+          listener.transport_factory->AdoptListeningSockets(sockets);
+        }
+        try {
+          listener.server->Start();
+          is_started[i] = true;
+        } catch (const std::exception& e) {
+          LOG.Error("failed to start the server on %s, port: %u, reason: %s",
+                    listener.address.c_str(), listener.port, e.what());
+          listener.transport_factory->StopAccepting();
+          if (old != old_listeners.cend()) {
+            is_kept[static_cast<std::size_t>(old - old_listeners.cbegin())] =
+                true;
+          }
+        }
+      }
+      for (std::size_t i = 0; i < old_listeners.size(); ++i) {
+        if (old_listeners[i].worker == worker && !is_kept[i]) {
+          old_listeners[i].server->Stop();
+        }
+      }
+    });
+  }
+
+  for (std::size_t i = 0; i < old_listeners.size(); ++i) {
+    // moved, so that the retired ones are released only on their workers
+    if (is_kept[i]) {
+      listeners_.push_back(std::move(old_listeners[i]));
+    } else {
+      retired_listeners_.push_back(std::move(old_listeners[i]));
+    }
+  }
+  CheckRetired();
+  for (std::size_t i = 0; i < listeners.size(); ++i) {
+    if (is_started[i]) {
+      listeners_.push_back(listeners[i]);
+    }
+  }
+  config_ = config;
+  drain_timeout_ = drain_timeout;
+  trace::SetSampling(trace_sampling);
+  THESTRAL_LOG_INFO(LOG, "config reloaded");
+}
+
+void MainApp::Handoff() {
+  // a config the new process can't load would leave nothing accepting
+  try {
+    MakeListeners(LoadConfigOrDie(config_file_name_));
+  } catch (const std::exception& e) {
+    LOG.Error("not handing off to a new process, bad config: %s", e.what());
+    return;
+  }
+
+  SocketMap sockets;
+  for (unsigned int worker = 0; worker < io_services_.size(); ++worker) {
+    RunOnWorker(worker, [this, worker, &sockets]() {
+      for (const auto& listener : listeners_) {
+        if (listener.worker != worker) {
+          continue;
+        }
+        auto& endpoint_sockets =
+            sockets[std::make_pair(listener.address, listener.port)];
+        for (auto fd : listener.transport_factory->GetListeningSockets()) {
+          endpoint_sockets.push_back(fd);
+        }
+      }
+    });
+  }
+
+  // everything is prepared before forking, where only async-signal-safe calls
+  // are allowed
+  std::vector<int> kept;
+  for (const auto& entry : sockets) {
+    kept.insert(kept.end(), entry.second.cbegin(), entry.second.cend());
+  }
+  std::sort(kept.begin(), kept.end());
+  std::vector<std::string> environment;
+  std::string variable_prefix = std::string(kListenSocketsVariable) + '=';
+  for (auto variable = environ; *variable; ++variable) {
+    if (std::strncmp(*variable, variable_prefix.c_str(),
+                     variable_prefix.size()) != 0) {
+      environment.push_back(*variable);
+    }
+  }
+  environment.push_back(variable_prefix + FormatSockets(sockets));
+
+  // An exec failing sends its errno back, and the new process sends 0 once
+  // its servers have started. The pipe closing before either means that the
+  // new process has died.
+  int status_pipe[2];
+  if (pipe2(status_pipe, O_CLOEXEC) != 0) {
+    LOG.Error("failed to start a new process, reason: %s",
+              std::strerror(errno));
+    return;
+  }
+  environment.push_back(std::string(kReadyPipeVariable) + '=' +
+                        std::to_string(status_pipe[1]));
+  std::vector<char*> argv;
+  for (const auto& arg : command_line_) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  std::vector<char*> envp;
+  for (const auto& variable : environment) {
+    envp.push_back(const_cast<char*>(variable.c_str()));
+  }
+  envp.push_back(nullptr);
+  auto max_fd = static_cast<int>(sysconf(_SC_OPEN_MAX));
+
+  auto kept_fds = kept;
+  kept_fds.insert(
+      std::upper_bound(kept_fds.begin(), kept_fds.end(), status_pipe[1]),
+      status_pipe[1]);
+  max_fd = std::max(max_fd, kept_fds.back() + 1);
+
+  auto pid = fork();
+  if (pid == 0) {
+    for (auto fd : kept_fds) {
+      fcntl(fd, F_SETFD, 0);
+    }
+    CloseFdsExcept(kept_fds, max_fd);
+    execve(executable_.c_str(), argv.data(), envp.data());
+    int exec_errno = errno;
+    ssize_t n_written = write(status_pipe[1], &exec_errno, sizeof(exec_errno));
+    (void)n_written;
+    _exit(127);
+  }
+  close(status_pipe[1]);
+  if (pid < 0) {
+    LOG.Error("failed to start a new process, reason: %s",
+              std::strerror(errno));
+    close(status_pipe[0]);
+    return;
+  }
+  int child_status = 0;
+  ssize_t n_read = -1;
+  pollfd ready = {status_pipe[0], POLLIN, 0};
+  auto timeout = std::chrono::milliseconds(kHandoffTimeout).count();
+  int n_ready;
+  do {
+    n_ready = poll(&ready, 1, static_cast<int>(timeout));
+  } while (n_ready < 0 && errno == EINTR);
+  if (n_ready > 0) {
+    do {
+      n_read = read(status_pipe[0], &child_status, sizeof(child_status));
+    } while (n_read < 0 && errno == EINTR);
+  }
+  close(status_pipe[0]);
+  if (n_read != sizeof(child_status) || child_status != 0) {
+    if (n_ready == 0) {
+      LOG.Error("process %d not ready in %lld seconds, killing it",
+                static_cast<int>(pid),
+                static_cast<long long>(kHandoffTimeout.count()));
+      kill(pid, SIGKILL);
+    } else if (n_read == sizeof(child_status)) {
+      LOG.Error("failed to start a new process, reason: %s",
+                std::strerror(child_status));
+    } else {
+      LOG.Error("process %d exited before starting its servers",
+                static_cast<int>(pid));
+    }
+    waitpid(pid, nullptr, 0);
+    return;
+  }
+  THESTRAL_LOG_INFO(LOG, "started process %d with %zu listening sockets",
+                    static_cast<int>(pid), kept.size());
+  StartDrain();
+}
+
+void MainApp::StartDrain() {
+  if (is_draining_) {
+    THESTRAL_LOG_INFO(LOG, "exiting without waiting for the sessions");
+    Exit();
+    return;
+  }
+  is_draining_ = true;
+  THESTRAL_LOG_INFO(LOG, "draining, waiting up to %lld seconds for sessions",
+                    static_cast<long long>(drain_timeout_.count()));
+  for (unsigned int worker = 0; worker < io_services_.size(); ++worker) {
+    RunOnWorker(worker, [this, worker]() {
+      for (const auto& listener : listeners_) {
+        if (listener.worker == worker) {
+          listener.server->Stop();
+        }
+      }
+    });
+  }
+  drain_deadline_ = std::chrono::steady_clock::now() + drain_timeout_;
+  CheckDrained();
+}
+
+void MainApp::CheckDrained() {
+  std::size_t n_sessions = 0;
+  for (const auto& listener : listeners_) {
+    n_sessions += listener.server->CountSessions();
+  }
+  for (const auto& listener : retired_listeners_) {
+    n_sessions += listener.server->CountSessions();
+  }
+  if (n_sessions == 0) {
+    THESTRAL_LOG_INFO(LOG, "all sessions ended, exiting");
+    Exit();
+    return;
+  }
+  if (std::chrono::steady_clock::now() >= drain_deadline_) {
+    LOG.Warn("drain timeout reached, exiting with %zu sessions left",
+             n_sessions);
+    Exit();
+    return;
+  }
+  drain_timer_.expires_from_now(std::chrono::milliseconds(100));
+  drain_timer_.async_wait([this](const ec_type& ec) {
+    if (!ec) {
+      CheckDrained();
+    }
+  });
+}
+
+void MainApp::CheckRetired() {
+  for (auto iter = retired_listeners_.begin();
+       iter != retired_listeners_.end();) {
+    if (iter->server->CountSessions() != 0) {
+      ++iter;
+      continue;
+    }
+    // released on its worker, together with its upstreams and their health
+    // checks
+    RunOnWorker(iter->worker, [&iter]() {
+      iter->server.reset();
+      iter->transport_factory.reset();
+    });
+    iter = retired_listeners_.erase(iter);
+  }
+  if (retired_listeners_.empty()) {
+    return;
+  }
+  retire_timer_.expires_from_now(std::chrono::seconds(1));
+  retire_timer_.async_wait([this](const ec_type& ec) {
+    if (!ec) {
+      CheckRetired();
+    }
+  });
+}
+
+void MainApp::Exit() {
+  works_.clear();
+  for (const auto& io_service_ptr : io_services_) {
+    io_service_ptr->stop();
+  }
+  ec_type ec;
+  signals_.cancel(ec);
+  drain_timer_.cancel(ec);
+  retire_timer_.cancel(ec);
+  control_service_.stop();
 }
 
 void MainApp::SetUpLoggingOrDie() const {
@@ -176,8 +1307,29 @@ void MainApp::SetUpLoggingOrDie() const {
     return;
   }
 
+  bool async = false;
+  logging::AsyncOptions async_options;
   for (auto& sink : iter->second) {
-    if (sink.first == "stderr") {
+    if (sink.first == "async") {
+      // not a sink, but how records are stored into the sinks
+      async = true;
+      auto queue_size = sink.second.get<int>("queue_size", 8192);
+      auto flush_interval = sink.second.get<int>("flush_interval", 1000);
+      if (queue_size <= 0 || flush_interval <= 0) {
+        DieOf("invalid queue_size or flush_interval of async logging");
+      }
+      async_options.queue_size = static_cast<std::size_t>(queue_size);
+      async_options.flush_interval = std::chrono::milliseconds(flush_interval);
+      auto overflow = sink.second.get<std::string>("overflow", "drop");
+      if (overflow == "drop") {
+        async_options.overflow_policy = logging::OverflowPolicy::DROP;
+      } else if (overflow == "block") {
+        async_options.overflow_policy = logging::OverflowPolicy::BLOCK;
+      } else {
+        DieOf("unknown overflow policy of async logging: ", overflow);
+      }
+
+    } else if (sink.first == "stderr") {
       logging::add_stderr_log_sink().SetLevel(
           ParseLevelOrDie(sink.second.data()));
 
@@ -208,6 +1360,10 @@ void MainApp::SetUpLoggingOrDie() const {
       DieOf("unknown log sink: ", sink.first);
     }
   }
+
+  if (async) {
+    logging::start_async_logging(async_options);
+  }
 }
 
 }  // namespace thestral
@@ -0,0 +1,229 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Implements the metrics.
+#include "metrics.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+
+namespace thestral {
+namespace metrics {
+
+namespace impl {
+
+namespace {
+
+struct SlotsRegistry {
+  std::mutex mutex;
+  std::vector<ThreadSlots*> threads;
+};
+
+SlotsRegistry& GetSlotsRegistry() {
+  static SlotsRegistry registry;
+  return registry;
+}
+
+struct MetricsRegistry {
+  std::mutex mutex;
+  std::vector<const MetricBase*> metrics;
+  std::size_t n_slots = 0;
+};
+
+MetricsRegistry& GetMetricsRegistry() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+}  // namespace
+
+thread_local ThreadSlots* t_slots = nullptr;
+
+ThreadSlots* NewThreadSlots() {
+  auto slots = new ThreadSlots();  // zero-initialized
+  auto& registry = GetSlotsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.threads.push_back(slots);
+  return slots;
+}
+
+uint64_t Sum(std::size_t slot) {
+  auto& registry = GetSlotsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  uint64_t sum = 0;
+  for (auto slots : registry.threads) {
+    sum += slots->values[slot].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+namespace {
+
+std::size_t AllocateSlots(MetricsRegistry& registry, std::size_t n) {
+  if (registry.n_slots + n > kMaxSlots) {
+    throw std::logic_error("too many metrics");
+  }
+  auto first_slot = registry.n_slots;
+  registry.n_slots += n;
+  return first_slot;
+}
+
+std::size_t RegisterMetric(const MetricBase* metric, std::size_t n_slots) {
+  auto& registry = GetMetricsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  auto first_slot = AllocateSlots(registry, n_slots);
+  registry.metrics.push_back(metric);
+  return first_slot;
+}
+
+}  // namespace
+
+MetricBase::MetricBase(const std::string& name, const std::string& help,
+                       const std::string& labels, std::size_t n_slots)
+    : name_(name),
+      help_(help),
+      labels_(labels),
+      first_slot_(RegisterMetric(this, n_slots)) {}
+
+std::string MetricBase::FormatLabels(const std::string& extra) const {
+  if (labels_.empty() && extra.empty()) {
+    return std::string();
+  }
+  std::string result = "{" + labels_;
+  if (!labels_.empty() && !extra.empty()) {
+    result += ',';
+  }
+  return result + extra + "}";
+}
+
+}  // namespace impl
+
+namespace {
+
+std::string FormatDouble(double value) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%.9g", value);
+  return buf;
+}
+
+void AppendSample(std::string* out, const std::string& name,
+                  const std::string& labels, const std::string& value) {
+  out->append(name).append(labels).append(" ").append(value).append("\n");
+}
+
+}  // namespace
+
+void Counter::Render(std::string* out) const {
+  AppendSample(out, name_, FormatLabels(), std::to_string(GetValue()));
+}
+
+std::shared_ptr<void> Gauge::Track() const {
+  Increment();
+  return std::shared_ptr<void>(nullptr,
+                               [this](void*) { Decrement(); });
+}
+
+int64_t Gauge::GetValue() const {
+  // reads the decrements first so that the result is never negative
+  auto n_decrements = impl::Sum(first_slot_ + 1);
+  auto n_increments = impl::Sum(first_slot_);
+  return static_cast<int64_t>(n_increments - n_decrements);
+}
+
+void Gauge::Render(std::string* out) const {
+  AppendSample(out, name_, FormatLabels(), std::to_string(GetValue()));
+}
+
+Histogram::Histogram(const std::string& name, const std::string& help,
+                     const std::vector<double>& bounds,
+                     const std::string& labels)
+    : MetricBase(name, help, labels, bounds.size() + 2), bounds_(bounds) {
+  for (auto bound : bounds_) {
+    bounds_ns_.push_back(static_cast<uint64_t>(bound * 1e9));
+  }
+}
+
+std::vector<double> Histogram::LatencyBounds() {
+  return {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+          0.25,  0.5,    1,     2.5,  5,    10};
+}
+
+void Histogram::Observe(ClockType::duration duration) const {
+  auto ns = static_cast<uint64_t>(std::max<int64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+      0));
+  auto bucket = static_cast<std::size_t>(
+      std::lower_bound(bounds_ns_.cbegin(), bounds_ns_.cend(), ns) -
+      bounds_ns_.cbegin());
+  impl::Add(first_slot_ + bucket, 1);
+  impl::Add(first_slot_ + bounds_.size() + 1, ns);
+}
+
+uint64_t Histogram::GetCount() const {
+  uint64_t count = 0;
+  for (std::size_t i = 0; i <= bounds_.size(); ++i) {
+    count += impl::Sum(first_slot_ + i);
+  }
+  return count;
+}
+
+void Histogram::Render(std::string* out) const {
+  uint64_t count = 0;
+  for (std::size_t i = 0; i <= bounds_.size(); ++i) {
+    count += impl::Sum(first_slot_ + i);
+    auto le = i < bounds_.size() ? FormatDouble(bounds_[i]) : "+Inf";
+    AppendSample(out, name_ + "_bucket", FormatLabels("le=\"" + le + "\""),
+                 std::to_string(count));
+  }
+  auto sum_ns = impl::Sum(first_slot_ + bounds_.size() + 1);
+  AppendSample(out, name_ + "_sum", FormatLabels(), FormatDouble(sum_ns / 1e9));
+  AppendSample(out, name_ + "_count", FormatLabels(), std::to_string(count));
+}
+
+std::string RenderText() {
+  std::vector<const impl::MetricBase*> metrics;
+  {
+    auto& registry = impl::GetMetricsRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    metrics = registry.metrics;
+  }
+  // metrics of the same name must be grouped together
+  std::stable_sort(
+      metrics.begin(), metrics.end(),
+      [](const impl::MetricBase* lhs, const impl::MetricBase* rhs) {
+        return lhs->GetName() < rhs->GetName();
+      });
+
+  std::string result;
+  const std::string* last_name = nullptr;
+  for (auto metric : metrics) {
+    if (!last_name || *last_name != metric->GetName()) {
+      last_name = &metric->GetName();
+      result.append("# HELP ").append(*last_name).append(" ")
+          .append(metric->GetHelp()).append("\n");
+      result.append("# TYPE ").append(*last_name).append(" ")
+          .append(metric->GetType()).append("\n");
+    }
+    metric->Render(&result);
+  }
+  return result;
+}
+
+}  // namespace metrics
+}  // namespace thestral
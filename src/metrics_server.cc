@@ -0,0 +1,133 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Implements the HTTP server exposing the metrics.
+#include "metrics_server.h"
+
+#include <array>
+#include <functional>
+
+#include "metrics.h"
+#include "trace.h"
+
+namespace thestral {
+
+namespace ip = boost::asio::ip;
+using namespace std::placeholders;
+
+logging::Logger MetricsServer::LOG("MetricsServer");
+
+constexpr std::size_t MetricsServer::kMaxRequestSize;
+
+void MetricsServer::Start() {
+  ip::tcp::resolver resolver(*transport_factory_->get_io_service_ptr());
+  auto query_flags = ip::tcp::resolver::query::address_configured |
+                     ip::tcp::resolver::query::numeric_service |
+                     ip::tcp::resolver::query::passive;
+  THESTRAL_LOG_INFO(LOG, "start serving metrics on %s, port: %u",
+                    bind_address_.c_str(), bind_port_);
+  ip::tcp::resolver::query query(bind_address_, std::to_string(bind_port_),
+                                 query_flags);
+  ec_type error_code;
+  auto iter = resolver.resolve(query, error_code);
+  if (error_code) {
+    LOG.Error("failed to resolve address %s, port: %u, reason: %s",
+              bind_address_.c_str(), bind_port_, error_code.message().c_str());
+    return;
+  }
+
+  transport_factory_->StartAccept(
+      *iter, std::bind(&MetricsServer::HandleNewConnection, shared_from_this(),
+                       _1, _2));
+}
+
+bool MetricsServer::HandleNewConnection(
+    const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+  if (ec == boost::asio::error::operation_aborted) {
+    return false;  // stopped
+  }
+  if (ec) {
+    LOG.Error("failed to accept a new connection, reason: %s",
+              ec.message().c_str());
+    return true;
+  }
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] new metrics request from %s",
+                     transport->GetId(),
+                     transport->GetRemoteAddress().Format().c_str());
+  ReceiveRequest(transport, std::make_shared<std::string>());
+  return true;
+}
+
+void MetricsServer::ReceiveRequest(
+    const std::shared_ptr<TransportBase>& transport,
+    const std::shared_ptr<std::string>& request) {
+  auto buf = std::make_shared<std::array<char, 1024>>();
+  auto self = shared_from_this();
+  transport->StartRead(
+      *buf,
+      [self, transport, request, buf](const ec_type& ec, std::size_t n_read) {
+        if (ec) {
+          LOG.Warn("[%llX] failed to receive metrics request, reason: %s",
+                   transport->GetId(), ec.message().c_str());
+          transport->StartClose();
+          return;
+        }
+        request->append(buf->data(), n_read);
+        if (request->find("\r\n\r\n") != std::string::npos) {
+          self->HandleRequest(transport, *request);
+        } else if (request->size() >= kMaxRequestSize) {
+          LOG.Warn("[%llX] metrics request too large", transport->GetId());
+          transport->StartClose();
+        } else {
+          self->ReceiveRequest(transport, request);
+        }
+      },
+      true);
+}
+
+void MetricsServer::HandleRequest(
+    const std::shared_ptr<TransportBase>& transport,
+    const std::string& request) {
+  std::string status = "200 OK";
+  std::string body;
+  // only the request line matters, e.g. "GET /metrics HTTP/1.1"
+  auto line = request.substr(0, request.find("\r\n"));
+  if (line.compare(0, 13, "GET /metrics ") == 0 || line == "GET /metrics") {
+    body = metrics::RenderText();
+  } else if (line.compare(0, 12, "GET /traces ") == 0 ||
+             line == "GET /traces") {
+    body = trace::RenderText();
+  } else {
+    status = "404 Not Found";
+    body = "not found\n";
+  }
+
+  auto response = std::make_shared<std::string>("HTTP/1.0 " + status + "\r\n");
+  response->append("Content-Type: text/plain; version=0.0.4\r\n");
+  response->append("Content-Length: " + std::to_string(body.size()) + "\r\n");
+  response->append("Connection: close\r\n\r\n");
+  response->append(body);
+  transport->StartWrite(
+      *response, [transport, response](const ec_type& ec, std::size_t) {
+        if (ec) {
+          LOG.Warn("[%llX] failed to send metrics response, reason: %s",
+                   transport->GetId(), ec.message().c_str());
+        }
+        transport->StartClose();
+      });
+}
+
+}  // namespace thestral
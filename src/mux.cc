@@ -0,0 +1,707 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the multiplexing protocol.
+#include "mux.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "metrics.h"
+#include "socks.h"
+
+namespace thestral {
+namespace mux {
+
+namespace asio = boost::asio;
+
+namespace {
+
+const metrics::Gauge kActiveSessions(
+    "thestral_mux_sessions_active",
+    "Number of multiplexed sessions currently established.");
+const metrics::Gauge kActiveStreams(
+    "thestral_mux_streams_active",
+    "Number of streams currently open on multiplexed sessions.");
+
+/// Size of the reading buffer, which holds at least a frame of maximum size.
+constexpr std::size_t kReadBufferSize = 64 * 1024;
+/// Consumed bytes are announced to the peer once there are this many of them.
+constexpr uint32_t kWindowUpdateThreshold = MuxSession::kInitialWindow / 4;
+
+uint32_t DecodeUint32(const char* data) {
+  auto bytes = reinterpret_cast<const unsigned char*>(data);
+  return static_cast<uint32_t>(bytes[0]) << 24 |
+         static_cast<uint32_t>(bytes[1]) << 16 |
+         static_cast<uint32_t>(bytes[2]) << 8 | static_cast<uint32_t>(bytes[3]);
+}
+
+void EncodeUint32(uint32_t value, char* data) {
+  data[0] = static_cast<char>(value >> 24);
+  data[1] = static_cast<char>(value >> 16);
+  data[2] = static_cast<char>(value >> 8);
+  data[3] = static_cast<char>(value);
+}
+
+}  // anonymous namespace
+
+constexpr std::size_t FrameHeader::kSize;
+
+void FrameHeader::FromBytes(const char* data) {
+  auto bytes = reinterpret_cast<const unsigned char*>(data);
+  type = static_cast<FrameType>(bytes[0]);
+  length = static_cast<uint16_t>(bytes[2] << 8 | bytes[3]);
+  stream_id = DecodeUint32(data + 4);
+}
+
+void FrameHeader::ToBytes(char* data) const {
+  data[0] = static_cast<char>(type);
+  data[1] = 0;
+  data[2] = static_cast<char>(length >> 8);
+  data[3] = static_cast<char>(length);
+  EncodeUint32(stream_id, data + 4);
+}
+
+MuxStream::MuxStream(const std::shared_ptr<MuxSession>& session,
+                     uint32_t stream_id, bool expect_response)
+    : session_(session),
+      stream_id_(stream_id),
+      active_token_(kActiveStreams.Track()),
+      recv_window_(MuxSession::kInitialWindow),
+      expect_response_(expect_response),
+      send_window_(MuxSession::kInitialWindow) {}
+
+MuxStream::~MuxStream() { Detach(!(fin_sent_ && fin_received_)); }
+
+Address MuxStream::GetLocalAddress() const { return session_->local_address_; }
+
+Address MuxStream::GetRemoteAddress() const {
+  return session_->remote_address_;
+}
+
+void MuxStream::StartRead(const asio::mutable_buffers_1& buf,
+                          const ReadCallbackType& callback,
+                          bool allow_short_read) {
+  read_buf_ = buf;
+  n_read_ = 0;
+  allow_short_read_ = allow_short_read;
+  read_callback_ = callback;
+  ContinueRead();
+}
+
+void MuxStream::StartWrite(const asio::const_buffers_1& buf,
+                           const WriteCallbackType& callback) {
+  if (error_ || fin_sent_) {
+    auto ec = error_ ? error_ : asio::error::shut_down;
+    session_->io_service_ptr_->post([callback, ec]() { callback(ec, 0); });
+    return;
+  }
+  write_data_ = asio::buffer_cast<const char*>(buf);
+  write_size_ = asio::buffer_size(buf);
+  n_framed_ = 0;
+  if (write_size_ == 0) {
+    session_->io_service_ptr_->post([callback]() { callback(ec_type(), 0); });
+    return;
+  }
+  write_callback_ = callback;
+  ContinueWrite();
+}
+
+void MuxStream::StartWaitReadable(const WaitCallbackType& callback) {
+  wait_callback_ = callback;
+  NotifyReadable();
+}
+
+void MuxStream::StartClose(const CloseCallbackType& callback) {
+  if (!is_closed_) {
+    is_closed_ = true;
+    Detach(!(fin_sent_ && fin_received_));
+    HandleError(asio::error::operation_aborted);
+  }
+  session_->io_service_ptr_->post([callback]() { callback(ec_type()); });
+}
+
+void MuxStream::StartShutdownSend(const CloseCallbackType& callback) {
+  ec_type ec;
+  if (error_) {
+    ec = error_;
+  } else if (write_callback_) {
+    // the rest of the pending write would follow the end of stream
+    ec = asio::error::in_progress;
+  } else if (!fin_sent_) {
+    fin_sent_ = true;
+    session_->SendFrame(FrameType::kFin, stream_id_, nullptr, 0, callback);
+    return;
+  }
+  session_->io_service_ptr_->post([callback, ec]() { callback(ec); });
+}
+
+void MuxStream::SendInitialData(const std::string& data) {
+  for (std::size_t offset = 0; offset < data.size();) {
+    auto n = std::min(data.size() - offset, MuxSession::kMaxFramePayload);
+    session_->SendFrame(FrameType::kData, stream_id_, data.data() + offset, n);
+    send_window_ -= static_cast<uint32_t>(n);
+    offset += n;
+  }
+}
+
+bool MuxStream::HandleData(const char* data, std::size_t size) {
+  if (fin_received_ || size > recv_window_) {
+    return false;
+  }
+  recv_window_ -= static_cast<uint32_t>(size);
+  if (error_) {
+    return true;
+  }
+  if (expect_response_) {
+    response_buf_.append(data, size);
+    ParseResponse();
+    return true;
+  }
+  recv_chunks_.emplace_back(data, size);
+  recv_size_ += size;
+  ContinueRead();
+  NotifyReadable();
+  return true;
+}
+
+void MuxStream::HandleFin() {
+  fin_received_ = true;
+  if (expect_response_) {
+    MuxSession::LOG.Error("[%llX] stream %u ended without a response",
+                          session_->GetId(), stream_id_);
+    Abort(asio::error::connection_reset);
+    return;
+  }
+  ContinueRead();
+  NotifyReadable();
+}
+
+void MuxStream::HandleWindowUpdate(uint32_t increment) {
+  send_window_ += increment;
+  ContinueWrite();
+}
+
+void MuxStream::HandleError(const ec_type& ec) {
+  if (error_) {
+    return;
+  }
+  error_ = ec;
+  recv_chunks_.clear();
+  recv_offset_ = 0;
+  recv_size_ = 0;
+  if (read_callback_) {
+    CompleteRead(ec);
+  }
+  NotifyReadable();
+  if (write_callback_) {
+    WriteCallbackType callback;
+    callback.swap(write_callback_);
+    session_->io_service_ptr_->post([callback, ec]() { callback(ec, 0); });
+  }
+}
+
+void MuxStream::ParseResponse() {
+  socks::ResponsePacket response;
+  std::size_t n_consumed = 0;
+  auto result = response.ParseFrom(response_buf_.data(), response_buf_.size(),
+                                   &n_consumed);
+  if (result == ParseResult::kIncomplete) {
+    return;
+  }
+  expect_response_ = false;
+  if (result == ParseResult::kInvalid) {
+    MuxSession::LOG.Error("[%llX] stream %u got an invalid response",
+                          session_->GetId(), stream_id_);
+    Abort(boost::system::errc::make_error_code(
+        boost::system::errc::protocol_error));
+    return;
+  }
+  auto response_code = response.header.response_code;
+  if (response_code != socks::ResponseCode::kSuccess) {
+    MuxSession::LOG.Error("[%llX] stream %u got response: %s",
+                          session_->GetId(), stream_id_,
+                          to_string(response_code).c_str());
+    Abort(socks::error::make_error_code(response_code));
+    return;
+  }
+
+  Consume(n_consumed);
+  if (n_consumed < response_buf_.size()) {
+    recv_chunks_.emplace_back(response_buf_, n_consumed);
+    recv_size_ += response_buf_.size() - n_consumed;
+  }
+  std::string().swap(response_buf_);
+  ContinueRead();
+  NotifyReadable();
+}
+
+void MuxStream::ContinueRead() {
+  if (!read_callback_) {
+    return;
+  }
+  auto data = asio::buffer_cast<char*>(read_buf_);
+  auto size = asio::buffer_size(read_buf_);
+  std::size_t n_copied = 0;
+  while (n_read_ < size && recv_size_ > 0) {
+    const auto& chunk = recv_chunks_.front();
+    auto n = std::min(size - n_read_, chunk.size() - recv_offset_);
+    std::memcpy(data + n_read_, chunk.data() + recv_offset_, n);
+    n_read_ += n;
+    n_copied += n;
+    recv_offset_ += n;
+    recv_size_ -= n;
+    if (recv_offset_ == chunk.size()) {
+      recv_chunks_.pop_front();
+      recv_offset_ = 0;
+    }
+  }
+  Consume(n_copied);
+
+  if (n_read_ == size || (allow_short_read_ && n_read_ > 0)) {
+    CompleteRead(ec_type());
+  } else if (error_) {
+    CompleteRead(error_);
+  } else if (fin_received_ && !expect_response_) {
+    CompleteRead(asio::error::eof);
+  }
+}
+
+void MuxStream::ContinueWrite() {
+  while (write_callback_ && n_framed_ < write_size_ && send_window_ > 0) {
+    auto n = std::min({write_size_ - n_framed_,
+                       static_cast<std::size_t>(send_window_),
+                       MuxSession::kMaxFramePayload});
+    auto offset = n_framed_;
+    send_window_ -= static_cast<uint32_t>(n);
+    n_framed_ += n;
+    MuxSession::SentCallbackType on_sent;
+    if (n_framed_ == write_size_) {
+      // the write completes when its last frame has been written out
+      auto self = shared_from_this();
+      on_sent = [self](const ec_type& ec) {
+        WriteCallbackType callback;
+        callback.swap(self->write_callback_);
+        if (callback) {
+          callback(ec, ec ? 0 : self->write_size_);
+        }
+      };
+    }
+    session_->SendFrame(FrameType::kData, stream_id_, write_data_ + offset, n,
+                        on_sent);
+  }
+}
+
+void MuxStream::NotifyReadable() {
+  if (wait_callback_ && (recv_size_ > 0 || fin_received_ || error_)) {
+    WaitCallbackType callback;
+    callback.swap(wait_callback_);
+    auto ec = error_;
+    session_->io_service_ptr_->post([callback, ec]() { callback(ec); });
+  }
+}
+
+void MuxStream::Consume(std::size_t n_bytes) {
+  recv_consumed_ += static_cast<uint32_t>(n_bytes);
+  if (recv_consumed_ >= kWindowUpdateThreshold && !fin_received_ &&
+      !is_detached_) {
+    char payload[4];
+    EncodeUint32(recv_consumed_, payload);
+    session_->SendFrame(FrameType::kWindowUpdate, stream_id_, payload,
+                        sizeof(payload));
+    recv_window_ += recv_consumed_;
+    recv_consumed_ = 0;
+  }
+}
+
+void MuxStream::CompleteRead(const ec_type& ec) {
+  ReadCallbackType callback;
+  callback.swap(read_callback_);
+  auto n_read = n_read_;
+  session_->io_service_ptr_->post(
+      [callback, ec, n_read]() { callback(ec, n_read); });
+}
+
+void MuxStream::Abort(const ec_type& ec) {
+  Detach(true);
+  HandleError(ec);
+}
+
+void MuxStream::Detach(bool reset) {
+  if (!is_detached_) {
+    is_detached_ = true;
+    session_->RemoveStream(stream_id_, reset);
+  }
+}
+
+logging::Logger MuxSession::LOG("MuxSession");
+
+constexpr uint32_t MuxSession::kInitialWindow;
+constexpr std::size_t MuxSession::kMaxFramePayload;
+constexpr uint32_t MuxSession::kMaxStreamId;
+const char MuxSession::kPreface[8] = {'T', 'H', 'S', 'T', 'M', 'U', 'X', '1'};
+
+MuxSession::MuxSession(
+    const std::shared_ptr<TransportBase>& transport,
+    const std::shared_ptr<asio::io_service>& io_service_ptr,
+    const AcceptCallbackType& accept_callback)
+    : transport_(transport),
+      io_service_ptr_(io_service_ptr),
+      accept_callback_(accept_callback),
+      active_token_(kActiveSessions.Track()),
+      local_address_(transport->GetLocalAddress()),
+      remote_address_(transport->GetRemoteAddress()),
+      preface_received_(!accept_callback),
+      read_buf_(kReadBufferSize) {}
+
+void MuxSession::Start() {
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] starting %s session", GetId(),
+                     accept_callback_ ? "server" : "client");
+  if (!accept_callback_) {
+    pending_.assign(kPreface, sizeof(kPreface));
+    DoWrite();
+    if (ping_interval_ != TimingWheel::ClockType::duration::zero()) {
+      StartPingTimer();
+    }
+  }
+  DoRead();
+}
+
+void MuxSession::Close() { HandleError(asio::error::operation_aborted); }
+
+void MuxSession::GoAway() {
+  if (!accept_callback_ || is_going_away_ || is_closed_) {
+    return;
+  }
+  THESTRAL_LOG_INFO(LOG, "[%llX] session going away with %zu streams open",
+                    GetId(), streams_.size());
+  // both ends close the session once its streams are gone
+  is_going_away_ = true;
+  SendFrame(FrameType::kGoAway, 0, nullptr, 0);
+  CloseIfDrained();
+}
+
+std::shared_ptr<MuxStream> MuxSession::OpenStream(
+    const std::string& initial_data) {
+  auto stream_id = next_stream_id_;
+  next_stream_id_ += 2;  // client-initiated ids are odd
+  std::shared_ptr<MuxStream> stream(
+      new MuxStream(shared_from_this(), stream_id, true));
+  if (is_closed_ || is_going_away_ || stream_id > kMaxStreamId) {
+    stream->is_detached_ = true;
+    stream->HandleError(asio::error::not_connected);
+    return stream;
+  }
+
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] opening stream %u", GetId(), stream_id);
+  streams_[stream_id] = stream;
+  SendFrame(FrameType::kOpen, stream_id, nullptr, 0);
+  stream->SendInitialData(initial_data);
+  return stream;
+}
+
+void MuxSession::SendFrame(FrameType type, uint32_t stream_id,
+                           const char* payload, std::size_t size,
+                           const SentCallbackType& callback) {
+  if (is_closed_) {
+    if (callback) {
+      io_service_ptr_->post(
+          [callback]() { callback(asio::error::operation_aborted); });
+    }
+    return;
+  }
+  FrameHeader header;
+  header.type = type;
+  header.length = static_cast<uint16_t>(size);
+  header.stream_id = stream_id;
+  auto offset = pending_.size();
+  pending_.resize(offset + FrameHeader::kSize);
+  header.ToBytes(&pending_[offset]);
+  if (size > 0) {
+    pending_.append(payload, size);
+  }
+  if (callback) {
+    pending_callbacks_.push_back(callback);
+  }
+  DoWrite();
+}
+
+void MuxSession::DoWrite() {
+  if (is_writing_ || is_closed_ || pending_.empty()) {
+    return;
+  }
+  // everything queued so far goes out in a single write
+  is_writing_ = true;
+  writing_.swap(pending_);
+  pending_.clear();
+  writing_callbacks_.swap(pending_callbacks_);
+  pending_callbacks_.clear();
+  auto self = shared_from_this();
+  transport_->StartWrite(
+      asio::buffer(writing_), [self](const ec_type& ec, std::size_t) {
+        self->is_writing_ = false;
+        std::vector<SentCallbackType> callbacks;
+        callbacks.swap(self->writing_callbacks_);
+        if (ec) {
+          LOG.Error("[%llX] failed to write to the session, reason: %s",
+                    self->GetId(), ec.message().c_str());
+          self->HandleError(ec);
+        }
+        for (const auto& callback : callbacks) {
+          callback(ec);
+        }
+        if (self->is_closing_ && self->pending_.empty()) {
+          self->Close();
+        } else {
+          self->DoWrite();
+        }
+      });
+}
+
+void MuxSession::DoRead() {
+  auto self = shared_from_this();
+  transport_->StartRead(
+      asio::buffer(&read_buf_[read_end_], read_buf_.size() - read_end_),
+      [self](const ec_type& ec, std::size_t n_bytes) {
+        if (self->is_closed_) {
+          return;
+        }
+        if (ec) {
+          if (ec == asio::error::eof) {
+            THESTRAL_LOG_DEBUG(LOG, "[%llX] session closed by the peer",
+                               self->GetId());
+          } else {
+            LOG.Error("[%llX] failed to read from the session, reason: %s",
+                      self->GetId(), ec.message().c_str());
+          }
+          self->HandleError(ec);
+          return;
+        }
+        // anything from the peer shows the session is alive
+        self->ping_timer_.Touch();
+        self->is_ping_pending_ = false;
+        self->read_end_ += n_bytes;
+        if (!self->HandleFrames()) {
+          LOG.Error("[%llX] protocol error on the session", self->GetId());
+          self->HandleError(boost::system::errc::make_error_code(
+              boost::system::errc::protocol_error));
+        } else if (!self->is_closed_) {
+          self->DoRead();
+        }
+      },
+      true);
+}
+
+void MuxSession::StartPingTimer() {
+  std::weak_ptr<MuxSession> weak_self = shared_from_this();
+  auto& wheel = asio::use_service<TimingWheel>(*io_service_ptr_);
+  ping_timer_ = wheel.Start(ping_interval_, [weak_self]() {
+    auto self = weak_self.lock();
+    if (!self || self->is_closed_) {
+      return;
+    }
+    if (self->is_ping_pending_) {
+      LOG.Warn("[%llX] session not responding to ping, closing",
+               self->GetId());
+      self->HandleError(asio::error::timed_out);
+      return;
+    }
+    THESTRAL_LOG_DEBUG(LOG, "[%llX] pinging idle session", self->GetId());
+    self->is_ping_pending_ = true;
+    char payload[8] = {};
+    self->SendFrame(FrameType::kPing, 0, payload, sizeof(payload));
+    self->StartPingTimer();
+  });
+}
+
+bool MuxSession::HandleFrames() {
+  std::size_t begin = 0;
+  if (!preface_received_) {
+    if (read_end_ < sizeof(kPreface)) {
+      return true;
+    }
+    if (std::memcmp(read_buf_.data(), kPreface, sizeof(kPreface)) != 0) {
+      return false;
+    }
+    preface_received_ = true;
+    begin = sizeof(kPreface);
+    if (handshake_timer_) {
+      handshake_timer_->Cancel();
+      handshake_timer_.reset();
+    }
+  }
+
+  FrameHeader header;
+  const auto header_size = FrameHeader::kSize;
+  while (!is_closed_ && read_end_ - begin >= header_size) {
+    header.FromBytes(&read_buf_[begin]);
+    if (header.length > kMaxFramePayload) {
+      return false;
+    }
+    if (read_end_ - begin < header_size + header.length) {
+      break;
+    }
+    if (!HandleFrame(header, &read_buf_[begin + header_size])) {
+      return false;
+    }
+    begin += header_size + header.length;
+  }
+  std::memmove(read_buf_.data(), read_buf_.data() + begin, read_end_ - begin);
+  read_end_ -= begin;
+  return true;
+}
+
+bool MuxSession::HandleFrame(const FrameHeader& header, const char* payload) {
+  auto stream_id = header.stream_id;
+  if (header.type == FrameType::kOpen) {
+    if (!accept_callback_ || header.length != 0 || stream_id % 2 == 0 ||
+        streams_.count(stream_id)) {
+      return false;
+    }
+    if (is_going_away_) {
+      THESTRAL_LOG_DEBUG(LOG, "[%llX] resetting stream %u opened after going "
+                         "away", GetId(), stream_id);
+      SendFrame(FrameType::kReset, stream_id, nullptr, 0);
+      return true;
+    }
+    if (max_streams_ != 0 && streams_.size() >= max_streams_) {
+      LOG.Warn("[%llX] resetting stream %u beyond the limit of %zu streams",
+               GetId(), stream_id, max_streams_);
+      SendFrame(FrameType::kReset, stream_id, nullptr, 0);
+      return true;
+    }
+    THESTRAL_LOG_DEBUG(LOG, "[%llX] stream %u opened by the peer", GetId(),
+                       stream_id);
+    std::shared_ptr<MuxStream> stream(
+        new MuxStream(shared_from_this(), stream_id, false));
+    streams_[stream_id] = stream;
+    accept_callback_(stream);
+    return true;
+  }
+  if (header.type == FrameType::kGoAway) {
+    if (accept_callback_ || header.length != 0 || stream_id != 0) {
+      return false;
+    }
+    THESTRAL_LOG_INFO(LOG, "[%llX] session going away with %zu streams open",
+                      GetId(), streams_.size());
+    is_going_away_ = true;
+    CloseIfDrained();
+    return true;
+  }
+  if (header.type == FrameType::kPing || header.type == FrameType::kPong) {
+    if (header.length != 8 || stream_id != 0) {
+      return false;
+    }
+    if (header.type == FrameType::kPing) {
+      SendFrame(FrameType::kPong, 0, payload, header.length);
+    }
+    return true;
+  }
+
+  auto iter = streams_.find(stream_id);
+  if (iter == streams_.end()) {
+    return true;  // the stream has been closed on this side
+  }
+  auto stream = iter->second.lock();
+  if (!stream) {
+    return true;
+  }
+  switch (header.type) {
+    case FrameType::kData:
+      if (!stream->HandleData(payload, header.length)) {
+        LOG.Error("[%llX] stream %u exceeded its window", GetId(), stream_id);
+        stream->Abort(boost::system::errc::make_error_code(
+            boost::system::errc::protocol_error));
+      }
+      return true;
+    case FrameType::kFin:
+      stream->HandleFin();
+      return true;
+    case FrameType::kReset:
+      THESTRAL_LOG_DEBUG(LOG, "[%llX] stream %u reset by the peer", GetId(),
+                         stream_id);
+      streams_.erase(iter);
+      stream->is_detached_ = true;
+      stream->HandleError(asio::error::connection_reset);
+      CloseIfDrained();
+      return true;
+    case FrameType::kWindowUpdate:
+      if (header.length != 4) {
+        return false;
+      }
+      stream->HandleWindowUpdate(DecodeUint32(payload));
+      return true;
+    default:
+      return false;
+  }
+}
+
+void MuxSession::RemoveStream(uint32_t stream_id, bool reset) {
+  streams_.erase(stream_id);
+  if (reset) {
+    SendFrame(FrameType::kReset, stream_id, nullptr, 0);
+  }
+  CloseIfDrained();
+}
+
+void MuxSession::CloseIfDrained() {
+  if (is_closed_ || is_closing_ || !streams_.empty()) {
+    return;
+  }
+  if (!is_going_away_ &&
+      (accept_callback_ || next_stream_id_ <= kMaxStreamId)) {
+    return;
+  }
+  THESTRAL_LOG_INFO(LOG, "[%llX] closing a session %s", GetId(),
+                    is_going_away_ ? "gone away" : "out of stream ids");
+  // the frames queued, such as the end of the last stream, go out first
+  if (is_writing_) {
+    is_closing_ = true;
+  } else {
+    Close();
+  }
+}
+
+void MuxSession::HandleError(const ec_type& ec) {
+  if (is_closed_) {
+    return;
+  }
+  is_closed_ = true;
+  transport_->StartClose();
+  ping_timer_.Cancel();
+  handshake_timer_.reset();
+
+  // a session ending in the middle of a stream is not the end of the stream
+  auto stream_ec =
+      ec == asio::error::eof ? asio::error::connection_aborted : ec;
+  decltype(streams_) streams;
+  streams.swap(streams_);
+  for (const auto& entry : streams) {
+    if (auto stream = entry.second.lock()) {
+      stream->is_detached_ = true;
+      stream->HandleError(stream_ec);
+    }
+  }
+
+  std::vector<SentCallbackType> callbacks;
+  callbacks.swap(pending_callbacks_);
+  pending_.clear();
+  for (const auto& callback : callbacks) {
+    callback(asio::error::operation_aborted);
+  }
+}
+
+}  // namespace mux
+}  // namespace thestral
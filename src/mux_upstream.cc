@@ -0,0 +1,149 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the upstream factory carrying requests over multiplexed sessions.
+#include "mux_upstream.h"
+
+#include <algorithm>
+
+#include "socks.h"
+
+namespace thestral {
+namespace mux {
+
+namespace ip = boost::asio::ip;
+
+logging::Logger MuxTcpUpstreamFactory::LOG("MuxTcpUpstreamFactory");
+
+void MuxTcpUpstreamFactory::StartRequest(const Address& endpoint,
+                                         const RequestCallbackType& callback) {
+  THESTRAL_LOG_INFO(LOG, "starting a request to host %s",
+                    endpoint.Format().c_str());
+  // sessions ended, running out of stream ids or told to go away by the
+  // server are replaced
+  sessions_.erase(
+      std::remove_if(sessions_.begin(), sessions_.end(),
+                     [](const std::shared_ptr<MuxSession>& session) {
+                       return !session->CanOpenStream();
+                     }),
+      sessions_.end());
+  while (sessions_.size() + n_connecting_ < n_sessions_) {
+    StartSession();
+  }
+
+  if (sessions_.empty()) {
+    waiters_.emplace_back(endpoint, callback);
+  } else {
+    OpenStream(endpoint, callback);
+  }
+}
+
+void MuxTcpUpstreamFactory::StartSession() {
+  ++n_connecting_;
+  THESTRAL_LOG_DEBUG(LOG, "resolving upstream address %s, port: %u",
+                     upstream_host_.c_str(), upstream_port_);
+  ip::tcp::resolver::query query(
+      upstream_host_, std::to_string(upstream_port_),
+      ip::tcp::resolver::query::address_configured |
+          ip::tcp::resolver::query::numeric_service);
+  auto self = shared_from_this();
+  resolver_.async_resolve(
+      query, [self](const ec_type& ec, ip::tcp::resolver::iterator iter) {
+        if (ec) {
+          LOG.Error("failed to resolve upstream address %s, port: %u, "
+                    "reason: %s",
+                    self->upstream_host_.c_str(), self->upstream_port_,
+                    ec.message().c_str());
+          self->HandleSession(ec, nullptr);
+        } else {
+          self->ConnectEndpoint(iter);
+        }
+      });
+}
+
+void MuxTcpUpstreamFactory::ConnectEndpoint(ip::tcp::resolver::iterator iter) {
+  ip::tcp::endpoint upstream_endpoint = *iter;
+  THESTRAL_LOG_DEBUG(LOG, "try connecting to upstream %s, port: %u",
+                     upstream_endpoint.address().to_string().c_str(),
+                     upstream_endpoint.port());
+  auto self = shared_from_this();
+  transport_factory_->StartConnect(
+      upstream_endpoint,
+      [self, iter, upstream_endpoint](
+          const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+        if (ec) {
+          LOG.Error("failed to connect to upstream %s, port: %u, reason: %s",
+                    upstream_endpoint.address().to_string().c_str(),
+                    upstream_endpoint.port(), ec.message().c_str());
+          auto next = iter;
+          if (++next != ip::tcp::resolver::iterator()) {
+            self->ConnectEndpoint(next);
+            return;
+          }
+        }
+        self->HandleSession(ec, transport);
+      });
+}
+
+void MuxTcpUpstreamFactory::HandleSession(
+    const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+  --n_connecting_;
+  if (ec) {
+    if (n_connecting_ == 0 && sessions_.empty()) {
+      // no session is coming for the waiting requests
+      decltype(waiters_) waiters;
+      waiters.swap(waiters_);
+      for (const auto& waiter : waiters) {
+        waiter.second(ec, nullptr);
+      }
+    }
+    return;
+  }
+
+  auto session = MuxSession::NewClient(transport, get_io_service_ptr());
+  session->SetPingInterval(ping_interval_);
+  THESTRAL_LOG_INFO(LOG, "[%llX] session to upstream %s established",
+                    session->GetId(),
+                    transport->GetRemoteAddress().Format().c_str());
+  session->Start();
+  sessions_.push_back(session);
+
+  decltype(waiters_) waiters;
+  waiters.swap(waiters_);
+  for (const auto& waiter : waiters) {
+    OpenStream(waiter.first, waiter.second);
+  }
+}
+
+void MuxTcpUpstreamFactory::OpenStream(const Address& endpoint,
+                                       const RequestCallbackType& callback) {
+  const auto& session = *std::min_element(
+      sessions_.cbegin(), sessions_.cend(),
+      [](const std::shared_ptr<MuxSession>& lhs,
+         const std::shared_ptr<MuxSession>& rhs) {
+        return lhs->GetStreamCount() < rhs->GetStreamCount();
+      });
+  socks::RequestPacket request;
+  request.header.command = socks::Command::kConnect;
+  request.body = endpoint;
+  auto stream = session->OpenStream(request.Serialize());
+  THESTRAL_LOG_INFO(LOG, "[%llX] stream %u opened for host %s",
+                    session->GetId(), stream->GetStreamId(),
+                    endpoint.Format().c_str());
+  callback(ec_type(), stream);
+}
+
+}  // namespace mux
+}  // namespace thestral
@@ -0,0 +1,179 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the token buckets limiting the rate of relayed data.
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace thestral {
+
+constexpr uint64_t TokenBucket::kMinBurst;
+constexpr std::size_t BucketSet::kMaxQuantum;
+
+boost::asio::io_service::id ShapingScheduler::id;
+
+TokenBucket::TokenBucket(uint64_t rate)
+    : rate_(rate),
+      burst_(std::max(rate / 10, kMinBurst)),
+      tokens_(static_cast<double>(burst_)),
+      last_refill_(ClockType::now()) {}
+
+TokenBucket::ClockType::duration TokenBucket::GetDelay() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Refill(ClockType::now());
+  if (tokens_ > 0) {
+    return ClockType::duration::zero();
+  }
+  // round up, so that the bucket surely has tokens by then
+  return std::chrono::duration_cast<ClockType::duration>(
+             std::chrono::duration<double>((1 - tokens_) / rate_)) +
+         ClockType::duration(1);
+}
+
+void TokenBucket::Consume(int64_t n_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Refill(ClockType::now());
+  tokens_ = std::min(tokens_ - static_cast<double>(n_bytes),
+                     static_cast<double>(burst_));
+}
+
+void TokenBucket::Refill(ClockType::time_point now) {
+  if (now <= last_refill_) {
+    return;
+  }
+  std::chrono::duration<double> elapsed = now - last_refill_;
+  tokens_ = std::min(tokens_ + elapsed.count() * rate_,
+                     static_cast<double>(burst_));
+  last_refill_ = now;
+}
+
+void BucketSet::Add(const std::shared_ptr<TokenBucket>& bucket) {
+  buckets_.push_back(bucket);
+  quantum_ = std::min(quantum_, static_cast<std::size_t>(bucket->GetBurst()));
+}
+
+TokenBucket::ClockType::duration BucketSet::GetDelay() const {
+  auto delay = TokenBucket::ClockType::duration::zero();
+  for (const auto& bucket : buckets_) {
+    delay = std::max(delay, bucket->GetDelay());
+  }
+  return delay;
+}
+
+void BucketSet::Consume(int64_t n_bytes) const {
+  for (const auto& bucket : buckets_) {
+    bucket->Consume(n_bytes);
+  }
+}
+
+std::shared_ptr<const BucketSet> RateLimiter::StartSession(
+    const Address& client) {
+  auto buckets = std::make_shared<BucketSet>();
+  if (session_rate_ != 0) {
+    buckets->Add(std::make_shared<TokenBucket>(session_rate_));
+  }
+  if (client_rate_ != 0) {
+    std::string key(client.host);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = client_buckets_[key];
+    auto bucket = entry.lock();
+    if (!bucket) {
+      bucket = std::make_shared<TokenBucket>(client_rate_);
+      entry = bucket;
+    }
+    buckets->Add(bucket);
+
+    // drop the clients gone, once there are enough of them
+    if (client_buckets_.size() >= prune_size_) {
+      for (auto iter = client_buckets_.begin();
+           iter != client_buckets_.end();) {
+        if (iter->second.expired()) {
+          iter = client_buckets_.erase(iter);
+        } else {
+          ++iter;
+        }
+      }
+      prune_size_ = std::max<std::size_t>(64, client_buckets_.size() * 2);
+    }
+  }
+  if (global_bucket_) {
+    buckets->Add(global_bucket_);
+  }
+  return buckets->IsEmpty() ? nullptr : buckets;
+}
+
+void ShapingScheduler::StartAcquire(const BucketSet& buckets,
+                                    const GrantCallbackType& callback) {
+  // tokens refilled while others wait are theirs first, so join the queue
+  auto delay = buckets.GetDelay();
+  if (delay == TokenBucket::ClockType::duration::zero() && waiters_.empty()) {
+    buckets.Consume(static_cast<int64_t>(buckets.GetQuantum()));
+    callback(buckets.GetQuantum());
+    return;
+  }
+  waiters_.push_back(Waiter{&buckets, callback});
+  ScheduleWakeup(delay);
+}
+
+void ShapingScheduler::shutdown_service() {
+  waiters_.clear();
+  boost::system::error_code ec;
+  timer_.cancel(ec);
+}
+
+void ShapingScheduler::ScheduleWakeup(TokenBucket::ClockType::duration delay) {
+  auto wakeup_time = TokenBucket::ClockType::now() + delay;
+  if (wakeup_time >= wakeup_time_) {
+    return;  // the pending wakeup comes earlier
+  }
+  wakeup_time_ = wakeup_time;
+  timer_.expires_at(wakeup_time);
+  timer_.async_wait([this](const boost::system::error_code& ec) {
+    if (ec != boost::asio::error::operation_aborted) {
+      HandleWakeup();
+    }
+  });
+}
+
+void ShapingScheduler::HandleWakeup() {
+  wakeup_time_ = TokenBucket::ClockType::time_point::max();
+
+  // grant in turn while there are tokens, taking them right away so that
+  // the waiters behind see what is left
+  std::vector<std::pair<GrantCallbackType, std::size_t>> granted;
+  auto min_delay = TokenBucket::ClockType::duration::max();
+  for (auto iter = waiters_.begin(); iter != waiters_.end();) {
+    auto delay = iter->buckets->GetDelay();
+    if (delay == TokenBucket::ClockType::duration::zero()) {
+      auto quantum = iter->buckets->GetQuantum();
+      iter->buckets->Consume(static_cast<int64_t>(quantum));
+      granted.emplace_back(std::move(iter->callback), quantum);
+      iter = waiters_.erase(iter);
+    } else {
+      min_delay = std::min(min_delay, delay);
+      ++iter;
+    }
+  }
+  if (!waiters_.empty()) {
+    ScheduleWakeup(min_delay);
+  }
+  for (const auto& grant : granted) {
+    grant.first(grant.second);
+  }
+}
+
+}  // namespace thestral
@@ -0,0 +1,274 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the rules routing requests by their destinations.
+#include "route_table.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+#include <boost/asio/ip/address.hpp>
+
+namespace thestral {
+
+namespace {
+char ToLower(char c) {
+  return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+}
+
+bool MatchesPort(RouteTable::PortRange ports, uint16_t port) {
+  return ports.first <= port && port <= ports.last;
+}
+}  // anonymous namespace
+
+constexpr RouteTable::Target RouteTable::kAllow;
+constexpr RouteTable::Target RouteTable::kDeny;
+constexpr uint32_t RouteTable::kNone;
+
+RouteTable::RouteTable()
+    : ipv4_trie_(1), ipv6_trie_(1), domain_nodes_(1) {
+  domain_nodes_[0].parent = kNone;
+}
+
+bool RouteTable::AddNetworkRule(const std::string& network, PortRange ports,
+                                Target target) {
+  auto slash = network.find('/');
+  boost::system::error_code ec;
+  auto address = boost::asio::ip::address::from_string(
+      network.substr(0, slash), ec);
+  if (ec) {
+    return false;
+  }
+
+  unsigned char bytes[16];
+  std::size_t max_bits;
+  std::vector<IpNode>* trie;
+  if (address.is_v4()) {
+    auto v4_bytes = address.to_v4().to_bytes();
+    std::copy(v4_bytes.cbegin(), v4_bytes.cend(), bytes);
+    max_bits = 32;
+    trie = &ipv4_trie_;
+  } else {
+    auto v6_bytes = address.to_v6().to_bytes();
+    std::copy(v6_bytes.cbegin(), v6_bytes.cend(), bytes);
+    max_bits = 128;
+    trie = &ipv6_trie_;
+  }
+
+  std::size_t n_bits = max_bits;
+  if (slash != std::string::npos) {
+    auto length = network.c_str() + slash + 1;
+    char* end;
+    auto value = std::strtoul(length, &end, 10);
+    if (end == length || *end != '\0' || value > max_bits) {
+      return false;
+    }
+    n_bits = value;
+  }
+
+  uint32_t node = 0;
+  for (std::size_t i = 0; i < n_bits; ++i) {
+    auto bit = (bytes[i / 8] >> (7 - i % 8)) & 1;
+    if ((*trie)[node].children[bit] == kNone) {
+      (*trie)[node].children[bit] = static_cast<uint32_t>(trie->size());
+      trie->emplace_back();
+    }
+    node = (*trie)[node].children[bit];
+  }
+  AddRule(&(*trie)[node].rules, ports, target);
+  has_network_rules_ = true;
+  return true;
+}
+
+void RouteTable::AddDomainRule(const std::string& domain, PortRange ports,
+                               Target target) {
+  std::size_t begin = domain.empty() || domain.front() != '.' ? 0 : 1;
+  std::size_t end = domain.size();
+  if (end > begin && domain[end - 1] == '.') {
+    --end;
+  }
+  if (begin >= end) {
+    AddAnyRule(ports, target);
+    return;
+  }
+
+  // walk down the labels from the right, creating the missing ones
+  uint32_t node = 0;
+  while (true) {
+    auto dot = domain.rfind('.', end - 1);
+    auto label_begin =
+        dot == std::string::npos || dot < begin ? begin : dot + 1;
+    auto label = domain.c_str() + label_begin;
+    auto size = end - label_begin;
+    auto child = FindDomainChild(node, label, size);
+    if (child == kNone) {
+      child = static_cast<uint32_t>(domain_nodes_.size());
+      domain_nodes_.emplace_back();
+      auto& child_node = domain_nodes_.back();
+      child_node.parent = node;
+      child_node.label.resize(size);
+      std::transform(label, label + size, child_node.label.begin(), ToLower);
+      domain_children_.emplace(HashLabel(node, label, size), child);
+    }
+    node = child;
+    if (label_begin == begin) {
+      break;
+    }
+    end = label_begin - 1;
+  }
+  AddRule(&domain_nodes_[node].rules, ports, target);
+}
+
+void RouteTable::AddAnyRule(PortRange ports, Target target) {
+  AddRule(&any_rules_, ports, target);
+}
+
+RouteTable::Target RouteTable::Lookup(const Address& address) const {
+  auto best = MatchAddress(address);
+  return best == kNone ? default_target_ : rules_[best].target;
+}
+
+RouteTable::Target RouteTable::Lookup(const Address& address,
+                                      const Address& resolved) const {
+  auto best = std::min(MatchAddress(address), MatchAddress(resolved));
+  return best == kNone ? default_target_ : rules_[best].target;
+}
+
+uint32_t RouteTable::MatchAddress(const Address& address) const {
+  uint32_t best = kNone;
+  MatchRules(any_rules_, address.port, &best);
+
+  const auto bytes = reinterpret_cast<const unsigned char*>(
+      address.host.data());
+  uint32_t matched = kNone;
+  if (address.type == AddressType::kIPv4 && address.host.size() == 4) {
+    matched = MatchIp(ipv4_trie_, bytes, 32, address.port);
+  } else if (address.type == AddressType::kIPv6 &&
+             address.host.size() == 16) {
+    // IPv4-mapped addresses are matched against the IPv4 networks
+    static const unsigned char kMappedPrefix[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (std::equal(bytes, bytes + 12, kMappedPrefix)) {
+      matched = MatchIp(ipv4_trie_, bytes + 12, 32, address.port);
+    } else {
+      matched = MatchIp(ipv6_trie_, bytes, 128, address.port);
+    }
+  } else if (address.type == AddressType::kDomainName) {
+    matched = MatchDomain(address.host, address.port);
+  }
+  return std::min(best, matched);
+}
+
+void RouteTable::AddRule(RuleList* list, PortRange ports, Target target) {
+  auto rule = static_cast<uint32_t>(rules_.size());
+  rules_.push_back(Rule{ports, target});
+  auto ref = static_cast<uint32_t>(rule_refs_.size());
+  rule_refs_.push_back(RuleRef{rule, kNone});
+  if (list->last == kNone) {
+    list->first = ref;
+  } else {
+    rule_refs_[list->last].next = ref;
+  }
+  list->last = ref;
+}
+
+void RouteTable::MatchRules(const RuleList& list, uint16_t port,
+                            uint32_t* best) const {
+  // the rules in a list are in the order of adding, so the first match wins
+  for (auto ref = list.first; ref != kNone; ref = rule_refs_[ref].next) {
+    auto rule = rule_refs_[ref].rule;
+    if (rule >= *best) {
+      return;
+    }
+    if (MatchesPort(rules_[rule].ports, port)) {
+      *best = rule;
+      return;
+    }
+  }
+}
+
+uint32_t RouteTable::MatchIp(const std::vector<IpNode>& trie,
+                             const unsigned char* bytes, std::size_t n_bits,
+                             uint16_t port) const {
+  uint32_t best = kNone;
+  uint32_t node = 0;
+  for (std::size_t i = 0; node != kNone; ++i) {
+    MatchRules(trie[node].rules, port, &best);
+    if (i == n_bits) {
+      break;
+    }
+    node = trie[node].children[(bytes[i / 8] >> (7 - i % 8)) & 1];
+  }
+  return best;
+}
+
+uint32_t RouteTable::MatchDomain(const AddressHost& host,
+                                 uint16_t port) const {
+  std::size_t end = host.size();
+  if (end > 0 && host[end - 1] == '.') {
+    --end;
+  }
+
+  uint32_t best = kNone;
+  uint32_t node = 0;
+  while (end > 0) {
+    auto label_begin = end;
+    while (label_begin > 0 && host[label_begin - 1] != '.') {
+      --label_begin;
+    }
+    node = FindDomainChild(node, host.data() + label_begin,
+                           end - label_begin);
+    if (node == kNone) {
+      break;
+    }
+    MatchRules(domain_nodes_[node].rules, port, &best);
+    if (label_begin == 0) {
+      break;
+    }
+    end = label_begin - 1;
+  }
+  return best;
+}
+
+uint32_t RouteTable::FindDomainChild(uint32_t parent, const char* label,
+                                     std::size_t size) const {
+  auto range = domain_children_.equal_range(HashLabel(parent, label, size));
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    const auto& node = domain_nodes_[iter->second];
+    if (node.parent == parent && node.label.size() == size &&
+        std::equal(label, label + size, node.label.cbegin(),
+                   [](char a, char b) { return ToLower(a) == b; })) {
+      return iter->second;
+    }
+  }
+  return kNone;
+}
+
+uint64_t RouteTable::HashLabel(uint32_t parent, const char* label,
+                               std::size_t size) {
+  // FNV-1a over the parent and the label in lower case
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < 4; ++i) {
+    hash = (hash ^ ((parent >> (i * 8)) & 0xff)) * 1099511628211ULL;
+  }
+  for (std::size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(ToLower(label[i]))) *
+           1099511628211ULL;
+  }
+  return hash;
+}
+
+}  // namespace thestral
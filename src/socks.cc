@@ -39,14 +39,53 @@ void AuthMethodList::StartCreateFrom(
   });
 }
 
-std::string AuthMethodList::Serialize() const {
+ParseResult AuthMethodList::ParseFrom(const char* data, std::size_t size,
+                                     std::size_t* n_consumed) {
+  if (size < 2) {
+    return ParseResult::kIncomplete;
+  }
+  std::size_t n_methods = static_cast<uint8_t>(data[1]);
+  if (size < 2 + n_methods) {
+    return ParseResult::kIncomplete;
+  }
+  version = static_cast<uint8_t>(data[0]);
+  methods.clear();
+  for (std::size_t i = 0; i < n_methods; ++i) {
+    methods.push_back(static_cast<AuthMethod>(data[2 + i]));
+  }
+  *n_consumed = 2 + n_methods;
+  return ParseResult::kOk;
+}
+
+void AuthMethodList::SerializeTo(std::string* data) const {
   // TODO(richardtsai): check methods.size()
-  std::string str{static_cast<char>(version),
-                  static_cast<char>(methods.size())};
+  data->append({static_cast<char>(version),
+                static_cast<char>(methods.size())});
   for (auto m : methods) {
-    str.push_back(static_cast<char>(m));
+    data->push_back(static_cast<char>(m));
   }
-  return str;
+}
+
+void AuthMethodList::AddTraceId(uint64_t id) {
+  methods.push_back(AuthMethod::kTraceId);
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    methods.push_back(static_cast<AuthMethod>((id >> shift) & 0xff));
+  }
+}
+
+uint64_t AuthMethodList::TakeTraceId() {
+  // only as appended by AddTraceId(), as 0x88 may also be a real method
+  if (methods.size() < 9 ||
+      methods[methods.size() - 9] != AuthMethod::kTraceId) {
+    return 0;
+  }
+  auto iter = methods.end() - 9;
+  uint64_t id = 0;
+  for (auto i = iter + 1; i != iter + 9; ++i) {
+    id = (id << 8) | static_cast<uint8_t>(*i);
+  }
+  methods.erase(iter, iter + 9);
+  return id;
 }
 
 SocksAddress::SocksAddress(const Address& address) : Address(address) {}
@@ -131,21 +170,60 @@ void SocksAddress::StartReadDomain(
   });
 }
 
+ParseResult SocksAddress::ParseFrom(const char* data, std::size_t size,
+                                   std::size_t* n_consumed) {
+  if (size < 1) {
+    return ParseResult::kIncomplete;
+  }
+
+  std::size_t host_begin = 1;
+  std::size_t host_size;
+  switch (static_cast<AddressType>(data[0])) {
+    case AddressType::kIPv4:
+      host_size = 4;
+      break;
+    case AddressType::kIPv6:
+      host_size = 16;
+      break;
+    case AddressType::kDomainName:
+      if (size < 2) {
+        return ParseResult::kIncomplete;
+      }
+      host_begin = 2;
+      host_size = static_cast<uint8_t>(data[1]);
+      break;
+    default:
+      return ParseResult::kInvalid;
+  }
+
+  // the extra 2 bytes specify the port number
+  std::size_t packet_size = host_begin + host_size + 2;
+  if (size < packet_size) {
+    return ParseResult::kIncomplete;
+  }
+  type = static_cast<AddressType>(data[0]);
+  host.assign(data + host_begin, host_size);
+  port = static_cast<uint16_t>(
+      static_cast<uint8_t>(data[host_begin + host_size]) << 8 |
+      static_cast<uint8_t>(data[host_begin + host_size + 1]));
+  *n_consumed = packet_size;
+  return ParseResult::kOk;
+}
+
 void SocksAddress::ExtractPortFromHost() {
   port = static_cast<uint8_t>(host[host.size() - 2]) << 8;
   port |= static_cast<uint8_t>(host.back());
   host.resize(host.size() - 2);
 }
 
-std::string SocksAddress::Serialize() const {
-  std::string str{static_cast<char>(type)};
+void SocksAddress::SerializeTo(std::string* data) const {
+  data->push_back(static_cast<char>(type));
   if (type == AddressType::kDomainName) {
     // TODO(richardtsai): check host length
-    str.push_back(static_cast<char>(host.size()));
+    data->push_back(static_cast<char>(host.size()));
   }
-  str.append(host);
-  str.append({static_cast<char>(port >> 8), static_cast<char>(port & 0xff)});
-  return str;
+  data->append(host.data(), host.size());
+  data->append({static_cast<char>(port >> 8), static_cast<char>(port & 0xff)});
 }
 
 }  // namespace socks
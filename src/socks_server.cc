@@ -22,12 +22,56 @@
 
 #include <boost/asio/ssl/error.hpp>
 
+#include "direct_upstream.h"
+#include "metrics.h"
+
 namespace thestral {
 namespace socks {
 
 namespace ip = boost::asio::ip;
 using namespace std::placeholders;
 
+namespace {
+
+const metrics::Counter kAcceptedConnections(
+    "thestral_socks_connections_accepted_total",
+    "Number of connections accepted by the SOCKS servers.");
+const metrics::Gauge kActiveSessions(
+    "thestral_socks_sessions_active",
+    "Number of SOCKS sessions currently relaying data.");
+const metrics::Histogram kUpstreamConnectLatency(
+    "thestral_socks_upstream_connect_seconds",
+    "Time taken to establish upstream connections for SOCKS requests.",
+    metrics::Histogram::LatencyBounds());
+const metrics::Counter kUpstreamBytes(
+    "thestral_socks_relayed_bytes_total", "Number of bytes relayed.",
+    "direction=\"upstream\"");
+const metrics::Counter kDownstreamBytes(
+    "thestral_socks_relayed_bytes_total", "Number of bytes relayed.",
+    "direction=\"downstream\"");
+const metrics::Counter kTimeouts(
+    "thestral_socks_timeouts_total",
+    "Number of SOCKS connections closed by handshake, connect or idle "
+    "timeouts.");
+
+#define THESTRAL_REQUEST_ERROR_COUNTER(code)             \
+  {"thestral_socks_request_errors_total",                \
+   "Number of SOCKS requests answered with an error.",   \
+   "code=\"" #code "\""}
+/// Indexed by the response code minus one.
+const metrics::Counter kRequestErrors[] = {
+    THESTRAL_REQUEST_ERROR_COUNTER(kSocksServerFailure),
+    THESTRAL_REQUEST_ERROR_COUNTER(kConnectionNotAllow),
+    THESTRAL_REQUEST_ERROR_COUNTER(kNetworkUnreachable),
+    THESTRAL_REQUEST_ERROR_COUNTER(kHostUnreachable),
+    THESTRAL_REQUEST_ERROR_COUNTER(kConnectionRefused),
+    THESTRAL_REQUEST_ERROR_COUNTER(kTtlExpired),
+    THESTRAL_REQUEST_ERROR_COUNTER(kCommandNotSupported),
+    THESTRAL_REQUEST_ERROR_COUNTER(kAddressTypeNotSupported)};
+#undef THESTRAL_REQUEST_ERROR_COUNTER
+
+}  // anonymous namespace
+
 logging::Logger SocksTcpServer::LOG("SocksTcpServer");
 
 void SocksTcpServer::Start() {
@@ -35,8 +79,8 @@ void SocksTcpServer::Start() {
   auto query_flags = ip::tcp::resolver::query::address_configured |
                      ip::tcp::resolver::query::numeric_service |
                      ip::tcp::resolver::query::passive;
-  LOG.Info("start listening on %s, port: %u", bind_address_.c_str(),
-           bind_port_);
+  THESTRAL_LOG_INFO(LOG, "start listening on %s, port: %u",
+                    bind_address_.c_str(), bind_port_);
   ip::tcp::resolver::query query(bind_address_, std::to_string(bind_port_),
                                  query_flags);
   ec_type error_code;
@@ -53,26 +97,111 @@ void SocksTcpServer::Start() {
                        _1, _2));
 }
 
+void SocksTcpServer::Stop() {
+  THESTRAL_LOG_INFO(LOG, "stop listening on %s, port: %u",
+                    bind_address_.c_str(), bind_port_);
+  server_transport_factory_->StopAccepting();
+  for (const auto& weak_session : mux_sessions_) {
+    if (auto session = weak_session.lock()) {
+      session->GoAway();
+    }
+  }
+  mux_sessions_.clear();
+}
+
+void SocksTcpServer::SetUdpAssociate(bool udp_associate) {
+  udp_associate_ = udp_associate &&
+                   dynamic_cast<DirectTcpUpstreamFactory*>(
+                       upstream_factory_.get()) != nullptr;
+  if (udp_associate && !udp_associate_) {
+    LOG.Warn("UDP ASSOCIATE disabled on %s, port: %u, as the upstream is not "
+             "direct", bind_address_.c_str(), bind_port_);
+  }
+}
+
+std::shared_ptr<void> SocksTcpServer::TrackSession() {
+  kActiveSessions.Increment();
+  ++n_sessions_;
+  auto self = shared_from_this();
+  return std::shared_ptr<void>(nullptr, [self](void*) {
+    kActiveSessions.Decrement();
+    --self->n_sessions_;
+  });
+}
+
 bool SocksTcpServer::HandleNewConnection(
     const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+  if (ec == boost::asio::error::operation_aborted) {
+    return false;  // stopped
+  }
   if (ec) {
     LOG.Error("failed to accept a new connection, reason: %s",
               ec.message().c_str());
     return true;  // the underlying transport factory should decide when to stop
   }
+  kAcceptedConnections.Increment();
 
   auto self = shared_from_this();
-  LOG.Info("[%llX] new incoming connection %s", transport->GetId(),
-           transport->GetRemoteAddress().ToString().c_str());
-  LOG.Debug("[%llX] receiving auth request packet", transport->GetId());
-  AuthMethodList::StartCreateFrom(
-      transport, [self, transport](const ec_type& ec, AuthMethodList packet) {
+  if (multiplexing_) {
+    THESTRAL_LOG_INFO(LOG, "[%llX] new incoming multiplexed session %s",
+                      transport->GetId(),
+                      transport->GetRemoteAddress().Format().c_str());
+    auto session = mux::MuxSession::NewServer(
+        transport, server_transport_factory_->get_io_service_ptr(),
+        [self](const std::shared_ptr<mux::MuxStream>& stream) {
+          self->HandleNewStream(stream);
+        });
+    session->SetMaxStreams(max_streams_);
+    // the handshake of a session ends with the preface of the client
+    session->SetHandshakeTimer(
+        StartTimeout(handshake_timeout_, transport, "handshake"));
+    mux_sessions_.erase(
+        std::remove_if(mux_sessions_.begin(), mux_sessions_.end(),
+                       [](const std::weak_ptr<mux::MuxSession>& weak_session) {
+                         return weak_session.expired();
+                       }),
+        mux_sessions_.end());
+    mux_sessions_.push_back(session);
+    session->Start();
+    return true;
+  }
+
+  auto timer = StartTimeout(handshake_timeout_, transport, "handshake");
+  auto reader = PacketReader::New(transport);
+  trace::Trace::ClockType::time_point accept_time;
+  std::shared_ptr<trace::Trace> trace;
+  if (trace::IsEnabled()) {
+    accept_time = trace::Trace::ClockType::now();
+    trace = trace::Trace::StartSampled(accept_time);
+  }
+  THESTRAL_LOG_INFO(LOG, "[%llX] new incoming connection %s",
+                    transport->GetId(),
+                    transport->GetRemoteAddress().Format().c_str());
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] receiving auth request packet",
+                     transport->GetId());
+  reader->StartReadPacket<AuthMethodList>(
+      [self, reader, timer, accept_time, trace](const ec_type& ec,
+                                                AuthMethodList packet) {
+        const auto& transport = reader->GetTransport();
         if (ec) {
           LOG.Error("[%llX] failed to receive auth request packet, reason: %s",
                     transport->GetId(), ec.message().c_str());
           transport->StartClose();
           return;
         }
+        // a previous thestral hop may have forwarded the ID of its trace
+        auto session_trace = trace;
+        if (auto trace_id = packet.TakeTraceId()) {
+          if (session_trace) {
+            session_trace->SetForwardedId(trace_id);
+          } else {
+            session_trace =
+                trace::Trace::StartForwarded(trace_id, accept_time);
+          }
+        }
+        if (session_trace) {
+          session_trace->Record(trace::Event::kGreeting);
+        }
         AuthMethodSelectPacket response;
         if (std::find(packet.methods.cbegin(), packet.methods.cend(),
                       AuthMethod::kNoAuth) == packet.methods.cend()) {
@@ -85,20 +214,65 @@ bool SocksTcpServer::HandleNewConnection(
             transport->StartClose();
           });
         } else {
-          LOG.Debug("[%llX] sending auth acknowledgment packet",
-                    transport->GetId());
           response.method = AuthMethod::kNoAuth;
-          response.StartWriteTo(
-              transport, std::bind(&SocksTcpServer::ReceiveRequestPacket, self,
-                                   _1, transport));
+          if (reader->HasBuffered()) {
+            // the client has sent the request without waiting for the reply,
+            // so the reply can go along with the SOCKS response
+            THESTRAL_LOG_DEBUG(LOG,
+                               "[%llX] deferring auth acknowledgment packet",
+                               transport->GetId());
+            self->ReceiveRequestPacket(ec_type(), reader, response.Serialize(),
+                                       timer, session_trace);
+          } else {
+            THESTRAL_LOG_DEBUG(LOG, "[%llX] sending auth acknowledgment packet",
+                               transport->GetId());
+            response.StartWriteTo(
+                transport,
+                std::bind(&SocksTcpServer::ReceiveRequestPacket, self, _1,
+                          reader, std::string(), timer, session_trace));
+          }
         }
       });
 
   return true;
 }
 
+void SocksTcpServer::HandleNewStream(
+    const std::shared_ptr<TransportBase>& stream) {
+  // the client sends the request right away without auth negotiation, and
+  // expects only the SOCKS response
+  auto timer = StartTimeout(handshake_timeout_, stream, "handshake");
+  std::shared_ptr<trace::Trace> trace;
+  if (trace::IsEnabled()) {
+    trace = trace::Trace::StartSampled(trace::Trace::ClockType::now());
+  }
+  ReceiveRequestPacket(ec_type(), PacketReader::New(stream), std::string(),
+                       timer, trace);
+}
+
+std::shared_ptr<TimingWheel::Timer> SocksTcpServer::StartTimeout(
+    DurationType timeout, const std::shared_ptr<TransportBase>& transport,
+    const char* stage) {
+  if (timeout == DurationType::zero()) {
+    return nullptr;
+  }
+  auto& wheel = boost::asio::use_service<TimingWheel>(
+      *server_transport_factory_->get_io_service_ptr());
+  return std::make_shared<TimingWheel::Timer>(
+      wheel.Start(timeout, [transport, stage]() {
+        LOG.Warn("[%llX] %s timed out, closing the connection",
+                 transport->GetId(), stage);
+        kTimeouts.Increment();
+        transport->StartClose();
+      }));
+}
+
 void SocksTcpServer::ReceiveRequestPacket(
-    const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+    const ec_type& ec, const std::shared_ptr<PacketReader>& reader,
+    const std::string& reply_prefix,
+    const std::shared_ptr<TimingWheel::Timer>& timer,
+    const std::shared_ptr<trace::Trace>& trace) {
+  const auto& transport = reader->GetTransport();
   if (ec) {
     LOG.Error("[%llX] failed to send auth acknowledgment packet, reason: %s",
               transport->GetId(), ec.message().c_str());
@@ -107,53 +281,124 @@ void SocksTcpServer::ReceiveRequestPacket(
   }
 
   auto self = shared_from_this();
-  LOG.Debug("[%llX] receiving SOCKS request packet", transport->GetId());
-  RequestPacket::StartCreateFrom(
-      transport, [self, transport](const ec_type& ec, RequestPacket packet) {
-        if (ec) {
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] receiving SOCKS request packet",
+                     transport->GetId());
+  reader->StartReadPacket<RequestPacket>(
+      [self, reader, reply_prefix, timer, trace](const ec_type& ec,
+                                                 RequestPacket packet) {
+        const auto& transport = reader->GetTransport();
+        if (timer) {
+          timer->Cancel();
+        }
+        if (trace) {
+          trace->Record(trace::Event::kRequest);
+        }
+        if (ec == boost::system::errc::protocol_error) {
+          LOG.Error("[%llX] downstream requested an unsupported address type",
+                    transport->GetId());
+          self->ResponseError(ResponseCode::kAddressTypeNotSupported,
+                              transport, reply_prefix);
+        } else if (ec) {
           LOG.Error("[%llX] failed to receive SOCKS request packet, reason: %s",
                     transport->GetId(), ec.message().c_str());
           transport->StartClose();
+        } else if (packet.header.command == Command::kUdpAssociate &&
+                   self->udp_associate_) {
+          self->HandleUdpAssociate(packet, transport, reply_prefix);
         } else if (packet.header.command != Command::kConnect) {
           LOG.Error("[%llX] downstream requested an unsupported command %s",
                     transport->GetId(),
                     to_string(packet.header.command).c_str());
-          self->ResponseError(ResponseCode::kCommandNotSupported, transport);
+          self->ResponseError(ResponseCode::kCommandNotSupported, transport,
+                              reply_prefix);
         } else {
-          // TODO(richardtsai): ACL on request
-          self->HandleRequest(packet, transport);
+          // data pipelined after the request are forwarded to the upstream
+          self->HandleRequest(packet, transport, reader->TakeBuffered(),
+                              reply_prefix, trace);
         }
       });
 }
 
 void SocksTcpServer::HandleRequest(
-    RequestPacket request, const std::shared_ptr<TransportBase>& downstream) {
+    RequestPacket request, const std::shared_ptr<TransportBase>& downstream,
+    const std::string& early_data, const std::string& reply_prefix,
+    const std::shared_ptr<trace::Trace>& trace) {
   Address downstream_address = downstream->GetRemoteAddress();
-  LOG.Info(
-      "[%llX] establishing connection to %s, "
+  THESTRAL_LOG_INFO(
+      LOG, "[%llX] establishing connection to %s, "
       "on behalf of downstream %s",
-      downstream->GetId(), request.body.ToString().c_str(),
-      downstream_address.ToString().c_str());
+      downstream->GetId(), request.body.Format().c_str(),
+      downstream_address.Format().c_str());
+
+  const auto* upstream_factory = &upstream_factory_;
+  if (routes_) {
+    auto target = routes_->Lookup(request.body);
+    if (target == RouteTable::kDeny) {
+      LOG.Warn("[%llX] request to %s denied by the routes",
+               downstream->GetId(), request.body.Format().c_str());
+      ResponseError(ResponseCode::kConnectionNotAllow, downstream,
+                    reply_prefix);
+      return;
+    } else if (target != RouteTable::kAllow) {
+      upstream_factory = &routed_upstreams_[target];
+    }
+  }
 
   auto self = shared_from_this();
-  upstream_factory_->StartRequest(
+  std::shared_ptr<TimingWheel::Timer> timer;
+  if (connect_timeout_ != DurationType::zero()) {
+    // the request can't be cancelled, its result is dropped on arrival
+    auto& wheel = boost::asio::use_service<TimingWheel>(
+        *server_transport_factory_->get_io_service_ptr());
+    timer = std::make_shared<TimingWheel::Timer>(
+        wheel.Start(connect_timeout_, [self, downstream, reply_prefix]() {
+          LOG.Warn("[%llX] upstream connection timed out",
+                   downstream->GetId());
+          kTimeouts.Increment();
+          self->ResponseError(ResponseCode::kTtlExpired, downstream,
+                              reply_prefix);
+        }));
+  }
+  if (trace) {
+    trace->SetDescription(std::string(downstream_address.Format().c_str()) +
+                          " -> " + request.body.Format().c_str());
+  }
+  // the upstream factories pick the trace up themselves
+  trace::Scope trace_scope(trace);
+  auto start = metrics::Histogram::ClockType::now();
+  (*upstream_factory)->StartRequest(
       request.body,
-      [self, request, downstream](
-          const ec_type& ec, const std::shared_ptr<TransportBase>& upstream) {
+      [self, request, downstream, early_data, reply_prefix, start, timer,
+       trace](const ec_type& ec,
+              const std::shared_ptr<TransportBase>& upstream) {
+        if (timer) {
+          if (!timer->IsPending()) {  // the downstream has got a response
+            if (upstream) {
+              upstream->StartClose();
+            }
+            return;
+          }
+          timer->Cancel();
+        }
         if (ec) {
           // TODO(richardtsai): handle more kinds of errors
           LOG.Error("[%llX] failed to establish connection, reason: %s",
                     downstream->GetId(), ec.message().c_str());
-          self->ResponseError(ResponseCode::kConnectionRefused, downstream);
+          // e.g. all the resolved addresses are denied by the routes
+          self->ResponseError(ec == boost::asio::error::access_denied
+                                  ? ResponseCode::kConnectionNotAllow
+                                  : ResponseCode::kConnectionRefused,
+                              downstream, reply_prefix);
         } else {
+          kUpstreamConnectLatency.ObserveSince(start);
           ResponsePacket response;
           response.header.response_code = ResponseCode::kSuccess;
           response.body = upstream->GetLocalAddress();
-          LOG.Debug("[%llX => %llX] sending SOCKS response to downstream",
-                    downstream->GetId(), upstream->GetId());
-          response.StartWriteTo(downstream, [self, request, downstream,
-                                             upstream](const ec_type& ec,
-                                                       size_t) {
+          THESTRAL_LOG_DEBUG(
+              LOG, "[%llX => %llX] sending SOCKS response to downstream",
+              downstream->GetId(), upstream->GetId());
+          auto on_sent = [self, request, downstream, upstream, early_data,
+                          trace](const ec_type& ec, size_t) {
             if (ec) {
               LOG.Error(
                   "[%llX => %llX] failed to send SOCKS response, reason: %s",
@@ -161,51 +406,296 @@ void SocksTcpServer::HandleRequest(
               downstream->StartClose();
               upstream->StartClose();
             } else {
-              // start relay in both direction
               Address downstream_address = downstream->GetRemoteAddress();
-              LOG.Info(
-                  "[%llX => %llX] connection established to %s, "
+              THESTRAL_LOG_INFO(
+                  LOG, "[%llX => %llX] connection established to %s, "
                   "on behalf of downstream %s, start relaying",
                   downstream->GetId(), upstream->GetId(),
-                  request.body.ToString().c_str(),
-                  downstream_address.ToString().c_str());
-              self->StartRelay(downstream, upstream);
-              self->StartRelay(upstream, downstream);
+                  request.body.Format().c_str(),
+                  downstream_address.Format().c_str());
+              if (trace) {
+                trace->Record(trace::Event::kReady);
+              }
+              self->StartRelays(downstream, upstream, early_data, trace);
             }
-          });
+          };
+          self->SendResponse(response, downstream, reply_prefix, on_sent);
         }
       });
 }
 
-void SocksTcpServer::ResponseError(
-    ResponseCode response_code,
-    const std::shared_ptr<TransportBase>& transport) {
+void SocksTcpServer::HandleUdpAssociate(
+    const RequestPacket& request,
+    const std::shared_ptr<TransportBase>& transport,
+    const std::string& reply_prefix) {
+  // datagrams are accepted from the address in the request, or the address of
+  // the control connection if the client doesn't know it yet
+  auto client_address = ToIpAddress(request.body);
+  if (client_address.is_unspecified()) {
+    client_address = ToIpAddress(transport->GetRemoteAddress());
+  }
+  ip::udp::endpoint client_endpoint(client_address, request.body.port);
+  THESTRAL_LOG_INFO(LOG, "[%llX] opening UDP association for downstream %s",
+                    transport->GetId(),
+                    transport->GetRemoteAddress().Format().c_str());
+
+  if (!udp_dns_cache_) {
+    udp_dns_cache_ =
+        DnsCache::New(server_transport_factory_->get_io_service_ptr());
+  }
+  auto association = SocksUdpAssociation::New(
+      server_transport_factory_->get_io_service_ptr(), udp_dns_cache_);
+  association->SetRoutes(routes_);
+  if (rate_limiter_) {
+    association->SetRateLimit(
+        rate_limiter_->StartSession(transport->GetRemoteAddress()));
+  }
+  auto ec = association->Open(ToIpAddress(transport->GetLocalAddress()),
+                              client_endpoint);
+  if (ec) {
+    LOG.Error("[%llX] failed to open UDP association, reason: %s",
+              transport->GetId(), ec.message().c_str());
+    ResponseError(ResponseCode::kSocksServerFailure, transport, reply_prefix);
+    return;
+  }
+
   ResponsePacket response;
-  response.header.response_code = response_code;
-  response.StartWriteTo(transport, [transport](const ec_type&, size_t) {
-    transport->StartClose();
-  });
+  response.header.response_code = ResponseCode::kSuccess;
+  response.body = Address::FromAsioEndpoint(association->GetLocalEndpoint());
+  auto self = shared_from_this();
+  SendResponse(response, transport, reply_prefix,
+               [self, transport, association](const ec_type& ec, size_t) {
+                 if (ec) {
+                   LOG.Error(
+                       "[%llX] failed to send SOCKS response, reason: %s",
+                       transport->GetId(), ec.message().c_str());
+                   association->Close();
+                   transport->StartClose();
+                   return;
+                 }
+                 association->SetIdleTimer(self->StartTimeout(
+                     self->idle_timeout_, transport, "idle association"));
+                 association->Start();
+                 WatchControl(transport, association, self->TrackSession());
+               });
 }
 
-void SocksTcpServer::StartRelay(const std::shared_ptr<TransportBase>& from,
-                                const std::shared_ptr<TransportBase>& to) {
-  auto self = shared_from_this();
-  auto buf = std::make_shared<std::array<char, kRelayBufferSize>>();
-  from->StartRead(
-      *buf,
-      [self, buf, from, to](const ec_type& error_code, size_t bytes_read) {
-        if (bytes_read == 0 || error_code) {
-          // TODO(richardtsai): finer control on shutdown
-          // TODO(richardtsai): log this event
-          from->StartClose();
-          to->StartClose();
+void SocksTcpServer::WatchControl(
+    const std::shared_ptr<TransportBase>& transport,
+    const std::shared_ptr<SocksUdpAssociation>& association,
+    const std::shared_ptr<void>& active_token) {
+  auto buffer = std::make_shared<std::array<char, 64>>();
+  transport->StartRead(
+      *buffer,
+      [transport, association, active_token, buffer](const ec_type& ec,
+                                                     size_t) {
+        if (ec) {
+          THESTRAL_LOG_INFO(LOG, "[%llX] UDP association closed",
+                            transport->GetId());
+          association->Close();
+          transport->StartClose();
         } else {
-          to->StartWrite(
-              buf->data(), bytes_read,
-              std::bind(&SocksTcpServer::StartRelay, self, from, to));
+          WatchControl(transport, association, active_token);
         }
       },
-      true /* allow short read */);
+      true);
+}
+
+void SocksTcpServer::StartRelays(
+    const std::shared_ptr<TransportBase>& downstream,
+    const std::shared_ptr<TransportBase>& upstream,
+    const std::string& early_data,
+    const std::shared_ptr<trace::Trace>& trace) {
+  // both directions hold the session until they are done
+  auto session = std::make_shared<RelaySession>();
+  session->active_token = TrackSession();
+  session->trace = trace;
+  if (rate_limiter_) {
+    session->buckets =
+        rate_limiter_->StartSession(downstream->GetRemoteAddress());
+  }
+  if (idle_timeout_ != DurationType::zero()) {
+    auto& wheel = boost::asio::use_service<TimingWheel>(
+        *server_transport_factory_->get_io_service_ptr());
+    session->idle_timer =
+        wheel.Start(idle_timeout_, [downstream, upstream]() {
+          THESTRAL_LOG_INFO(LOG, "[%llX => %llX] session idle, closing",
+                            downstream->GetId(), upstream->GetId());
+          kTimeouts.Increment();
+          downstream->StartClose();
+          upstream->StartClose();
+        });
+  }
+  if (!StartSpliceRelay(upstream, downstream, session, kDownstreamBytes,
+                        trace::Event::kFirstByteDown)) {
+    StartRelay(upstream, downstream, session, kDownstreamBytes,
+               trace::Event::kFirstByteDown);
+  }
+  if (early_data.empty()) {
+    if (!StartSpliceRelay(downstream, upstream, session, kUpstreamBytes,
+                          trace::Event::kFirstByteUp)) {
+      StartRelay(downstream, upstream, session, kUpstreamBytes,
+                 trace::Event::kFirstByteUp);
+    }
+    return;
+  }
+
+  // flush the data already read from the downstream before relaying the rest
+  THESTRAL_LOG_DEBUG(LOG, "[%llX => %llX] forwarding %zu bytes of early data",
+                     downstream->GetId(), upstream->GetId(), early_data.size());
+  auto self = shared_from_this();
+  auto data = std::make_shared<std::string>(early_data);
+  upstream->StartWrite(
+      *data,
+      [self, downstream, upstream, data, session](const ec_type& ec,
+                                                  size_t) {
+        if (ec) {
+          LOG.Error("[%llX => %llX] failed to forward early data, reason: %s",
+                    downstream->GetId(), upstream->GetId(),
+                    ec.message().c_str());
+          session->is_closed = true;
+          downstream->StartClose();
+          upstream->StartClose();
+          return;
+        }
+        kUpstreamBytes.Increment(data->size());
+        if (session->buckets) {
+          session->buckets->Consume(static_cast<int64_t>(data->size()));
+        }
+        if (session->trace) {
+          session->trace->Record(trace::Event::kFirstByteUp);
+        }
+        if (!self->StartSpliceRelay(downstream, upstream, session,
+                                    kUpstreamBytes,
+                                    trace::Event::kFirstByteUp)) {
+          self->StartRelay(downstream, upstream, session, kUpstreamBytes,
+                           trace::Event::kFirstByteUp);
+        }
+      });
+}
+
+void SocksTcpServer::ResponseError(
+    ResponseCode response_code, const std::shared_ptr<TransportBase>& transport,
+    const std::string& reply_prefix) {
+  auto index = static_cast<std::size_t>(response_code) - 1;
+  if (index < sizeof(kRequestErrors) / sizeof(kRequestErrors[0])) {
+    kRequestErrors[index].Increment();
+  }
+  ResponsePacket response;
+  response.header.response_code = response_code;
+  SendResponse(response, transport, reply_prefix,
+               [transport](const ec_type&, size_t) {
+                 transport->StartClose();
+               });
+}
+
+void SocksTcpServer::SendResponse(
+    const ResponsePacket& response,
+    const std::shared_ptr<TransportBase>& transport,
+    const std::string& reply_prefix,
+    const TransportBase::WriteCallbackType& callback) {
+  if (reply_prefix.empty()) {
+    response.StartWriteTo(transport, callback);
+    return;
+  }
+  // coalesce the deferred replies into a single write
+  auto data = std::make_shared<std::string>(reply_prefix);
+  response.SerializeTo(data.get());
+  transport->StartWrite(
+      *data, [callback, data](const ec_type& ec, size_t bytes_written) {
+        callback(ec, bytes_written);
+      });
+}
+
+void SocksTcpServer::StartRelay(const std::shared_ptr<TransportBase>& from,
+                                const std::shared_ptr<TransportBase>& to,
+                                const std::shared_ptr<RelaySession>& session,
+                                const metrics::Counter& byte_counter,
+                                trace::Event first_byte) {
+  auto relay = CopyRelay::New(from, to,
+                              server_transport_factory_->get_io_service_ptr());
+  relay->SetByteCounter(&byte_counter);
+  if (session->trace) {
+    relay->SetTrace(session->trace, first_byte);
+  }
+  if (session->idle_timer.IsPending()) {
+    relay->SetIdleTimer(std::shared_ptr<TimingWheel::Timer>(
+        session, &session->idle_timer));
+  }
+  if (session->buckets) {
+    relay->SetRateLimit(session->buckets);
+  }
+  relay->Start([from, to, session](const ec_type& ec) {
+    HandleRelayDone(ec, from, to, session);
+  });
+}
+
+bool SocksTcpServer::StartSpliceRelay(
+    const std::shared_ptr<TransportBase>& from,
+    const std::shared_ptr<TransportBase>& to,
+    const std::shared_ptr<RelaySession>& session,
+    const metrics::Counter& byte_counter, trace::Event first_byte) {
+  if (session->buckets || !SpliceRelay::IsApplicable(from, to)) {
+    return false;
+  }
+
+  ec_type ec;
+  auto relay = SpliceRelay::New(
+      from, to, server_transport_factory_->get_io_service_ptr(), ec);
+  if (!relay) {
+    LOG.Warn("[%llX => %llX] failed to set up splice relay, reason: %s",
+             from->GetId(), to->GetId(), ec.message().c_str());
+    return false;
+  }
+
+  relay->SetByteCounter(&byte_counter);
+  if (session->idle_timer.IsPending()) {
+    relay->SetIdleTimer(std::shared_ptr<TimingWheel::Timer>(
+        session, &session->idle_timer));
+  }
+  if (session->trace) {
+    relay->SetTrace(session->trace, first_byte);
+  }
+  relay->Start([from, to, session](const ec_type& ec) {
+    HandleRelayDone(ec, from, to, session);
+  });
+  return true;
+}
+
+void SocksTcpServer::HandleRelayDone(
+    const ec_type& ec, const std::shared_ptr<TransportBase>& from,
+    const std::shared_ptr<TransportBase>& to,
+    const std::shared_ptr<RelaySession>& session) {
+  if (session->is_closed) {
+    return;  // the other direction has failed
+  }
+  bool is_eof = ec == boost::asio::error::eof ||
+                ec == boost::asio::ssl::error::stream_truncated;
+  if (is_eof && ++session->n_finished < 2) {
+    THESTRAL_LOG_DEBUG(LOG, "[%llX => %llX] end of stream, half-closing",
+                       from->GetId(), to->GetId());
+    to->StartShutdownSend([from, to, session](const ec_type& ec) {
+      if (ec && !session->is_closed) {
+        THESTRAL_LOG_DEBUG(LOG, "[%llX] failed to half-close, reason: %s",
+                           to->GetId(), ec.message().c_str());
+        session->is_closed = true;
+        from->StartClose();
+        to->StartClose();
+      }
+    });
+    return;
+  }
+
+  if (is_eof) {
+    THESTRAL_LOG_DEBUG(LOG, "[%llX => %llX] both directions finished",
+                       from->GetId(), to->GetId());
+  } else {
+    THESTRAL_LOG_DEBUG(LOG, "[%llX => %llX] relay stopped, reason: %s",
+                       from->GetId(), to->GetId(), ec.message().c_str());
+  }
+  session->is_closed = true;
+  from->StartClose();
+  to->StartClose();
 }
 
 }  // namespace socks
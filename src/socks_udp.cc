@@ -0,0 +1,510 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the UDP relay serving SOCKS UDP ASSOCIATE requests.
+#include "socks_udp.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(THESTRAL_HAVE_MMSG)
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#endif
+
+#include "metrics.h"
+
+namespace thestral {
+namespace socks {
+
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+namespace {
+
+const metrics::Counter kUpstreamDatagrams(
+    "thestral_socks_udp_datagrams_total", "Number of UDP datagrams relayed.",
+    "direction=\"upstream\"");
+const metrics::Counter kDownstreamDatagrams(
+    "thestral_socks_udp_datagrams_total", "Number of UDP datagrams relayed.",
+    "direction=\"downstream\"");
+const metrics::Counter kDroppedDatagrams(
+    "thestral_socks_udp_dropped_total",
+    "Number of UDP datagrams dropped as malformed, fragmented, unsendable, "
+    "denied by the routes or over the rate limits.");
+
+/// Number of batches received in a row before waiting again, so that a busy
+/// association can't starve the others.
+constexpr int kMaxBatchesPerWait = 4;
+
+}  // anonymous namespace
+
+ParseResult ParseUdpHeader(const char* data, std::size_t size,
+                           UdpHeaderView* header) {
+  // RSV(2) FRAG(1) ATYP(1) ADDR PORT(2)
+  if (size < 4) {
+    return ParseResult::kIncomplete;
+  }
+  std::size_t host_begin = 4;
+  std::size_t host_size;
+  switch (static_cast<AddressType>(data[3])) {
+    case AddressType::kIPv4:
+      host_size = 4;
+      break;
+    case AddressType::kIPv6:
+      host_size = 16;
+      break;
+    case AddressType::kDomainName:
+      if (size < 5) {
+        return ParseResult::kIncomplete;
+      }
+      host_begin = 5;
+      host_size = static_cast<uint8_t>(data[4]);
+      break;
+    default:
+      return ParseResult::kInvalid;
+  }
+  std::size_t header_size = host_begin + host_size + 2;
+  if (size < header_size) {
+    return ParseResult::kIncomplete;
+  }
+  header->fragment = static_cast<uint8_t>(data[2]);
+  header->type = static_cast<AddressType>(data[3]);
+  header->host = data + host_begin;
+  header->host_size = host_size;
+  header->port = static_cast<uint16_t>(
+      static_cast<uint8_t>(data[header_size - 2]) << 8 |
+      static_cast<uint8_t>(data[header_size - 1]));
+  header->size = header_size;
+  return ParseResult::kOk;
+}
+
+std::size_t WriteUdpHeader(const ip::udp::endpoint& endpoint, char* data) {
+  data[0] = data[1] = data[2] = 0;
+  std::size_t port_offset;
+  auto address = endpoint.address();
+  if (address.is_v4()) {
+    auto bytes = address.to_v4().to_bytes();
+    data[3] = static_cast<char>(AddressType::kIPv4);
+    std::memcpy(data + 4, bytes.data(), bytes.size());
+    port_offset = 4 + bytes.size();
+  } else {
+    auto bytes = address.to_v6().to_bytes();
+    data[3] = static_cast<char>(AddressType::kIPv6);
+    std::memcpy(data + 4, bytes.data(), bytes.size());
+    port_offset = 4 + bytes.size();
+  }
+  data[port_offset] = static_cast<char>(endpoint.port() >> 8);
+  data[port_offset + 1] = static_cast<char>(endpoint.port());
+  return port_offset + 2;
+}
+
+ip::address ToIpAddress(const Address& address) {
+  auto asio_address = address.ToAsioAddress();
+  if (asio_address.is_v6() && asio_address.to_v6().is_v4_mapped()) {
+    return ip::make_address_v4(ip::v4_mapped, asio_address.to_v6());
+  }
+  return asio_address;
+}
+
+namespace impl {
+
+asio::io_service::id UdpBatchBuffers::id;
+
+constexpr std::size_t UdpBatchBuffers::kBatchSize;
+constexpr std::size_t UdpBatchBuffers::kBufferSize;
+
+char* UdpBatchBuffers::GetBuffer(std::size_t i) {
+  if (!buffers_) {
+    buffers_.reset(new char[kBatchSize * kBufferSize]);
+  }
+  return buffers_.get() + i * kBufferSize;
+}
+
+}  // namespace impl
+
+logging::Logger SocksUdpAssociation::LOG("SocksUdpAssociation");
+
+ec_type SocksUdpAssociation::Open(const ip::address& bind_address,
+                                  const ip::udp::endpoint& client_endpoint) {
+  ip::udp::endpoint endpoint(bind_address, 0);
+  ec_type ec;
+  socket_.open(endpoint.protocol(), ec);
+  if (!ec) {
+    socket_.bind(endpoint, ec);
+  }
+  if (!ec) {
+    socket_.non_blocking(true, ec);
+  }
+  if (ec) {
+    return ec;
+  }
+#if defined(THESTRAL_HAVE_MMSG) && defined(UDP_GRO)
+  // coalesced datagrams are split by the segment size reported in ReceiveBatch
+  int enabled = 1;
+  setsockopt(socket_.native_handle(), IPPROTO_UDP, UDP_GRO, &enabled,
+             sizeof(enabled));
+#endif
+  client_endpoint_ = client_endpoint;
+  return ec;
+}
+
+ip::udp::endpoint SocksUdpAssociation::GetLocalEndpoint() const {
+  ec_type ec;
+  return socket_.local_endpoint(ec);
+}
+
+void SocksUdpAssociation::Start() {
+  THESTRAL_LOG_DEBUG(LOG, "relaying datagrams on port %u for client %s:%u",
+                     GetLocalEndpoint().port(),
+                     client_endpoint_.address().to_string().c_str(),
+                     client_endpoint_.port());
+  WaitReadable();
+}
+
+void SocksUdpAssociation::Close() {
+  if (is_closed_) {
+    return;
+  }
+  is_closed_ = true;
+  ec_type ec;
+  socket_.close(ec);
+  idle_timer_.reset();
+}
+
+void SocksUdpAssociation::WaitReadable() {
+  auto self = shared_from_this();
+  socket_.async_wait(ip::udp::socket::wait_read,
+                     [self](const ec_type& ec) { self->HandleReadable(ec); });
+}
+
+void SocksUdpAssociation::HandleReadable(const ec_type& ec) {
+  if (is_closed_) {
+    return;
+  }
+  if (ec) {
+    LOG.Error("failed to wait for datagrams, reason: %s",
+              ec.message().c_str());
+    return;
+  }
+
+  n_upstream_ = n_downstream_ = n_dropped_ = 0;
+  for (int i = 0; i < kMaxBatchesPerWait; ++i) {
+    auto n_received = ReceiveBatch();
+    for (std::size_t j = 0; j < n_received; ++j) {
+      const char* data = batch_.GetBuffer(j);
+      auto size = batch_.sizes[j];
+      auto segment_size = std::max<std::size_t>(batch_.segment_sizes[j], 1);
+      for (std::size_t offset = 0; offset < size; offset += segment_size) {
+        HandleDatagram(batch_.sources[j], data + offset,
+                       std::min(segment_size, size - offset));
+      }
+    }
+    SendBatch();
+    if (n_received < impl::UdpBatchBuffers::kBatchSize) {
+      break;
+    }
+  }
+
+  kUpstreamDatagrams.Increment(n_upstream_);
+  kDownstreamDatagrams.Increment(n_downstream_);
+  kDroppedDatagrams.Increment(n_dropped_);
+  if (idle_timer_ && n_upstream_ + n_downstream_ > 0) {
+    idle_timer_->Touch();
+  }
+  WaitReadable();
+}
+
+std::size_t SocksUdpAssociation::ReceiveBatch() {
+  constexpr auto kBatchSize = impl::UdpBatchBuffers::kBatchSize;
+  constexpr auto kBufferSize = impl::UdpBatchBuffers::kBufferSize;
+#if defined(THESTRAL_HAVE_MMSG)
+  std::array<mmsghdr, kBatchSize> messages;
+  std::array<iovec, kBatchSize> iovecs;
+#if defined(UDP_GRO)
+  typedef char ControlType[CMSG_SPACE(sizeof(int))];
+  alignas(cmsghdr) ControlType controls[kBatchSize];
+#endif
+  for (std::size_t i = 0; i < kBatchSize; ++i) {
+    iovecs[i].iov_base = batch_.GetBuffer(i);
+    iovecs[i].iov_len = kBufferSize;
+    auto& header = messages[i].msg_hdr;
+    std::memset(&header, 0, sizeof(header));
+    header.msg_name = batch_.sources[i].data();
+    header.msg_namelen =
+        static_cast<socklen_t>(batch_.sources[i].capacity());
+    header.msg_iov = &iovecs[i];
+    header.msg_iovlen = 1;
+#if defined(UDP_GRO)
+    header.msg_control = controls[i];
+    header.msg_controllen = sizeof(controls[i]);
+#endif
+  }
+  int n_received = recvmmsg(socket_.native_handle(), messages.data(),
+                            kBatchSize, MSG_DONTWAIT, nullptr);
+  if (n_received <= 0) {
+    return 0;  // nothing to read, or an error to be reported again later
+  }
+
+  for (int i = 0; i < n_received; ++i) {
+    auto& header = messages[i].msg_hdr;
+    batch_.sources[i].resize(header.msg_namelen);
+    batch_.sizes[i] = messages[i].msg_len;
+    batch_.segment_sizes[i] = messages[i].msg_len;
+#if defined(UDP_GRO)
+    for (auto cmsg = CMSG_FIRSTHDR(&header); cmsg;
+         cmsg = CMSG_NXTHDR(&header, cmsg)) {
+      if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int segment_size;
+        std::memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+        batch_.segment_sizes[i] = static_cast<std::size_t>(segment_size);
+      }
+    }
+#endif
+  }
+  return static_cast<std::size_t>(n_received);
+#else
+  std::size_t n_received = 0;
+  while (n_received < kBatchSize) {
+    ec_type ec;
+    auto size = socket_.receive_from(
+        asio::buffer(batch_.GetBuffer(n_received), kBufferSize),
+        batch_.sources[n_received], 0, ec);
+    if (ec) {
+      break;
+    }
+    batch_.sizes[n_received] = size;
+    batch_.segment_sizes[n_received] = size;
+    ++n_received;
+  }
+  return n_received;
+#endif
+}
+
+void SocksUdpAssociation::HandleDatagram(const ip::udp::endpoint& source,
+                                         const char* data, std::size_t size) {
+  if (source.address() == client_endpoint_.address() &&
+      (client_endpoint_.port() == 0 ||
+       source.port() == client_endpoint_.port())) {
+    if (client_endpoint_.port() == 0) {
+      client_endpoint_.port(source.port());
+    }
+    RelayFromClient(data, size);
+  } else {
+    RelayFromTarget(source, data, size);
+  }
+}
+
+void SocksUdpAssociation::RelayFromClient(const char* data, std::size_t size) {
+  UdpHeaderView header;
+  if (ParseUdpHeader(data, size, &header) != ParseResult::kOk ||
+      header.fragment != 0) {
+    ++n_dropped_;
+    return;
+  }
+  const char* payload = data + header.size;
+  auto payload_size = size - header.size;
+
+  ip::address address;
+  switch (header.type) {
+    case AddressType::kIPv4: {
+      ip::address_v4::bytes_type bytes;
+      std::memcpy(bytes.data(), header.host, bytes.size());
+      address = ip::address_v4(bytes);
+      break;
+    }
+    case AddressType::kIPv6: {
+      ip::address_v6::bytes_type bytes;
+      std::memcpy(bytes.data(), header.host, bytes.size());
+      address = ip::address_v6(bytes);
+      break;
+    }
+    default:
+      if (header.host_size != last_host_.size() ||
+          std::memcmp(header.host, last_host_.data(), header.host_size) != 0) {
+        ResolveAndSend(std::string(header.host, header.host_size),
+                       header.port,
+                       std::make_shared<std::string>(payload, payload_size));
+        return;
+      }
+      address = last_host_address_;
+      break;
+  }
+
+  ip::udp::endpoint endpoint(address, header.port);
+  bool is_domain = header.type == AddressType::kDomainName;
+  if (!IsRouted(is_domain ? header.host : nullptr, header.host_size,
+                endpoint) ||
+      !ConsumeTokens(payload_size)) {
+    ++n_dropped_;
+    return;
+  }
+  auto& datagram = NextOutgoing();
+  datagram.endpoint = endpoint;
+  datagram.header_size = 0;
+  datagram.payload = payload;
+  datagram.payload_size = payload_size;
+  ++n_upstream_;
+}
+
+void SocksUdpAssociation::RelayFromTarget(const ip::udp::endpoint& source,
+                                          const char* data, std::size_t size) {
+  if (client_endpoint_.port() == 0) {
+    ++n_dropped_;  // the client hasn't sent anything yet
+    return;
+  }
+  if (!ConsumeTokens(size)) {
+    ++n_dropped_;
+    return;
+  }
+  auto& datagram = NextOutgoing();
+  datagram.endpoint = client_endpoint_;
+  datagram.header_size = WriteUdpHeader(source, datagram.header.data());
+  datagram.payload = data;
+  datagram.payload_size = size;
+  ++n_downstream_;
+}
+
+impl::UdpBatchBuffers::OutgoingDatagram& SocksUdpAssociation::NextOutgoing() {
+  if (batch_.n_outgoing == impl::UdpBatchBuffers::kBatchSize) {
+    SendBatch();
+  }
+  return batch_.outgoing[batch_.n_outgoing++];
+}
+
+bool SocksUdpAssociation::IsRouted(const char* host, std::size_t host_size,
+                                   const ip::udp::endpoint& endpoint) const {
+  if (!routes_) {
+    return true;
+  }
+  auto resolved = Address::FromAsioEndpoint(endpoint);
+  RouteTable::Target target;
+  if (host) {
+    Address destination;
+    destination.type = AddressType::kDomainName;
+    destination.host.assign(host, host_size);
+    destination.port = endpoint.port();
+    target = routes_->Lookup(destination, resolved);
+  } else {
+    target = routes_->Lookup(resolved);
+  }
+  // the datagrams of other upstreams can't be sent from here either
+  return target == RouteTable::kAllow;
+}
+
+bool SocksUdpAssociation::ConsumeTokens(std::size_t size) {
+  if (!buckets_) {
+    return true;
+  }
+  if (buckets_->GetDelay() != TokenBucket::ClockType::duration::zero()) {
+    return false;
+  }
+  buckets_->Consume(static_cast<int64_t>(size));
+  return true;
+}
+
+void SocksUdpAssociation::SendBatch() {
+  constexpr auto kBatchSize = impl::UdpBatchBuffers::kBatchSize;
+  auto n_outgoing = batch_.n_outgoing;
+  batch_.n_outgoing = 0;
+#if defined(THESTRAL_HAVE_MMSG)
+  std::array<mmsghdr, kBatchSize> messages;
+  std::array<std::array<iovec, 2>, kBatchSize> iovecs;
+  for (std::size_t i = 0; i < n_outgoing; ++i) {
+    auto& datagram = batch_.outgoing[i];
+    iovecs[i][0].iov_base = datagram.header.data();
+    iovecs[i][0].iov_len = datagram.header_size;
+    iovecs[i][1].iov_base = const_cast<char*>(datagram.payload);
+    iovecs[i][1].iov_len = datagram.payload_size;
+    auto& header = messages[i].msg_hdr;
+    std::memset(&header, 0, sizeof(header));
+    header.msg_name = datagram.endpoint.data();
+    header.msg_namelen = static_cast<socklen_t>(datagram.endpoint.size());
+    header.msg_iov = iovecs[i].data();
+    header.msg_iovlen = 2;
+  }
+  std::size_t n_sent = 0;
+  while (n_sent < n_outgoing) {
+    int result = sendmmsg(socket_.native_handle(), messages.data() + n_sent,
+                          static_cast<unsigned int>(n_outgoing - n_sent),
+                          MSG_DONTWAIT);
+    if (result > 0) {
+      n_sent += static_cast<std::size_t>(result);
+    } else if (result < 0 && errno == EINTR) {
+      continue;
+    } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      n_dropped_ += n_outgoing - n_sent;  // no room in the socket buffer
+      return;
+    } else {
+      ++n_dropped_;  // skip the datagram failing, e.g. of a wrong family
+      ++n_sent;
+    }
+  }
+#else
+  for (std::size_t i = 0; i < n_outgoing; ++i) {
+    const auto& datagram = batch_.outgoing[i];
+    std::array<asio::const_buffer, 2> buffers{
+        {asio::buffer(datagram.header.data(), datagram.header_size),
+         asio::buffer(datagram.payload, datagram.payload_size)}};
+    ec_type ec;
+    socket_.send_to(buffers, datagram.endpoint, 0, ec);
+    if (ec) {
+      ++n_dropped_;
+    }
+  }
+#endif
+}
+
+void SocksUdpAssociation::ResolveAndSend(
+    const std::string& host, uint16_t port,
+    const std::shared_ptr<std::string>& payload) {
+  auto self = shared_from_this();
+  dns_cache_->StartResolve(host, [self, host, port, payload](
+      const ec_type& ec, const std::vector<ip::address>& addresses) {
+    if (self->is_closed_) {
+      return;
+    }
+    // only the addresses of the family of the socket are reachable
+    auto is_v4 = self->GetLocalEndpoint().address().is_v4();
+    auto iter = std::find_if(addresses.cbegin(), addresses.cend(),
+                             [is_v4](const ip::address& address) {
+                               return address.is_v4() == is_v4;
+                             });
+    ec_type send_ec = ec;
+    bool is_sent = false;
+    if (!send_ec && iter != addresses.cend()) {
+      ip::udp::endpoint endpoint(*iter, port);
+      // a denied host is looked up again on its next datagram
+      if (self->IsRouted(host.data(), host.size(), endpoint)) {
+        self->last_host_ = host;
+        self->last_host_address_ = *iter;
+        if (self->ConsumeTokens(payload->size())) {
+          self->socket_.send_to(asio::buffer(*payload), endpoint, 0, send_ec);
+          is_sent = !send_ec;
+        }
+      }
+    }
+    if (!is_sent) {
+      THESTRAL_LOG_DEBUG(LOG, "dropping a datagram to %s", host.c_str());
+      kDroppedDatagrams.Increment();
+    } else {
+      kUpstreamDatagrams.Increment();
+    }
+  });
+}
+
+}  // namespace socks
+}  // namespace thestral
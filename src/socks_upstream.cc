@@ -16,86 +16,240 @@
 /// Implements the classes for the upstream part of SOCKS protocol.
 #include "socks_upstream.h"
 
+#include <algorithm>
+
+#include "metrics.h"
+
 namespace thestral {
 namespace socks {
 
 namespace ip = boost::asio::ip;
 
+namespace {
+const metrics::Histogram kResolveLatency(
+    "thestral_dns_resolve_seconds", "Time taken to resolve a host name.",
+    metrics::Histogram::LatencyBounds(), "resolver=\"upstream\"");
+}  // anonymous namespace
+
 logging::Logger SocksTcpUpstreamFactory::LOG("SocksTcpUpstreamFactory");
 
+constexpr SocksTcpUpstreamFactory::ClockType::duration
+    SocksTcpUpstreamFactory::kResolveRetryDelay;
+
 void SocksTcpUpstreamFactory::StartRequest(
     const Address& endpoint, const RequestCallbackType& callback) {
-  LOG.Info("starting a request to host %s", endpoint.ToString().c_str());
-
-  ec_type ec;
-  std::shared_ptr<TransportBase> transport;
-
-  // if upstream_endpoint_ has not been initialized, we have to resolve the
-  // upstream host address first
-  if (!is_upstream_endpoint_init_) {
-    std::lock_guard<std::mutex> lock(upstream_endpoint_init_mtx_);
-
-    if (!is_upstream_endpoint_init_) {
-      // need to resolve the upstream host
-      // synchronous operations are used to simplify locking control
-      LOG.Debug("resolving upstream address %s, port: %u",
-                upstream_host_.c_str(), upstream_port_);
-      ip::tcp::resolver resolver(*transport_factory_->get_io_service_ptr());
-      ip::tcp::resolver::query query(
-          upstream_host_, std::to_string(upstream_port_),
-          ip::tcp::resolver::query::address_configured |
-              ip::tcp::resolver::query::numeric_service);
-
-      auto iter = resolver.resolve(query, ec);
-      if (ec) {
-        LOG.Error("failed to resolve upstream address %s, port: %u, reason: %s",
-                  upstream_host_.c_str(), upstream_port_, ec.message().c_str());
-        callback(ec, nullptr);
-        return;
-      }
-
-      LOG.Debug("try connecting to upstream");
-      transport = transport_factory_->TryConnect(iter, ec);
-      if (ec) {
-        LOG.Error("failed to connect to upstream, reason: %s",
-                  ec.message().c_str());
-        callback(ec, nullptr);
-        return;
-      }
-
-      upstream_endpoint_ = *iter;
-      is_upstream_endpoint_init_ = true;
-    }
-  }
+  THESTRAL_LOG_INFO(LOG, "starting a request to host %s",
+                    endpoint.Format().c_str());
+  auto trace = trace::Current();
 
-  if (transport) {  // connection to upstream established already
-    SendAuthRequest(endpoint, transport, callback);
-  } else {  // not connected yet
-    LOG.Debug("try connecting to upstream");
+  if (upstream_endpoints_.empty()) {
+    // wait for the upstream host to be resolved, along with other requests
     auto self = shared_from_this();
-    transport_factory_->StartConnect(
-        upstream_endpoint_,
-        [self, endpoint, callback](
-            const ec_type& ec,
-            const std::shared_ptr<TransportBase>& transport) {
+    resolve_waiters_.push_back(
+        [self, endpoint, callback, trace](const ec_type& ec) {
+          if (trace) {
+            trace->Record(trace::Event::kDnsDone);
+          }
           if (ec) {
-            self->LOG.Error("failed to connect to upstream, reason: %s",
-                            ec.message().c_str());
-            callback(ec, nullptr);  // don't care about the closing result
+            callback(ec, nullptr);
           } else {
-            self->SendAuthRequest(endpoint, transport, callback);
+            self->ConnectUpstream(endpoint, callback, trace);
           }
         });
+    StartResolve();
+    return;
+  }
+
+  if (ClockType::now() >= endpoints_expiry_) {
+    // refresh in the background and keep using the current endpoints
+    StartResolve();
   }
+  ConnectUpstream(endpoint, callback, trace);
 }
 
-void SocksTcpUpstreamFactory::SendAuthRequest(
-    const Address& endpoint, const std::shared_ptr<TransportBase>& transport,
-    const RequestCallbackType& callback) const {
+void SocksTcpUpstreamFactory::StartResolve() {
+  if (is_resolving_) {
+    return;
+  }
+  is_resolving_ = true;
+
+  THESTRAL_LOG_DEBUG(LOG, "resolving upstream address %s, port: %u",
+                     upstream_host_.c_str(), upstream_port_);
+  ip::tcp::resolver::query query(
+      upstream_host_, std::to_string(upstream_port_),
+      ip::tcp::resolver::query::address_configured |
+          ip::tcp::resolver::query::numeric_service);
+  auto self = shared_from_this();
+  auto start = metrics::Histogram::ClockType::now();
+  resolver_.async_resolve(
+      query,
+      [self, start](const ec_type& ec, ip::tcp::resolver::iterator iter) {
+        kResolveLatency.ObserveSince(start);
+        self->HandleResolve(ec, iter);
+      });
+}
+
+void SocksTcpUpstreamFactory::HandleResolve(const ec_type& ec,
+                                            ip::tcp::resolver::iterator iter) {
+  is_resolving_ = false;
+  if (ec) {
+    LOG.Error("failed to resolve upstream address %s, port: %u, reason: %s",
+              upstream_host_.c_str(), upstream_port_, ec.message().c_str());
+    // stale endpoints, if any, are better than nothing
+    endpoints_expiry_ =
+        ClockType::now() + std::min(resolve_ttl_, kResolveRetryDelay);
+  } else {
+    // keep preferring the endpoint that worked if it is still there
+    ip::tcp::endpoint preferred;
+    if (!upstream_endpoints_.empty()) {
+      preferred = upstream_endpoints_[preferred_endpoint_];
+    }
+    upstream_endpoints_.assign(iter, ip::tcp::resolver::iterator());
+    auto preferred_iter = std::find(upstream_endpoints_.cbegin(),
+                                    upstream_endpoints_.cend(), preferred);
+    preferred_endpoint_ =
+        preferred_iter == upstream_endpoints_.cend()
+            ? 0
+            : static_cast<std::size_t>(preferred_iter -
+                                       upstream_endpoints_.cbegin());
+    endpoints_expiry_ = ClockType::now() + resolve_ttl_;
+    THESTRAL_LOG_DEBUG(LOG, "upstream address %s resolved to %zu endpoints",
+                       upstream_host_.c_str(), upstream_endpoints_.size());
+  }
+
+  std::vector<ResolveCallbackType> waiters;
+  waiters.swap(resolve_waiters_);
+  for (const auto& waiter : waiters) {
+    waiter(upstream_endpoints_.empty() ? ec : ec_type());
+  }
+}
+
+void SocksTcpUpstreamFactory::ConnectUpstream(
+    const Address& endpoint, const RequestCallbackType& callback,
+    const std::shared_ptr<trace::Trace>& trace) {
+  if (pool_) {
+    // does nothing if the pool is already connecting to the same endpoint
+    pool_->Start(upstream_endpoints_[preferred_endpoint_]);
+    if (auto transport = pool_->Take()) {
+      // the upstream may have closed the idle connection meanwhile, e.g. by
+      // its handshake timeout, so retry on a fresh one unless the upstream
+      // has replied with an error
+      auto self = shared_from_this();
+      SendRequests(
+          endpoint, transport,
+          [self, endpoint, callback, trace](
+              const ec_type& ec,
+              const std::shared_ptr<TransportBase>& transport) {
+            if (ec && ec.category() != error::GetSocksCategory()) {
+              THESTRAL_LOG_INFO(LOG,
+                                "pooled connection failed, reason: %s, "
+                                "retrying with a new connection",
+                                ec.message().c_str());
+              self->ConnectEndpoint(endpoint, callback, trace, 0);
+            } else {
+              callback(ec, transport);
+            }
+          },
+          trace);
+      return;
+    }
+  }
+  ConnectEndpoint(endpoint, callback, trace, 0);
+}
+
+void SocksTcpUpstreamFactory::ConnectEndpoint(
+    const Address& endpoint, const RequestCallbackType& callback,
+    const std::shared_ptr<trace::Trace>& trace, std::size_t n_tried) {
+  // try the endpoints in turn, starting from the preferred one
+  auto index = (preferred_endpoint_ + n_tried) % upstream_endpoints_.size();
+  auto upstream_endpoint = upstream_endpoints_[index];
+  THESTRAL_LOG_DEBUG(LOG, "try connecting to upstream %s, port: %u",
+                     upstream_endpoint.address().to_string().c_str(),
+                     upstream_endpoint.port());
+  auto self = shared_from_this();
+  // for a transport factory doing TLS
+  trace::Scope trace_scope(trace);
+  transport_factory_->StartConnect(
+      upstream_endpoint,
+      [self, endpoint, callback, trace, n_tried, index, upstream_endpoint](
+          const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+        auto& endpoints = self->upstream_endpoints_;
+        if (ec) {
+          LOG.Error("failed to connect to upstream %s, port: %u, reason: %s",
+                    upstream_endpoint.address().to_string().c_str(),
+                    upstream_endpoint.port(), ec.message().c_str());
+          if (n_tried + 1 < endpoints.size()) {
+            self->ConnectEndpoint(endpoint, callback, trace, n_tried + 1);
+          } else {
+            callback(ec, nullptr);  // don't care about the closing result
+          }
+          return;
+        }
+
+        // the endpoints may have been refreshed in the meantime
+        if (index < endpoints.size() && endpoints[index] == upstream_endpoint) {
+          self->preferred_endpoint_ = index;
+        }
+        if (trace) {
+          trace->Record(trace::Event::kConnected);
+        }
+        self->SendRequests(endpoint, transport, callback, trace);
+      });
+}
+
+AuthMethodList SocksTcpUpstreamFactory::MakeAuthRequest(
+    const std::shared_ptr<trace::Trace>& trace) const {
   AuthMethodList packet;
   packet.methods.push_back(AuthMethod::kNoAuth);
+  if (trace && trace_forwarding_) {
+    packet.AddTraceId(trace->GetId());
+  }
+  return packet;
+}
+
+void SocksTcpUpstreamFactory::SendRequests(
+    const Address& endpoint, const std::shared_ptr<TransportBase>& transport,
+    const RequestCallbackType& callback,
+    const std::shared_ptr<trace::Trace>& trace) const {
+  if (!fast_chaining_) {
+    SendAuthRequest(endpoint, transport, callback, trace);
+    return;
+  }
+
+  // send both packets at once and expect both replies
+  auto auth_packet = MakeAuthRequest(trace);
+  RequestPacket request_packet;
+  request_packet.header.command = Command::kConnect;
+  request_packet.body = endpoint;
+  auto data = std::make_shared<std::string>();
+  auth_packet.SerializeTo(data.get());
+  request_packet.SerializeTo(data.get());
+
   auto self = shared_from_this();
-  LOG.Debug("[%llX] sending SOCKS auth request packet", transport->GetId());
+  THESTRAL_LOG_DEBUG(LOG,
+                     "[%llX] sending SOCKS auth request and request packets",
+                     transport->GetId());
+  transport->StartWrite(*data, [self, endpoint, transport, callback, data](
+                                   const ec_type& ec, size_t) {
+    if (ec) {
+      LOG.Error("[%llX] failed to send SOCKS request packets, reason: %s",
+                transport->GetId(), ec.message().c_str());
+      transport->StartClose();
+      callback(ec, nullptr);
+    } else {
+      self->ReceiveAuthReply(endpoint, transport, callback);
+    }
+  });
+}
+
+void SocksTcpUpstreamFactory::SendAuthRequest(
+    const Address& endpoint, const std::shared_ptr<TransportBase>& transport,
+    const RequestCallbackType& callback,
+    const std::shared_ptr<trace::Trace>& trace) const {
+  auto packet = MakeAuthRequest(trace);
+  auto self = shared_from_this();
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] sending SOCKS auth request packet",
+                     transport->GetId());
   packet.StartWriteTo(transport, [self, endpoint, transport, callback](
                                      const ec_type& ec, size_t) {
     if (ec) {
@@ -103,30 +257,44 @@ void SocksTcpUpstreamFactory::SendAuthRequest(
                 transport->GetId(), ec.message().c_str());
       transport->StartClose();
       callback(ec, nullptr);
-      return;
+    } else {
+      self->ReceiveAuthReply(endpoint, transport, callback);
     }
-    LOG.Debug("[%llX] receiving SOCKS auth acknowledgment packet",
-              transport->GetId());
-    AuthMethodSelectPacket::StartCreateFrom(
-        transport, [self, endpoint, transport, callback](
-                       const ec_type& ec, AuthMethodSelectPacket packet) {
-          if (ec || packet.method != AuthMethod::kNoAuth) {
-            if (ec) {
-              LOG.Error(
-                  "[%llX] failed to receive SOCKS auth acknowledgment packet,"
-                  " reason: %s",
-                  transport->GetId(), ec.message().c_str());
-            } else {
-              LOG.Error("[%llX] upstream chose an unsupported auth method %s",
-                        transport->GetId(), to_string(packet.method).c_str());
-            }
-            transport->StartClose();
-            callback(ec, nullptr);
+  });
+}
+
+void SocksTcpUpstreamFactory::ReceiveAuthReply(
+    const Address& endpoint, const std::shared_ptr<TransportBase>& transport,
+    const RequestCallbackType& callback) const {
+  auto self = shared_from_this();
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] receiving SOCKS auth acknowledgment packet",
+                     transport->GetId());
+  AuthMethodSelectPacket::StartCreateFrom(
+      transport, [self, endpoint, transport, callback](
+                     const ec_type& ec, AuthMethodSelectPacket packet) {
+        if (ec || packet.method != AuthMethod::kNoAuth) {
+          if (ec) {
+            LOG.Error(
+                "[%llX] failed to receive SOCKS auth acknowledgment packet,"
+                " reason: %s",
+                transport->GetId(), ec.message().c_str());
           } else {
-            self->SendSocksRequest(endpoint, transport, callback);
+            LOG.Error("[%llX] upstream chose an unsupported auth method %s",
+                      transport->GetId(), to_string(packet.method).c_str());
           }
-        });
-  });
+          transport->StartClose();
+          // the upstream can't serve any request before the method is agreed
+          callback(ec ? ec
+                      : boost::system::errc::make_error_code(
+                            boost::system::errc::protocol_error),
+                   nullptr);
+        } else if (self->fast_chaining_) {
+          // the request has been sent along with the auth request
+          self->ReceiveSocksResponse(endpoint, transport, callback);
+        } else {
+          self->SendSocksRequest(endpoint, transport, callback);
+        }
+      });
 }
 
 void SocksTcpUpstreamFactory::SendSocksRequest(
@@ -137,7 +305,8 @@ void SocksTcpUpstreamFactory::SendSocksRequest(
   packet.body = endpoint;
 
   auto self = shared_from_this();
-  LOG.Debug("[%llX] sending to SOCKS request packet", transport->GetId());
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] sending to SOCKS request packet",
+                     transport->GetId());
   packet.StartWriteTo(transport, [self, endpoint, transport, callback](
                                      const ec_type& ec, size_t) {
     if (ec) {
@@ -145,38 +314,46 @@ void SocksTcpUpstreamFactory::SendSocksRequest(
                 transport->GetId(), ec.message().c_str());
       transport->StartClose();
       callback(ec, nullptr);
-      return;
+    } else {
+      self->ReceiveSocksResponse(endpoint, transport, callback);
     }
-    LOG.Debug("[%llX] receiving SOCKS response packet", transport->GetId());
-    ResponsePacket::StartCreateFrom(
-        transport, [self, endpoint, transport, callback](
-                       const ec_type& ec, ResponsePacket packet) {
-          if (ec || packet.header.response_code != ResponseCode::kSuccess) {
-            transport->StartClose();
-            if (ec) {
-              LOG.Error(
-                  "[%llX] failed to receive SOCKS response packet, reason: %s",
-                  transport->GetId(), ec.message().c_str());
-              callback(ec, nullptr);
-            } else {
-              LOG.Error("[%llX] upstream response: %s", transport->GetId(),
-                        to_string(packet.header.response_code).c_str());
-              callback(error::make_error_code(packet.header.response_code),
-                       nullptr);
-            }
+  });
+}
+
+void SocksTcpUpstreamFactory::ReceiveSocksResponse(
+    const Address& endpoint, const std::shared_ptr<TransportBase>& transport,
+    const RequestCallbackType& callback) const {
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] receiving SOCKS response packet",
+                     transport->GetId());
+  ResponsePacket::StartCreateFrom(
+      transport,
+      [endpoint, transport, callback](const ec_type& ec,
+                                      ResponsePacket packet) {
+        if (ec || packet.header.response_code != ResponseCode::kSuccess) {
+          transport->StartClose();
+          if (ec) {
+            LOG.Error(
+                "[%llX] failed to receive SOCKS response packet, reason: %s",
+                transport->GetId(), ec.message().c_str());
+            callback(ec, nullptr);
           } else {
-            // the bound address of the resulting transport should be the
-            // one reported by the server rather than the one of the
-            // underlying transport
-            auto wrapped_transport =
-                std::make_shared<impl::SocksTransportWrapper>(transport,
-                                                              packet.body);
-            LOG.Info("[%llX] connection to %s established", transport->GetId(),
-                     endpoint.ToString().c_str());
-            callback(ec, wrapped_transport);  // finally, success!
+            LOG.Error("[%llX] upstream response: %s", transport->GetId(),
+                      to_string(packet.header.response_code).c_str());
+            callback(error::make_error_code(packet.header.response_code),
+                     nullptr);
           }
-        });
-  });
+        } else {
+          // the bound address of the resulting transport should be the
+          // one reported by the server rather than the one of the
+          // underlying transport
+          auto wrapped_transport =
+              std::make_shared<impl::SocksTransportWrapper>(transport,
+                                                            packet.body);
+          THESTRAL_LOG_INFO(LOG, "[%llX] connection to %s established",
+                            transport->GetId(), endpoint.Format().c_str());
+          callback(ec, wrapped_transport);  // finally, success!
+        }
+      });
 }
 
 }  // namespace socks
@@ -0,0 +1,244 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements a zero-copy relay between plain TCP transports.
+#include "splice_relay.h"
+
+#include <cerrno>
+
+#if defined(THESTRAL_HAVE_SPLICE)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace thestral {
+
+namespace asio = boost::asio;
+
+constexpr size_t SpliceRelay::kSpliceChunkSize;
+constexpr int SpliceRelay::kMaxSplicesPerWakeup;
+
+logging::Logger SpliceRelay::LOG("SpliceRelay");
+
+SpliceRelay::~SpliceRelay() {
+#if defined(THESTRAL_HAVE_SPLICE)
+  for (auto fd : pipe_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+#endif
+}
+
+bool SpliceRelay::IsApplicable(const std::shared_ptr<TransportBase>& from,
+                               const std::shared_ptr<TransportBase>& to) {
+#if defined(THESTRAL_HAVE_SPLICE)
+  // wrappers do not map the stream onto the socket 1:1, neither do SSL
+  // transports unless the records are handled by the kernel
+  auto from_tcp = dynamic_cast<TcpTransport*>(from.get());
+  auto to_tcp = dynamic_cast<TcpTransport*>(to.get());
+  return from_tcp && to_tcp && from_tcp->IsPlainForReading() &&
+         to_tcp->IsPlainForWriting();
+#else
+  return false;
+#endif
+}
+
+std::shared_ptr<SpliceRelay> SpliceRelay::New(
+    const std::shared_ptr<TransportBase>& from,
+    const std::shared_ptr<TransportBase>& to,
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+    ec_type& error_code) {
+  if (!IsApplicable(from, to)) {
+    error_code = asio::error::operation_not_supported;
+    return nullptr;
+  }
+
+  std::shared_ptr<SpliceRelay> relay(
+      new SpliceRelay(std::static_pointer_cast<TcpTransport>(from),
+                      std::static_pointer_cast<TcpTransport>(to),
+                      io_service_ptr));
+#if defined(THESTRAL_HAVE_SPLICE)
+  if (pipe2(relay->pipe_, O_NONBLOCK | O_CLOEXEC) != 0) {
+    error_code = ec_type(errno, asio::error::get_system_category());
+    return nullptr;
+  }
+#endif
+  // splice(2) honours the blocking mode of the sockets
+  relay->from_->GetUnderlyingSocket().non_blocking(true, error_code);
+  if (!error_code) {
+    relay->to_->GetUnderlyingSocket().non_blocking(true, error_code);
+  }
+  if (error_code) {
+    return nullptr;
+  }
+  return relay;
+}
+
+void SpliceRelay::Start(const DoneCallbackType& callback) {
+  callback_ = callback;
+  THESTRAL_LOG_DEBUG(LOG, "[%llX => %llX] start splicing", from_->GetId(),
+                     to_->GetId());
+  DoTransfer();
+}
+
+void SpliceRelay::DoTransfer() {
+#if defined(THESTRAL_HAVE_SPLICE)
+  const int in_fd = from_->GetUnderlyingSocket().native_handle();
+  const int out_fd = to_->GetUnderlyingSocket().native_handle();
+  const unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+
+  for (int i = 0; i < kMaxSplicesPerWakeup; ++i) {
+    if (n_pending_ > 0) {  // drain the pipe before reading more
+      auto n = splice(pipe_[0], nullptr, out_fd, nullptr, n_pending_, flags);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          WaitWritable();
+        } else if (errno == EINTR) {
+          continue;
+        } else {
+          Finish(ec_type(errno, asio::error::get_system_category()));
+        }
+        return;
+      }
+      n_pending_ -= static_cast<size_t>(n);
+      if (byte_counter_) {
+        byte_counter_->Increment(static_cast<uint64_t>(n));
+      }
+      if (trace_) {
+        trace_->Record(trace_event_);
+        trace_.reset();
+      }
+
+    } else {
+      auto n =
+          splice(in_fd, nullptr, pipe_[1], nullptr, kSpliceChunkSize, flags);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          WaitReadable();
+        } else if (errno == EINTR) {
+          continue;
+        } else if (errno == EIO || errno == EINVAL) {
+          // kernel TLS refuses to splice records other than application data,
+          // such as close_notify or a post-handshake message
+          ReadThrough();
+        } else {
+          Finish(ec_type(errno, asio::error::get_system_category()));
+        }
+        return;
+      } else if (n == 0) {
+        Finish(asio::error::eof);
+        return;
+      }
+      n_pending_ += static_cast<size_t>(n);
+      if (idle_timer_) {
+        idle_timer_->Touch();
+      }
+    }
+  }
+
+  // still busy, give other handlers a chance to run
+  auto self = shared_from_this();
+  io_service_ptr_->post(MakeAllocatingHandler(
+      handler_memory_, [self]() { self->DoTransfer(); }));
+#else
+  Finish(asio::error::operation_not_supported);
+#endif
+}
+
+void SpliceRelay::ReadThrough() {
+  constexpr size_t kMaxRecordSize = 0x4000;
+  read_through_buf_.resize(kMaxRecordSize);
+  auto self = shared_from_this();
+  from_->StartRead(
+      asio::buffer(read_through_buf_),
+      [self](const ec_type& ec, size_t n_bytes) {
+        if (ec) {
+          self->Finish(ec);
+          return;
+        }
+        if (self->idle_timer_) {
+          self->idle_timer_->Touch();
+        }
+        self->to_->StartWrite(
+            asio::buffer(self->read_through_buf_.data(), n_bytes),
+            [self](const ec_type& ec, size_t n_bytes) {
+              if (ec) {
+                self->Finish(ec);
+                return;
+              }
+              if (n_bytes > 0) {
+                if (self->byte_counter_) {
+                  self->byte_counter_->Increment(
+                      static_cast<uint64_t>(n_bytes));
+                }
+                if (self->trace_) {
+                  self->trace_->Record(self->trace_event_);
+                  self->trace_.reset();
+                }
+              }
+              // OpenSSL may have buffered records while handling the control
+              // record, or stopped offloading the reads
+              if (self->from_->IsPlainForReading()) {
+                self->DoTransfer();
+              } else {
+                self->ReadThrough();
+              }
+            });
+      },
+      true);
+}
+
+void SpliceRelay::WaitReadable() {
+  auto self = shared_from_this();
+  from_->GetUnderlyingSocket().async_read_some(
+      asio::null_buffers(),
+      MakeAllocatingHandler(handler_memory_,
+                            [self](const ec_type& ec, size_t) {
+                              if (ec) {
+                                self->Finish(ec);
+                              } else {
+                                self->DoTransfer();
+                              }
+                            }));
+}
+
+void SpliceRelay::WaitWritable() {
+  auto self = shared_from_this();
+  to_->GetUnderlyingSocket().async_write_some(
+      asio::null_buffers(),
+      MakeAllocatingHandler(handler_memory_,
+                            [self](const ec_type& ec, size_t) {
+                              if (ec) {
+                                self->Finish(ec);
+                              } else {
+                                self->DoTransfer();
+                              }
+                            }));
+}
+
+void SpliceRelay::Finish(const ec_type& ec) {
+  if (!callback_) {
+    return;
+  }
+  THESTRAL_LOG_DEBUG(LOG, "[%llX => %llX] splicing stopped: %s",
+                     from_->GetId(), to_->GetId(), ec.message().c_str());
+  idle_timer_.reset();
+  DoneCallbackType callback;
+  callback.swap(callback_);  // make sure it is called only once
+  callback(ec);
+}
+
+}  // namespace thestral
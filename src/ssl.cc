@@ -16,33 +16,655 @@
 /// Implements classes for ssl.
 #include "ssl.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#include "metrics.h"
+
 namespace thestral {
 namespace ssl {
 
 namespace ip = boost::asio::ip;
 
+namespace {
+
+/// Index of the ex data of SSL objects pointing to their transports.
+int GetTransportExDataIndex() {
+  static const int index =
+      SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+/// Index of the ex data of SSL contexts pointing to their ticket key rings.
+int GetKeyRingExDataIndex() {
+  static const int index =
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+const metrics::Histogram kServerHandshakeLatency(
+    "thestral_tls_handshake_seconds",
+    "Time taken by successful TLS handshakes.",
+    metrics::Histogram::LatencyBounds(), "side=\"server\"");
+const metrics::Histogram kClientHandshakeLatency(
+    "thestral_tls_handshake_seconds",
+    "Time taken by successful TLS handshakes.",
+    metrics::Histogram::LatencyBounds(), "side=\"client\"");
+const metrics::Counter kServerHandshakeFailures(
+    "thestral_tls_handshake_failures_total", "Number of failed TLS handshakes.",
+    "side=\"server\"");
+const metrics::Counter kClientHandshakeFailures(
+    "thestral_tls_handshake_failures_total", "Number of failed TLS handshakes.",
+    "side=\"client\"");
+const metrics::Gauge kPooledHandshakes(
+    "thestral_tls_handshake_pool_pending",
+    "Number of TLS handshakes in the handshake pool.");
+const metrics::Counter kRefusedHandshakes(
+    "thestral_tls_handshakes_refused_total",
+    "Number of TLS handshakes refused by a full handshake pool.");
+
+[[noreturn]] void ThrowSslError(const char* what) {
+  ec_type ec(static_cast<int>(ERR_get_error()),
+             boost::asio::error::get_ssl_category());
+  throw boost::system::system_error(ec, what);
+}
+
+void UpRefSession(SSL_SESSION* session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  SSL_SESSION_up_ref(session);
+#else
+  CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+}
+
+}  // anonymous namespace
+
+HandshakePool::HandshakePool(unsigned int n_threads, std::size_t max_pending)
+    : max_pending_(max_pending) {
+  for (unsigned int i = 0; i < n_threads; ++i) {
+    io_services_.emplace_back(new boost::asio::io_service(1));
+    works_.emplace_back(new boost::asio::io_service::work(*io_services_[i]));
+  }
+  for (auto& io_service : io_services_) {
+    auto io_service_ptr = io_service.get();
+    threads_.emplace_back([io_service_ptr]() { io_service_ptr->run(); });
+  }
+}
+
+boost::asio::io_service* HandshakePool::Acquire() {
+  if (is_stopped_ || io_services_.empty()) {
+    return nullptr;
+  }
+  if (++n_pending_ > max_pending_) {
+    --n_pending_;
+    return nullptr;
+  }
+  return io_services_[next_++ % io_services_.size()].get();
+}
+
+void HandshakePool::Stop() {
+  if (is_stopped_.exchange(true)) {
+    return;
+  }
+  works_.clear();
+  for (auto& io_service : io_services_) {
+    io_service->stop();
+  }
+  for (auto& thread : threads_) {
+    if (thread.get_id() == std::this_thread::get_id()) {
+      // the last owner is a handler in the pool
+      thread.detach();
+    } else {
+      thread.join();
+    }
+  }
+  threads_.clear();
+}
+
 namespace impl {
 
+constexpr std::size_t ClientSessionCache::kMaxSessions;
+constexpr std::size_t TicketKeyRing::kSecretSize;
+
+std::shared_ptr<SSL_SESSION> ClientSessionCache::Get(
+    const ip::tcp::endpoint& endpoint) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = sessions_.find(endpoint);
+  return iter == sessions_.end() ? nullptr : iter->second;
+}
+
+void ClientSessionCache::Put(const ip::tcp::endpoint& endpoint,
+                             SSL_SESSION* session) {
+  UpRefSession(session);
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessions_[endpoint] = std::shared_ptr<SSL_SESSION>(session, SSL_SESSION_free);
+  if (sessions_.size() > kMaxSessions) {
+    auto victim = sessions_.begin();
+    if (victim->first == endpoint) {
+      ++victim;
+    }
+    sessions_.erase(victim);
+  }
+}
+
+/// Callbacks for OpenSSL to set up the encryption of session tickets.
+struct TicketKeyCallbacks {
+  /// Sets up the cipher with the key to use, and copies the key to `key` for
+  /// setting up the MAC. Returns what the OpenSSL callback should return.
+  static int SetUpCipher(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                         EVP_CIPHER_CTX* cipher_ctx, int enc,
+                         TicketKeyRing::Key* key) {
+    auto key_ring = static_cast<TicketKeyRing*>(SSL_CTX_get_ex_data(
+        SSL_get_SSL_CTX(ssl), GetKeyRingExDataIndex()));
+    if (!key_ring) {
+      return -1;
+    }
+
+    if (enc) {
+      *key = key_ring->DeriveKey(key_ring->GetCurrentEpoch());
+      if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+        return -1;
+      }
+      std::memcpy(key_name, key->name.data(), key->name.size());
+      return EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr,
+                                key->aes_key.data(), iv) == 1
+                 ? 1
+                 : -1;
+    }
+
+    int result = key_ring->FindKey(key_name, key);
+    if (result == 0) {
+      return 0;  // unknown key, fall back to a full handshake
+    }
+    return EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr,
+                              key->aes_key.data(), iv) == 1
+               ? result
+               : -1;
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int Callback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                      EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx,
+                      int enc) {
+    TicketKeyRing::Key key;
+    int result = SetUpCipher(ssl, key_name, iv, cipher_ctx, enc, &key);
+    if (result <= 0) {
+      return result;
+    }
+    char digest[] = "SHA256";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(
+            OSSL_MAC_PARAM_KEY, key.hmac_key.data(), key.hmac_key.size()),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()};
+    return EVP_MAC_CTX_set_params(mac_ctx, params) == 1 ? result : -1;
+  }
+#else
+  static int Callback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+                      EVP_CIPHER_CTX* cipher_ctx, HMAC_CTX* hmac_ctx,
+                      int enc) {
+    TicketKeyRing::Key key;
+    int result = SetUpCipher(ssl, key_name, iv, cipher_ctx, enc, &key);
+    if (result <= 0) {
+      return result;
+    }
+    return HMAC_Init_ex(hmac_ctx, key.hmac_key.data(),
+                        static_cast<int>(key.hmac_key.size()), EVP_sha256(),
+                        nullptr) == 1
+               ? result
+               : -1;
+  }
+#endif
+};
+
+void TicketKeyRing::InstallInto(SSL_CTX* ssl_ctx) {
+  SSL_CTX_set_ex_data(ssl_ctx, GetKeyRingExDataIndex(), this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, &TicketKeyCallbacks::Callback);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, &TicketKeyCallbacks::Callback);
+#endif
+}
+
+const TicketKeyRing::SecretType& TicketKeyRing::GetProcessSecret() {
+  static const SecretType secret = []() {
+    SecretType secret;
+    if (RAND_bytes(secret.data(), static_cast<int>(secret.size())) != 1) {
+      throw std::runtime_error("failed to generate the ticket key secret");
+    }
+    return secret;
+  }();
+  return secret;
+}
+
+TicketKeyRing::Key TicketKeyRing::DeriveKey(uint64_t epoch) const {
+  // every part of the key is HMAC(secret, label || epoch)
+  auto derive = [this, epoch](const char* label, unsigned char* out,
+                              std::size_t size) {
+    std::string message(label);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      message.push_back(static_cast<char>((epoch >> shift) & 0xff));
+    }
+    std::array<unsigned char, EVP_MAX_MD_SIZE> digest;
+    unsigned int digest_size = 0;
+    HMAC(EVP_sha256(), secret_.data(), static_cast<int>(secret_.size()),
+         reinterpret_cast<const unsigned char*>(message.data()),
+         message.size(), digest.data(), &digest_size);
+    std::memcpy(out, digest.data(), size);
+  };
+
+  Key key;
+  derive("name", key.name.data(), key.name.size());
+  derive("aes", key.aes_key.data(), key.aes_key.size());
+  derive("hmac", key.hmac_key.data(), key.hmac_key.size());
+  return key;
+}
+
+uint64_t TicketKeyRing::GetCurrentEpoch() const {
+  // wall-clock time, so that other processes sharing the secret agree on it
+  auto now = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  return static_cast<uint64_t>(now.count() / interval_.count());
+}
+
+int TicketKeyRing::FindKey(const unsigned char* name, Key* key) const {
+  auto epoch = GetCurrentEpoch();
+  for (int age = 0; age < 2; ++age) {
+    *key = DeriveKey(epoch - age);
+    if (std::memcmp(key->name.data(), name, key->name.size()) == 0) {
+      return age == 0 ? 1 : 2;
+    }
+  }
+  return 0;
+}
+
 SslTransportImpl::SslTransportImpl(boost::asio::io_service& io_service,
-                                   boost::asio::ssl::context& ssl_ctx)
-    : ssl_sock_(io_service, ssl_ctx) {}
+                                   boost::asio::ssl::context& ssl_ctx,
+                                   bool on_socket)
+    : io_service_(&io_service),
+      ssl_sock_(io_service, ssl_ctx),
+      on_socket_(on_socket) {}
+
+bool SslTransportImpl::IsPlainForReading() {
+  // records already read by OpenSSL have to go through it
+  return IsKernelTlsReceiveActive() &&
+         !SSL_has_pending(ssl_sock_.native_handle());
+}
+
+bool SslTransportImpl::IsPlainForWriting() { return IsKernelTlsSendActive(); }
+
+bool SslTransportImpl::IsKernelTlsSendActive() {
+#if defined(THESTRAL_HAVE_KTLS)
+  return on_socket_ &&
+         BIO_get_ktls_send(SSL_get_wbio(ssl_sock_.native_handle()));
+#else
+  return false;
+#endif
+}
+
+bool SslTransportImpl::IsKernelTlsReceiveActive() {
+#if defined(THESTRAL_HAVE_KTLS)
+  return on_socket_ &&
+         BIO_get_ktls_recv(SSL_get_rbio(ssl_sock_.native_handle()));
+#else
+  return false;
+#endif
+}
+
+void SslTransportImpl::StartHandshake(
+    boost::asio::ssl::stream_base::handshake_type type,
+    const std::function<void(const ec_type&)>& handshake_callback) {
+  bool is_client = type == boost::asio::ssl::stream_base::client;
+  auto start = metrics::Histogram::ClockType::now();
+  auto callback = [handshake_callback, is_client, start](const ec_type& ec) {
+    if (ec) {
+      (is_client ? kClientHandshakeFailures : kServerHandshakeFailures)
+          .Increment();
+    } else {
+      (is_client ? kClientHandshakeLatency : kServerHandshakeLatency)
+          .ObserveSince(start);
+    }
+    handshake_callback(ec);
+  };
+
+  if (!on_socket_) {
+    ssl_sock_.async_handshake(type, callback);
+    return;
+  }
+
+  ec_type ec;
+  AttachToSocket(type, ec);
+  if (ec) {
+    io_service_->post([callback, ec]() { callback(ec); });
+    return;
+  }
+  auto ssl = ssl_sock_.native_handle();
+  StartSslOperation([ssl]() { return SSL_do_handshake(ssl); },
+                    [callback](const ec_type& ec, int) { callback(ec); });
+}
+
+void SslTransportImpl::MoveTo(boost::asio::io_service& io_service,
+                              ec_type& error_code) {
+  // the engine of the stream isn't bound to any io_service, and its timers
+  // are only waited on by concurrent operations
+  auto& socket = ssl_sock_.next_layer();
+  ip::tcp::socket moved(io_service);
+  if (socket.is_open()) {
+    auto protocol = socket.local_endpoint(error_code).protocol();
+    if (error_code) {
+      return;
+    }
+    bool non_blocking = socket.non_blocking();
+    auto fd = socket.release(error_code);
+    if (error_code) {
+      return;
+    }
+    moved.assign(protocol, fd, error_code);
+    if (error_code) {
+      ::close(fd);
+      return;
+    }
+    moved.non_blocking(non_blocking, error_code);
+  }
+  socket = std::move(moved);
+  io_service_ = &io_service;
+}
+
+void SslTransportImpl::Handshake(
+    boost::asio::ssl::stream_base::handshake_type type, ec_type& error_code) {
+  if (!on_socket_) {
+    ssl_sock_.handshake(type, error_code);
+    return;
+  }
+
+  // the socket is still blocking, so is the handshake
+  auto ssl = ssl_sock_.native_handle();
+  auto& socket = ssl_sock_.next_layer();
+  if (SSL_set_fd(ssl, socket.native_handle()) != 1) {
+    error_code = GetSslError(0, errno);
+    return;
+  }
+  int result = type == boost::asio::ssl::stream_base::client ? SSL_connect(ssl)
+                                                             : SSL_accept(ssl);
+  if (result <= 0) {
+    error_code = GetSslError(result, errno);
+    return;
+  }
+  socket.non_blocking(true, error_code);
+}
+
+void SslTransportImpl::AttachToSocket(
+    boost::asio::ssl::stream_base::handshake_type type, ec_type& error_code) {
+  // the kernel can only take over records OpenSSL writes to the socket itself
+  auto ssl = ssl_sock_.native_handle();
+  auto& socket = ssl_sock_.next_layer();
+  socket.non_blocking(true, error_code);
+  if (error_code) {
+    return;
+  }
+  if (SSL_set_fd(ssl, socket.native_handle()) != 1) {
+    error_code = GetSslError(0, errno);
+    return;
+  }
+  if (type == boost::asio::ssl::stream_base::client) {
+    SSL_set_connect_state(ssl);
+  } else {
+    SSL_set_accept_state(ssl);
+  }
+}
+
+void SslTransportImpl::StartSslOperation(const SslOperationType& operation,
+                                         const SslCallbackType& callback) {
+  auto& socket = ssl_sock_.next_layer();
+  ERR_clear_error();
+  errno = 0;
+  int result = operation();
+  int sys_errno = errno;
+  if (result > 0) {
+    // never call back in place, or a relay would recurse as long as the
+    // socket keeps up
+    io_service_->post(
+        [callback, result]() { callback(ec_type(), result); });
+    return;
+  }
+
+  auto self = shared_from_this();
+  auto retry = [self, operation, callback](const ec_type& ec, std::size_t) {
+    if (ec) {
+      callback(ec, 0);
+    } else {
+      self->StartSslOperation(operation, callback);
+    }
+  };
+  switch (SSL_get_error(ssl_sock_.native_handle(), result)) {
+    case SSL_ERROR_WANT_READ:
+      socket.async_read_some(boost::asio::null_buffers(), retry);
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      socket.async_write_some(boost::asio::null_buffers(), retry);
+      break;
+    default: {
+      auto ec = GetSslError(result, sys_errno);
+      io_service_->post([callback, ec]() { callback(ec, 0); });
+    }
+  }
+}
+
+ec_type SslTransportImpl::GetSslError(int result, int sys_errno) {
+  switch (SSL_get_error(ssl_sock_.native_handle(), result)) {
+    case SSL_ERROR_ZERO_RETURN:
+      return boost::asio::error::eof;
+    case SSL_ERROR_SYSCALL:
+      if (ERR_peek_error() == 0) {
+        // the peer has gone without close_notify if errno is not set
+        return sys_errno ? ec_type(sys_errno,
+                                   boost::asio::error::get_system_category())
+                         : ec_type(boost::asio::error::eof);
+      }
+    // fall through
+    default:
+      return ec_type(static_cast<int>(ERR_get_error()),
+                     boost::asio::error::get_ssl_category());
+  }
+}
+
+void SslTransportImpl::StartSslRead(const boost::asio::mutable_buffers_1& buf,
+                                    std::size_t n_transferred,
+                                    const ReadCallbackType& callback,
+                                    bool allow_short_read) {
+  ssl_read_.data = boost::asio::buffer_cast<char*>(buf);
+  ssl_read_.size = boost::asio::buffer_size(buf);
+  ssl_read_.n_transferred = n_transferred;
+  ssl_read_.allow_short_read = allow_short_read;
+  ssl_read_.callback = callback;
+  ContinueSslRead();
+}
+
+void SslTransportImpl::StartSslWrite(const boost::asio::const_buffers_1& buf,
+                                     std::size_t n_transferred,
+                                     const WriteCallbackType& callback) {
+  // the data is never written to, SslIo just serves both directions
+  ssl_write_.data =
+      const_cast<char*>(boost::asio::buffer_cast<const char*>(buf));
+  ssl_write_.size = boost::asio::buffer_size(buf);
+  ssl_write_.n_transferred = n_transferred;
+  ssl_write_.callback = callback;
+  ContinueSslWrite();
+}
+
+void SslTransportImpl::ContinueSslRead() {
+  auto ssl = ssl_sock_.native_handle();
+  for (;;) {
+    auto size = static_cast<int>(std::min<std::size_t>(
+        ssl_read_.size - ssl_read_.n_transferred, INT_MAX));
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_read(ssl, ssl_read_.data + ssl_read_.n_transferred, size);
+    if (result <= 0) {
+      WaitForSslIo(result, errno, true);
+      return;
+    }
+    ssl_read_.n_transferred += static_cast<std::size_t>(result);
+    if (ssl_read_.allow_short_read ||
+        ssl_read_.n_transferred == ssl_read_.size) {
+      FinishSslIo(true, ec_type());
+      return;
+    }
+  }
+}
+
+void SslTransportImpl::ContinueSslWrite() {
+  auto ssl = ssl_sock_.native_handle();
+  for (;;) {
+    auto size = static_cast<int>(std::min<std::size_t>(
+        ssl_write_.size - ssl_write_.n_transferred, INT_MAX));
+    ERR_clear_error();
+    errno = 0;
+    int result =
+        SSL_write(ssl, ssl_write_.data + ssl_write_.n_transferred, size);
+    if (result <= 0) {
+      WaitForSslIo(result, errno, false);
+      return;
+    }
+    // partial writes are enabled by asio for the SSL object
+    ssl_write_.n_transferred += static_cast<std::size_t>(result);
+    if (ssl_write_.n_transferred == ssl_write_.size) {
+      FinishSslIo(false, ec_type());
+      return;
+    }
+  }
+}
+
+void SslTransportImpl::WaitForSslIo(int result, int sys_errno,
+                                    bool is_read) {
+  auto& socket = ssl_sock_.next_layer();
+  auto& memory = is_read ? read_memory_ : write_memory_;
+  auto error = SSL_get_error(ssl_sock_.native_handle(), result);
+  if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+    FinishSslIo(is_read, GetSslError(result, sys_errno));
+    return;
+  }
+
+  auto self = shared_from_this();
+  auto retry = [self, is_read](const ec_type& ec, std::size_t) {
+    if (ec) {
+      self->FinishSslIo(is_read, ec);
+    } else if (is_read) {
+      self->ContinueSslRead();
+    } else {
+      self->ContinueSslWrite();
+    }
+  };
+  if (error == SSL_ERROR_WANT_READ) {
+    socket.async_read_some(boost::asio::null_buffers(),
+                           MakeAllocatingHandler(memory, retry));
+  } else {
+    socket.async_write_some(boost::asio::null_buffers(),
+                            MakeAllocatingHandler(memory, retry));
+  }
+}
+
+void SslTransportImpl::FinishSslIo(bool is_read, const ec_type& ec) {
+  // never call back in place, or a relay would recurse as long as the socket
+  // keeps up
+  auto self = shared_from_this();
+  io_service_->post(MakeAllocatingHandler(
+      is_read ? read_memory_ : write_memory_, [self, is_read, ec]() {
+        auto& io = is_read ? self->ssl_read_ : self->ssl_write_;
+        ReadCallbackType callback;
+        callback.swap(io.callback);  // the callback may start the next one
+        callback(ec, io.n_transferred);
+      }));
+}
+
+void SslTransportImpl::PrepareClientSession(
+    const std::shared_ptr<ClientSessionCache>& session_cache,
+    const ip::tcp::endpoint& endpoint) {
+  session_cache_ = session_cache;
+  session_key_ = endpoint;
+  auto ssl = ssl_sock_.native_handle();
+  SSL_set_ex_data(ssl, GetTransportExDataIndex(), this);
+  if (auto session = session_cache_->Get(endpoint)) {
+    SSL_set_session(ssl, session.get());
+  }
+}
+
+int SslTransportImpl::HandleNewSession(SSL* ssl, SSL_SESSION* session) {
+  auto transport = static_cast<SslTransportImpl*>(
+      SSL_get_ex_data(ssl, GetTransportExDataIndex()));
+  if (transport && transport->session_cache_) {
+    transport->session_cache_->Put(transport->session_key_, session);
+  }
+  return 0;  // the cache takes its own reference
+}
 
 void SslTransportImpl::StartRead(const boost::asio::mutable_buffers_1& buf,
                                  const ReadCallbackType& callback,
                                  bool allow_short_read) {
-  if (allow_short_read) {
-    ssl_sock_.async_read_some(buf, callback);
+  if (on_socket_) {
+    StartSslRead(buf, 0, callback, allow_short_read);
+  } else if (allow_short_read) {
+    ssl_sock_.async_read_some(buf,
+                              MakeAllocatingHandler(read_memory_, callback));
   } else {
-    boost::asio::async_read(ssl_sock_, buf, callback);
+    boost::asio::async_read(ssl_sock_, buf,
+                            MakeAllocatingHandler(read_memory_, callback));
   }
 }
 
 void SslTransportImpl::StartWrite(const boost::asio::const_buffers_1& buf,
                                   const WriteCallbackType& callback) {
-  boost::asio::async_write(ssl_sock_, buf, callback);
+  if (on_socket_) {
+    StartSslWrite(buf, 0, callback);
+  } else {
+    boost::asio::async_write(ssl_sock_, buf,
+                             MakeAllocatingHandler(write_memory_, callback));
+  }
+}
+
+void SslTransportImpl::StartWrite(const ConstBufferSequence& buffers,
+                                  const WriteCallbackType& callback) {
+  gathered_.clear();
+  for (const auto& buffer : buffers) {
+    gathered_.append(boost::asio::buffer_cast<const char*>(buffer),
+                     boost::asio::buffer_size(buffer));
+  }
+  StartWrite(boost::asio::const_buffers_1(boost::asio::buffer(gathered_)),
+             callback);
 }
 
 void SslTransportImpl::StartClose(const CloseCallbackType& callback) {
+  if (on_socket_) {
+    // send close_notify if possible, but don't wait for the peer
+    auto ssl = ssl_sock_.native_handle();
+    if (SSL_is_init_finished(ssl)) {
+      ERR_clear_error();
+      SSL_shutdown(ssl);
+    }
+    auto& socket = ssl_sock_.next_layer();
+    ec_type ec;
+    socket.close(ec);
+    auto self = shared_from_this();
+    io_service_->post([self, callback, ec]() { callback(ec); });
+    return;
+  }
+
   // openssl will crash if the socket is destroyed before shutdown operation
   // completes
   auto self = shared_from_this();
@@ -50,143 +672,380 @@ void SslTransportImpl::StartClose(const CloseCallbackType& callback) {
       [self, callback](const ec_type& ec) { callback(ec); });
 }
 
+void SslTransportImpl::StartShutdownSend(const CloseCallbackType& callback) {
+  if (on_socket_) {
+    // openssl keeps reading records after sending close_notify
+    auto ssl = ssl_sock_.native_handle();
+    if (SSL_is_init_finished(ssl)) {
+      ERR_clear_error();
+      SSL_shutdown(ssl);
+    }
+  }
+  // with memory BIOs, asio's shutdown waits for the peer's close_notify and
+  // consumes the reading side, so only the underlying socket is shut down,
+  // which the peer sees as a truncated stream
+  ec_type ec;
+  ssl_sock_.next_layer().shutdown(
+      boost::asio::ip::tcp::socket::shutdown_send, ec);
+  auto self = shared_from_this();
+  io_service_->post([self, callback, ec]() { callback(ec); });
+}
+
 logging::Logger SslTransportFactoryImpl::LOG("SslTransportFactoryImpl");
 
+SslTransportFactoryImpl::SslTransportFactoryImpl(
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+    boost::asio::ssl::context&& ssl_ctx,
+    const std::shared_ptr<TicketKeyRing>& ticket_key_ring,
+    const std::shared_ptr<ClientSessionCache>& session_cache,
+    bool kernel_tls)
+    : io_service_ptr_(io_service_ptr),
+      ssl_ctx_(std::move(ssl_ctx)),
+      ticket_key_ring_(ticket_key_ring),
+      session_cache_(session_cache),
+      kernel_tls_(kernel_tls) {
+  if (ticket_key_ring_) {
+    ticket_key_ring_->InstallInto(ssl_ctx_.native_handle());
+  }
+  if (session_cache_) {
+    // sessions are kept by the cache of the factory, keyed by endpoints
+    SSL_CTX_set_session_cache_mode(
+        ssl_ctx_.native_handle(),
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx_.native_handle(),
+                            &SslTransportImpl::HandleNewSession);
+  }
+}
+
 void SslTransportFactoryImpl::StartAccept(EndpointType endpoint,
                                           const AcceptCallbackType& callback) {
-  LOG.Debug("start accepting");
-  auto acceptor =
-      std::make_shared<ip::tcp::acceptor>(*io_service_ptr_, endpoint);
-  acceptor->set_option(ip::tcp::no_delay(true));
-  acceptor->set_option(ip::tcp::socket::reuse_address(true));
-  last_acceptor_ = acceptor;
-  DoAccept(acceptor, callback);
-}
-
-void SslTransportFactoryImpl::DoAccept(
-    const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
-    const AcceptCallbackType& callback) {
-  std::shared_ptr<SslTransportImpl> transport(
-      new SslTransportImpl(*io_service_ptr_, ssl_ctx_));
+  THESTRAL_LOG_DEBUG(LOG, "start accepting");
+  auto self = shared_from_this();
+  StartAcceptLoops(
+      *io_service_ptr_, endpoint,
+      [self]() -> std::shared_ptr<TcpTransport> {
+        return std::shared_ptr<SslTransportImpl>(
+            new SslTransportImpl(*self->io_service_ptr_, self->ssl_ctx_,
+                                 self->kernel_tls_));
+      },
+      [self](const std::shared_ptr<TcpTransport>& transport,
+             const FinishCallbackType& callback) {
+        self->StartHandshake(
+            std::static_pointer_cast<SslTransportImpl>(transport), callback);
+      },
+      callback);
+}
 
+void SslTransportFactoryImpl::StartHandshake(
+    const std::shared_ptr<SslTransportImpl>& transport,
+    const FinishCallbackType& callback) {
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] start performing ssl handshake",
+                     transport->GetId());
   auto self = shared_from_this();
-  LOG.Debug("[%llX] waiting for one connection", transport->GetId());
-  acceptor->async_accept(
-      transport->ssl_sock_.lowest_layer(),
-      [self, acceptor, callback, transport](const ec_type& ec) {
+  RunHandshake(
+      transport, boost::asio::ssl::stream_base::server, handshake_timeout_,
+      [self, callback, transport](const ec_type& ec) {
         if (ec) {
-          self->LOG.Debug(
-              "[%llX] acceptor returning an error: %s, stop accepting",
-              transport->GetId(), ec.message().c_str());
-          // accept() call failed. impossible to proceed.
+          THESTRAL_LOG_DEBUG(
+              self->LOG,
+              "[%llX] ssl transport returning an error on handshake: %s,"
+              " remote endpoint: %s",
+              transport->GetId(), ec.message().c_str(),
+              transport->GetRemoteAddress().Format().c_str());
           transport->StartClose();
-          callback(ec, nullptr);
-          return;
         } else {
-          self->LOG.Debug(
-              "[%llX] one connection accepted, start performing ssl handshake",
-              transport->GetId());
+          THESTRAL_LOG_DEBUG(
+              self->LOG,
+              "[%llX] ssl handshake succeeded%s, remote endpoint: %s",
+              transport->GetId(),
+              transport->IsSessionReused() ? ", session resumed" : "",
+              transport->GetRemoteAddress().Format().c_str());
+          self->LogKernelTls(*transport);
         }
+        callback(ec, ec ? nullptr : transport);
+      });
+}
 
-        transport->ssl_sock_.async_handshake(
-            boost::asio::ssl::stream_base::server,
-            [self, acceptor, callback, transport](const ec_type& ec) {
-              if (ec) {
-                self->LOG.Debug(
-                    "[%llX] ssl transport returning an error on handshake: %s,"
-                    " remote endpoint: %s",
-                    transport->GetId(), ec.message().c_str(),
-                    transport->GetRemoteAddress().ToString().c_str());
-                transport->StartClose();
-              } else {
-                self->LOG.Debug(
-                    "[%llX] ssl handshake succeeded, remote endpoint: %s",
-                    transport->GetId(),
-                    transport->GetRemoteAddress().ToString().c_str());
-              }
-              if (callback(ec, ec ? nullptr : transport)) {
-                self->DoAccept(acceptor, callback);
-              } else {
-                self->LOG.Debug(
-                    "[%llX] upper layer gave up accepting more connections",
-                    transport->GetId());
-              }
-            });
+TcpTransportFactory::CancelFunctionType SslTransportFactoryImpl::RunHandshake(
+    const std::shared_ptr<SslTransportImpl>& transport,
+    boost::asio::ssl::stream_base::handshake_type type,
+    TimingWheel::ClockType::duration timeout,
+    const std::function<void(const ec_type&)>& callback) {
+  // closing the socket aborts the pending handshake
+  std::weak_ptr<SslTransportImpl> weak_transport = transport;
+  auto close = [weak_transport]() {
+    if (auto transport = weak_transport.lock()) {
+      ec_type ec;
+      transport->GetUnderlyingSocket().close(ec);
+    }
+  };
+  auto log_timeout = [](SslTransportImpl& transport) {
+    LOG.Warn("[%llX] ssl handshake timed out, remote endpoint: %s",
+             transport.GetId(),
+             transport.GetRemoteAddress().Format().c_str());
+  };
+
+  auto pool_service = handshake_pool_ ? handshake_pool_->Acquire() : nullptr;
+  if (!pool_service && handshake_pool_) {
+    kRefusedHandshakes.Increment();
+    LOG.Warn("[%llX] handshake pool full, refusing ssl handshake",
+             transport->GetId());
+    ec_type ec(boost::asio::error::try_again);
+    io_service_ptr_->post([callback, ec]() { callback(ec); });
+    return close;
+  }
+
+  if (!pool_service) {
+    std::shared_ptr<TimingWheel::Timer> timer;
+    if (timeout != TimingWheel::ClockType::duration(0)) {
+      auto& wheel = boost::asio::use_service<TimingWheel>(*io_service_ptr_);
+      timer = std::make_shared<TimingWheel::Timer>(
+          wheel.Start(timeout, [transport, log_timeout]() {
+            log_timeout(*transport);
+            ec_type ec;
+            transport->GetUnderlyingSocket().close(ec);
+          }));
+    }
+    transport->StartHandshake(type, [callback, timer](const ec_type& ec) {
+      if (timer) {
+        timer->Cancel();
+      }
+      callback(ec);
+    });
+    return close;
+  }
+
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] moving ssl handshake to the handshake pool",
+                     transport->GetId());
+  auto pool = handshake_pool_;
+  ec_type move_ec;
+  transport->MoveTo(*pool_service, move_ec);
+  if (move_ec) {
+    pool->Release();
+    io_service_ptr_->post([callback, move_ec]() { callback(move_ec); });
+    return close;
+  }
+
+  // where the socket is, tracked by each side for aborting the handshake
+  struct State {
+    /// Whether the callback is yet to be called, on this io_service.
+    bool is_in_pool = true;
+    /// Whether the socket has been moved back, in the pool.
+    bool is_moved_back = false;
+    /// Kept until the callback is called, so that the transport and whatever
+    /// the callback holds are always released on this io_service. The pool
+    /// only holds weak references, locked before the socket is moved back.
+    std::shared_ptr<SslTransportImpl> transport;
+    std::function<void(const ec_type&)> callback;
+  };
+  auto state = std::make_shared<State>();
+  state->transport = transport;
+  state->callback = callback;
+  auto home = io_service_ptr_;
+  // keeps this io_service running while nothing is left on it
+  auto work = std::make_shared<boost::asio::io_service::work>(*home);
+  auto token = kPooledHandshakes.Track();
+  auto finish = [weak_transport, pool, home, state, work, token](ec_type ec) {
+    state->is_moved_back = true;
+    ec_type move_ec;
+    weak_transport.lock()->MoveTo(*home, move_ec);
+    if (!ec) {
+      ec = move_ec;
+    }
+    home->post([pool, state, work, ec]() {
+      pool->Release();
+      state->is_in_pool = false;
+      std::function<void(const ec_type&)> callback;
+      callback.swap(state->callback);
+      state->transport.reset();
+      callback(ec);
+    });
+  };
+  pool_service->post([weak_transport, type, timeout, pool_service,
+                      log_timeout, state, finish]() {
+    std::shared_ptr<boost::asio::steady_timer> timer;
+    if (timeout != TimingWheel::ClockType::duration(0)) {
+      timer = std::make_shared<boost::asio::steady_timer>(*pool_service);
+      timer->expires_from_now(timeout);
+      timer->async_wait([weak_transport, log_timeout, state](
+          const ec_type& ec) {
+        if (!ec && !state->is_moved_back) {
+          auto transport = weak_transport.lock();
+          log_timeout(*transport);
+          ec_type ec;
+          transport->GetUnderlyingSocket().close(ec);
+        }
       });
+    }
+    weak_transport.lock()->StartHandshake(
+        type, [timer, finish](const ec_type& ec) {
+          if (timer) {
+            timer->cancel();
+          }
+          finish(ec);
+        });
+  });
+
+  return [weak_transport, state, pool_service, close]() {
+    if (!state->is_in_pool) {
+      close();
+      return;
+    }
+    pool_service->post([weak_transport, state]() {
+      if (!state->is_moved_back) {
+        ec_type ec;
+        weak_transport.lock()->GetUnderlyingSocket().close(ec);
+      }
+    });
+  };
 }
 
 void SslTransportFactoryImpl::StartConnect(
     EndpointType endpoint, const ConnectCallbackType& callback) {
+  StartCancelableConnect(endpoint, callback);
+}
+
+TcpTransportFactory::CancelFunctionType
+SslTransportFactoryImpl::StartCancelableConnect(
+    EndpointType endpoint, const ConnectCallbackType& callback) {
   std::shared_ptr<SslTransportImpl> transport(
-      new SslTransportImpl(*io_service_ptr_, ssl_ctx_));
+      new SslTransportImpl(*io_service_ptr_, ssl_ctx_, kernel_tls_));
   auto self = shared_from_this();
-  LOG.Debug("[%llX] start connecting", transport->GetId());
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] start connecting", transport->GetId());
+  ec_type open_ec, warning;
+  OpenConnectingSocket(transport->ssl_sock_.lowest_layer(), endpoint, open_ec,
+                       warning);
+  if (warning) {
+    LOG.Warn("[%llX] failed to apply socket options, reason: %s",
+             transport->GetId(), warning.message().c_str());
+  }
+  if (open_ec) {
+    io_service_ptr_->post(
+        [callback, open_ec]() { callback(open_ec, nullptr); });
+    return []() {};
+  }
+  auto abort = std::make_shared<CancelFunctionType>();
+  auto trace = trace::Current();
   transport->ssl_sock_.lowest_layer().async_connect(
-      endpoint, [self, transport, callback](const ec_type& ec) {
+      endpoint,
+      [self, transport, callback, endpoint, abort, trace](const ec_type& ec) {
         if (ec) {
-          self->LOG.Debug("[%llX] ssl transport returning an error: %s",
-                          transport->GetId(), ec.message().c_str());
+          THESTRAL_LOG_DEBUG(self->LOG,
+                             "[%llX] ssl transport returning an error: %s",
+                             transport->GetId(), ec.message().c_str());
           transport->StartClose();
           callback(ec, nullptr);
-        } else {
-          self->LOG.Debug(
-              "[%llX] connection established, start performing ssl handshake",
-              transport->GetId());
+          return;
+        }
+        THESTRAL_LOG_DEBUG(
+            self->LOG,
+            "[%llX] connection established, start performing ssl handshake",
+            transport->GetId());
+        if (trace) {
+          trace->Record(trace::Event::kConnected);
         }
         transport->ssl_sock_.lowest_layer().set_option(ip::tcp::no_delay(true));
-        transport->ssl_sock_.async_handshake(
-            boost::asio::ssl::stream_base::client,
-            [self, callback, transport](const ec_type& ec) {
+        if (self->session_cache_) {
+          transport->PrepareClientSession(self->session_cache_, endpoint);
+        }
+        *abort = self->RunHandshake(
+            transport, boost::asio::ssl::stream_base::client,
+            TimingWheel::ClockType::duration(0),
+            [self, callback, transport, trace](const ec_type& ec) {
               if (ec) {
-                self->LOG.Debug(
+                THESTRAL_LOG_DEBUG(
+                    self->LOG,
                     "[%llX] ssl transport returning an error on handshake: %s",
                     transport->GetId(), ec.message().c_str());
                 transport->StartClose();
                 callback(ec, nullptr);
               } else {
-                self->LOG.Debug("[%llX] ssl handshake succeeded",
-                                transport->GetId());
+                if (trace) {
+                  trace->Record(trace::Event::kTlsDone);
+                }
+                THESTRAL_LOG_DEBUG(
+                    self->LOG, "[%llX] ssl handshake succeeded%s",
+                    transport->GetId(),
+                    transport->IsSessionReused() ? ", session resumed" : "");
+                self->LogKernelTls(*transport);
                 callback(ec, transport);
               }
             });
       });
+
+  // closing the socket aborts the connection, and the handshake unless it
+  // is in the handshake pool
+  std::weak_ptr<SslTransportImpl> weak_transport = transport;
+  return [weak_transport, abort]() {
+    if (*abort) {
+      (*abort)();
+    } else if (auto transport = weak_transport.lock()) {
+      ec_type ec;
+      transport->ssl_sock_.lowest_layer().close(ec);
+    }
+  };
 }
 
 std::shared_ptr<TransportBase> SslTransportFactoryImpl::TryConnect(
     boost::asio::ip::tcp::resolver::iterator& iter, ec_type& error_code) {
   std::shared_ptr<SslTransportImpl> transport(
-      new SslTransportImpl(*io_service_ptr_, ssl_ctx_));
-  LOG.Debug("[%llX] start connecting", transport->GetId());
+      new SslTransportImpl(*io_service_ptr_, ssl_ctx_, kernel_tls_));
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] start connecting", transport->GetId());
   iter = boost::asio::connect(transport->ssl_sock_.lowest_layer(), iter,
                               error_code);
   if (!error_code) {
-    LOG.Debug("[%llX] connection established, start performing ssl handshake",
-              transport->GetId());
+    THESTRAL_LOG_DEBUG(
+        LOG, "[%llX] connection established, start performing ssl handshake",
+        transport->GetId());
     transport->ssl_sock_.lowest_layer().set_option(ip::tcp::no_delay(true));
-    transport->ssl_sock_.handshake(boost::asio::ssl::stream_base::client,
-                                   error_code);
+    if (session_cache_) {
+      transport->PrepareClientSession(session_cache_, iter->endpoint());
+    }
+    transport->Handshake(boost::asio::ssl::stream_base::client, error_code);
   }
 
   if (error_code) {
-    LOG.Debug("[%llX] ssl transport returning an error: %s", transport->GetId(),
-              error_code.message().c_str());
+    THESTRAL_LOG_DEBUG(LOG, "[%llX] ssl transport returning an error: %s",
+                       transport->GetId(), error_code.message().c_str());
     transport->StartClose();
     return nullptr;
   }
 
-  LOG.Debug("[%llX] ssl handshake succeeded", transport->GetId());
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] ssl handshake succeeded%s",
+                     transport->GetId(),
+                     transport->IsSessionReused() ? ", session resumed" : "");
+  LogKernelTls(*transport);
   return transport;
 }
 
+void SslTransportFactoryImpl::LogKernelTls(SslTransportImpl& transport) const {
+  if (kernel_tls_) {
+    THESTRAL_LOG_DEBUG(LOG, "[%llX] kernel tls send: %s, receive: %s",
+                       transport.GetId(),
+                       transport.IsKernelTlsSendActive() ? "on" : "off",
+                       transport.IsKernelTlsReceiveActive() ? "on" : "off");
+  }
+}
+
 }  // namespace impl
 
 SslTransportFactoryBuilder::SslTransportFactoryBuilder()
-    : ssl_ctx_(boost::asio::ssl::context::sslv23), used_(false) {
+    : ssl_ctx_(boost::asio::ssl::context::sslv23),
+      used_(false),
+      ticket_key_secret_(impl::TicketKeyRing::GetProcessSecret()) {
   ssl_ctx_.set_options(boost::asio::ssl::context::no_sslv2 |
                        boost::asio::ssl::context::no_sslv3 |
                        boost::asio::ssl::context::no_tlsv1 |
                        boost::asio::ssl::context::single_dh_use |
                        boost::asio::ssl::context::default_workarounds);
+  // required for resuming sessions when client certificates are verified
+  static const unsigned char kSessionIdContext[] = "thestral";
+  SSL_CTX_set_session_id_context(ssl_ctx_.native_handle(), kSessionIdContext,
+                                 sizeof(kSessionIdContext) - 1);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  // ECDHE is only enabled by default since OpenSSL 1.1.0
+  SSL_CTX_set_ecdh_auto(ssl_ctx_.native_handle(), 1);
+#endif
 }
 
 std::shared_ptr<TcpTransportFactory> SslTransportFactoryBuilder::Build(
@@ -195,8 +1054,21 @@ std::shared_ptr<TcpTransportFactory> SslTransportFactoryBuilder::Build(
     return nullptr;
   }
   used_ = true;
-  return std::shared_ptr<TcpTransportFactory>(
-      new impl::SslTransportFactoryImpl(io_service_ptr, std::move(ssl_ctx_)));
+  std::shared_ptr<impl::TicketKeyRing> ticket_key_ring;
+  if (ticket_key_interval_.count() > 0) {
+    ticket_key_ring = std::make_shared<impl::TicketKeyRing>(
+        ticket_key_secret_, ticket_key_interval_);
+  }
+  std::shared_ptr<impl::ClientSessionCache> session_cache;
+  if (session_cache_enabled_) {
+    session_cache = std::make_shared<impl::ClientSessionCache>();
+  }
+  auto factory = new impl::SslTransportFactoryImpl(
+      io_service_ptr, std::move(ssl_ctx_), ticket_key_ring, session_cache,
+      kernel_tls_enabled_);
+  factory->handshake_timeout_ = handshake_timeout_;
+  factory->handshake_pool_ = handshake_pool_;
+  return std::shared_ptr<TcpTransportFactory>(factory);
 }
 
 SslTransportFactoryBuilder& SslTransportFactoryBuilder::AddCaPath(
@@ -259,5 +1131,128 @@ SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetVerifyHost(
   return *this;
 }
 
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetSessionTickets(
+    bool enable) {
+  if (enable) {
+    ssl_ctx_.clear_options(SSL_OP_NO_TICKET);
+  } else {
+    ssl_ctx_.set_options(SSL_OP_NO_TICKET);
+  }
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetTicketKeyRotation(
+    std::chrono::seconds interval) {
+  ticket_key_interval_ = interval;
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::LoadTicketKeyFile(
+    const std::string& file) {
+  std::ifstream in(file, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("failed to open ticket key file: " + file);
+  }
+  std::string content((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+  if (content.size() < impl::TicketKeyRing::kSecretSize) {
+    throw std::runtime_error("ticket key file is too short: " + file);
+  }
+  unsigned int digest_size = 0;
+  EVP_Digest(content.data(), content.size(), ticket_key_secret_.data(),
+             &digest_size, EVP_sha256(), nullptr);
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetSessionCache(
+    bool enable) {
+  session_cache_enabled_ = enable;
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetKernelTls(
+    bool enable) {
+#if defined(THESTRAL_HAVE_KTLS)
+  if (enable) {
+    ssl_ctx_.set_options(SSL_OP_ENABLE_KTLS);
+  } else {
+    ssl_ctx_.clear_options(SSL_OP_ENABLE_KTLS);
+  }
+  kernel_tls_enabled_ = enable;
+#else
+  (void)enable;
+#endif
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetCipherList(
+    const std::string& ciphers) {
+  if (SSL_CTX_set_cipher_list(ssl_ctx_.native_handle(), ciphers.c_str()) !=
+      1) {
+    ThrowSslError("SetCipherList");
+  }
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetCipherSuites(
+    const std::string& suites) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_TLS1_3)
+  if (SSL_CTX_set_ciphersuites(ssl_ctx_.native_handle(), suites.c_str()) !=
+      1) {
+    ThrowSslError("SetCipherSuites");
+  }
+#else
+  (void)suites;
+#endif
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetGroups(
+    const std::string& groups) {
+  // named curves before OpenSSL 1.1.1, which still accepts the old name
+  if (SSL_CTX_set1_curves_list(ssl_ctx_.native_handle(), groups.c_str()) !=
+      1) {
+    ThrowSslError("SetGroups");
+  }
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetMinProtocolVersion(
+    int version) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  if (SSL_CTX_set_min_proto_version(ssl_ctx_.native_handle(), version) != 1) {
+    ThrowSslError("SetMinProtocolVersion");
+  }
+#else
+  if (version > TLS1_1_VERSION) {
+    ssl_ctx_.set_options(boost::asio::ssl::context::no_tlsv1_1);
+  }
+  if (version > TLS1_2_VERSION) {
+    ssl_ctx_.set_options(boost::asio::ssl::context::no_tlsv1_2);
+  }
+#endif
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetHandshakeTimeout(
+    TimingWheel::ClockType::duration timeout) {
+  handshake_timeout_ = timeout;
+  return *this;
+}
+
+SslTransportFactoryBuilder& SslTransportFactoryBuilder::SetHandshakePool(
+    const std::shared_ptr<HandshakePool>& pool) {
+  handshake_pool_ = pool;
+  return *this;
+}
+
+bool SslTransportFactoryBuilder::IsKernelTlsSupported() {
+#if defined(THESTRAL_HAVE_KTLS)
+  return true;
+#else
+  return false;
+#endif
+}
+
 }  // namespace ssl
 }  // namespace thestral
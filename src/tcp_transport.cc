@@ -16,18 +16,472 @@
 /// Implements a transport on plain TCP protocol.
 #include "tcp_transport.h"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include <boost/system/system_error.hpp>
+
+#include "metrics.h"
+
 namespace thestral {
 
+namespace {
+#if defined(SO_REUSEPORT)
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>
+    reuse_port;
+#endif
+#if defined(TCP_KEEPIDLE)
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE>
+    keepalive_idle;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL>
+    keepalive_interval;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPCNT>
+    keepalive_count;
+#endif
+#if defined(TCP_NOTSENT_LOWAT)
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP,
+                                                    TCP_NOTSENT_LOWAT>
+    notsent_lowat;
+#endif
+#if defined(TCP_FASTOPEN)
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>
+    fast_open;
+#endif
+#if defined(TCP_FASTOPEN_CONNECT)
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP,
+                                                    TCP_FASTOPEN_CONNECT>
+    fast_open_connect;
+#endif
+
+const metrics::Histogram kConnectLatency(
+    "thestral_tcp_connect_seconds",
+    "Time taken to establish an outgoing TCP connection.",
+    metrics::Histogram::LatencyBounds());
+const metrics::Counter kAcceptErrors(
+    "thestral_tcp_accept_errors_total",
+    "Number of failures to accept a connection, not ending the accepting.");
+const metrics::Counter kAcceptPauses(
+    "thestral_tcp_accept_pauses_total",
+    "Number of times accepting paused at the connection or handshake limits.");
+
+/// Returns whether an accept error means that the listening socket is unusable.
+bool IsListenerError(const ec_type& ec) {
+  return ec == boost::asio::error::operation_aborted ||
+         ec == boost::asio::error::bad_descriptor ||
+         ec == boost::asio::error::invalid_argument ||
+         ec == boost::asio::error::not_socket;
+}
+
+/// Returns whether an accept error is due to running out of resources, which
+/// may be released soon.
+bool IsResourceError(const ec_type& ec) {
+  return ec == boost::asio::error::no_descriptors ||
+         ec == boost::system::errc::too_many_files_open_in_system ||
+         ec == boost::asio::error::no_buffer_space ||
+         ec == boost::asio::error::no_memory;
+}
+
+/// Applies the options shared by listening and connecting sockets. All of them
+/// are tried, and the first failure, if any, is returned.
+template <typename SocketType>
+ec_type ApplySocketOptions(SocketType& socket, const TcpOptions& options) {
+  ec_type first_error;
+  auto check = [&first_error](const ec_type& ec) {
+    if (ec && !first_error) {
+      first_error = ec;
+    }
+  };
+  ec_type ec;
+  if (options.keepalive_idle > 0) {
+    socket.set_option(boost::asio::socket_base::keep_alive(true), ec);
+    check(ec);
+#if defined(TCP_KEEPIDLE)
+    socket.set_option(keepalive_idle(options.keepalive_idle), ec);
+    check(ec);
+    if (options.keepalive_interval > 0) {
+      socket.set_option(keepalive_interval(options.keepalive_interval), ec);
+      check(ec);
+    }
+    if (options.keepalive_count > 0) {
+      socket.set_option(keepalive_count(options.keepalive_count), ec);
+      check(ec);
+    }
+#else
+    check(boost::asio::error::operation_not_supported);
+#endif
+  }
+  if (options.send_buffer > 0) {
+    socket.set_option(
+        boost::asio::socket_base::send_buffer_size(options.send_buffer), ec);
+    check(ec);
+  }
+  if (options.receive_buffer > 0) {
+    socket.set_option(
+        boost::asio::socket_base::receive_buffer_size(options.receive_buffer),
+        ec);
+    check(ec);
+  }
+  if (options.notsent_lowat > 0) {
+#if defined(TCP_NOTSENT_LOWAT)
+    socket.set_option(notsent_lowat(options.notsent_lowat), ec);
+    check(ec);
+#else
+    check(boost::asio::error::operation_not_supported);
+#endif
+  }
+  if (!options.congestion.empty()) {
+#if defined(TCP_CONGESTION)
+    if (::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_CONGESTION,
+                     options.congestion.data(),
+                     static_cast<socklen_t>(options.congestion.size())) != 0) {
+      check(ec_type(errno, boost::system::system_category()));
+    }
+#else
+    check(boost::asio::error::operation_not_supported);
+#endif
+  }
+  return first_error;
+}
+
+/// Applies the options of a listening socket, opened or adopted, which its
+/// accepted connections inherit. Throws on failure.
+void ApplyListenOptions(boost::asio::ip::tcp::acceptor& acceptor,
+                        const TcpOptions& options) {
+  auto ec = ApplySocketOptions(acceptor, options);
+  if (ec) {
+    throw boost::system::system_error(ec, "setting TCP options");
+  }
+  if (options.fast_open > 0) {
+#if defined(TCP_FASTOPEN)
+    acceptor.set_option(fast_open(options.fast_open));
+#else
+    throw boost::system::system_error(
+        boost::asio::error::operation_not_supported, "TCP_FASTOPEN");
+#endif
+  }
+}
+}  // anonymous namespace
+
+TcpTransportFactory::TcpTransportFactory()
+    : accept_state_(std::make_shared<impl::AcceptState>()) {}
+
 std::shared_ptr<TcpTransportFactory> TcpTransportFactory::New(
     const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
   return impl::TcpTransportFactoryImpl::New(io_service_ptr);
 }
 
+std::shared_ptr<boost::asio::ip::tcp::acceptor>
+TcpTransportFactory::OpenAcceptor(boost::asio::io_service& io_service,
+                                  const EndpointType& endpoint) {
+  auto acceptor = std::make_shared<boost::asio::ip::tcp::acceptor>(io_service);
+  acceptor->open(endpoint.protocol());
+  acceptor->set_option(boost::asio::ip::tcp::no_delay(true));
+  acceptor->set_option(boost::asio::ip::tcp::socket::reuse_address(true));
+  if (reuse_port_) {
+#if defined(SO_REUSEPORT)
+    acceptor->set_option(reuse_port(true));
+#else
+    throw boost::system::system_error(
+        boost::asio::error::operation_not_supported, "SO_REUSEPORT");
+#endif
+  }
+  ApplyListenOptions(*acceptor, tcp_options_);
+  acceptor->bind(endpoint);
+  acceptor->listen(tcp_options_.backlog > 0
+                       ? tcp_options_.backlog
+                       : boost::asio::socket_base::max_connections);
+  last_acceptor_ = acceptor;
+  return acceptor;
+}
+
+std::vector<std::shared_ptr<boost::asio::ip::tcp::acceptor>>
+TcpTransportFactory::OpenAcceptors(boost::asio::io_service& io_service,
+                                   const EndpointType& endpoint) {
+  std::vector<std::shared_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+  if (adopted_sockets_.empty()) {
+    acceptors.push_back(OpenAcceptor(io_service, endpoint));
+  }
+  for (auto socket : adopted_sockets_) {
+    auto acceptor =
+        std::make_shared<boost::asio::ip::tcp::acceptor>(io_service);
+    acceptor->assign(endpoint.protocol(), socket);
+    ApplyListenOptions(*acceptor, tcp_options_);
+    if (tcp_options_.backlog > 0) {
+      acceptor->listen(tcp_options_.backlog);  // only updates the backlog
+    }
+    last_acceptor_ = acceptor;
+    acceptors.push_back(acceptor);
+  }
+  adopted_sockets_.clear();
+  acceptors_.insert(acceptors_.end(), acceptors.cbegin(), acceptors.cend());
+  return acceptors;
+}
+
+std::vector<int> TcpTransportFactory::GetListeningSockets() const {
+  std::vector<int> sockets;
+  for (const auto& weak_acceptor : acceptors_) {
+    auto acceptor = weak_acceptor.lock();
+    if (acceptor && acceptor->is_open()) {
+      sockets.push_back(acceptor->native_handle());
+    }
+  }
+  return sockets;
+}
+
+void TcpTransportFactory::OpenConnectingSocket(
+    boost::asio::ip::tcp::socket::lowest_layer_type& socket,
+    const EndpointType& endpoint, ec_type& error_code, ec_type& warning) const {
+  warning = ec_type();
+  socket.open(endpoint.protocol(), error_code);
+  if (error_code) {
+    return;
+  }
+  warning = ApplySocketOptions(socket, tcp_options_);
+  if (tcp_options_.fast_open != 0) {
+#if defined(TCP_FASTOPEN_CONNECT)
+    ec_type ec;
+    socket.set_option(fast_open_connect(1), ec);
+    if (ec && !warning) {
+      warning = ec;
+    }
+#else
+    if (!warning) {
+      warning = boost::asio::error::operation_not_supported;
+    }
+#endif
+  }
+}
+
+void TcpTransportFactory::StopAccepting() {
+  for (const auto& weak_acceptor : acceptors_) {
+    if (auto acceptor = weak_acceptor.lock()) {
+      ec_type ec;
+      acceptor->close(ec);
+    }
+  }
+  acceptors_.clear();
+  // the paused loops have no accept to abort
+  std::vector<std::shared_ptr<impl::AcceptLoop>> paused_loops;
+  paused_loops.swap(accept_state_->paused_loops);
+  for (const auto& loop : paused_loops) {
+    loop->Abort();
+  }
+}
+
+void TcpTransportFactory::SetAcceptLimits(const AcceptLimits& limits) {
+  accept_state_->limits = limits;
+  accept_state_->Resume();
+}
+
+const AcceptLimits& TcpTransportFactory::GetAcceptLimits() const {
+  return accept_state_->limits;
+}
+
+void TcpTransportFactory::StartAcceptLoops(
+    boost::asio::io_service& io_service, const EndpointType& endpoint,
+    const NewTransportType& new_transport, const FinishAcceptType& finish,
+    const AcceptCallbackType& callback) {
+  for (const auto& acceptor : OpenAcceptors(io_service, endpoint)) {
+    StartAcceptLoop(io_service, acceptor, new_transport, finish, callback);
+  }
+}
+
+void TcpTransportFactory::StartAcceptLoop(
+    boost::asio::io_service& io_service,
+    const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
+    const NewTransportType& new_transport, const FinishAcceptType& finish,
+    const AcceptCallbackType& callback) {
+  impl::AcceptLoop::New(io_service, acceptor, accept_state_, new_transport,
+                        finish, callback)
+      ->Start();
+}
+
 namespace impl {
 
 namespace asio = boost::asio;
 namespace ip = boost::asio::ip;
 
+bool AcceptState::CanAccept() const {
+  return (limits.max_connections == 0 ||
+          n_connections < limits.max_connections) &&
+         (limits.max_handshakes == 0 || n_handshakes < limits.max_handshakes);
+}
+
+void AcceptState::Resume() {
+  if (paused_loops.empty() || !CanAccept()) {
+    return;
+  }
+  std::vector<std::shared_ptr<AcceptLoop>> loops;
+  loops.swap(paused_loops);
+  for (const auto& loop : loops) {
+    loop->Resume();
+  }
+}
+
+logging::Logger AcceptLoop::LOG("AcceptLoop");
+
+constexpr int AcceptLoop::kMaxAcceptsPerWakeup;
+constexpr std::chrono::milliseconds AcceptLoop::kMinBackoff;
+constexpr std::chrono::milliseconds AcceptLoop::kMaxBackoff;
+
+void AcceptLoop::Start() {
+  ec_type ec;
+  acceptor_->non_blocking(true, ec);
+  can_drain_ = !ec;
+  DoAccept();
+}
+
+void AcceptLoop::Resume() {
+  auto self = shared_from_this();
+  io_service_.post([self]() { self->DoAccept(); });
+}
+
+void AcceptLoop::Abort() {
+  auto self = shared_from_this();
+  io_service_.post([self]() {
+    if (!self->is_stopped_) {
+      self->is_stopped_ = true;
+      self->callback_(asio::error::operation_aborted, nullptr);
+    }
+  });
+}
+
+void AcceptLoop::DoAccept() {
+  if (is_stopped_) {
+    return;
+  }
+  if (!state_->CanAccept()) {
+    THESTRAL_LOG_DEBUG(LOG, "connection limits reached, pause accepting");
+    kAcceptPauses.Increment();
+    state_->paused_loops.push_back(shared_from_this());
+    return;
+  }
+
+  auto transport =
+      spare_transport_ ? std::move(spare_transport_) : new_transport_();
+  auto self = shared_from_this();
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] waiting for one connection",
+                     transport->GetId());
+  acceptor_->async_accept(transport->GetUnderlyingSocket(),
+                          [self, transport](const ec_type& ec) {
+                            self->HandleAccept(ec, transport);
+                          });
+}
+
+void AcceptLoop::HandleAccept(const ec_type& ec,
+                              const std::shared_ptr<TcpTransport>& transport) {
+  if (ec) {
+    transport->StartClose();
+    if (HandleError(ec)) {
+      DoAccept();
+    }
+    return;
+  }
+  backoff_ = std::chrono::milliseconds(0);
+  HandleConnection(transport);
+
+  // take the connections already queued without waiting for the reactor
+  for (int i = 1; i < kMaxAcceptsPerWakeup && can_drain_ && !is_stopped_ &&
+                  state_->CanAccept();
+       ++i) {
+    auto next = new_transport_();
+    ec_type accept_ec;
+    acceptor_->accept(next->GetUnderlyingSocket(), accept_ec);
+    if (accept_ec == asio::error::would_block ||
+        accept_ec == asio::error::try_again) {
+      spare_transport_ = std::move(next);
+      break;
+    }
+    if (accept_ec) {
+      if (!HandleError(accept_ec)) {
+        return;
+      }
+      continue;
+    }
+    HandleConnection(next);
+  }
+  DoAccept();
+}
+
+bool AcceptLoop::HandleError(const ec_type& ec) {
+  if (is_stopped_) {
+    return false;
+  }
+  if (IsListenerError(ec)) {
+    THESTRAL_LOG_DEBUG(LOG, "acceptor returning an error: %s, stop accepting",
+                       ec.message().c_str());
+    is_stopped_ = true;
+    callback_(ec, nullptr);
+    return false;
+  }
+
+  kAcceptErrors.Increment();
+  if (!IsResourceError(ec)) {
+    THESTRAL_LOG_DEBUG(LOG, "failed to accept a connection, reason: %s",
+                       ec.message().c_str());
+    return true;
+  }
+  // the connections stay in the backlog until resources are released
+  backoff_ = std::min(kMaxBackoff, std::max(kMinBackoff, backoff_ * 2));
+  LOG.Warn("failed to accept a connection, reason: %s, retrying in %d ms",
+           ec.message().c_str(), static_cast<int>(backoff_.count()));
+  auto self = shared_from_this();
+  backoff_timer_.expires_from_now(backoff_);
+  backoff_timer_.async_wait([self](const ec_type& ec) {
+    if (!ec) {
+      self->DoAccept();
+    }
+  });
+  return false;
+}
+
+void AcceptLoop::HandleConnection(
+    const std::shared_ptr<TcpTransport>& transport) {
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] one connection accepted",
+                     transport->GetId());
+  if (state_->limits.max_connections != 0) {
+    ++state_->n_connections;
+    auto state = state_;
+    transport->SetAcceptToken(std::shared_ptr<void>(nullptr, [state](void*) {
+      --state->n_connections;
+      state->Resume();
+    }));
+  }
+  if (!finish_) {
+    Deliver(ec_type(), transport);
+    return;
+  }
+
+  ++state_->n_handshakes;
+  auto self = shared_from_this();
+  finish_(transport, [self](const ec_type& ec,
+                            const std::shared_ptr<TransportBase>& transport) {
+    --self->state_->n_handshakes;
+    self->state_->Resume();
+    self->Deliver(ec, transport);
+  });
+}
+
+void AcceptLoop::Deliver(const ec_type& ec,
+                         const std::shared_ptr<TransportBase>& transport) {
+  // connections finished after stopping are still handed over
+  if (!callback_(ec, transport) && !is_stopped_) {
+    THESTRAL_LOG_DEBUG(LOG, "upper layer gave up accepting more connections");
+    Stop();
+  }
+}
+
+void AcceptLoop::Stop() {
+  is_stopped_ = true;
+  ec_type ec;
+  acceptor_->cancel(ec);
+  backoff_timer_.cancel(ec);
+}
+
 TcpTransportImpl::TcpTransportImpl(asio::io_service& io_service)
     : socket_(io_service) {}
 
@@ -43,15 +497,32 @@ void TcpTransportImpl::StartRead(const boost::asio::mutable_buffers_1& buf,
                                  const ReadCallbackType& callback,
                                  bool allow_short_read) {
   if (allow_short_read) {
-    socket_.async_read_some(buf, callback);
+    socket_.async_read_some(buf, MakeAllocatingHandler(read_memory_, callback));
   } else {
-    boost::asio::async_read(socket_, buf, callback);
+    boost::asio::async_read(socket_, buf,
+                            MakeAllocatingHandler(read_memory_, callback));
   }
 }
 
 void TcpTransportImpl::StartWrite(const boost::asio::const_buffers_1& buf,
                                   const WriteCallbackType& callback) {
-  boost::asio::async_write(socket_, buf, callback);
+  boost::asio::async_write(socket_, buf,
+                           MakeAllocatingHandler(write_memory_, callback));
+}
+
+void TcpTransportImpl::StartWrite(const ConstBufferSequence& buffers,
+                                  const WriteCallbackType& callback) {
+  boost::asio::async_write(socket_, buffers,
+                           MakeAllocatingHandler(write_memory_, callback));
+}
+
+void TcpTransportImpl::StartWaitReadable(const WaitCallbackType& callback) {
+  socket_.async_read_some(
+      asio::null_buffers(),
+      MakeAllocatingHandler(read_memory_,
+                            [callback](const ec_type& ec, std::size_t) {
+                              callback(ec);
+                            }));
 }
 
 void TcpTransportImpl::StartClose(const CloseCallbackType& callback) {
@@ -65,86 +536,89 @@ void TcpTransportImpl::StartClose(const CloseCallbackType& callback) {
   callback(ec);
 }
 
+void TcpTransportImpl::StartShutdownSend(const CloseCallbackType& callback) {
+  ec_type ec;
+  socket_.shutdown(ip::tcp::socket::shutdown_send, ec);
+  callback(ec);
+}
+
 logging::Logger TcpTransportFactoryImpl::LOG("TcpTransportFactoryImpl");
 
 void TcpTransportFactoryImpl::StartAccept(EndpointType endpoint,
                                           const AcceptCallbackType& callback) {
-  LOG.Debug("start accepting");
-  auto acceptor =
-      std::make_shared<ip::tcp::acceptor>(*io_service_ptr_, endpoint);
-  acceptor->set_option(ip::tcp::no_delay(true));
-  acceptor->set_option(ip::tcp::socket::reuse_address(true));
-  last_acceptor_ = acceptor;
-  DoAccept(acceptor, callback);
+  THESTRAL_LOG_DEBUG(LOG, "start accepting");
+  auto self = shared_from_this();
+  StartAcceptLoops(
+      *io_service_ptr_, endpoint,
+      [self]() -> std::shared_ptr<TcpTransport> {
+        return self->NewTransport();
+      },
+      FinishAcceptType(), callback);
 }
 
 void TcpTransportFactoryImpl::StartConnect(
     EndpointType endpoint, const ConnectCallbackType& callback) {
+  StartCancelableConnect(endpoint, callback);
+}
+
+TcpTransportFactory::CancelFunctionType
+TcpTransportFactoryImpl::StartCancelableConnect(
+    EndpointType endpoint, const ConnectCallbackType& callback) {
   auto transport = NewTransport();
   auto self = shared_from_this();
-  LOG.Debug("[%llX] start connecting", transport->GetId());
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] start connecting", transport->GetId());
+  ec_type open_ec, warning;
+  OpenConnectingSocket(transport->GetUnderlyingSocket(), endpoint, open_ec,
+                       warning);
+  if (warning) {
+    LOG.Warn("[%llX] failed to apply socket options, reason: %s",
+             transport->GetId(), warning.message().c_str());
+  }
+  if (open_ec) {
+    io_service_ptr_->post(
+        [callback, open_ec]() { callback(open_ec, nullptr); });
+    return []() {};
+  }
+  auto start = metrics::Histogram::ClockType::now();
   transport->GetUnderlyingSocket().async_connect(
-      endpoint, [transport, self, callback](const ec_type& ec) {
+      endpoint, [transport, self, callback, start](const ec_type& ec) {
         if (ec) {
-          self->LOG.Debug("[%llX] transport returning an error: %s",
-                          transport->GetId(), ec.message().c_str());
+          THESTRAL_LOG_DEBUG(self->LOG,
+                             "[%llX] transport returning an error: %s",
+                             transport->GetId(), ec.message().c_str());
           transport->StartClose();
           callback(ec, nullptr);
         } else {
-          self->LOG.Debug("[%llX] connection established", transport->GetId());
+          THESTRAL_LOG_DEBUG(self->LOG, "[%llX] connection established",
+                             transport->GetId());
+          kConnectLatency.ObserveSince(start);
           transport->GetUnderlyingSocket().set_option(ip::tcp::no_delay(true));
           callback(ec, transport);
         }
       });
-}
 
-void TcpTransportFactoryImpl::DoAccept(
-    const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor,
-    const AcceptCallbackType& callback) {
-  auto transport = NewTransport();
-  auto self = shared_from_this();
-  LOG.Debug("[%llX] waiting for one connection", transport->GetId());
-  acceptor->async_accept(
-      transport->GetUnderlyingSocket(),
-      [self, acceptor, callback, transport](const ec_type& ec) {
-        bool should_stop = false;
-        if (ec) {
-          self->LOG.Debug(
-              "[%llX] acceptor returning an error: %s, stop accepting",
-              transport->GetId(), ec.message().c_str());
-          should_stop = true;
-          transport->StartClose();
-        } else {
-          self->LOG.Debug("[%llX] one connection accepted", transport->GetId());
-        }
-        // even if `should_stop` is true, we still need to report the error
-        // to the upper layer(s)
-        if (callback(ec, ec ? nullptr : transport) && !should_stop) {
-          // recursively accept more connections
-          self->DoAccept(acceptor, callback);
-        } else if (should_stop) {
-          self->LOG.Debug("[%llX] give up accepting more connections",
-                          transport->GetId());
-        } else {
-          self->LOG.Debug(
-              "[%llX] upper layer gave up accepting more connections",
-              transport->GetId());
-        }
-      });
+  std::weak_ptr<TcpTransport> weak_transport = transport;
+  return [weak_transport]() {
+    if (auto transport = weak_transport.lock()) {
+      ec_type ec;
+      transport->GetUnderlyingSocket().close(ec);
+    }
+  };
 }
 
 std::shared_ptr<TransportBase> TcpTransportFactoryImpl::TryConnect(
     boost::asio::ip::tcp::resolver::iterator& iter, ec_type& error_code) {
   auto transport = NewTransport();
-  LOG.Debug("[%llX] start connecting", transport->GetId());
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] start connecting", transport->GetId());
   boost::asio::connect(transport->GetUnderlyingSocket(), iter, error_code);
   if (error_code) {
-    LOG.Debug("[%llX] transport returning an error: %s", transport->GetId(),
-              error_code.message().c_str());
+    THESTRAL_LOG_DEBUG(LOG, "[%llX] transport returning an error: %s",
+                       transport->GetId(), error_code.message().c_str());
     transport->StartClose();
     return nullptr;
   } else {
-    LOG.Debug("[%llX] connection established", transport->GetId());
+    THESTRAL_LOG_DEBUG(LOG, "[%llX] connection established",
+                       transport->GetId());
     return transport;
   }
 }
@@ -0,0 +1,180 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Implements a hashed timing wheel bound to an io_service.
+#include "timing_wheel.h"
+
+#include <utility>
+
+namespace thestral {
+
+constexpr TimingWheel::ClockType::duration TimingWheel::kTickInterval;
+constexpr std::size_t TimingWheel::kNumSlots;
+
+boost::asio::io_service::id TimingWheel::id;
+
+TimingWheel::Timer& TimingWheel::Timer::operator=(Timer&& other) {
+  if (this != &other) {
+    Cancel();
+    entry_ = std::move(other.entry_);
+  }
+  return *this;
+}
+
+TimingWheel::Timer::~Timer() { Cancel(); }
+
+bool TimingWheel::Timer::IsPending() const {
+  return entry_ && entry_->wheel;
+}
+
+void TimingWheel::Timer::Touch() {
+  if (IsPending()) {
+    entry_->expiry_tick = entry_->wheel->current_tick_ + entry_->timeout_ticks;
+  }
+}
+
+void TimingWheel::Timer::Cancel() {
+  if (IsPending()) {
+    entry_->wheel->Unlink(entry_.get());
+  }
+  entry_.reset();
+}
+
+TimingWheel::TimingWheel(boost::asio::io_service& io_service)
+    : boost::asio::io_service::service(io_service),
+      start_time_(ClockType::now()),
+      tick_timer_(io_service) {
+  for (auto& slot : slots_) {
+    slot.prev = slot.next = &slot;
+  }
+  expired_.prev = expired_.next = &expired_;
+}
+
+TimingWheel::Timer TimingWheel::Start(ClockType::duration timeout,
+                                      const CallbackType& callback) {
+  if (!is_ticking_) {
+    current_tick_ = GetCurrentTick();  // no slot to catch up with
+  }
+
+  Timer timer;
+  timer.entry_.reset(new Entry);
+  auto entry = timer.entry_.get();
+  // one more tick, as the current tick has partly passed
+  entry->timeout_ticks =
+      static_cast<uint64_t>((timeout + kTickInterval - ClockType::duration(1)) /
+                            kTickInterval) +
+      1;
+  entry->expiry_tick = current_tick_ + entry->timeout_ticks;
+  entry->callback = callback;
+  Link(entry, GetSlot(entry->expiry_tick));
+
+  if (!is_ticking_) {
+    ScheduleTick();
+  }
+  return timer;
+}
+
+void TimingWheel::shutdown_service() {
+  for (auto& slot : slots_) {
+    while (slot.next != &slot) {
+      Unlink(slot.next);
+    }
+  }
+  while (expired_.next != &expired_) {
+    Unlink(expired_.next);
+  }
+  boost::system::error_code ec;
+  tick_timer_.cancel(ec);
+  is_ticking_ = false;
+}
+
+void TimingWheel::Link(Entry* entry, Entry& list) {
+  entry->prev = list.prev;
+  entry->next = &list;
+  list.prev->next = entry;
+  list.prev = entry;
+  entry->wheel = this;
+  ++n_pending_;
+}
+
+void TimingWheel::Unlink(Entry* entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->prev = entry->next = nullptr;
+  entry->wheel = nullptr;
+  --n_pending_;
+}
+
+uint64_t TimingWheel::GetCurrentTick() const {
+  return static_cast<uint64_t>((ClockType::now() - start_time_) /
+                               kTickInterval);
+}
+
+void TimingWheel::ScheduleTick() {
+  is_ticking_ = true;
+  tick_timer_.expires_at(start_time_ + kTickInterval * (current_tick_ + 1));
+  tick_timer_.async_wait([this](const boost::system::error_code& ec) {
+    if (!ec) {
+      HandleTick();
+    }
+  });
+}
+
+void TimingWheel::HandleTick() {
+  auto process_slot = [this](Entry& slot) {
+    for (auto entry = slot.next; entry != &slot;) {
+      auto next = entry->next;
+      if (entry->expiry_tick <= current_tick_) {
+        Unlink(entry);
+        Link(entry, expired_);
+      } else if (&GetSlot(entry->expiry_tick) != &slot) {
+        Unlink(entry);  // touched since it was linked
+        Link(entry, GetSlot(entry->expiry_tick));
+      }
+      entry = next;
+    }
+  };
+
+  auto target_tick = GetCurrentTick();
+  if (target_tick - current_tick_ > kNumSlots) {
+    // a full turn has been missed, every slot has to be checked anyway
+    current_tick_ = target_tick;
+    for (auto& slot : slots_) {
+      process_slot(slot);
+    }
+  } else {
+    while (current_tick_ < target_tick) {
+      ++current_tick_;
+      process_slot(GetSlot(current_tick_));
+    }
+  }
+
+  // the callbacks may cancel other expired timers, which then stay silent
+  while (expired_.next != &expired_) {
+    auto entry = expired_.next;
+    Unlink(entry);
+    auto callback = std::move(entry->callback);
+    callback();  // may destroy the timer, along with the entry
+  }
+
+  if (n_pending_ > 0) {
+    ScheduleTick();
+  } else {
+    is_ticking_ = false;
+  }
+}
+
+}  // namespace thestral
@@ -0,0 +1,281 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the sampled tracing of sessions.
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace thestral {
+namespace trace {
+
+namespace {
+
+constexpr std::size_t kDescriptionWords = kMaxDescriptionSize / 8;
+
+/// A trace in a recorder. Every field is atomic so that readers can copy it
+/// while it is being overwritten, which they detect with the sequence like a
+/// seqlock.
+struct Slot {
+  /// Odd while being written, zero if never written.
+  std::atomic<uint32_t> sequence;
+  std::atomic<uint64_t> id;
+  std::atomic<uint64_t> is_forwarded;
+  /// Nanoseconds since the epoch of the system clock.
+  std::atomic<int64_t> wall_time;
+  std::atomic<uint64_t> offsets[kNumEvents];
+  std::atomic<uint64_t> description[kDescriptionWords];
+};
+
+/// The traces written by a single thread. Only that thread writes them, so
+/// writing takes no lock.
+struct Recorder {
+  std::atomic<uint64_t> n_written;
+  Slot slots[kRecorderSize];
+};
+
+struct RecorderRegistry {
+  std::mutex mutex;
+  std::vector<Recorder*> recorders;
+};
+
+RecorderRegistry& GetRecorderRegistry() {
+  static RecorderRegistry registry;
+  return registry;
+}
+
+/// Registers the recorder of the calling thread. It is never freed, so that
+/// the traces survive the thread.
+Recorder& GetThreadRecorder() {
+  thread_local Recorder* recorder = nullptr;
+  if (!recorder) {
+    recorder = new Recorder();  // zero-initialized
+    auto& registry = GetRecorderRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.recorders.push_back(recorder);
+  }
+  return *recorder;
+}
+
+std::atomic<unsigned int> g_sampling{0};
+
+uint64_t NewId() {
+  thread_local std::mt19937_64 engine{
+      std::random_device{}() ^
+      std::hash<std::thread::id>()(std::this_thread::get_id())};
+  uint64_t id;
+  do {
+    id = engine();
+  } while (id == 0);
+  return id;
+}
+
+/// A trace copied out of a recorder.
+struct Record {
+  uint64_t id;
+  bool is_forwarded;
+  int64_t wall_time;
+  uint64_t offsets[kNumEvents];
+  char description[kMaxDescriptionSize + 1];
+};
+
+/// Copies a slot, returning `false` if it is empty or being overwritten.
+bool ReadSlot(const Slot& slot, Record* record) {
+  auto sequence = slot.sequence.load(std::memory_order_acquire);
+  if (sequence == 0 || sequence % 2 != 0) {
+    return false;
+  }
+  record->id = slot.id.load(std::memory_order_relaxed);
+  record->is_forwarded = slot.is_forwarded.load(std::memory_order_relaxed);
+  record->wall_time = slot.wall_time.load(std::memory_order_relaxed);
+  for (std::size_t i = 0; i < kNumEvents; ++i) {
+    record->offsets[i] = slot.offsets[i].load(std::memory_order_relaxed);
+  }
+  for (std::size_t i = 0; i < kDescriptionWords; ++i) {
+    auto word = slot.description[i].load(std::memory_order_relaxed);
+    std::memcpy(record->description + i * 8, &word, 8);
+  }
+  record->description[kMaxDescriptionSize] = '\0';
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+/// Names of the events in the text, indexed by their values.
+const char* const kEventNames[kNumEvents] = {
+    "accept", "greeting", "request", "dns", "connected",
+    "tls", "ready", "first_up", "first_down", "close"};
+
+}  // anonymous namespace
+
+void SetSampling(unsigned int n) {
+  g_sampling.store(n, std::memory_order_relaxed);
+}
+
+bool IsEnabled() { return g_sampling.load(std::memory_order_relaxed) != 0; }
+
+Trace::Trace(uint64_t id, bool is_forwarded,
+             ClockType::time_point accept_time)
+    : id_(id),
+      is_forwarded_(is_forwarded),
+      accept_time_(accept_time),
+      wall_time_(std::chrono::system_clock::now() -
+                 std::chrono::duration_cast<
+                     std::chrono::system_clock::duration>(ClockType::now() -
+                                                          accept_time)) {
+  offsets_.fill(0);
+  offsets_[static_cast<std::size_t>(Event::kAccept)] = 1;
+}
+
+Trace::~Trace() {
+  Record(Event::kClose);
+
+  auto& recorder = GetThreadRecorder();
+  auto n_written = recorder.n_written.load(std::memory_order_relaxed);
+  auto& slot = recorder.slots[n_written % kRecorderSize];
+  auto sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.id.store(id_, std::memory_order_relaxed);
+  slot.is_forwarded.store(is_forwarded_, std::memory_order_relaxed);
+  slot.wall_time.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           wall_time_.time_since_epoch())
+                           .count(),
+                       std::memory_order_relaxed);
+  for (std::size_t i = 0; i < kNumEvents; ++i) {
+    slot.offsets[i].store(offsets_[i], std::memory_order_relaxed);
+  }
+  char description[kMaxDescriptionSize] = {};
+  description_.copy(description, kMaxDescriptionSize);
+  for (std::size_t i = 0; i < kDescriptionWords; ++i) {
+    uint64_t word;
+    std::memcpy(&word, description + i * 8, 8);
+    slot.description[i].store(word, std::memory_order_relaxed);
+  }
+
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+  recorder.n_written.store(n_written + 1, std::memory_order_release);
+}
+
+std::shared_ptr<Trace> Trace::StartSampled(
+    ClockType::time_point accept_time) {
+  auto n = g_sampling.load(std::memory_order_relaxed);
+  thread_local unsigned int n_sessions = 0;
+  if (n == 0 || ++n_sessions % n != 0) {
+    return nullptr;
+  }
+  n_sessions = 0;
+  return std::shared_ptr<Trace>(new Trace(NewId(), false, accept_time));
+}
+
+std::shared_ptr<Trace> Trace::StartForwarded(
+    uint64_t id, ClockType::time_point accept_time) {
+  if (!IsEnabled()) {
+    return nullptr;
+  }
+  return std::shared_ptr<Trace>(new Trace(id, true, accept_time));
+}
+
+void Trace::Record(Event event) {
+  auto& offset = offsets_[static_cast<std::size_t>(event)];
+  if (offset == 0) {
+    offset = static_cast<uint64_t>(
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     ClockType::now() - accept_time_)
+                     .count()) +
+             1;
+  }
+}
+
+void Trace::SetDescription(const std::string& description) {
+  // domain names may hold anything, and the text has a trace per line
+  description_ = description.substr(0, kMaxDescriptionSize);
+  for (auto& c : description_) {
+    if (c < 0x20 || c == 0x7f || c == '"') {
+      c = '?';
+    }
+  }
+}
+
+namespace {
+thread_local std::shared_ptr<Trace> t_current;
+}  // anonymous namespace
+
+Scope::Scope(const std::shared_ptr<Trace>& trace) : previous_(t_current) {
+  t_current = trace;
+}
+
+Scope::~Scope() { t_current = previous_; }
+
+const std::shared_ptr<Trace>& Current() { return t_current; }
+
+std::string RenderText() {
+  std::vector<Recorder*> recorders;
+  {
+    auto& registry = GetRecorderRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    recorders = registry.recorders;
+  }
+
+  std::vector<Record> records;
+  for (auto recorder : recorders) {
+    auto n_written = recorder->n_written.load(std::memory_order_acquire);
+    auto first = n_written > kRecorderSize ? n_written - kRecorderSize : 0;
+    for (auto i = first; i < n_written; ++i) {
+      Record record;
+      if (ReadSlot(recorder->slots[i % kRecorderSize], &record)) {
+        records.push_back(record);
+      }
+    }
+  }
+  std::stable_sort(records.begin(), records.end(),
+                   [](const Record& lhs, const Record& rhs) {
+                     return lhs.wall_time < rhs.wall_time;
+                   });
+
+  std::string result;
+  char buf[128];
+  for (const auto& record : records) {
+    std::snprintf(buf, sizeof(buf),
+                  "trace=%016" PRIx64 " start=%" PRId64 ".%06" PRId64
+                  " forwarded=%d session=\"",
+                  record.id, record.wall_time / 1000000000,
+                  record.wall_time % 1000000000 / 1000,
+                  record.is_forwarded ? 1 : 0);
+    result.append(buf).append(record.description).append("\"");
+    // the accept is the origin of the other events
+    for (std::size_t i = 1; i < kNumEvents; ++i) {
+      result.append(" ").append(kEventNames[i]).append("=");
+      if (record.offsets[i] == 0) {
+        result.append("-");
+      } else {
+        result.append(std::to_string((record.offsets[i] - 1) / 1000));
+      }
+    }
+    result.append("\n");
+  }
+  return result;
+}
+
+}  // namespace trace
+}  // namespace thestral
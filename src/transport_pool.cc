@@ -0,0 +1,118 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements a pool of pre-established transports.
+#include "transport_pool.h"
+
+namespace thestral {
+
+logging::Logger TransportPool::LOG("TransportPool");
+
+void TransportPool::Start(const boost::asio::ip::tcp::endpoint& endpoint) {
+  if (started_ && endpoint == endpoint_) {
+    return;
+  }
+  for (auto& idle : idle_) {
+    idle.transport->StartClose();
+  }
+  idle_.clear();
+  endpoint_ = endpoint;
+  ++generation_;
+  started_ = true;
+  Refill();
+}
+
+std::shared_ptr<TransportBase> TransportPool::Take() {
+  std::shared_ptr<TransportBase> transport;
+  auto now = ClockType::now();
+  while (!idle_.empty() && !transport) {
+    auto idle = idle_.front();
+    idle_.pop_front();
+    if (idle.expiry > now) {
+      transport = idle.transport;
+    } else {
+      idle.transport->StartClose();
+    }
+  }
+  Refill();
+  return transport;
+}
+
+void TransportPool::Refill() {
+  if (!started_) {
+    return;
+  }
+  auto self = shared_from_this();
+  auto generation = generation_;
+  while (idle_.size() + n_connecting_ < max_size_) {
+    ++n_connecting_;
+    transport_factory_->StartConnect(
+        endpoint_,
+        [self, generation](const ec_type& ec,
+                           const std::shared_ptr<TransportBase>& transport) {
+          self->HandleConnect(ec, transport, generation);
+        });
+  }
+}
+
+void TransportPool::HandleConnect(
+    const ec_type& ec, const std::shared_ptr<TransportBase>& transport,
+    unsigned int generation) {
+  --n_connecting_;
+  if (ec) {
+    // don't retry now, or a dead endpoint would be hammered; the pool is
+    // refilled on the next Take()
+    LOG.Warn("failed to pre-connect to %s, port: %u, reason: %s",
+             endpoint_.address().to_string().c_str(), endpoint_.port(),
+             ec.message().c_str());
+    return;
+  }
+  if (generation != generation_ || idle_.size() >= max_size_) {
+    transport->StartClose();
+    Refill();
+    return;
+  }
+
+  THESTRAL_LOG_DEBUG(LOG, "[%llX] pre-connected transport added to the pool",
+                     transport->GetId());
+  idle_.push_back({transport, ClockType::now() + idle_timeout_});
+  ScheduleExpiry();
+}
+
+void TransportPool::ExpireIdle() {
+  expiry_scheduled_ = false;
+  // expired transports are not replaced until the pool is used again, so
+  // that an idle pool doesn't keep reconnecting
+  auto now = ClockType::now();
+  while (!idle_.empty() && idle_.front().expiry <= now) {
+    THESTRAL_LOG_DEBUG(LOG, "[%llX] closing expired idle transport",
+                       idle_.front().transport->GetId());
+    idle_.front().transport->StartClose();
+    idle_.pop_front();
+  }
+  ScheduleExpiry();
+}
+
+void TransportPool::ScheduleExpiry() {
+  if (expiry_scheduled_ || idle_.empty()) {
+    return;
+  }
+  expiry_scheduled_ = true;
+  expiry_timer_.expires_at(idle_.front().expiry);
+  auto self = shared_from_this();
+  expiry_timer_.async_wait([self](const ec_type&) { self->ExpireIdle(); });
+}
+
+}  // namespace thestral
@@ -0,0 +1,297 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements \ref thestral::UpstreamGroup.
+#include "upstream_group.h"
+
+#include "metrics.h"
+#include "timing_wheel.h"
+
+namespace thestral {
+
+namespace {
+const metrics::Counter kEjections(
+    "thestral_upstream_group_ejections_total",
+    "Number of times a member of an upstream group was ejected.");
+const metrics::Counter kRetries(
+    "thestral_upstream_group_retries_total",
+    "Number of requests retried on another member of an upstream group.");
+const metrics::Counter kHealthCheckFailures(
+    "thestral_upstream_group_health_check_failures_total",
+    "Number of failed health checks of upstream group members.");
+}  // anonymous namespace
+
+logging::Logger UpstreamGroup::LOG("UpstreamGroup");
+
+constexpr double UpstreamGroup::kLatencyWeight;
+constexpr std::size_t UpstreamGroup::kNoMember;
+
+UpstreamGroup::UpstreamGroup(
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr,
+    Policy policy)
+    : io_service_ptr_(io_service_ptr),
+      policy_(policy),
+      random_(std::random_device()()),
+      check_timer_(*io_service_ptr) {}
+
+void UpstreamGroup::AddMember(
+    const std::string& name,
+    const std::shared_ptr<UpstreamFactoryBase>& upstream) {
+  members_.emplace_back();
+  members_.back().name = name;
+  members_.back().upstream = upstream;
+  candidates_.reserve(members_.size());
+}
+
+void UpstreamGroup::SetHealthCheck(const Address& target,
+                                   ClockType::duration interval,
+                                   ClockType::duration timeout) {
+  check_target_ = target;
+  check_interval_ = interval;
+  check_timeout_ = timeout;
+  // may be called from another thread while the io_service is running
+  std::weak_ptr<UpstreamGroup> weak_self = shared_from_this();
+  io_service_ptr_->post([weak_self]() {
+    if (auto self = weak_self.lock()) {
+      self->ScheduleHealthCheck();
+    }
+  });
+}
+
+void UpstreamGroup::StartRequest(const Address& endpoint,
+                                 const RequestCallbackType& callback) {
+  StartMemberRequest(PickMember(kNoMember), endpoint, callback,
+                     members_.size() > 1);
+}
+
+bool UpstreamGroup::IsUpstreamFailure(const ec_type& ec) const {
+  for (const auto& member : members_) {
+    if (member.upstream->IsUpstreamFailure(ec)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::size_t UpstreamGroup::CountAvailableMembers() const {
+  auto now = ClockType::now();
+  std::size_t n_available = 0;
+  for (const auto& member : members_) {
+    if (member.ejected_until <= now) {
+      ++n_available;
+    }
+  }
+  return n_available;
+}
+
+std::size_t UpstreamGroup::PickMember(std::size_t excluded) {
+  auto now = ClockType::now();
+  candidates_.clear();
+  for (std::size_t i = 0; i < members_.size(); ++i) {
+    if (i != excluded && members_[i].ejected_until <= now) {
+      candidates_.push_back(i);
+    }
+  }
+
+  if (candidates_.empty()) {
+    auto picked = excluded;
+    for (std::size_t i = 0; i < members_.size(); ++i) {
+      if (i != excluded &&
+          (picked == excluded ||
+           members_[i].ejected_until < members_[picked].ejected_until)) {
+        picked = i;
+      }
+    }
+    return picked;
+  }
+
+  if (policy_ == Policy::kPowerOfTwoChoices) {
+    if (candidates_.size() == 1) {
+      return candidates_.front();
+    }
+    std::uniform_int_distribution<std::size_t> distribution(
+        0, candidates_.size() - 1);
+    auto first = candidates_[distribution(random_)];
+    auto second = first;
+    while (second == first) {
+      second = candidates_[distribution(random_)];
+    }
+    // members not measured yet are tried first
+    const auto& a = members_[first];
+    const auto& b = members_[second];
+    if (a.connect_latency != b.connect_latency) {
+      return a.connect_latency < b.connect_latency ? first : second;
+    }
+    return a.n_outstanding <= b.n_outstanding ? first : second;
+  }
+
+  auto offset = next_member_++ % candidates_.size();
+  auto picked = candidates_[offset];
+  for (std::size_t i = 1; i < candidates_.size(); ++i) {
+    auto index = candidates_[(offset + i) % candidates_.size()];
+    if (members_[index].n_outstanding < members_[picked].n_outstanding) {
+      picked = index;
+    }
+  }
+  return picked;
+}
+
+void UpstreamGroup::StartMemberRequest(std::size_t index,
+                                       const Address& endpoint,
+                                       const RequestCallbackType& callback,
+                                       bool can_retry) {
+  ++members_[index].n_outstanding;
+  auto self = shared_from_this();
+  auto start = ClockType::now();
+  members_[index].upstream->StartRequest(
+      endpoint, [self, index, endpoint, callback, can_retry, start](
+                    const ec_type& request_ec,
+                    const std::shared_ptr<TransportBase>& transport) {
+        // a success without a transport is the member's fault
+        auto ec = request_ec;
+        if (!ec && !transport) {
+          ec = boost::system::errc::make_error_code(
+              boost::system::errc::protocol_error);
+        }
+        if (!ec) {
+          self->RecordSuccess(index, ClockType::now() - start);
+          // the session stays outstanding until the transport is released,
+          // keeping the same pointer so that its type can still be checked
+          std::shared_ptr<TransportBase> tracked(
+              transport.get(), [self, index, transport](TransportBase*) {
+                --self->members_[index].n_outstanding;
+              });
+          callback(ec, tracked);
+          return;
+        }
+
+        --self->members_[index].n_outstanding;
+        if (request_ec &&
+            !self->members_[index].upstream->IsUpstreamFailure(request_ec)) {
+          callback(ec, transport);
+          return;
+        }
+        self->LOG.Warn("request through member %s failed, reason: %s",
+                       self->members_[index].name.c_str(),
+                       ec.message().c_str());
+        self->RecordFailure(index);
+        auto next = can_retry ? self->PickMember(index) : index;
+        if (next == index) {
+          callback(ec, transport);
+        } else {
+          kRetries.Increment();
+          self->StartMemberRequest(next, endpoint, callback, false);
+        }
+      });
+}
+
+void UpstreamGroup::RecordSuccess(std::size_t index,
+                                  ClockType::duration latency) {
+  auto& member = members_[index];
+  auto seconds = std::chrono::duration<double>(latency).count();
+  member.connect_latency =
+      member.connect_latency == 0
+          ? seconds
+          : member.connect_latency * (1 - kLatencyWeight) +
+                seconds * kLatencyWeight;
+  member.n_failures = 0;
+  if (member.ejected_until > ClockType::now()) {
+    THESTRAL_LOG_INFO(LOG, "member %s is back", member.name.c_str());
+    member.ejected_until = ClockType::time_point();
+  }
+}
+
+void UpstreamGroup::RecordFailure(std::size_t index) {
+  auto& member = members_[index];
+  if (max_failures_ == 0 || ++member.n_failures < max_failures_) {
+    return;
+  }
+  member.n_failures = 0;
+  auto now = ClockType::now();
+  if (member.ejected_until <= now) {
+    LOG.Warn("member %s ejected after %zu failures in a row",
+             member.name.c_str(), max_failures_);
+    kEjections.Increment();
+  }
+  member.ejected_until = now + ejection_time_;
+}
+
+void UpstreamGroup::ScheduleHealthCheck() {
+  std::weak_ptr<UpstreamGroup> weak_self = shared_from_this();
+  check_timer_.expires_from_now(check_interval_);
+  check_timer_.async_wait([weak_self](const ec_type& ec) {
+    auto self = weak_self.lock();
+    if (ec || !self) {
+      return;
+    }
+    for (std::size_t i = 0; i < self->members_.size(); ++i) {
+      self->CheckMember(i);
+    }
+    self->ScheduleHealthCheck();
+  });
+}
+
+void UpstreamGroup::CheckMember(std::size_t index) {
+  auto& member = members_[index];
+  if (member.is_checking || !member.upstream->CanHealthCheck()) {
+    return;
+  }
+  member.is_checking = true;
+
+  // whichever of the reply and the timeout comes first decides
+  struct Check {
+    bool is_done = false;
+    TimingWheel::Timer timer;
+  };
+  auto check = std::make_shared<Check>();
+  auto self = shared_from_this();
+  auto start = ClockType::now();
+  auto finish = [self, index, check, start](const ec_type& ec) {
+    check->is_done = true;
+    check->timer.Cancel();
+    auto& member = self->members_[index];
+    member.is_checking = false;
+    if (ec) {
+      THESTRAL_LOG_DEBUG(LOG, "health check of member %s failed: %s",
+                         member.name.c_str(), ec.message().c_str());
+      kHealthCheckFailures.Increment();
+      self->RecordFailure(index);
+    } else {
+      self->RecordSuccess(index, ClockType::now() - start);
+    }
+  };
+
+  auto& wheel = boost::asio::use_service<TimingWheel>(*io_service_ptr_);
+  check->timer = wheel.Start(check_timeout_, [check, finish]() {
+    if (!check->is_done) {
+      finish(boost::asio::error::timed_out);
+    }
+  });
+  member.upstream->StartRequest(
+      check_target_,
+      [check, finish](const ec_type& ec,
+                      const std::shared_ptr<TransportBase>& transport) {
+        if (transport) {
+          transport->StartClose();
+        }
+        if (!check->is_done) {
+          finish(ec || transport ? ec
+                                 : boost::system::errc::make_error_code(
+                                       boost::system::errc::protocol_error));
+        }
+      });
+}
+
+}  // namespace thestral
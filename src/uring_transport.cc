@@ -0,0 +1,791 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Implements the TcpTransport doing its I/O through io_uring.
+#include "uring_transport.h"
+
+#if defined(THESTRAL_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // defined(THESTRAL_HAVE_IO_URING)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "metrics.h"
+
+namespace thestral {
+
+#if defined(THESTRAL_HAVE_IO_URING)
+
+namespace {
+const metrics::Counter kSubmitCalls(
+    "thestral_io_uring_submit_calls_total",
+    "Number of system calls submitting requests to io_uring.");
+const metrics::Counter kSubmissions(
+    "thestral_io_uring_submissions_total",
+    "Number of requests submitted to io_uring.");
+
+int SetupRing(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int EnterRing(int fd, unsigned to_submit) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, nullptr, 0));
+}
+
+/// Moves the completions the kernel had no room for into the ring.
+int FlushRing(int fd) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, 0, 0,
+                                  IORING_ENTER_GETEVENTS, nullptr, 0));
+}
+
+int RegisterRing(int fd, unsigned opcode, const void* arg, unsigned n_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, n_args));
+}
+
+ec_type MakeErrorCode(int error) {
+  return ec_type(error, boost::system::system_category());
+}
+}  // anonymous namespace
+
+bool UringTransportFactory::IsSupported() {
+  static const bool is_supported = []() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    auto fd = SetupRing(1, &params);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    // without it, completions could be lost when the queue overflows
+    return (params.features & IORING_FEAT_NODROP) != 0;
+  }();
+  return is_supported;
+}
+
+std::shared_ptr<TcpTransportFactory> UringTransportFactory::New(
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
+  return impl::UringTransportFactoryImpl::New(io_service_ptr);
+}
+
+namespace impl {
+
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+logging::Logger IoUring::LOG("IoUring");
+asio::io_service::id IoUring::id;
+
+constexpr unsigned IoUring::kQueueDepth;
+constexpr unsigned IoUring::kMaxFixedFiles;
+
+IoUring::IoUring(asio::io_service& io_service)
+    : asio::io_service::service(io_service),
+      io_service_(io_service),
+      event_fd_(io_service) {
+  Setup();
+  if (error_) {
+    LOG.Error("failed to set up io_uring, reason: %s",
+              error_.message().c_str());
+    Close();
+  }
+}
+
+IoUring::~IoUring() { Close(); }
+
+void IoUring::Setup() {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd_ = SetupRing(kQueueDepth, &params);
+  if (ring_fd_ < 0) {
+    error_ = MakeErrorCode(errno);
+    return;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    error_ = MakeErrorCode(errno);
+    return;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      error_ = MakeErrorCode(errno);
+      return;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  auto sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    error_ = MakeErrorCode(errno);
+    return;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  auto sq = static_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sq_flags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+  auto cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+
+  auto event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0) {
+    error_ = MakeErrorCode(errno);
+    return;
+  }
+  event_fd_.assign(event_fd);
+  if (RegisterRing(ring_fd_, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+    error_ = MakeErrorCode(errno);
+    return;
+  }
+
+  // a sparse table, filled as sockets are installed
+  rlimit limit;
+  auto n_files = kMaxFixedFiles;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < n_files) {
+    n_files = static_cast<unsigned>(limit.rlim_cur / 2);
+  }
+  std::vector<int> files(n_files, -1);
+  if (n_files != 0 &&
+      RegisterRing(ring_fd_, IORING_REGISTER_FILES, files.data(), n_files) ==
+          0) {
+    for (auto i = static_cast<int>(n_files); i > 0; --i) {
+      free_files_.push_back(i - 1);
+    }
+  } else {
+    THESTRAL_LOG_DEBUG(LOG, "fixed files unavailable, reason: %s",
+                       std::strerror(errno));
+  }
+}
+
+void IoUring::Close() {
+  ec_type ec;
+  event_fd_.close(ec);
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (cq_ring_ && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = nullptr;
+  if (sq_ring_) {
+    munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = nullptr;
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+  }
+  free_files_.clear();
+}
+
+void IoUring::shutdown_service() {
+  // the kernel cancels the requests in flight as the ring goes away
+  Close();
+  error_ = asio::error::shut_down;
+  // releasing an owner may destroy other operations of the list
+  std::vector<std::shared_ptr<void>> owners;
+  while (auto op = pending_ops_) {
+    pending_ops_ = op->next_;
+    op->prev_ = op->next_ = nullptr;
+    owners.push_back(std::move(op->keep_alive_));
+  }
+  n_in_flight_ = 0;
+}
+
+io_uring_sqe* IoUring::GetSubmission() {
+  while (*sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) > sq_mask_) {
+    // the kernel takes the submissions on entering, before any is reused
+    Submit();
+    if (*sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) > sq_mask_) {
+      Reap();
+    }
+  }
+  auto tail = *sq_tail_;
+  auto index = tail & sq_mask_;
+  auto sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++n_prepared_;
+  ++n_in_flight_;
+
+  if (!is_submit_scheduled_) {
+    // everything prepared by the handlers run before this goes at once
+    is_submit_scheduled_ = true;
+    io_service_.post([this]() {
+      is_submit_scheduled_ = false;
+      Submit();
+    });
+  }
+  if (!is_waiting_) {
+    StartWait();
+  }
+  return sqe;
+}
+
+io_uring_sqe* IoUring::Prepare(Operation* op, std::uint8_t opcode,
+                               const std::shared_ptr<void>& owner) {
+  if (!op->keep_alive_) {
+    op->next_ = pending_ops_;
+    op->prev_ = nullptr;
+    if (pending_ops_) {
+      pending_ops_->prev_ = op;
+    }
+    pending_ops_ = op;
+  }
+  op->keep_alive_ = owner;
+
+  auto sqe = GetSubmission();
+  sqe->opcode = opcode;
+  sqe->user_data = reinterpret_cast<std::uintptr_t>(op);
+  return sqe;
+}
+
+void IoUring::Cancel(Operation* op) {
+  if (!op->IsPending() || error_) {
+    return;
+  }
+  auto sqe = GetSubmission();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(op);
+  sqe->user_data = 0;  // completion ignored
+}
+
+void IoUring::Submit() {
+  while (n_prepared_ != 0) {
+    kSubmitCalls.Increment();
+    auto n_submitted = EnterRing(ring_fd_, n_prepared_);
+    if (n_submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EBUSY || errno == EAGAIN) {
+        // the completions have to be reaped first
+        Reap();
+        io_service_.post([this]() { Submit(); });
+        return;
+      }
+      LOG.Error("failed to submit to io_uring, reason: %s",
+                std::strerror(errno));
+      return;
+    }
+    kSubmissions.Increment(n_submitted);
+    n_prepared_ -= static_cast<unsigned>(n_submitted);
+  }
+}
+
+void IoUring::Reap() {
+  auto cqes = static_cast<io_uring_cqe*>(cqes_);
+  // a completion may prepare submissions, which may reap in turn when the
+  // queue is full, so the head is read again for each completion
+  for (;;) {
+    auto head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      // the completions overflowing the ring are kept by the kernel, without
+      // signaling the eventfd, until they are asked for
+      if ((__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) &
+           IORING_SQ_CQ_OVERFLOW) == 0 ||
+          FlushRing(ring_fd_) < 0 ||
+          head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      continue;
+    }
+    auto cqe = cqes[head & cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+    bool has_more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (!has_more) {
+      --n_in_flight_;
+    }
+    auto op = reinterpret_cast<Operation*>(cqe.user_data);
+    if (!op) {
+      continue;
+    }
+    std::shared_ptr<void> keep_alive;
+    if (!has_more) {
+      // the operation may be submitted again on completion
+      if (op->prev_) {
+        op->prev_->next_ = op->next_;
+      } else {
+        pending_ops_ = op->next_;
+      }
+      if (op->next_) {
+        op->next_->prev_ = op->prev_;
+      }
+      op->prev_ = op->next_ = nullptr;
+      keep_alive.swap(op->keep_alive_);
+    }
+    op->Complete(cqe.res, has_more);
+    if (ring_fd_ < 0) {
+      return;  // shut down by the completion
+    }
+  }
+}
+
+void IoUring::StartWait() {
+  is_waiting_ = true;
+  event_fd_.async_wait(asio::posix::stream_descriptor::wait_read,
+                       [this](const ec_type& ec) {
+                         is_waiting_ = false;
+                         if (ec) {
+                           return;
+                         }
+                         // reset before reaping, not to miss any signal
+                         std::uint64_t n_events;
+                         auto n_read = read(event_fd_.native_handle(),
+                                            &n_events, sizeof(n_events));
+                         static_cast<void>(n_read);
+                         Reap();
+                         // nothing keeps the io_service running when idle
+                         if (n_in_flight_ != 0 && !is_waiting_) {
+                           StartWait();
+                         }
+                       });
+}
+
+int IoUring::RegisterFile(int fd) {
+  if (free_files_.empty()) {
+    return -1;
+  }
+  auto index = free_files_.back();
+  io_uring_files_update update;
+  std::memset(&update, 0, sizeof(update));
+  update.offset = static_cast<unsigned>(index);
+  update.fds = reinterpret_cast<std::uintptr_t>(&fd);
+  if (RegisterRing(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+    return -1;
+  }
+  free_files_.pop_back();
+  return index;
+}
+
+bool IoUring::UnregisterFile(int index) {
+  if (ring_fd_ < 0) {
+    return false;
+  }
+  int fd = -1;
+  io_uring_files_update update;
+  std::memset(&update, 0, sizeof(update));
+  update.offset = static_cast<unsigned>(index);
+  update.fds = reinterpret_cast<std::uintptr_t>(&fd);
+  return RegisterRing(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+void IoUring::ReleaseFile(int index) {
+  if (ring_fd_ >= 0) {
+    free_files_.push_back(index);
+  }
+}
+
+UringTransportImpl::UringTransportImpl(asio::io_service& io_service)
+    : io_service_(io_service),
+      ring_(asio::use_service<IoUring>(io_service)),
+      socket_(io_service),
+      read_op_(this),
+      write_op_(this) {}
+
+UringTransportImpl::~UringTransportImpl() {
+  UnregisterFile();
+  // the operations holding the transport are all done
+  if (unregistered_index_ >= 0) {
+    ring_.ReleaseFile(unregistered_index_);
+  }
+}
+
+Address UringTransportImpl::GetLocalAddress() const {
+  return Address::FromAsioEndpoint(socket_.local_endpoint());
+}
+
+Address UringTransportImpl::GetRemoteAddress() const {
+  return Address::FromAsioEndpoint(socket_.remote_endpoint());
+}
+
+io_uring_sqe* UringTransportImpl::Prepare(IoUring::Operation* op,
+                                          std::uint8_t opcode) {
+  if (!is_file_registered_) {
+    is_file_registered_ = true;
+    file_index_ = ring_.RegisterFile(socket_.native_handle());
+  }
+  auto sqe = ring_.Prepare(op, opcode, shared_from_this());
+  if (file_index_ >= 0) {
+    sqe->fd = file_index_;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = socket_.native_handle();
+  }
+  return sqe;
+}
+
+void UringTransportImpl::UnregisterFile() {
+  if (file_index_ >= 0) {
+    if (ring_.UnregisterFile(file_index_)) {
+      unregistered_index_ = file_index_;
+    }
+    file_index_ = -1;
+  }
+}
+
+void UringTransportImpl::StartRead(const asio::mutable_buffers_1& buf,
+                                   const ReadCallbackType& callback,
+                                   bool allow_short_read) {
+  read_op_.data = asio::buffer_cast<char*>(buf);
+  read_op_.size = asio::buffer_size(buf);
+  read_op_.n_read = 0;
+  read_op_.allow_short_read = allow_short_read;
+  read_op_.callback = callback;
+  SubmitRead();
+}
+
+void UringTransportImpl::SubmitRead() {
+  auto error = ring_.GetError();
+  if (!error && !socket_.is_open()) {
+    error = asio::error::bad_descriptor;
+  }
+  if (error || read_op_.n_read == read_op_.size) {
+    auto callback = std::move(read_op_.callback);
+    read_op_.callback = nullptr;
+    auto n_bytes = read_op_.n_read;
+    io_service_.post(
+        [callback, error, n_bytes]() { callback(error, n_bytes); });
+    return;
+  }
+  auto sqe = Prepare(&read_op_, IORING_OP_RECV);
+  sqe->addr = reinterpret_cast<std::uintptr_t>(read_op_.data + read_op_.n_read);
+  sqe->len = static_cast<unsigned>(read_op_.size - read_op_.n_read);
+}
+
+void UringTransportImpl::ReadOperation::Complete(int result, bool) {
+  ec_type ec;
+  if (result < 0) {
+    ec = MakeErrorCode(-result);
+  } else if (result == 0) {
+    ec = asio::error::eof;
+  } else {
+    n_read += static_cast<std::size_t>(result);
+    if (!allow_short_read && n_read != size) {
+      transport_->SubmitRead();
+      return;
+    }
+  }
+  // the callback may start another read with this operation
+  auto done_callback = std::move(callback);
+  callback = nullptr;
+  done_callback(ec, n_read);
+}
+
+void UringTransportImpl::StartWaitReadable(const WaitCallbackType& callback) {
+  wait_op_.callback = callback;
+  auto error = ring_.GetError();
+  if (error) {
+    io_service_.post([callback, error]() { callback(error); });
+    return;
+  }
+  auto sqe = Prepare(&wait_op_, IORING_OP_POLL_ADD);
+  sqe->poll_events = POLLIN;
+}
+
+void UringTransportImpl::WaitOperation::Complete(int result, bool) {
+  auto done_callback = std::move(callback);
+  callback = nullptr;
+  done_callback(result < 0 ? MakeErrorCode(-result) : ec_type());
+}
+
+void UringTransportImpl::StartWrite(const asio::const_buffers_1& buf,
+                                    const WriteCallbackType& callback) {
+  write_op_.iovecs.resize(1);
+  write_op_.iovecs[0].iov_base =
+      const_cast<void*>(asio::buffer_cast<const void*>(buf));
+  write_op_.iovecs[0].iov_len = asio::buffer_size(buf);
+  write_op_.first = 0;
+  write_op_.n_written = 0;
+  write_op_.callback = callback;
+  SubmitWrite();
+}
+
+void UringTransportImpl::StartWrite(const ConstBufferSequence& buffers,
+                                    const WriteCallbackType& callback) {
+  write_op_.iovecs.resize(buffers.size());
+  for (std::size_t i = 0; i < buffers.size(); ++i) {
+    write_op_.iovecs[i].iov_base =
+        const_cast<void*>(asio::buffer_cast<const void*>(buffers[i]));
+    write_op_.iovecs[i].iov_len = asio::buffer_size(buffers[i]);
+  }
+  write_op_.first = 0;
+  write_op_.n_written = 0;
+  write_op_.callback = callback;
+  SubmitWrite();
+}
+
+void UringTransportImpl::SubmitWrite() {
+  auto& iovecs = write_op_.iovecs;
+  auto& first = write_op_.first;
+  while (first < iovecs.size() && iovecs[first].iov_len == 0) {
+    ++first;
+  }
+  auto error = ring_.GetError();
+  if (!error && !socket_.is_open()) {
+    error = asio::error::bad_descriptor;
+  }
+  if (error || first == iovecs.size()) {
+    auto callback = std::move(write_op_.callback);
+    write_op_.callback = nullptr;
+    auto n_bytes = write_op_.n_written;
+    io_service_.post(
+        [callback, error, n_bytes]() { callback(error, n_bytes); });
+    return;
+  }
+
+  auto& message = write_op_.message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &iovecs[first];
+  message.msg_iovlen = iovecs.size() - first;
+  auto sqe = Prepare(&write_op_, IORING_OP_SENDMSG);
+  sqe->addr = reinterpret_cast<std::uintptr_t>(&message);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+void UringTransportImpl::WriteOperation::Complete(int result, bool) {
+  if (result >= 0) {
+    auto n_bytes = static_cast<std::size_t>(result);
+    n_written += n_bytes;
+    while (first < iovecs.size() && n_bytes >= iovecs[first].iov_len) {
+      n_bytes -= iovecs[first].iov_len;
+      ++first;
+    }
+    if (first < iovecs.size()) {
+      iovecs[first].iov_base = static_cast<char*>(iovecs[first].iov_base) +
+                               n_bytes;
+      iovecs[first].iov_len -= n_bytes;
+      transport_->SubmitWrite();
+      return;
+    }
+  }
+  auto done_callback = std::move(callback);
+  callback = nullptr;
+  done_callback(result < 0 ? MakeErrorCode(-result) : ec_type(), n_written);
+}
+
+void UringTransportImpl::StartClose(const CloseCallbackType& callback) {
+  // closing the socket doesn't end the requests holding it
+  ring_.Cancel(&read_op_);
+  ring_.Cancel(&wait_op_);
+  ring_.Cancel(&write_op_);
+  if (file_index_ >= 0) {
+    // submissions still naming the index fail rather than reach the socket
+    // installed there next
+    UnregisterFile();
+  } else if (!ring_.GetError()) {
+    // the requests take hold of the socket once submitted, before its
+    // descriptor can be reused by another one
+    ring_.Submit();
+  }
+
+  ec_type ec;
+  socket_.shutdown(ip::tcp::socket::shutdown_both, ec);
+  if (ec) {
+    socket_.close();
+  } else {
+    socket_.close(ec);
+  }
+  callback(ec);
+}
+
+void UringTransportImpl::StartShutdownSend(const CloseCallbackType& callback) {
+  ec_type ec;
+  socket_.shutdown(ip::tcp::socket::shutdown_send, ec);
+  callback(ec);
+}
+
+logging::Logger UringTransportFactoryImpl::LOG("UringTransportFactoryImpl");
+
+void UringTransportFactoryImpl::StartAccept(
+    EndpointType endpoint, const AcceptCallbackType& callback) {
+  auto self = std::static_pointer_cast<UringTransportFactoryImpl>(
+      shared_from_this());
+  auto& ring = asio::use_service<IoUring>(*io_service_ptr_);
+  const auto& limits = GetAcceptLimits();
+  bool is_limited = limits.max_connections != 0 || limits.max_handshakes != 0;
+  for (const auto& acceptor : OpenAcceptors(*io_service_ptr_, endpoint)) {
+    auto op = std::make_shared<AcceptOperation>(self, acceptor, callback);
+    if (is_limited || ring.GetError()) {
+      // a multishot accept can't pause at the limits
+      THESTRAL_LOG_DEBUG(LOG, "start accepting");
+      op->StartAcceptLoop();
+    } else {
+      THESTRAL_LOG_DEBUG(LOG, "start accepting with io_uring");
+      accept_ops_.push_back(op);
+      op->Start();
+    }
+  }
+}
+
+void UringTransportFactoryImpl::StopAccepting() {
+  for (const auto& weak_op : accept_ops_) {
+    if (auto op = weak_op.lock()) {
+      op->Abort();
+    }
+  }
+  accept_ops_.clear();
+  TcpTransportFactoryImpl::StopAccepting();
+}
+
+void UringTransportFactoryImpl::AcceptOperation::Start() {
+  auto& ring = asio::use_service<IoUring>(*factory_->io_service_ptr_);
+  if (ring.GetError()) {
+    is_stopped_ = true;
+    callback_(ring.GetError(), nullptr);
+    return;
+  }
+  auto sqe = ring.Prepare(this, IORING_OP_ACCEPT, shared_from_this());
+  sqe->fd = acceptor_->native_handle();
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void UringTransportFactoryImpl::AcceptOperation::StartAcceptLoop() {
+  auto factory = factory_;
+  factory_->StartAcceptLoop(
+      *factory_->io_service_ptr_, acceptor_,
+      [factory]() { return factory->NewTransport(); }, FinishAcceptType(),
+      callback_);
+}
+
+void UringTransportFactoryImpl::AcceptOperation::Stop() {
+  is_stopped_ = true;
+  retry_timer_.cancel();
+  asio::use_service<IoUring>(*factory_->io_service_ptr_).Cancel(this);
+}
+
+void UringTransportFactoryImpl::AcceptOperation::Abort() {
+  if (IsPending()) {
+    // completed with ECANCELED, which ends accepting
+    asio::use_service<IoUring>(*factory_->io_service_ptr_).Cancel(this);
+  } else if (!is_stopped_) {
+    is_stopped_ = true;
+    retry_timer_.cancel();
+    auto callback = callback_;
+    factory_->io_service_ptr_->post(
+        [callback]() { callback(asio::error::operation_aborted, nullptr); });
+  }
+}
+
+void UringTransportFactoryImpl::AcceptOperation::Complete(int result,
+                                                         bool has_more) {
+  if (is_stopped_) {
+    if (result >= 0) {
+      close(result);
+    }
+    return;
+  }
+
+  if (result >= 0) {
+    has_accepted_ = true;
+    auto transport = factory_->NewTransport();
+    ec_type ec;
+    transport->GetUnderlyingSocket().assign(protocol_, result, ec);
+    if (ec) {
+      close(result);
+      LOG.Warn("failed to accept a connection, reason: %s",
+               ec.message().c_str());
+    } else {
+      THESTRAL_LOG_DEBUG(LOG, "[%llX] one connection accepted",
+                         transport->GetId());
+      if (!callback_(ec, transport)) {
+        THESTRAL_LOG_DEBUG(LOG,
+                           "upper layer gave up accepting more connections");
+        Stop();
+        return;
+      }
+    }
+    if (!has_more) {
+      Start();  // the kernel may end a multishot request at any time
+    }
+    return;
+  }
+
+  auto ec = MakeErrorCode(-result);
+  if (result == -EINVAL && !has_accepted_) {
+    THESTRAL_LOG_DEBUG(LOG, "multishot accept unsupported, accept in turn");
+    is_stopped_ = true;
+    StartAcceptLoop();
+    return;
+  }
+  if (result == -ECANCELED || result == -EBADF || result == -EINVAL ||
+      result == -ENOTSOCK) {
+    THESTRAL_LOG_DEBUG(LOG, "acceptor returning an error: %s, stop accepting",
+                       ec.message().c_str());
+    is_stopped_ = true;
+    callback_(ec, nullptr);
+    return;
+  }
+  LOG.Warn("failed to accept a connection, reason: %s", ec.message().c_str());
+  if (!has_more) {
+    // e.g. out of descriptors, which may be released soon
+    auto self = shared_from_this();
+    retry_timer_.expires_from_now(AcceptLoop::kMinBackoff);
+    retry_timer_.async_wait([self](const ec_type& ec) {
+      if (!ec && !self->is_stopped_) {
+        self->Start();
+      }
+    });
+  }
+}
+
+}  // namespace impl
+
+#else  // defined(THESTRAL_HAVE_IO_URING)
+
+bool UringTransportFactory::IsSupported() { return false; }
+
+std::shared_ptr<TcpTransportFactory> UringTransportFactory::New(
+    const std::shared_ptr<boost::asio::io_service>& io_service_ptr) {
+  return TcpTransportFactory::New(io_service_ptr);
+}
+
+#endif  // defined(THESTRAL_HAVE_IO_URING)
+
+}  // namespace thestral
@@ -0,0 +1,469 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Benchmarks of the relay performance of thestral. Starts thestral with
+/// bench.conf and a target server in separate processes, then measures each
+/// setup through real SOCKS connections. Results are printed to stdout as one
+/// JSON object per line, e.g.
+///
+///     {"setup": "plain", "metric": "ttfb_p99", "value": 0.41, "unit": "ms"}
+///
+/// Usage: bench_relay [--thestral_bin PATH] [--config FILE]
+///                    [--setup NAME]... [--duration SECONDS]
+///                    [--streams N] [--idle_sessions N]
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "common.h"
+#include "socks.h"
+
+namespace thestral {
+namespace bench {
+
+namespace asio = boost::asio;
+namespace ip = boost::asio::ip;
+
+typedef std::chrono::steady_clock ClockType;
+
+constexpr uint16_t kTargetPort = 29173;
+constexpr std::size_t kChunkSize = 0x10000;
+
+struct Setup {
+  const char* name;
+  uint16_t port;
+};
+
+const Setup kSetups[] = {
+    {"plain", 1181}, {"ssl", 1182}, {"chained", 1183}, {"mux", 1184}};
+
+struct Options {
+  std::string thestral_bin = "thestral";
+  std::string config = "bench.conf";
+  std::vector<std::string> setups;
+  double duration = 3;
+  int n_streams = 16;
+  int n_idle_sessions = 256;
+};
+
+void Report(const std::string& setup, const std::string& metric, double value,
+            const std::string& unit) {
+  std::printf(
+      "{\"setup\": \"%s\", \"metric\": \"%s\", \"value\": %.6g, "
+      "\"unit\": \"%s\"}\n",
+      setup.c_str(), metric.c_str(), value, unit.c_str());
+  std::fflush(stdout);
+}
+
+/// Serves the benchmark connections in a child process, so that it doesn't
+/// compete with the clients for the CPU of this process. A client sends the
+/// number of bytes it wants as a 64-bit big-endian integer, then the server
+/// sends that many bytes and closes the connection.
+class TargetServer {
+ public:
+  TargetServer()
+      : acceptor_(io_service_, ip::tcp::endpoint(
+                                   ip::address_v4::loopback(), kTargetPort)) {
+    // listening before forking, so that the clients can connect right away
+    if ((pid_ = fork()) == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      io_service_.notify_fork(asio::io_service::fork_child);
+      AcceptOne();
+      io_service_.run();
+      std::_Exit(EXIT_SUCCESS);
+    } else if (pid_ == -1) {
+      std::perror("Error occured when creating subprocess");
+      std::exit(EXIT_FAILURE);
+    }
+    ec_type ec;
+    acceptor_.close(ec);
+  }
+
+  ~TargetServer() {
+    kill(pid_, SIGTERM);
+    int status;
+    waitpid(pid_, &status, 0);
+  }
+
+ private:
+  typedef std::shared_ptr<ip::tcp::socket> SocketPtr;
+
+  void AcceptOne() {
+    auto s = std::make_shared<ip::tcp::socket>(io_service_);
+    acceptor_.async_accept(*s, [this, s](const ec_type& ec) {
+      if (!ec) {
+        s->set_option(ip::tcp::no_delay(true));
+        ReadRequest(s);
+      }
+      AcceptOne();
+    });
+  }
+
+  void ReadRequest(const SocketPtr& s) {
+    auto buf = std::make_shared<std::array<unsigned char, 8>>();
+    asio::async_read(*s, asio::buffer(*buf),
+                     [this, s, buf](const ec_type& ec, std::size_t) {
+                       if (ec) {
+                         return;
+                       }
+                       uint64_t n_bytes = 0;
+                       for (auto byte : *buf) {
+                         n_bytes = (n_bytes << 8) | byte;
+                       }
+                       WriteSome(s, n_bytes);
+                     });
+  }
+
+  void WriteSome(const SocketPtr& s, uint64_t n_remaining) {
+    if (n_remaining == 0) {
+      ec_type ec;
+      s->shutdown(ip::tcp::socket::shutdown_both, ec);
+      s->close(ec);
+      return;
+    }
+    auto n = static_cast<std::size_t>(
+        std::min<uint64_t>(n_remaining, chunk_.size()));
+    asio::async_write(*s, asio::buffer(chunk_.data(), n),
+                      [this, s, n_remaining](const ec_type& ec,
+                                             std::size_t n_written) {
+                        if (!ec) {
+                          WriteSome(s, n_remaining - n_written);
+                        }
+                      });
+  }
+
+  asio::io_service io_service_;
+  ip::tcp::acceptor acceptor_;
+  std::array<char, kChunkSize> chunk_{};
+  pid_t pid_;
+};
+
+/// Runs thestral in a child process for the lifetime of the object.
+class ThestralProcess {
+ public:
+  ThestralProcess(const std::string& bin, const std::string& config) {
+    if ((pid_ = fork()) == 0) {
+      execl(bin.c_str(), "thestral", "-c", config.c_str(), nullptr);
+      std::perror("Error occured when starting thestral bin");
+      std::_Exit(EXIT_FAILURE);
+    } else if (pid_ == -1) {
+      std::perror("Error occured when creating subprocess");
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  ~ThestralProcess() {
+    kill(pid_, SIGTERM);
+    int status;
+    waitpid(pid_, &status, 0);
+  }
+
+  /// Returns the resident set size in bytes, or 0 if it is not available.
+  std::size_t GetResidentSize() const {
+    std::ifstream status("/proc/" + std::to_string(pid_) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+      if (line.compare(0, 6, "VmRSS:") == 0) {
+        return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+      }
+    }
+    return 0;
+  }
+
+ private:
+  pid_t pid_;
+};
+
+/// Establishes a connection to the target server through the SOCKS server on
+/// `port` and sends the request for `n_bytes` bytes.
+void ConnectThroughSocks(ip::tcp::socket& s, uint16_t port, uint64_t n_bytes,
+                         bool send_request = true) {
+  s.connect(ip::tcp::endpoint(ip::address_v4::loopback(), port));
+  s.set_option(ip::tcp::no_delay(true));
+
+  socks::AuthMethodList auth_packet;
+  auth_packet.methods.push_back(socks::AuthMethod::kNoAuth);
+  socks::RequestPacket request_packet;
+  request_packet.header.command = socks::Command::kConnect;
+  request_packet.body = Address::FromAsioEndpoint(
+      ip::tcp::endpoint(ip::address_v4::loopback(), kTargetPort));
+  // the servers support pipelining the request after the auth request
+  asio::write(s, asio::buffer(auth_packet.Serialize() +
+                              request_packet.Serialize()));
+
+  std::array<unsigned char, 262> buf;
+  asio::read(s, asio::buffer(buf, 2 + 4));
+  if (buf[1] != 0 || buf[3] != 0) {
+    throw std::runtime_error("SOCKS request rejected");
+  }
+  switch (buf[5]) {  // the bound address
+    case 0x1:
+      asio::read(s, asio::buffer(buf, 4 + 2));
+      break;
+    case 0x4:
+      asio::read(s, asio::buffer(buf, 16 + 2));
+      break;
+    default:
+      asio::read(s, asio::buffer(buf, 1));
+      asio::read(s, asio::buffer(buf, buf[0] + 2u));
+  }
+
+  if (send_request) {
+    std::array<unsigned char, 8> request;
+    for (int i = 7; i >= 0; --i, n_bytes >>= 8) {
+      request[i] = static_cast<unsigned char>(n_bytes & 0xFF);
+    }
+    asio::write(s, asio::buffer(request));
+  }
+}
+
+/// Waits until thestral accepts connections on `port`.
+bool WaitForPort(uint16_t port) {
+  for (int i = 0; i < 100; ++i) {
+    asio::io_service io_service;
+    ip::tcp::socket s(io_service);
+    ec_type ec;
+    s.connect(ip::tcp::endpoint(ip::address_v4::loopback(), port), ec);
+    if (!ec) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+ClockType::duration ToDuration(double seconds) {
+  return std::chrono::duration_cast<ClockType::duration>(
+      std::chrono::duration<double>(seconds));
+}
+
+/// Runs `fn(i)` on `n` threads and rethrows the first exception thrown.
+template <typename F>
+void RunThreads(int n, const F& fn) {
+  std::mutex mutex;
+  std::exception_ptr error;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < n; ++i) {
+    threads.emplace_back([&, i]() {
+      try {
+        fn(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/// Measures the aggregate download throughput of `n_streams` streams.
+double MeasureThroughput(uint16_t port, int n_streams, double duration) {
+  std::atomic<uint64_t> n_total{0};
+  auto deadline = ClockType::now() + ToDuration(duration);
+  auto start = ClockType::now();
+  RunThreads(n_streams, [&n_total, port, deadline](int) {
+    asio::io_service io_service;
+    ip::tcp::socket s(io_service);
+    ConnectThroughSocks(s, port, UINT64_MAX);
+    std::vector<char> buf(kChunkSize);
+    uint64_t n_read = 0;
+    while (ClockType::now() < deadline) {
+      n_read += s.read_some(asio::buffer(buf));
+    }
+    n_total += n_read;
+  });
+  std::chrono::duration<double> elapsed = ClockType::now() - start;
+  return n_total / elapsed.count() / (1024 * 1024);
+}
+
+/// Opens short connections for `duration` seconds on a few threads, each
+/// fetching a small response. Reports the connection rate and the time from
+/// starting the connection to the first byte of the response.
+void MeasureConnections(const Setup& setup, double duration) {
+  constexpr int kThreads = 4;
+  constexpr uint64_t kResponseSize = 64;
+  auto deadline = ClockType::now() + ToDuration(duration);
+  std::mutex mutex;
+  std::vector<double> ttfb_ms;
+  auto start = ClockType::now();
+  RunThreads(kThreads, [&](int) {
+    std::vector<double> samples;
+    asio::io_service io_service;
+    std::array<char, kResponseSize> buf;
+    while (ClockType::now() < deadline) {
+      ip::tcp::socket s(io_service);
+      auto connect_start = ClockType::now();
+      ConnectThroughSocks(s, setup.port, kResponseSize);
+      auto n_read = s.read_some(asio::buffer(buf));
+      std::chrono::duration<double, std::milli> ttfb =
+          ClockType::now() - connect_start;
+      samples.push_back(ttfb.count());
+      if (n_read < kResponseSize) {
+        asio::read(s, asio::buffer(buf, kResponseSize - n_read));
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ttfb_ms.insert(ttfb_ms.end(), samples.cbegin(), samples.cend());
+  });
+  std::chrono::duration<double> elapsed = ClockType::now() - start;
+  Report(setup.name, "connections_per_second",
+         ttfb_ms.size() / elapsed.count(), "1/s");
+
+  std::sort(ttfb_ms.begin(), ttfb_ms.end());
+  if (!ttfb_ms.empty()) {
+    Report(setup.name, "ttfb_p50", ttfb_ms[ttfb_ms.size() / 2], "ms");
+    Report(setup.name, "ttfb_p99", ttfb_ms[ttfb_ms.size() * 99 / 100], "ms");
+  }
+}
+
+/// Measures the memory thestral takes for each established but idle session.
+void MeasureIdleSessions(const Setup& setup, const ThestralProcess& thestral,
+                         int n_sessions) {
+  auto before = thestral.GetResidentSize();
+  if (before == 0) {
+    return;  // not on Linux
+  }
+  asio::io_service io_service;
+  std::vector<std::unique_ptr<ip::tcp::socket>> sockets;
+  for (int i = 0; i < n_sessions; ++i) {
+    sockets.emplace_back(new ip::tcp::socket(io_service));
+    ConnectThroughSocks(*sockets.back(), setup.port, 0, false);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  auto after = thestral.GetResidentSize();
+  Report(setup.name, "idle_session_memory",
+         after > before ? static_cast<double>(after - before) / n_sessions : 0,
+         "bytes");
+}
+
+void RunSetup(const Setup& setup, const ThestralProcess& thestral,
+              const Options& options) {
+  // warm up the connections, sessions and buffers before measuring
+  MeasureThroughput(setup.port, 1, 0.2);
+
+  Report(setup.name, "throughput_1_stream",
+         MeasureThroughput(setup.port, 1, options.duration), "MiB/s");
+  Report(setup.name,
+         "throughput_" + std::to_string(options.n_streams) + "_streams",
+         MeasureThroughput(setup.port, options.n_streams, options.duration),
+         "MiB/s");
+  MeasureConnections(setup, options.duration);
+  MeasureIdleSessions(setup, thestral, options.n_idle_sessions);
+}
+
+Options ParseOptionsOrDie(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      std::cerr << "missing value of " << arg << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    std::string value = argv[++i];
+    if (arg == "--thestral_bin") {
+      options.thestral_bin = value;
+    } else if (arg == "--config") {
+      options.config = value;
+    } else if (arg == "--setup") {
+      options.setups.push_back(value);
+    } else if (arg == "--duration") {
+      options.duration = std::atof(value.c_str());
+    } else if (arg == "--streams") {
+      options.n_streams = std::atoi(value.c_str());
+    } else if (arg == "--idle_sessions") {
+      options.n_idle_sessions = std::atoi(value.c_str());
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
+  if (options.duration <= 0 || options.n_streams <= 0 ||
+      options.n_idle_sessions <= 0) {
+    std::cerr << "invalid duration, streams or idle_sessions" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  return options;
+}
+
+int Main(int argc, char** argv) {
+  auto options = ParseOptionsOrDie(argc, argv);
+
+  // each idle session takes a few descriptors in both processes
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  TargetServer target;
+  for (const auto& setup : kSetups) {
+    if (!options.setups.empty() &&
+        std::find(options.setups.cbegin(), options.setups.cend(),
+                  setup.name) == options.setups.cend()) {
+      continue;
+    }
+    // a fresh process for each setup, so that memory freed by the previous
+    // one doesn't hide the memory of idle sessions
+    ThestralProcess thestral(options.thestral_bin, options.config);
+    if (!WaitForPort(setup.port)) {
+      std::cerr << "thestral is not listening on port " << setup.port
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    try {
+      RunSetup(setup, thestral, options);
+    } catch (const std::exception& e) {
+      std::cerr << "setup " << setup.name << " failed: " << e.what()
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace bench
+}  // namespace thestral
+
+int main(int argc, char** argv) { return thestral::bench::Main(argc, argv); }
@@ -18,6 +18,7 @@
 #include <iterator>
 #include <memory>
 #include <random>
+#include <string>
 
 #include <boost/asio.hpp>
 #include <boost/test/unit_test.hpp>
@@ -42,14 +43,13 @@ void FillWithRandomBytes(T& buf) {
     *begin++ = dist(eng);
   }
 }
-}  // anonymous namespace
-
-BOOST_FIXTURE_TEST_SUITE(e2e_basic, testing::MockServer);
 
-BOOST_AUTO_TEST_CASE(test_relay) {
+/// Relays random data to the echo server through a thestral instance.
+void TestRelayThrough(const std::string& host, uint16_t port,
+                      const boost::asio::ip::tcp::endpoint& echo_endpoint) {
   auto io_service_ptr = std::make_shared<boost::asio::io_service>();
   auto client = socks::SocksTcpUpstreamFactory::New(
-      TcpTransportFactory::New(io_service_ptr), "::1", 1081);
+      TcpTransportFactory::New(io_service_ptr), host, port);
 
   typedef std::array<unsigned char, 1024 * 1024> BufferType;
 
@@ -59,7 +59,7 @@ BOOST_AUTO_TEST_CASE(test_relay) {
     FillWithRandomBytes(*write_buf);
 
     client->StartRequest(
-        Address::FromAsioEndpoint(GetEndpoint()),
+        Address::FromAsioEndpoint(echo_endpoint),
         [=, &n_pending](const ec_type& ec,
                         const std::shared_ptr<TransportBase>& transport) {
           BOOST_CHECK(!ec);
@@ -86,6 +86,21 @@ BOOST_AUTO_TEST_CASE(test_relay) {
   io_service_ptr->run();
   BOOST_CHECK_EQUAL(0, n_pending);
 }
+}  // anonymous namespace
+
+BOOST_FIXTURE_TEST_SUITE(e2e_basic, testing::MockServer);
+
+BOOST_AUTO_TEST_CASE(test_relay) {
+  TestRelayThrough("::1", 1081, GetEndpoint());
+}
+
+BOOST_AUTO_TEST_CASE(test_multiplexed_relay) {
+  TestRelayThrough("127.0.0.1", 1082, GetEndpoint());
+}
+
+BOOST_AUTO_TEST_CASE(test_upstream_group_relay) {
+  TestRelayThrough("127.0.0.1", 1083, GetEndpoint());
+}
 
 BOOST_AUTO_TEST_SUITE_END();
 
@@ -52,6 +52,7 @@ void MockTransport::StartWrite(const asio::const_buffers_1& buf,
                                const WriteCallbackType& callback) {
   auto p = asio::buffer_cast<const char*>(buf);
   write_buf.append(p, p + asio::buffer_size(buf));
+  ++n_writes;
   io_service_ptr->post(std::bind(callback, ec, asio::buffer_size(buf)));
 }
 
@@ -107,16 +108,28 @@ void MockTcpTransportFactory::AcceptOne(const AcceptCallbackType& callback) {
 void MockTcpTransportFactory::StartConnect(
     EndpointType endpoint, const ConnectCallbackType& callback) {
   endpoints_.push(endpoint);
+  if (transports_.empty()) {
+    io_service_ptr_->post(std::bind(
+        callback, boost::asio::error::make_error_code(
+                      boost::asio::error::connection_refused),
+        nullptr));
+    return;
+  }
   auto transport = transports_.front();
+  auto error = errors_.front();
   transports_.pop();
-  io_service_ptr_->post(std::bind(callback, ec_type(), transport));
+  errors_.pop();
+  io_service_ptr_->post(
+      std::bind(callback, error, error ? nullptr : transport));
 }
 
 std::shared_ptr<TransportBase> MockTcpTransportFactory::TryConnect(
     boost::asio::ip::tcp::resolver::iterator& iter, ec_type& error_code) {
   endpoints_.push(*iter);
   auto transport = transports_.front();
+  error_code = errors_.front();
   transports_.pop();
+  errors_.pop();
   return transport;
 }
 
@@ -55,6 +55,7 @@ struct MockTransport : public TransportBase {
   Address remote_address;
   std::string read_buf;
   std::string write_buf;
+  std::size_t n_writes = 0;
   ec_type ec;
   bool closed = false;
 };
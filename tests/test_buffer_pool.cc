@@ -0,0 +1,76 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the buffer pool.
+#include "buffer_pool.h"
+
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace thestral {
+
+BOOST_AUTO_TEST_SUITE(test_buffer_pool);
+
+BOOST_AUTO_TEST_CASE(test_acquire_release) {
+  boost::asio::io_service io_service;
+  auto& pool = boost::asio::use_service<BufferPool>(io_service);
+  BOOST_CHECK_EQUAL(&pool, &boost::asio::use_service<BufferPool>(io_service));
+
+  auto buffer = pool.Acquire(1);
+  BOOST_CHECK(buffer);
+  BOOST_CHECK_EQUAL(BufferPool::GetSizeOfClass(1), buffer.size());
+  BOOST_CHECK_EQUAL(0, pool.GetIdleCount(1));
+  auto data = buffer.data();
+
+  buffer.Release();
+  BOOST_CHECK(!buffer);
+  BOOST_CHECK_EQUAL(1, pool.GetIdleCount(1));
+
+  // the idle buffer should be reused
+  {
+    auto another = pool.Acquire(1);
+    BOOST_CHECK_EQUAL(data, another.data());
+    BOOST_CHECK_EQUAL(0, pool.GetIdleCount(1));
+
+    BufferPool::Buffer moved(std::move(another));
+    BOOST_CHECK(!another);
+    BOOST_CHECK_EQUAL(data, moved.data());
+  }  // returned on destruction
+  BOOST_CHECK_EQUAL(1, pool.GetIdleCount(1));
+  BOOST_CHECK_EQUAL(0, pool.GetIdleCount(0));
+}
+
+BOOST_AUTO_TEST_CASE(test_size_classes) {
+  boost::asio::io_service io_service;
+  auto& pool = boost::asio::use_service<BufferPool>(io_service);
+
+  for (std::size_t i = 1; i < BufferPool::kNumSizeClasses; ++i) {
+    BOOST_CHECK_LT(BufferPool::GetSizeOfClass(i - 1),
+                   BufferPool::GetSizeOfClass(i));
+  }
+
+  // out-of-range classes are clamped to the largest one
+  auto buffer = pool.Acquire(BufferPool::kNumSizeClasses);
+  BOOST_CHECK_EQUAL(BufferPool::kNumSizeClasses - 1, buffer.size_class());
+  BOOST_CHECK_EQUAL(
+      BufferPool::GetSizeOfClass(BufferPool::kNumSizeClasses - 1),
+      buffer.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
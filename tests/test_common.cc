@@ -0,0 +1,91 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the Address type in common.h.
+#include "common.h"
+
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace thestral {
+
+namespace ip = boost::asio::ip;
+
+BOOST_AUTO_TEST_SUITE(test_common);
+
+BOOST_AUTO_TEST_CASE(test_address_host) {
+  AddressHost host("richardtsai.me");
+  BOOST_CHECK_EQUAL(host.size(), 14);
+  BOOST_CHECK_EQUAL(std::string(host), "richardtsai.me");
+  BOOST_CHECK_EQUAL(std::string(host.c_str()), "richardtsai.me");
+
+  // longer than the inline buffer, then back
+  std::string long_name(200, 'a');
+  host = long_name;
+  BOOST_CHECK_EQUAL(long_name, host);
+  AddressHost copied(host);
+  AddressHost moved(std::move(host));
+  BOOST_CHECK(copied == moved);
+  BOOST_CHECK(host.empty());
+  moved.resize(3);
+  BOOST_CHECK_EQUAL(std::string("aaa"), moved);
+
+  AddressHost bytes(4, '\0');
+  BOOST_CHECK_EQUAL(std::string(4, '\0'), bytes);
+  BOOST_CHECK(bytes != AddressHost(""));
+}
+
+BOOST_AUTO_TEST_CASE(test_address_format) {
+  Address address;
+  address.host = std::string("\x7f\0\0\x01", 4);
+  address.port = 1080;
+  BOOST_CHECK_EQUAL(address.Format().c_str(), std::string("127.0.0.1:1080"));
+
+  address.type = AddressType::kIPv6;
+  address.host = std::string(15, '\0') + '\x01';
+  BOOST_CHECK_EQUAL(address.ToString(), "[::1]:1080");
+
+  address.type = AddressType::kDomainName;
+  address.host = "richardtsai.me";
+  BOOST_CHECK_EQUAL(address.ToString(), "richardtsai.me:1080");
+
+  // truncated rather than overflowing, but only for logs
+  address.host = std::string(255, 'a');
+  BOOST_CHECK_EQUAL(std::strlen(address.Format().c_str()),
+                    Address::Formatted::kMaxSize - 1);
+  BOOST_CHECK_EQUAL(address.ToString(), std::string(255, 'a') + ":1080");
+}
+
+BOOST_AUTO_TEST_CASE(test_address_asio_conversion) {
+  ip::tcp::endpoint v4(ip::address::from_string("192.168.1.2"), 80);
+  ip::tcp::endpoint v6(ip::address::from_string("fe80::1"), 443);
+  auto v4_address = Address::FromAsioEndpoint(v4);
+  auto v6_address = Address::FromAsioEndpoint(v6);
+  BOOST_CHECK(v4_address.ToAsioEndpoint<ip::tcp::endpoint>() == v4);
+  BOOST_CHECK(v6_address.ToAsioEndpoint<ip::tcp::endpoint>() == v6);
+
+  Address domain;
+  domain.type = AddressType::kDomainName;
+  domain.host = "localhost";
+  BOOST_CHECK(domain.ToAsioAddress().is_unspecified());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
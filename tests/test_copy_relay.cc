@@ -0,0 +1,185 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the copy relay.
+#include "copy_relay.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "buffer_pool.h"
+#include "mocks.h"
+#include "tcp_transport.h"
+
+namespace {
+/// Allocations made by the current thread are counted while this is set.
+thread_local bool counting_allocations = false;
+thread_local std::size_t n_allocations = 0;
+}  // anonymous namespace
+
+// replaced for the whole test binary, only counting when asked to
+void* operator new(std::size_t size) {
+  if (counting_allocations) {
+    ++n_allocations;
+  }
+  if (auto pointer = std::malloc(size ? size : 1)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+
+namespace thestral {
+
+BOOST_AUTO_TEST_SUITE(test_copy_relay);
+
+BOOST_AUTO_TEST_CASE(test_relay) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  // large enough to make the buffer grow through all the size classes
+  std::string data(0x40000, 'x');
+  for (std::size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<char>(i * 7);
+  }
+  auto from = testing::MockTransport::New(io_service, data);
+  auto to = testing::MockTransport::New(io_service);
+
+  bool called = false;
+  CopyRelay::New(from, to, io_service)->Start([&](const ec_type& ec) {
+    called = true;
+    BOOST_CHECK_EQUAL(boost::asio::error::eof, ec);
+  });
+  io_service->run();
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(data == to->write_buf);
+
+  // every buffer should have been returned to the pool
+  auto& pool = boost::asio::use_service<BufferPool>(*io_service);
+  std::size_t n_idle = 0;
+  for (std::size_t i = 0; i < BufferPool::kNumSizeClasses; ++i) {
+    n_idle += pool.GetIdleCount(i);
+  }
+  BOOST_CHECK_EQUAL(BufferPool::kNumSizeClasses, n_idle);
+}
+
+BOOST_AUTO_TEST_CASE(test_write_error) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto from = testing::MockTransport::New(io_service, "some data");
+  auto to = testing::MockTransport::New(io_service);
+  to->ec = boost::asio::error::broken_pipe;
+
+  bool called = false;
+  CopyRelay::New(from, to, io_service)->Start([&](const ec_type& ec) {
+    called = true;
+    BOOST_CHECK_EQUAL(boost::asio::error::broken_pipe, ec);
+  });
+  io_service->run();
+  BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_CASE(test_rate_limit) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::string data(0x10000, 'x');
+  auto from = testing::MockTransport::New(io_service, data);
+  auto to = testing::MockTransport::New(io_service);
+  auto buckets = std::make_shared<BucketSet>();
+  buckets->Add(std::make_shared<TokenBucket>(0x10000));
+
+  auto relay = CopyRelay::New(from, to, io_service);
+  relay->SetRateLimit(buckets);
+  bool called = false;
+  auto start = std::chrono::steady_clock::now();
+  relay->Start([&](const ec_type& ec) {
+    called = true;
+    BOOST_CHECK_EQUAL(boost::asio::error::eof, ec);
+  });
+  relay.reset();
+  io_service->run();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(data == to->write_buf);
+  // a second of the rate, less the initial burst
+  BOOST_CHECK(elapsed >= std::chrono::milliseconds(800));
+  BOOST_CHECK(elapsed < std::chrono::seconds(3));
+}
+
+BOOST_AUTO_TEST_CASE(test_no_allocation_when_relaying) {
+  namespace ip = boost::asio::ip;
+  ip::tcp::endpoint endpoint(ip::address::from_string("127.0.0.1"), 51908);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = TcpTransportFactory::New(io_service);
+  std::vector<std::shared_ptr<TransportBase>> accepted;
+  factory->StartAccept(endpoint, [&accepted](
+                                     const ec_type& ec,
+                                     const std::shared_ptr<TransportBase>& t) {
+    BOOST_REQUIRE(!ec);
+    accepted.push_back(t);
+    return accepted.size() < 2;
+  });
+
+  ip::tcp::socket sender(*io_service);
+  ip::tcp::socket receiver(*io_service);
+  sender.connect(endpoint);
+  receiver.connect(endpoint);
+  while (accepted.size() < 2) {
+    io_service->run_one();
+  }
+  io_service->reset();  // it has run out of work once accepting stopped
+  bool done = false;
+  CopyRelay::New(accepted[0], accepted[1], io_service)
+      ->Start([&done](const ec_type&) { done = true; });
+
+  std::string data(1000, 'x');
+  std::string received(data.size(), '\0');
+  auto relay_once = [&]() {
+    boost::asio::write(sender, boost::asio::buffer(data));
+    while (receiver.available() < data.size()) {
+      io_service->run_one();
+    }
+    boost::asio::read(receiver, boost::asio::buffer(&received[0], data.size()));
+  };
+  // let the buffer pool and the metrics settle
+  for (int i = 0; i < 10; ++i) {
+    relay_once();
+  }
+
+  counting_allocations = true;
+  for (int i = 0; i < 100; ++i) {
+    relay_once();
+  }
+  counting_allocations = false;
+  BOOST_CHECK_EQUAL(n_allocations, 0);
+  BOOST_CHECK(received == data);
+
+  sender.shutdown(ip::tcp::socket::shutdown_send);
+  while (!done) {
+    io_service->run_one();
+  }
+  accepted[0]->StartClose();
+  accepted[1]->StartClose();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
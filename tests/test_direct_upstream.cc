@@ -99,6 +99,35 @@ BOOST_AUTO_TEST_CASE(test_request) {
   BOOST_CHECK_EQUAL(domain.port, endpoint_3.port());
 }
 
+BOOST_AUTO_TEST_CASE(test_denied_resolved_address) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  transport_factory->NewMockTransport();
+  auto upstream = DirectTcpUpstreamFactory::New(transport_factory);
+  auto routes = std::make_shared<RouteTable>();
+  routes->AddNetworkRule("127.0.0.0/8", {}, RouteTable::kDeny);
+  routes->AddNetworkRule("::1", {}, RouteTable::kDeny);
+  upstream->SetRoutes(routes);
+
+  // a domain name resolving into a denied network is denied too
+  Address domain;
+  domain.type = AddressType::kDomainName;
+  domain.host = "localhost";
+  domain.port = 11111;
+  bool called = false;
+  upstream->StartRequest(
+      domain,
+      [&](const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+        called = true;
+        BOOST_CHECK(ec == boost::asio::error::access_denied);
+        BOOST_CHECK(!transport);
+      });
+  io_service->run();
+  BOOST_CHECK(called);
+  BOOST_CHECK_EQUAL(1, transport_factory->GetTransports().size());
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 }  // namespace thestral
@@ -0,0 +1,129 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the DNS cache.
+#include "dns_cache.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#define RESOLVE_CALLBACK(...) \
+  [__VA_ARGS__](const ec_type& ec, \
+                const std::vector<boost::asio::ip::address>& addresses)
+
+namespace thestral {
+
+BOOST_AUTO_TEST_SUITE(test_dns_cache);
+
+BOOST_AUTO_TEST_CASE(test_resolve) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto cache = DnsCache::New(io_service);
+  auto expected = boost::asio::ip::address::from_string("127.0.0.1");
+
+  // concurrent lookups share a single entry
+  int n_resolved = 0;
+  for (int i = 0; i < 2; ++i) {
+    cache->StartResolve("127.0.0.1", RESOLVE_CALLBACK(&) {
+      BOOST_CHECK(!ec);
+      BOOST_REQUIRE_EQUAL(1, addresses.size());
+      BOOST_CHECK_EQUAL(expected, addresses.front());
+      ++n_resolved;
+    });
+  }
+  BOOST_CHECK_EQUAL(1, cache->GetEntryCount());
+  io_service->run();
+  io_service->reset();
+  BOOST_CHECK_EQUAL(2, n_resolved);
+
+  // cached results are returned at once
+  bool called = false;
+  cache->StartResolve("127.0.0.1", RESOLVE_CALLBACK(&) {
+    BOOST_CHECK(!ec);
+    BOOST_REQUIRE_EQUAL(1, addresses.size());
+    BOOST_CHECK_EQUAL(expected, addresses.front());
+    called = true;
+  });
+  BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_CASE(test_evict) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto cache = DnsCache::New(io_service);
+  cache->SetMaxEntries(2);
+
+  for (auto host : {"127.0.0.1", "127.0.0.2", "127.0.0.3"}) {
+    cache->StartResolve(
+        host, [](const ec_type& ec,
+                 const std::vector<boost::asio::ip::address>&) {
+          BOOST_CHECK(!ec);
+        });
+    io_service->run();
+    io_service->reset();
+  }
+  BOOST_CHECK_EQUAL(2, cache->GetEntryCount());
+
+  // the most recent hosts are still cached
+  for (auto host : {"127.0.0.2", "127.0.0.3"}) {
+    bool called = false;
+    cache->StartResolve(
+        host,
+        [&](const ec_type&, const std::vector<boost::asio::ip::address>&) {
+          called = true;
+        });
+    BOOST_CHECK(called);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_threads) {
+  // caches on different workers share the threads of the pool
+  std::vector<std::shared_ptr<boost::asio::io_service>> io_services;
+  std::vector<std::shared_ptr<DnsCache>> caches;
+  int n_resolved = 0;
+  for (int i = 0; i < 3; ++i) {
+    io_services.push_back(std::make_shared<boost::asio::io_service>());
+    caches.push_back(DnsCache::New(io_services.back()));
+    caches.back()->SetResolverThreads(2);
+    caches.back()->StartResolve(
+        "127.0.0.1",
+        [&](const ec_type& ec, const std::vector<boost::asio::ip::address>&) {
+          BOOST_CHECK(!ec);
+          ++n_resolved;
+        });
+  }
+  for (const auto& io_service : io_services) {
+    io_service->run();
+  }
+  BOOST_CHECK_EQUAL(3, n_resolved);
+  BOOST_CHECK_LE(DnsResolverPool::Get().GetThreadCount(), 4);
+
+  // a cache destroyed with a query in flight doesn't wait for it
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto cache = DnsCache::New(io_service);
+  cache->StartResolve(
+      "127.0.0.1",
+      [](const ec_type&, const std::vector<boost::asio::ip::address>&) {
+        BOOST_ERROR("the result of a destroyed cache is delivered");
+      });
+  cache.reset();
+  io_service->run();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
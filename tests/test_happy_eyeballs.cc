@@ -0,0 +1,170 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the Happy Eyeballs connector.
+#include "happy_eyeballs.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "mocks.h"
+
+namespace thestral {
+
+namespace ip = boost::asio::ip;
+
+namespace {
+/// A factory keeping the callbacks of the connections, so that the test
+/// decides when and how they complete.
+class HeldConnectFactory : public testing::MockTcpTransportFactory {
+ public:
+  using MockTcpTransportFactory::MockTcpTransportFactory;
+
+  void StartConnect(EndpointType,
+                    const ConnectCallbackType& callback) override {
+    callbacks.push_back(callback);
+  }
+
+  std::vector<ConnectCallbackType> callbacks;
+};
+}  // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(test_happy_eyeballs);
+
+BOOST_AUTO_TEST_CASE(test_sort_endpoints) {
+  auto v4_1 = ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), 80);
+  auto v4_2 = ip::tcp::endpoint(ip::address::from_string("127.0.0.2"), 80);
+  auto v4_3 = ip::tcp::endpoint(ip::address::from_string("127.0.0.3"), 80);
+  auto v6_1 = ip::tcp::endpoint(ip::address::from_string("::1"), 80);
+
+  auto sorted = HappyEyeballsConnector::SortEndpoints({v4_1, v4_2, v6_1, v4_3});
+  std::vector<ip::tcp::endpoint> expected{v6_1, v4_1, v4_2, v4_3};
+  BOOST_CHECK(expected == sorted);
+}
+
+BOOST_AUTO_TEST_CASE(test_failover) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  factory->NewMockTransport("", boost::asio::error::make_error_code(
+                                    boost::asio::error::network_unreachable));
+  auto transport = factory->NewMockTransport();
+
+  auto v6 = ip::tcp::endpoint(ip::address::from_string("::1"), 80);
+  auto v4 = ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), 80);
+  auto connector =
+      HappyEyeballsConnector::New(factory, {v4, v6}, std::chrono::hours(1));
+
+  // the next attempt starts as soon as the first one fails, long before the
+  // attempt delay
+  bool called = false;
+  connector->Start([&](const ec_type& ec,
+                       const std::shared_ptr<TransportBase>& result) {
+    called = true;
+    BOOST_CHECK(!ec);
+    BOOST_CHECK(transport == result);
+  });
+  io_service->run();
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(v6 == factory->PopEndpoint());
+  BOOST_CHECK(v4 == factory->PopEndpoint());
+}
+
+BOOST_AUTO_TEST_CASE(test_all_failed) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = std::make_shared<testing::MockTcpTransportFactory>(io_service);
+
+  auto connector = HappyEyeballsConnector::New(
+      factory,
+      {ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), 80),
+       ip::tcp::endpoint(ip::address::from_string("127.0.0.2"), 80)},
+      std::chrono::milliseconds(10));
+
+  int n_called = 0;
+  connector->Start([&](const ec_type& ec,
+                       const std::shared_ptr<TransportBase>& result) {
+    ++n_called;
+    BOOST_CHECK_EQUAL(boost::asio::error::connection_refused, ec);
+    BOOST_CHECK(!result);
+  });
+  io_service->run();
+  BOOST_CHECK_EQUAL(1, n_called);
+}
+
+BOOST_AUTO_TEST_CASE(test_expired_timer_after_failure) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = std::make_shared<HeldConnectFactory>(io_service);
+  auto connector = HappyEyeballsConnector::New(
+      factory,
+      {ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), 80),
+       ip::tcp::endpoint(ip::address::from_string("127.0.0.2"), 80),
+       ip::tcp::endpoint(ip::address::from_string("127.0.0.3"), 80)},
+      std::chrono::milliseconds(10));
+  connector->Start([](const ec_type&, const std::shared_ptr<TransportBase>&) {
+  });
+  BOOST_REQUIRE_EQUAL(1, factory->callbacks.size());
+
+  // the first attempt fails once the timer has expired, with its handler
+  // queued behind, which must not start the third attempt early
+  io_service->post([factory]() {
+    factory->callbacks[0](boost::asio::error::connection_refused, nullptr);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  io_service->poll();
+  BOOST_CHECK_EQUAL(2, factory->callbacks.size());
+  factory->callbacks.clear();
+}
+
+BOOST_AUTO_TEST_CASE(test_abort_losers) {
+  // the first endpoint never answers (or is unreachable at once if there is no
+  // route), the second one wins after the delay
+  ip::tcp::endpoint listening(ip::address::from_string("127.0.0.1"), 47930);
+  ip::tcp::endpoint blackhole(ip::address::from_string("10.255.255.1"), 47930);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = TcpTransportFactory::New(io_service);
+  factory->StartAccept(
+      listening,
+      [](const ec_type&, const std::shared_ptr<TransportBase>& transport) {
+        if (transport) {
+          transport->StartClose();
+        }
+        return false;
+      });
+
+  auto connector = HappyEyeballsConnector::New(
+      factory, {blackhole, listening}, std::chrono::milliseconds(50));
+  auto begin = std::chrono::steady_clock::now();
+  bool called = false;
+  connector->Start([&](const ec_type& ec,
+                       const std::shared_ptr<TransportBase>& result) {
+    called = true;
+    BOOST_CHECK(!ec);
+    BOOST_REQUIRE(result);
+    result->StartClose();
+  });
+  io_service->run();  // only returns once the blackholed attempt is aborted
+
+  BOOST_CHECK(called);
+  BOOST_CHECK(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
@@ -16,11 +16,13 @@
 /// Tests for logging facility.
 #include "logging.h"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <map>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <boost/test/unit_test.hpp>
@@ -149,6 +151,89 @@ BOOST_AUTO_TEST_CASE(test_logger) {
   BOOST_CHECK_EQUAL("[F][test2][fatal][value]", logs[3]);
 }
 
+BOOST_AUTO_TEST_CASE(test_async_logging) {
+  std::unique_ptr<testing::TestingLogSink> sink(new testing::TestingLogSink);
+  sink->SetFormat("{message}");
+  auto& logs = sink->GetLogs();
+  auto& added_sink = add_log_sink(std::move(sink));
+  Logger logger("test_async");
+
+  AsyncOptions options;
+  options.queue_size = 4;
+  options.overflow_policy = OverflowPolicy::BLOCK;
+  start_async_logging(options);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&logger, i]() {
+      for (int j = 0; j < 100; ++j) {
+        logger.Warn("%d %d", i, j);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  // stored after all the queued records, before the logging thread goes on
+  BOOST_CHECK_THROW(logger.Fatal("fatal"), FatalEvent);
+  BOOST_REQUIRE_EQUAL(401, logs.size());
+  BOOST_CHECK_EQUAL("fatal", logs.back());
+  stop_async_logging();
+
+  std::vector<int> next(4, 0);
+  for (std::size_t k = 0; k < 400; ++k) {  // in order within every thread
+    std::istringstream iss(logs[k]);
+    int i, j;
+    iss >> i >> j;
+    BOOST_REQUIRE(i >= 0 && i < 4);
+    BOOST_CHECK_EQUAL(next[i]++, j);
+  }
+
+  options.overflow_policy = OverflowPolicy::DROP;
+  start_async_logging(options);
+  {
+    // stall the logging thread
+    std::lock_guard<std::mutex> lock(added_sink.GetMutex());
+    for (int j = 0; j < 100; ++j) {
+      logger.Warn("dropped or not");
+    }
+  }
+  stop_async_logging();
+  BOOST_CHECK(logs.size() < 501);
+  BOOST_CHECK(std::any_of(logs.cbegin() + 401, logs.cend(),
+                          [](const std::string& log) {
+                            return log.find("records dropped") !=
+                                   std::string::npos;
+                          }));
+  added_sink.SetLevel(Level::FATAL);  // keep it from following tests
+}
+
+BOOST_AUTO_TEST_CASE(test_lazy_logging) {
+  std::unique_ptr<testing::TestingLogSink> sink(new testing::TestingLogSink);
+  sink->SetFormat("{message}");
+  sink->SetLevel(Level::ERROR);
+  auto& logs = sink->GetLogs();
+  auto& added_sink = add_log_sink(std::move(sink));
+  Logger logger("test_lazy");
+
+  int n_evaluated = 0;
+  auto evaluate = [&n_evaluated]() { return ++n_evaluated; };
+  // no sink takes INFO, even those added by other tests
+  BOOST_CHECK(!Logger::IsEnabled(Level::INFO));
+  THESTRAL_LOG_INFO(logger, "%d", evaluate());
+  BOOST_CHECK_EQUAL(0, n_evaluated);
+  THESTRAL_LOG_ERROR(logger, "%d", evaluate());
+  BOOST_CHECK_EQUAL(1, n_evaluated);
+  BOOST_REQUIRE(!logs.empty());
+  BOOST_CHECK_EQUAL("1", logs.back());
+
+  added_sink.SetLevel(Level::INFO);
+  BOOST_CHECK(Logger::IsEnabled(Level::INFO));
+  THESTRAL_LOG_INFO(logger, "%d", evaluate());
+  BOOST_CHECK_EQUAL(2, n_evaluated);
+  BOOST_CHECK_EQUAL("2", logs.back());
+  added_sink.SetLevel(Level::FATAL);  // keep it from following tests
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 }  // namespace logging
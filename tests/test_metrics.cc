@@ -0,0 +1,150 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Tests for metrics and the metrics server.
+#include "metrics.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "metrics_server.h"
+#include "tcp_transport.h"
+
+namespace thestral {
+namespace metrics {
+
+namespace {
+
+const Counter kTestCounter("thestral_test_events_total", "Test events.",
+                           "kind=\"a\"");
+const Counter kOtherTestCounter("thestral_test_events_total", "Test events.",
+                                "kind=\"b\"");
+const Gauge kTestGauge("thestral_test_active", "Test gauge.");
+const Histogram kTestHistogram("thestral_test_seconds", "Test histogram.",
+                               {0.01, 0.1});
+
+bool Contains(const std::string& text, const std::string& part) {
+  return text.find(part) != std::string::npos;
+}
+
+}  // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(test_metrics);
+
+BOOST_AUTO_TEST_CASE(test_counter_across_threads) {
+  auto before = kTestCounter.GetValue();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([]() {
+      for (int j = 0; j < 1000; ++j) {
+        kTestCounter.Increment();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  // the values of exited threads are kept
+  BOOST_CHECK_EQUAL(before + 4000, kTestCounter.GetValue());
+}
+
+BOOST_AUTO_TEST_CASE(test_gauge) {
+  auto before = kTestGauge.GetValue();
+  {
+    auto token = kTestGauge.Track();
+    std::thread([&token, before]() {
+      auto other = kTestGauge.Track();
+      BOOST_CHECK_EQUAL(before + 2, kTestGauge.GetValue());
+      token.reset();  // decremented on another thread
+    }).join();
+    BOOST_CHECK(!token);
+  }
+  BOOST_CHECK_EQUAL(before, kTestGauge.GetValue());
+}
+
+BOOST_AUTO_TEST_CASE(test_render) {
+  kOtherTestCounter.Increment(3);
+  kTestHistogram.Observe(std::chrono::milliseconds(5));
+  kTestHistogram.Observe(std::chrono::milliseconds(50));
+  kTestHistogram.Observe(std::chrono::seconds(1));
+  BOOST_CHECK_EQUAL(3, kTestHistogram.GetCount());
+
+  auto text = RenderText();
+  BOOST_CHECK(Contains(text, "# TYPE thestral_test_events_total counter\n"));
+  BOOST_CHECK(Contains(text, "thestral_test_events_total{kind=\"b\"} 3\n"));
+  // HELP and TYPE only appear once for metrics sharing a name
+  auto first = text.find("# HELP thestral_test_events_total");
+  BOOST_CHECK(first != std::string::npos);
+  BOOST_CHECK(text.find("# HELP thestral_test_events_total", first + 1) ==
+              std::string::npos);
+
+  BOOST_CHECK(Contains(text, "# TYPE thestral_test_seconds histogram\n"));
+  BOOST_CHECK(Contains(text, "thestral_test_seconds_bucket{le=\"0.01\"} 1\n"));
+  BOOST_CHECK(Contains(text, "thestral_test_seconds_bucket{le=\"0.1\"} 2\n"));
+  BOOST_CHECK(Contains(text, "thestral_test_seconds_bucket{le=\"+Inf\"} 3\n"));
+  BOOST_CHECK(Contains(text, "thestral_test_seconds_sum 1.055\n"));
+  BOOST_CHECK(Contains(text, "thestral_test_seconds_count 3\n"));
+}
+
+BOOST_AUTO_TEST_CASE(test_server) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto server = MetricsServer::New("127.0.0.1", 51900,
+                                   TcpTransportFactory::New(io_service));
+  server->Start();
+  std::thread thread([io_service]() { io_service->run(); });
+
+  auto request = [](const std::string& data) {
+    boost::asio::io_service client_service;
+    boost::asio::ip::tcp::socket s(client_service);
+    s.connect(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string("127.0.0.1"), 51900));
+    boost::asio::write(s, boost::asio::buffer(data));
+    boost::asio::streambuf response;
+    boost::system::error_code ec;
+    boost::asio::read(s, response, ec);  // until the server closes it
+    BOOST_CHECK(ec == boost::asio::error::eof);
+    return std::string(boost::asio::buffers_begin(response.data()),
+                       boost::asio::buffers_end(response.data()));
+  };
+
+  kTestCounter.Increment();
+  auto response = request("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  BOOST_CHECK_EQUAL(0, response.find("HTTP/1.0 200 OK\r\n"));
+  BOOST_CHECK(
+      Contains(response, "Content-Type: text/plain; version=0.0.4\r\n"));
+  auto body = response.substr(response.find("\r\n\r\n") + 4);
+  BOOST_CHECK(Contains(response, "Content-Length: " +
+                                     std::to_string(body.size()) + "\r\n"));
+  BOOST_CHECK(Contains(body, "thestral_test_events_total{kind=\"a\"} " +
+                                 std::to_string(kTestCounter.GetValue())));
+
+  response = request("GET / HTTP/1.1\r\n\r\n");
+  BOOST_CHECK_EQUAL(0, response.find("HTTP/1.0 404 Not Found\r\n"));
+
+  io_service->stop();
+  thread.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace metrics
+}  // namespace thestral
@@ -0,0 +1,543 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mux.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "socks.h"
+#include "tcp_transport.h"
+
+namespace thestral {
+namespace mux {
+
+namespace {
+
+const boost::asio::ip::tcp::endpoint kEndpoint(
+    boost::asio::ip::address::from_string("127.0.0.1"), 51904);
+
+/// Connects a pair of sessions over the loopback interface, collecting the
+/// streams accepted by the server side. The server session is stored in
+/// `server` if not `nullptr`.
+std::shared_ptr<MuxSession> ConnectSessions(
+    const std::shared_ptr<boost::asio::io_service>& io_service,
+    std::vector<std::shared_ptr<MuxStream>>* accepted,
+    std::shared_ptr<MuxSession>* server = nullptr,
+    TimingWheel::ClockType::duration ping_interval =
+        TimingWheel::ClockType::duration::zero()) {
+  auto factory = TcpTransportFactory::New(io_service);
+  bool server_started = false;
+  factory->StartAccept(
+      kEndpoint, [&server_started, io_service, accepted, server](
+                     const ec_type& ec,
+                     const std::shared_ptr<TransportBase>& transport) {
+        BOOST_REQUIRE(!ec);
+        auto session = MuxSession::NewServer(
+            transport, io_service,
+            [accepted](const std::shared_ptr<MuxStream>& stream) {
+              accepted->push_back(stream);
+            });
+        session->Start();
+        if (server) {
+          *server = session;
+        }
+        server_started = true;
+        return false;
+      });
+  std::shared_ptr<MuxSession> client;
+  factory->StartConnect(kEndpoint, [&client, io_service, ping_interval](
+                                       const ec_type& ec,
+                                       const std::shared_ptr<TransportBase>&
+                                           transport) {
+    BOOST_REQUIRE(!ec);
+    client = MuxSession::NewClient(transport, io_service);
+    client->SetPingInterval(ping_interval);
+    client->Start();
+  });
+  while (!client || !server_started) {
+    io_service->run_one();
+  }
+  return client;
+}
+
+std::string SerializeResponse(socks::ResponseCode response_code) {
+  socks::ResponsePacket response;
+  response.header.response_code = response_code;
+  response.body = Address::FromAsioEndpoint(kEndpoint);
+  return response.Serialize();
+}
+
+}  // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(test_mux);
+
+BOOST_AUTO_TEST_CASE(test_stream) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  auto client = ConnectSessions(io_service, &accepted);
+
+  auto stream = client->OpenStream("request");
+  BOOST_CHECK_EQUAL(1, client->GetStreamCount());
+  while (accepted.empty()) {
+    io_service->run_one();
+  }
+  auto peer = accepted.front();
+  BOOST_CHECK_EQUAL(stream->GetStreamId(), peer->GetStreamId());
+
+  // the initial data arrives without any reply
+  std::string request(7, '\0');
+  bool request_read = false;
+  peer->StartRead(&request[0], request.size(),
+                  [&request_read](const ec_type& ec, std::size_t n_bytes) {
+                    BOOST_CHECK(!ec);
+                    BOOST_CHECK_EQUAL(7, n_bytes);
+                    request_read = true;
+                  });
+  io_service->run_one();
+  while (!request_read) {
+    io_service->run_one();
+  }
+  BOOST_CHECK_EQUAL("request", request);
+
+  // the response is stripped on the client side
+  auto reply = std::make_shared<std::string>(
+      SerializeResponse(socks::ResponseCode::kSuccess) + "reply");
+  peer->StartWrite(*reply, [reply](const ec_type& ec, std::size_t) {
+    BOOST_CHECK(!ec);
+  });
+  char buf[64];
+  std::string received;
+  ec_type read_ec;
+  bool read_done = false;
+  stream->StartRead(buf, sizeof(buf),
+                    [&](const ec_type& ec, std::size_t n_bytes) {
+                      read_ec = ec;
+                      received.assign(buf, n_bytes);
+                      read_done = true;
+                    },
+                    true);
+  while (!read_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(!read_ec);
+  BOOST_CHECK_EQUAL("reply", received);
+
+  // each direction ends on its own
+  bool shut_down = false;
+  stream->StartShutdownSend([&shut_down](const ec_type& ec) {
+    BOOST_CHECK(!ec);
+    shut_down = true;
+  });
+  read_done = false;
+  peer->StartRead(buf, sizeof(buf),
+                  [&](const ec_type& ec, std::size_t) {
+                    read_ec = ec;
+                    read_done = true;
+                  },
+                  true);
+  while (!shut_down || !read_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(read_ec == boost::asio::error::eof);
+
+  auto more = std::make_shared<std::string>("more");
+  peer->StartWrite(*more, [more](const ec_type& ec, std::size_t) {
+    BOOST_CHECK(!ec);
+  });
+  read_done = false;
+  stream->StartRead(buf, 4, [&](const ec_type& ec, std::size_t n_bytes) {
+    read_ec = ec;
+    received.assign(buf, n_bytes);
+    read_done = true;
+  });
+  while (!read_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(!read_ec);
+  BOOST_CHECK_EQUAL("more", received);
+
+  stream->StartClose();
+  peer->StartClose();
+  BOOST_CHECK_EQUAL(0, client->GetStreamCount());
+  client->Close();
+  io_service->run();
+}
+
+BOOST_AUTO_TEST_CASE(test_error_response) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  auto client = ConnectSessions(io_service, &accepted);
+
+  auto stream = client->OpenStream("request");
+  while (accepted.empty()) {
+    io_service->run_one();
+  }
+  auto reply = std::make_shared<std::string>(
+      SerializeResponse(socks::ResponseCode::kConnectionRefused));
+  accepted.front()->StartWrite(*reply, [reply](const ec_type&, std::size_t) {});
+
+  char buf[16];
+  ec_type read_ec;
+  bool read_done = false;
+  stream->StartRead(buf, sizeof(buf),
+                    [&](const ec_type& ec, std::size_t) {
+                      read_ec = ec;
+                      read_done = true;
+                    },
+                    true);
+  while (!read_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(read_ec ==
+              socks::error::make_error_code(
+                  socks::ResponseCode::kConnectionRefused));
+  BOOST_CHECK_EQUAL(0, client->GetStreamCount());
+
+  // the server side gets reset
+  read_done = false;
+  accepted.front()->StartRead(buf, sizeof(buf),
+                              [&](const ec_type& ec, std::size_t) {
+                                read_ec = ec;
+                                read_done = true;
+                              });
+  while (!read_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(read_ec == boost::asio::error::connection_reset);
+  client->Close();
+  io_service->run();
+}
+
+BOOST_AUTO_TEST_CASE(test_flow_control) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  auto client = ConnectSessions(io_service, &accepted);
+
+  auto stream = client->OpenStream("");
+  while (accepted.empty()) {
+    io_service->run_one();
+  }
+  auto peer = accepted.front();
+
+  // a write larger than the window can't complete until the peer reads
+  std::string data(MuxSession::kInitialWindow * 4, 'x');
+  bool written = false;
+  stream->StartWrite(data, [&written, &data](const ec_type& ec,
+                                             std::size_t n_bytes) {
+    BOOST_CHECK(!ec);
+    BOOST_CHECK_EQUAL(data.size(), n_bytes);
+    written = true;
+  });
+  io_service->run_for(std::chrono::milliseconds(200));
+  BOOST_CHECK(!written);
+
+  std::string received(data.size(), '\0');
+  bool read_done = false;
+  peer->StartRead(&received[0], received.size(),
+                  [&read_done](const ec_type& ec, std::size_t) {
+                    BOOST_CHECK(!ec);
+                    read_done = true;
+                  });
+  while (!written || !read_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(data == received);
+
+  client->Close();
+  io_service->run();
+}
+
+BOOST_AUTO_TEST_CASE(test_session_failure) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  auto client = ConnectSessions(io_service, &accepted);
+
+  auto stream = client->OpenStream("");
+  while (accepted.empty()) {
+    io_service->run_one();
+  }
+
+  // all streams fail with the session
+  client->Close();
+  BOOST_CHECK(client->IsClosed());
+  BOOST_CHECK(!client->CanOpenStream());
+  char buf[16];
+  int n_failed = 0;
+  auto on_read = [&n_failed](const ec_type& ec, std::size_t) {
+    BOOST_CHECK(ec);
+    ++n_failed;
+  };
+  stream->StartRead(buf, sizeof(buf), on_read);
+  accepted.front()->StartRead(buf, sizeof(buf), on_read);
+  io_service->run();
+  BOOST_CHECK_EQUAL(2, n_failed);
+
+  // streams opened afterwards fail at once
+  bool failed = false;
+  client->OpenStream("")->StartWrite(
+      std::string("data"), [&failed](const ec_type& ec, std::size_t) {
+        BOOST_CHECK(ec);
+        failed = true;
+      });
+  io_service->reset();
+  io_service->run();
+  BOOST_CHECK(failed);
+}
+
+BOOST_AUTO_TEST_CASE(test_go_away) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  std::shared_ptr<MuxSession> server;
+  auto client = ConnectSessions(io_service, &accepted, &server);
+
+  auto stream = client->OpenStream("");
+  while (accepted.empty()) {
+    io_service->run_one();
+  }
+
+  // a stream opened before the client learns of it is reset
+  server->GoAway();
+  auto late_stream = client->OpenStream("");
+  ec_type late_ec;
+  bool late_done = false;
+  char buf[16];
+  late_stream->StartRead(buf, sizeof(buf),
+                         [&late_ec, &late_done](const ec_type& ec,
+                                                std::size_t) {
+                           late_ec = ec;
+                           late_done = true;
+                         });
+  while (!late_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(late_ec == boost::asio::error::connection_reset);
+  BOOST_CHECK_EQUAL(1, accepted.size());
+
+  // the stream already open goes on, and the session ends after it
+  BOOST_CHECK(!client->CanOpenStream());
+  BOOST_CHECK(!client->IsClosed());
+  auto reply = std::make_shared<std::string>(
+      SerializeResponse(socks::ResponseCode::kSuccess) + "reply");
+  accepted.front()->StartWrite(*reply, [reply](const ec_type& ec,
+                                               std::size_t) {
+    BOOST_CHECK(!ec);
+  });
+  std::string received;
+  bool read_done = false;
+  stream->StartRead(buf, 5, [&](const ec_type& ec, std::size_t n_bytes) {
+    BOOST_CHECK(!ec);
+    received.assign(buf, n_bytes);
+    read_done = true;
+  });
+  while (!read_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK_EQUAL("reply", received);
+  stream->StartClose();
+  BOOST_CHECK_EQUAL(0, client->GetStreamCount());
+  accepted.front()->StartClose();
+  io_service->run();
+  BOOST_CHECK(client->IsClosed());
+  BOOST_CHECK(server->IsClosed());
+}
+
+BOOST_AUTO_TEST_CASE(test_server_closes_after_go_away) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = TcpTransportFactory::New(io_service);
+  std::shared_ptr<MuxSession> server;
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  factory->StartAccept(
+      kEndpoint, [&server, &accepted, io_service](
+                     const ec_type& ec,
+                     const std::shared_ptr<TransportBase>& transport) {
+        BOOST_REQUIRE(!ec);
+        server = MuxSession::NewServer(
+            transport, io_service,
+            [&accepted](const std::shared_ptr<MuxStream>& stream) {
+              accepted.push_back(stream);
+            });
+        server->Start();
+        return false;
+      });
+
+  // a client opening a stream, which then neither reads nor closes
+  boost::asio::ip::tcp::socket client(*io_service);
+  client.connect(kEndpoint);
+  FrameHeader open;
+  open.type = FrameType::kOpen;
+  open.stream_id = 1;
+  boost::asio::write(client, boost::asio::buffer(
+                                 std::string(MuxSession::kPreface, 8) +
+                                 open.Serialize()));
+  while (accepted.empty()) {
+    io_service->run_one();
+  }
+
+  // the server ends its session with the last stream, once the frames
+  // queued before are written
+  server->GoAway();
+  auto reply = std::make_shared<std::string>("bye");
+  auto stream = accepted.front();
+  stream->StartWrite(*reply, [reply, stream](const ec_type& ec,
+                                             std::size_t) {
+    BOOST_CHECK(!ec);
+    stream->StartClose();
+  });
+  io_service->run();
+  BOOST_CHECK(server->IsClosed());
+
+  std::string received;
+  boost::system::error_code ec;
+  boost::asio::read(client, boost::asio::dynamic_buffer(received), ec);
+  BOOST_CHECK(ec == boost::asio::error::eof);
+  BOOST_REQUIRE_EQUAL(3 * FrameHeader::kSize + reply->size(),
+                      received.size());
+  FrameHeader header;
+  header.FromBytes(&received[0]);
+  BOOST_CHECK(header.type == FrameType::kGoAway);
+  header.FromBytes(&received[FrameHeader::kSize]);
+  BOOST_CHECK(header.type == FrameType::kData);
+  BOOST_CHECK_EQUAL(*reply, received.substr(2 * FrameHeader::kSize, 3));
+  header.FromBytes(&received[2 * FrameHeader::kSize + 3]);
+  BOOST_CHECK(header.type == FrameType::kReset);
+  BOOST_CHECK_EQUAL(1, header.stream_id);
+}
+
+BOOST_AUTO_TEST_CASE(test_reset_after_go_away) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  std::shared_ptr<MuxSession> server;
+  auto client = ConnectSessions(io_service, &accepted, &server);
+
+  auto stream = client->OpenStream("");
+  while (accepted.empty()) {
+    io_service->run_one();
+  }
+  server->GoAway();
+  while (client->CanOpenStream()) {
+    io_service->run_one();
+  }
+
+  // the last stream being reset by the server ends the session as well
+  accepted.front()->StartClose();
+  while (!client->IsClosed()) {
+    io_service->run_one();
+  }
+  BOOST_CHECK_EQUAL(0, client->GetStreamCount());
+  stream->StartClose();
+  io_service->run();
+  BOOST_CHECK(server->IsClosed());
+}
+
+BOOST_AUTO_TEST_CASE(test_max_streams) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  std::shared_ptr<MuxSession> server;
+  auto client = ConnectSessions(io_service, &accepted, &server);
+  server->SetMaxStreams(1);
+
+  // the stream beyond the limit is reset, leaving the session open
+  auto stream = client->OpenStream("");
+  auto extra_stream = client->OpenStream("");
+  char buf[16];
+  ec_type extra_ec;
+  bool extra_done = false;
+  extra_stream->StartRead(buf, sizeof(buf),
+                          [&extra_ec, &extra_done](const ec_type& ec,
+                                                   std::size_t) {
+                            extra_ec = ec;
+                            extra_done = true;
+                          });
+  while (!extra_done) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(extra_ec == boost::asio::error::connection_reset);
+  BOOST_CHECK_EQUAL(1, accepted.size());
+  BOOST_CHECK(client->CanOpenStream());
+
+  // a stream closed makes room for another
+  stream->StartClose();
+  accepted.front()->StartClose();
+  auto next_stream = client->OpenStream("");
+  while (accepted.size() < 2) {
+    io_service->run_one();
+  }
+  next_stream->StartClose();
+  accepted.back()->StartClose();
+  client->Close();
+  io_service->run();
+}
+
+BOOST_AUTO_TEST_CASE(test_ping) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  std::vector<std::shared_ptr<MuxStream>> accepted;
+  auto client = ConnectSessions(io_service, &accepted, nullptr,
+                                std::chrono::milliseconds(200));
+
+  // the pings of an idle session are answered
+  boost::asio::steady_timer timer(*io_service);
+  timer.expires_from_now(std::chrono::seconds(1));
+  bool waited = false;
+  timer.async_wait([&waited](const ec_type&) { waited = true; });
+  while (!waited) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(!client->IsClosed());
+  client->Close();
+  io_service->run();
+
+  // a peer gone silent is given up
+  io_service->reset();
+  auto factory = TcpTransportFactory::New(io_service);
+  std::shared_ptr<TransportBase> silent;
+  factory->StartAccept(kEndpoint, [&silent](
+                                      const ec_type& ec,
+                                      const std::shared_ptr<TransportBase>&
+                                          transport) {
+    BOOST_REQUIRE(!ec);
+    silent = transport;
+    return false;
+  });
+  std::shared_ptr<MuxSession> silent_client;
+  factory->StartConnect(kEndpoint, [&silent_client, io_service](
+                                       const ec_type& ec,
+                                       const std::shared_ptr<TransportBase>&
+                                           transport) {
+    BOOST_REQUIRE(!ec);
+    silent_client = MuxSession::NewClient(transport, io_service);
+    silent_client->SetPingInterval(std::chrono::milliseconds(200));
+    silent_client->Start();
+  });
+  auto start = std::chrono::steady_clock::now();
+  while (!silent_client || !silent_client->IsClosed()) {
+    io_service->run_one();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  BOOST_CHECK(elapsed >= std::chrono::milliseconds(400));
+  BOOST_CHECK(elapsed < std::chrono::seconds(2));
+  BOOST_CHECK(!silent_client->CanOpenStream());
+  silent->StartClose();
+  io_service->run();
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace mux
+}  // namespace thestral
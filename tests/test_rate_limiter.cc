@@ -0,0 +1,133 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the token buckets and the shaping scheduler.
+#include "rate_limiter.h"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "base.h"
+
+namespace thestral {
+
+BOOST_AUTO_TEST_SUITE(test_rate_limiter);
+
+BOOST_AUTO_TEST_CASE(test_token_bucket) {
+  TokenBucket bucket(100000);
+  BOOST_CHECK_EQUAL(bucket.GetBurst(), 10000);
+  BOOST_CHECK(bucket.GetDelay() == TokenBucket::ClockType::duration::zero());
+
+  // 20000 bytes in debt take 0.2s to pay off
+  bucket.Consume(30000);
+  auto delay = bucket.GetDelay();
+  BOOST_CHECK(delay > std::chrono::milliseconds(150));
+  BOOST_CHECK(delay <= std::chrono::milliseconds(201));
+  bucket.Consume(-30000);
+  BOOST_CHECK(bucket.GetDelay() == TokenBucket::ClockType::duration::zero());
+
+  // small rates still allow reads of a useful size
+  BOOST_CHECK_EQUAL(TokenBucket(100).GetBurst(), TokenBucket::kMinBurst);
+}
+
+BOOST_AUTO_TEST_CASE(test_rate_limiter) {
+  Address client1, client2;
+  client1.host = std::string("\x0a\0\0\x01", 4);
+  client2.host = std::string("\x0a\0\0\x02", 4);
+
+  RateLimiter no_limit(0, 0, nullptr);
+  BOOST_CHECK(!no_limit.StartSession(client1));
+
+  // the sessions of a client share its bucket
+  RateLimiter limiter(0, 100000, nullptr);
+  auto session1 = limiter.StartSession(client1);
+  auto session2 = limiter.StartSession(client1);
+  auto session3 = limiter.StartSession(client2);
+  BOOST_REQUIRE(session1 && session2 && session3);
+  session1->Consume(20000);
+  BOOST_CHECK(session2->GetDelay() > std::chrono::milliseconds(50));
+  BOOST_CHECK(session3->GetDelay() ==
+              TokenBucket::ClockType::duration::zero());
+
+  // but not their own ones
+  RateLimiter session_limiter(100000, 0, nullptr);
+  session1 = session_limiter.StartSession(client1);
+  session2 = session_limiter.StartSession(client1);
+  session1->Consume(20000);
+  BOOST_CHECK(session2->GetDelay() ==
+              TokenBucket::ClockType::duration::zero());
+  BOOST_CHECK_EQUAL(session1->GetQuantum(), 10000);
+}
+
+BOOST_AUTO_TEST_CASE(test_fair_scheduling) {
+  boost::asio::io_service io_service;
+  auto& scheduler = boost::asio::use_service<ShapingScheduler>(io_service);
+  auto global_bucket = std::make_shared<TokenBucket>(400000);
+  BucketSet buckets[2];
+  std::size_t n_granted[2] = {0, 0};
+  std::function<void(int)> acquire = [&](int i) {
+    scheduler.StartAcquire(buckets[i], [&, i](std::size_t n_bytes) {
+      n_granted[i] += n_bytes;
+      io_service.post([&acquire, i]() { acquire(i); });
+    });
+  };
+  for (int i = 0; i < 2; ++i) {
+    buckets[i].Add(global_bucket);
+    acquire(i);
+  }
+
+  boost::asio::steady_timer timer(io_service, std::chrono::milliseconds(500));
+  timer.async_wait([&io_service](const ec_type&) { io_service.stop(); });
+  io_service.run();
+
+  // a burst and half a second of the rate, in turns
+  auto quantum = buckets[0].GetQuantum();
+  auto total = n_granted[0] + n_granted[1];
+  BOOST_CHECK(total >= 200000);
+  BOOST_CHECK(total <= 240000 + 2 * quantum);
+  BOOST_CHECK(n_granted[0] <= n_granted[1] + 2 * quantum);
+  BOOST_CHECK(n_granted[1] <= n_granted[0] + 2 * quantum);
+}
+
+BOOST_AUTO_TEST_CASE(test_waiters_first) {
+  boost::asio::io_service io_service;
+  auto& scheduler = boost::asio::use_service<ShapingScheduler>(io_service);
+  auto bucket = std::make_shared<TokenBucket>(100000);
+  BucketSet buckets;
+  buckets.Add(bucket);
+  std::vector<int> granted;
+
+  bucket->Consume(20000);
+  scheduler.StartAcquire(buckets, [&](std::size_t) { granted.push_back(1); });
+  // the tokens come back before the waiter wakes up
+  bucket->Consume(-20000);
+  scheduler.StartAcquire(buckets, [&](std::size_t) { granted.push_back(2); });
+  BOOST_CHECK(granted.empty());
+  io_service.run();
+
+  BOOST_CHECK(granted == std::vector<int>({1, 2}));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
@@ -0,0 +1,147 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for RouteTable.
+#include "route_table.h"
+
+#include <string>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace thestral {
+
+namespace {
+Address MakeIpAddress(const std::string& host, uint16_t port) {
+  return Address::FromAsioEndpoint(boost::asio::ip::tcp::endpoint(
+      boost::asio::ip::address::from_string(host), port));
+}
+
+Address MakeDomainAddress(const std::string& host, uint16_t port) {
+  Address address;
+  address.type = AddressType::kDomainName;
+  address.host = host;
+  address.port = port;
+  return address;
+}
+}  // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(test_route_table);
+
+BOOST_AUTO_TEST_CASE(test_networks) {
+  RouteTable table;
+  BOOST_CHECK(table.AddNetworkRule("10.1.0.0/16", {}, 1));
+  BOOST_CHECK(table.AddNetworkRule("10.0.0.0/8", {}, RouteTable::kDeny));
+  BOOST_CHECK(table.AddNetworkRule("192.168.1.1", {}, 2));
+  BOOST_CHECK(table.AddNetworkRule("fd00::/8", {}, 3));
+  BOOST_CHECK(!table.AddNetworkRule("10.0.0.0/33", {}, 0));
+  BOOST_CHECK(!table.AddNetworkRule("example.com/8", {}, 0));
+  BOOST_CHECK(!table.AddNetworkRule("10.0.0.0/", {}, 0));
+
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("10.1.2.3", 80)), 1);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("10.2.3.4", 80)),
+                    RouteTable::kDeny);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("192.168.1.1", 80)), 2);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("192.168.1.2", 80)),
+                    RouteTable::kAllow);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("fd12::1", 80)), 3);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("fe80::1", 80)),
+                    RouteTable::kAllow);
+  // IPv4-mapped addresses are matched as IPv4 ones
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("::ffff:10.1.0.1", 80)), 1);
+  // networks never match domain names
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("10.1.0.1", 80)),
+                    RouteTable::kAllow);
+}
+
+BOOST_AUTO_TEST_CASE(test_resolved_addresses) {
+  RouteTable table;
+  table.AddDomainRule("allowed.example.com", {}, RouteTable::kAllow);
+  BOOST_CHECK(!table.HasNetworkRules());
+  BOOST_CHECK(table.AddNetworkRule("10.0.0.0/8", {}, RouteTable::kDeny));
+  BOOST_CHECK(table.HasNetworkRules());
+  table.AddDomainRule("example.com", {}, 1);
+
+  // the first rule matching the name or the address decides
+  auto internal = MakeIpAddress("10.1.2.3", 80);
+  auto external = MakeIpAddress("192.168.1.1", 80);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("example.com", 80)), 1);
+  BOOST_CHECK_EQUAL(
+      table.Lookup(MakeDomainAddress("example.com", 80), internal),
+      RouteTable::kDeny);
+  BOOST_CHECK_EQUAL(
+      table.Lookup(MakeDomainAddress("example.com", 80), external), 1);
+  BOOST_CHECK_EQUAL(
+      table.Lookup(MakeDomainAddress("allowed.example.com", 80), internal),
+      RouteTable::kAllow);
+  BOOST_CHECK_EQUAL(
+      table.Lookup(MakeDomainAddress("example.net", 80), internal),
+      RouteTable::kDeny);
+}
+
+BOOST_AUTO_TEST_CASE(test_domains) {
+  RouteTable table;
+  table.AddDomainRule("internal.example.com", {}, RouteTable::kAllow);
+  table.AddDomainRule(".example.com", {}, 1);
+  table.AddDomainRule("ads.example.net.", {}, RouteTable::kDeny);
+  table.SetDefault(0);
+
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("example.com", 80)), 1);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("WWW.Example.COM.", 80)),
+                    1);
+  BOOST_CHECK_EQUAL(
+      table.Lookup(MakeDomainAddress("a.internal.example.com", 80)),
+      RouteTable::kAllow);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("badexample.com", 80)), 0);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("com", 80)), 0);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("x.ads.example.net", 80)),
+                    RouteTable::kDeny);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("example.net", 80)), 0);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("", 80)), 0);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("127.0.0.1", 80)), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_first_match_and_ports) {
+  RouteTable table;
+  RouteTable::PortRange smtp;
+  smtp.first = smtp.last = 25;
+  RouteTable::PortRange high;
+  high.first = 8000;
+  high.last = 9000;
+  table.AddAnyRule(smtp, RouteTable::kDeny);
+  table.AddDomainRule("example.com", high, 1);
+  table.AddDomainRule("www.example.com", {}, 2);
+  BOOST_CHECK(table.AddNetworkRule("0.0.0.0/0", high, 3));
+  BOOST_CHECK_EQUAL(table.GetRuleCount(), 4);
+
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("www.example.com", 25)),
+                    RouteTable::kDeny);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("1.2.3.4", 25)),
+                    RouteTable::kDeny);
+  // the rule added earlier wins even if it is less specific
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("www.example.com", 8080)),
+                    1);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("www.example.com", 443)),
+                    2);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeDomainAddress("example.com", 443)),
+                    RouteTable::kAllow);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("1.2.3.4", 9000)), 3);
+  BOOST_CHECK_EQUAL(table.Lookup(MakeIpAddress("1.2.3.4", 9001)),
+                    RouteTable::kAllow);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
@@ -17,6 +17,7 @@
 #include "socks.h"
 
 #include <iterator>
+#include <vector>
 
 #include <boost/test/unit_test.hpp>
 
@@ -82,6 +83,27 @@ BOOST_AUTO_TEST_CASE(test_auth_method_list_write) {
   BOOST_CHECK_EQUAL(s, transport->write_buf);
 }
 
+BOOST_AUTO_TEST_CASE(test_auth_method_list_trace_id) {
+  AuthMethodList packet;
+  packet.methods.push_back(AuthMethod::kNoAuth);
+  packet.AddTraceId(0x0102030405060708);
+  std::string s{'\x05', '\x0a', '\x00', '\x88', '\x01', '\x02',
+                '\x03', '\x04', '\x05', '\x06', '\x07', '\x08'};
+  BOOST_CHECK_EQUAL(s, packet.Serialize());
+
+  BOOST_CHECK_EQUAL(0x0102030405060708, packet.TakeTraceId());
+  CHECK_SEQUENCES_EQUAL({AuthMethod::kNoAuth}, packet.methods);
+  BOOST_CHECK_EQUAL(0, packet.TakeTraceId());
+
+  // a client may offer 0x88 as a method of its own
+  packet.methods = {AuthMethod::kTraceId, AuthMethod::kNoAuth};
+  BOOST_CHECK_EQUAL(0, packet.TakeTraceId());
+  packet.AddTraceId(0x0102030405060708);
+  BOOST_CHECK_EQUAL(0x0102030405060708, packet.TakeTraceId());
+  std::vector<AuthMethod> expected{AuthMethod::kTraceId, AuthMethod::kNoAuth};
+  CHECK_SEQUENCES_EQUAL(expected, packet.methods);
+}
+
 BOOST_AUTO_TEST_CASE(test_socks_address_create) {
   std::string ipv4 = "\xab\xcd\xef\x12";
   std::string ipv6 =
@@ -177,6 +199,116 @@ BOOST_AUTO_TEST_CASE(test_socks_address_write) {
                     transport->write_buf);
 }
 
+BOOST_AUTO_TEST_CASE(test_socks_address_parse) {
+  std::string domain = "richardtsai.me";  // len = 14
+  std::string data = std::string("\x03\x0e") + domain + "\x34\x56";
+
+  SocksAddress packet;
+  std::size_t n_consumed = 0;
+  for (std::size_t size = 0; size < data.size(); ++size) {
+    BOOST_CHECK_EQUAL(ParseResult::kIncomplete,
+                      packet.ParseFrom(data.data(), size, &n_consumed));
+  }
+  data += "trailing";
+  BOOST_CHECK_EQUAL(ParseResult::kOk,
+                    packet.ParseFrom(data.data(), data.size(), &n_consumed));
+  BOOST_CHECK_EQUAL(domain.size() + 4, n_consumed);
+  BOOST_CHECK_EQUAL(AddressType::kDomainName, packet.type);
+  BOOST_CHECK_EQUAL(domain, packet.host);
+  BOOST_CHECK_EQUAL(13398, packet.port);
+
+  data = "\x02\x00\x00";
+  BOOST_CHECK_EQUAL(ParseResult::kInvalid,
+                    packet.ParseFrom(data.data(), data.size(), &n_consumed));
+}
+
+BOOST_AUTO_TEST_CASE(test_serialize_to) {
+  AuthMethodList auth_packet;
+  auth_packet.methods.push_back(AuthMethod::kNoAuth);
+  RequestPacket request_packet;
+  request_packet.body.type = AddressType::kDomainName;
+  request_packet.body.host = "a.b";
+  request_packet.body.port = 443;
+
+  // packets sent together are appended to the same buffer
+  std::string data("prefix");
+  auth_packet.SerializeTo(&data);
+  request_packet.SerializeTo(&data);
+  BOOST_CHECK_EQUAL(
+      "prefix" + auth_packet.Serialize() + request_packet.Serialize(), data);
+  BOOST_CHECK_EQUAL(std::string("\x05\x01\x00\x03\x03" "a.b\x01\xbb", 10),
+                    request_packet.Serialize());
+}
+
+BOOST_AUTO_TEST_CASE(test_gathered_write) {
+  // transports without writev() get the buffers copied into one write
+  std::string first("some data"), second(" some more data");
+  bool called = false;
+  transport->StartWrite(
+      {boost::asio::buffer(first), boost::asio::buffer(second)},
+      PACKET_CALLBACK(size_t) {
+        called = true;
+        BOOST_CHECK(!ec);
+        BOOST_CHECK_EQUAL(first.size() + second.size(), data);
+      });
+  RunAndReset();
+  BOOST_CHECK(called);
+  BOOST_CHECK_EQUAL(first + second, transport->write_buf);
+  BOOST_CHECK_EQUAL(1, transport->n_writes);
+}
+
+BOOST_AUTO_TEST_CASE(test_packet_reader_pipelined) {
+  // a greeting, a request and some payload arriving in a single read
+  transport->read_buf = std::string("\x05\x01\x00", 3) +
+                        std::string("\x05\x01\x00\x01\x7f\x00\x00\x01", 8) +
+                        "\x01\xbb" + "payload";
+  auto reader = PacketReader::New(transport);
+
+  bool called = false;
+  reader->StartReadPacket<AuthMethodList>(PACKET_CALLBACK(AuthMethodList) {
+    BOOST_CHECK(!ec);
+    CHECK_SEQUENCES_EQUAL({AuthMethod::kNoAuth}, data.methods);
+    reader->StartReadPacket<RequestPacket>(PACKET_CALLBACK(RequestPacket) {
+      called = true;
+      BOOST_CHECK(!ec);
+      BOOST_CHECK_EQUAL(Command::kConnect, data.header.command);
+      BOOST_CHECK_EQUAL(AddressType::kIPv4, data.body.type);
+      BOOST_CHECK_EQUAL(443, data.body.port);
+    });
+  });
+  RunAndReset();
+  BOOST_CHECK(called);
+  BOOST_CHECK(transport->read_buf.empty());
+  BOOST_CHECK_EQUAL("payload", reader->TakeBuffered());
+  BOOST_CHECK(reader->TakeBuffered().empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_packet_reader_errors) {
+  transport->read_buf = std::string("\x05\x01\x00\x05", 4);
+  auto reader = PacketReader::New(transport);
+
+  bool called = false;
+  reader->StartReadPacket<RequestPacket>(
+      [&](const ec_type& ec, RequestPacket) {
+        called = true;
+        BOOST_CHECK_EQUAL(boost::system::errc::protocol_error, ec);
+      });
+  RunAndReset();
+  BOOST_CHECK(called);
+
+  // the transport reaches EOF in the middle of a packet
+  transport->read_buf = std::string("\x05\x02\x00", 3);
+  reader = PacketReader::New(transport);
+  called = false;
+  reader->StartReadPacket<AuthMethodList>(
+      [&](const ec_type& ec, AuthMethodList) {
+        called = true;
+        BOOST_CHECK_EQUAL(boost::asio::error::eof, ec);
+      });
+  RunAndReset();
+  BOOST_CHECK(called);
+}
+
 }  // namespace socks
 }  // namespace thestral
 
@@ -16,8 +16,14 @@
 /// Tests for SOCKS server.
 #include "socks_server.h"
 
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <boost/test/unit_test.hpp>
 
+#include "direct_upstream.h"
 #include "mocks.h"
 #include "socks.h"
 
@@ -68,6 +74,8 @@ BOOST_AUTO_TEST_CASE(test_request) {
 
   BOOST_CHECK_EQUAL(p2.Serialize() + p4.Serialize() + data_to_downstream,
                     downstream_transport->write_buf);
+  // the request was pipelined, so both replies are sent in one write
+  BOOST_CHECK_EQUAL(2, downstream_transport->n_writes);
   BOOST_CHECK_EQUAL(data_to_upstream, upstream_transport->write_buf);
   BOOST_CHECK_EQUAL(p3.body, upstream_factory->PopAddress());
   auto listened_addr = downstream_transport_factory->PopEndpoint();
@@ -75,6 +83,54 @@ BOOST_AUTO_TEST_CASE(test_request) {
   BOOST_CHECK_EQUAL(19278, listened_addr.port());
 }
 
+BOOST_AUTO_TEST_CASE(test_routes) {
+  AuthMethodList auth_request;
+  auth_request.methods.push_back(AuthMethod::kNoAuth);
+  AuthMethodSelectPacket auth_reply;
+  auth_reply.method = AuthMethod::kNoAuth;
+
+  RequestPacket denied_request;
+  denied_request.header.command = Command::kConnect;
+  denied_request.body.type = AddressType::kDomainName;
+  denied_request.body.host = "ads.example.com";
+  denied_request.body.port = 80;
+  RequestPacket routed_request = denied_request;
+  routed_request.body.host = "www.example.com";
+  ResponsePacket denied_response;
+  denied_response.header.response_code = ResponseCode::kConnectionNotAllow;
+  ResponsePacket routed_response;
+  routed_response.header.response_code = ResponseCode::kSuccess;
+
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto downstream_transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto denied_downstream = downstream_transport_factory->NewMockTransport(
+      auth_request.Serialize() + denied_request.Serialize());
+  auto routed_downstream = downstream_transport_factory->NewMockTransport(
+      auth_request.Serialize() + routed_request.Serialize());
+
+  auto default_upstream =
+      std::make_shared<testing::MockUpstreamFactory>(io_service);
+  auto routed_upstream =
+      std::make_shared<testing::MockUpstreamFactory>(io_service);
+  routed_upstream->NewMockTransport()->local_address = routed_response.body;
+
+  auto routes = std::make_shared<RouteTable>();
+  routes->AddDomainRule("ads.example.com", {}, RouteTable::kDeny);
+  routes->AddDomainRule("example.com", {}, 0);
+  auto socks_server = SocksTcpServer::New(
+      "127.0.0.1", 19280, downstream_transport_factory, default_upstream);
+  socks_server->SetRoutes(routes, {routed_upstream});
+  socks_server->Start();
+  io_service->run();
+
+  BOOST_CHECK_EQUAL(auth_reply.Serialize() + denied_response.Serialize(),
+                    denied_downstream->write_buf);
+  BOOST_CHECK_EQUAL(auth_reply.Serialize() + routed_response.Serialize(),
+                    routed_downstream->write_buf);
+  BOOST_CHECK_EQUAL(routed_request.body, routed_upstream->PopAddress());
+}
+
 BOOST_AUTO_TEST_CASE(test_continue_accepting_on_error) {
   auto io_service = std::make_shared<boost::asio::io_service>();
 
@@ -96,6 +152,247 @@ BOOST_AUTO_TEST_CASE(test_continue_accepting_on_error) {
   BOOST_CHECK_EQUAL(0, downstream_transport_factory->GetTransports().size());
 }
 
+BOOST_AUTO_TEST_CASE(test_handshake_timeout) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto upstream_factory =
+      std::make_shared<testing::MockUpstreamFactory>(io_service);
+  auto socks_server = SocksTcpServer::New(
+      "127.0.0.1", 51901, TcpTransportFactory::New(io_service),
+      upstream_factory);
+  socks_server->SetHandshakeTimeout(std::chrono::milliseconds(200));
+  socks_server->Start();
+  // a multiplexed session times out before its preface
+  auto mux_server = SocksTcpServer::New(
+      "127.0.0.1", 51916, TcpTransportFactory::New(io_service),
+      upstream_factory);
+  mux_server->SetMultiplexing(true);
+  mux_server->SetHandshakeTimeout(std::chrono::milliseconds(200));
+  mux_server->Start();
+  std::thread thread([io_service]() { io_service->run(); });
+
+  // clients that never send anything
+  boost::asio::io_service client_service;
+  for (uint16_t port : {51901, 51916}) {
+    boost::asio::ip::tcp::socket s(client_service);
+    s.connect(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string("127.0.0.1"), port));
+    auto start = std::chrono::steady_clock::now();
+    char buf[1];
+    ec_type ec;
+    s.read_some(boost::asio::buffer(buf), ec);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    BOOST_CHECK(ec == boost::asio::error::eof ||
+                ec == boost::asio::error::connection_reset);
+    BOOST_CHECK(elapsed >= std::chrono::milliseconds(200));
+    BOOST_CHECK(elapsed < std::chrono::seconds(2));
+  }
+
+  io_service->stop();
+  thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(test_half_close) {
+  namespace ip = boost::asio::ip;
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory = TcpTransportFactory::New(io_service);
+  auto socks_server =
+      SocksTcpServer::New("127.0.0.1", 51902, transport_factory,
+                          DirectTcpUpstreamFactory::New(transport_factory));
+  socks_server->Start();
+  std::thread thread([io_service]() { io_service->run(); });
+
+  // a target answering only after the client has finished sending
+  boost::asio::io_service target_service;
+  ip::tcp::acceptor acceptor(
+      target_service,
+      ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), 51903));
+  std::thread target_thread([&acceptor, &target_service]() {
+    ip::tcp::socket s(target_service);
+    acceptor.accept(s);
+    std::string received;
+    char buf[64];
+    ec_type ec;
+    while (!ec) {
+      auto n = s.read_some(boost::asio::buffer(buf), ec);
+      received.append(buf, n);
+    }
+    boost::asio::write(s, boost::asio::buffer("got " + received));
+  });
+
+  boost::asio::io_service client_service;
+  ip::tcp::socket s(client_service);
+  s.connect(ip::tcp::endpoint(ip::address::from_string("127.0.0.1"), 51902));
+  // auth request and a request to 127.0.0.1:51903
+  const unsigned char request[] = {5, 1, 0, 5, 1, 0, 1,
+                                   127, 0, 0, 1, 0xCA, 0xBF};
+  boost::asio::write(s, boost::asio::buffer(request));
+  char replies[12];
+  boost::asio::read(s, boost::asio::buffer(replies));
+  BOOST_CHECK_EQUAL(replies[3], 0);  // kSuccess
+
+  boost::asio::write(s, boost::asio::buffer(std::string("hello")));
+  s.shutdown(ip::tcp::socket::shutdown_send);
+  std::string response;
+  char buf[64];
+  ec_type ec;
+  while (!ec) {
+    auto n = s.read_some(boost::asio::buffer(buf), ec);
+    response.append(buf, n);
+  }
+  BOOST_CHECK(ec == boost::asio::error::eof);
+  BOOST_CHECK_EQUAL(response, "got hello");
+
+  target_thread.join();
+  io_service->stop();
+  thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(test_udp_associate) {
+  namespace ip = boost::asio::ip;
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory = TcpTransportFactory::New(io_service);
+  auto socks_server =
+      SocksTcpServer::New("127.0.0.1", 51906, transport_factory,
+                          DirectTcpUpstreamFactory::New(transport_factory));
+  socks_server->SetUdpAssociate(true);
+  socks_server->Start();
+  std::thread thread([io_service]() { io_service->run(); });
+
+  auto localhost = ip::address::from_string("127.0.0.1");
+  boost::asio::io_service client_service;
+  ip::udp::socket target(client_service, ip::udp::endpoint(localhost, 51907));
+  ip::udp::socket client(client_service, ip::udp::endpoint(localhost, 0));
+
+  ip::tcp::socket s(client_service);
+  s.connect(ip::tcp::endpoint(localhost, 51906));
+  // auth request and a UDP ASSOCIATE request from an unknown address
+  const unsigned char request[] = {5, 1, 0, 5, 3, 0, 1, 0, 0, 0, 0, 0, 0};
+  boost::asio::write(s, boost::asio::buffer(request));
+  unsigned char replies[12];
+  boost::asio::read(s, boost::asio::buffer(replies));
+  BOOST_CHECK_EQUAL(replies[3], 0);  // kSuccess
+  auto relay_port = static_cast<uint16_t>(replies[10] << 8 | replies[11]);
+  ip::udp::endpoint relay(localhost, relay_port);
+
+  // to 127.0.0.1:51907
+  client.send_to(boost::asio::buffer(
+                     std::string("\0\0\0\x01\x7f\0\0\x01\xca\xc3ping", 14)),
+                 relay);
+  char buf[64];
+  ip::udp::endpoint source;
+  auto n = target.receive_from(boost::asio::buffer(buf), source);
+  BOOST_CHECK_EQUAL(std::string(buf, n), "ping");
+  target.send_to(boost::asio::buffer(std::string("pong")), source);
+  n = client.receive(boost::asio::buffer(buf));
+  BOOST_CHECK_EQUAL(std::string(buf, n),
+                    std::string("\0\0\0\x01\x7f\0\0\x01\xca\xc3pong", 14));
+
+  // the association goes away along with the control connection
+  s.close();
+  client.connect(relay);
+  client.non_blocking(true);
+  ec_type ec;
+  for (int i = 0; i < 50 && ec != boost::asio::error::connection_refused;
+       ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    client.send(boost::asio::buffer(std::string("ping")), 0, ec);
+    if (!ec) {
+      client.receive(boost::asio::buffer(buf), 0, ec);
+    }
+  }
+  BOOST_CHECK(ec == boost::asio::error::connection_refused);
+
+  io_service->stop();
+  thread.join();
+}
+
+BOOST_AUTO_TEST_CASE(test_udp_associate_indirect_upstream) {
+  AuthMethodList auth_request;
+  auth_request.methods.push_back(AuthMethod::kNoAuth);
+  AuthMethodSelectPacket auth_reply;
+  auth_reply.method = AuthMethod::kNoAuth;
+  RequestPacket request;
+  request.header.command = Command::kUdpAssociate;
+  request.body.type = AddressType::kIPv4;
+  request.body.host = AddressHost(4, '\0');
+  request.body.port = 0;
+  ResponsePacket response;
+  response.header.response_code = ResponseCode::kCommandNotSupported;
+
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto downstream_transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto downstream = downstream_transport_factory->NewMockTransport(
+      auth_request.Serialize() + request.Serialize());
+  auto upstream_factory =
+      std::make_shared<testing::MockUpstreamFactory>(io_service);
+
+  // the datagrams would bypass the upstream, a chained proxy for all we know
+  auto socks_server = SocksTcpServer::New(
+      "127.0.0.1", 19281, downstream_transport_factory, upstream_factory);
+  socks_server->SetUdpAssociate(true);
+  socks_server->Start();
+  io_service->run();
+
+  BOOST_CHECK_EQUAL(auth_reply.Serialize() + response.Serialize(),
+                    downstream->write_buf);
+}
+
+BOOST_AUTO_TEST_CASE(test_udp_associate_policies) {
+  namespace ip = boost::asio::ip;
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory = TcpTransportFactory::New(io_service);
+  auto socks_server =
+      SocksTcpServer::New("127.0.0.1", 51912, transport_factory,
+                          DirectTcpUpstreamFactory::New(transport_factory));
+  auto routes = std::make_shared<RouteTable>();
+  RouteTable::PortRange denied_port;
+  denied_port.first = denied_port.last = 51914;
+  routes->AddNetworkRule("127.0.0.1", denied_port, RouteTable::kDeny);
+  socks_server->SetRoutes(routes, {});
+  // the first datagram takes a whole burst of tokens and more
+  socks_server->SetRateLimiter(std::make_shared<RateLimiter>(1, 0, nullptr));
+  socks_server->SetUdpAssociate(true);
+  socks_server->Start();
+  std::thread thread([io_service]() { io_service->run(); });
+
+  auto localhost = ip::address::from_string("127.0.0.1");
+  boost::asio::io_service client_service;
+  ip::udp::socket target(client_service, ip::udp::endpoint(localhost, 51913));
+  ip::udp::socket denied(client_service, ip::udp::endpoint(localhost, 51914));
+  ip::udp::socket client(client_service, ip::udp::endpoint(localhost, 0));
+
+  ip::tcp::socket s(client_service);
+  s.connect(ip::tcp::endpoint(localhost, 51912));
+  const unsigned char request[] = {5, 1, 0, 5, 3, 0, 1, 0, 0, 0, 0, 0, 0};
+  boost::asio::write(s, boost::asio::buffer(request));
+  unsigned char replies[12];
+  boost::asio::read(s, boost::asio::buffer(replies));
+  BOOST_CHECK_EQUAL(replies[3], 0);  // kSuccess
+  auto relay_port = static_cast<uint16_t>(replies[10] << 8 | replies[11]);
+  ip::udp::endpoint relay(localhost, relay_port);
+
+  // to 127.0.0.1:51914, then to 127.0.0.1:51913 twice
+  const std::string denied_header("\0\0\0\x01\x7f\0\0\x01\xca\xca", 10);
+  const std::string target_header("\0\0\0\x01\x7f\0\0\x01\xca\xc9", 10);
+  std::string burst(TokenBucket::kMinBurst + 1, 'x');
+  client.send_to(boost::asio::buffer(denied_header + "ping"), relay);
+  client.send_to(boost::asio::buffer(target_header + burst), relay);
+  client.send_to(boost::asio::buffer(target_header + "ping"), relay);
+  std::vector<char> buf(burst.size() + 1);
+  auto n = target.receive(boost::asio::buffer(buf));
+  BOOST_CHECK_EQUAL(n, burst.size());
+
+  // neither the denied datagram nor the one over the limit is sent
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  BOOST_CHECK_EQUAL(target.available(), 0);
+  BOOST_CHECK_EQUAL(denied.available(), 0);
+
+  s.close();
+  io_service->stop();
+  thread.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 }  // namespace socks
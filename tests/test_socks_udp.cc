@@ -0,0 +1,86 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the SOCKS UDP header handling in socks_udp.h.
+#include "socks_udp.h"
+
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+namespace thestral {
+namespace socks {
+
+namespace ip = boost::asio::ip;
+
+BOOST_AUTO_TEST_SUITE(test_socks_udp);
+
+BOOST_AUTO_TEST_CASE(test_parse_header) {
+  std::string datagram("\0\0\0\x01\x7f\0\0\x01\x04\xd2payload", 17);
+  UdpHeaderView header;
+  BOOST_REQUIRE(ParseUdpHeader(datagram.data(), datagram.size(), &header) ==
+                ParseResult::kOk);
+  BOOST_CHECK(header.type == AddressType::kIPv4);
+  BOOST_CHECK_EQUAL(std::string(header.host, header.host_size),
+                    std::string("\x7f\0\0\x01", 4));
+  BOOST_CHECK_EQUAL(header.port, 1234);
+  BOOST_CHECK_EQUAL(datagram.substr(header.size), "payload");
+
+  datagram.assign("\0\0\x01\x03\x0erichardtsai.me\x01\xbb", 21);
+  BOOST_REQUIRE(ParseUdpHeader(datagram.data(), datagram.size(), &header) ==
+                ParseResult::kOk);
+  BOOST_CHECK_EQUAL(header.fragment, 1);
+  BOOST_CHECK(header.type == AddressType::kDomainName);
+  BOOST_CHECK_EQUAL(std::string(header.host, header.host_size),
+                    "richardtsai.me");
+  BOOST_CHECK_EQUAL(header.port, 443);
+  BOOST_CHECK_EQUAL(header.size, datagram.size());
+
+  BOOST_CHECK(ParseUdpHeader(datagram.data(), 10, &header) ==
+              ParseResult::kIncomplete);
+  datagram[3] = '\x05';
+  BOOST_CHECK(ParseUdpHeader(datagram.data(), datagram.size(), &header) ==
+              ParseResult::kInvalid);
+}
+
+BOOST_AUTO_TEST_CASE(test_write_header) {
+  char data[kMaxUdpHeaderSize];
+  auto size = WriteUdpHeader(
+      ip::udp::endpoint(ip::address::from_string("127.0.0.1"), 1234), data);
+  BOOST_CHECK_EQUAL(std::string(data, size),
+                    std::string("\0\0\0\x01\x7f\0\0\x01\x04\xd2", 10));
+
+  size = WriteUdpHeader(
+      ip::udp::endpoint(ip::address::from_string("::1"), 443), data);
+  BOOST_REQUIRE_EQUAL(size, kMaxUdpHeaderSize);
+  UdpHeaderView header;
+  BOOST_REQUIRE(ParseUdpHeader(data, size, &header) == ParseResult::kOk);
+  BOOST_CHECK(header.type == AddressType::kIPv6);
+  BOOST_CHECK_EQUAL(header.port, 443);
+}
+
+BOOST_AUTO_TEST_CASE(test_to_ip_address) {
+  auto address = Address::FromAsioEndpoint(
+      ip::udp::endpoint(ip::address::from_string("::ffff:10.0.0.1"), 0));
+  BOOST_CHECK_EQUAL(ToIpAddress(address).to_string(), "10.0.0.1");
+  address.type = AddressType::kDomainName;
+  address.host = "richardtsai.me";
+  BOOST_CHECK(ToIpAddress(address).is_unspecified());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace socks
+}  // namespace thestral
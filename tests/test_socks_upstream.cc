@@ -17,6 +17,7 @@
 #include "socks_upstream.h"
 
 #include <array>
+#include <chrono>
 #include <memory>
 #include <vector>
 
@@ -110,6 +111,241 @@ BOOST_AUTO_TEST_CASE(test_request) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_fast_chaining) {
+  AuthMethodList p1;
+  p1.methods.push_back(AuthMethod::kNoAuth);
+
+  AuthMethodSelectPacket p2;
+  p2.method = AuthMethod::kNoAuth;
+
+  RequestPacket p3;
+  p3.header.command = Command::kConnect;
+  p3.body.type = AddressType::kDomainName;
+  p3.body.host = "richardtsai.me";
+  p3.body.port = 54321;
+
+  ResponsePacket p4;
+  p4.header.response_code = ResponseCode::kSuccess;
+  p4.body.type = AddressType::kIPv4;
+  p4.body.host = "\xab\xcd\xef\x12";
+  p4.body.port = 12345;
+
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto upstream =
+      SocksTcpUpstreamFactory::New(transport_factory, "127.0.0.1", 57820);
+  upstream->SetFastChaining(true);
+
+  auto mock_transport = transport_factory->NewMockTransport(
+      p2.Serialize() + p4.Serialize() + "remaining");
+  bool called = false;
+  upstream->StartRequest(
+      p3.body,
+      [&](const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+        called = true;
+        BOOST_CHECK(!ec);
+        BOOST_CHECK_EQUAL(Address(p4.body), transport->GetLocalAddress());
+      });
+  io_service->run();
+
+  BOOST_CHECK(called);
+  BOOST_CHECK_EQUAL(p1.Serialize() + p3.Serialize(), mock_transport->write_buf);
+  BOOST_CHECK_EQUAL(1, mock_transport->n_writes);
+  // the replies are read exactly, leaving the relayed data untouched
+  BOOST_CHECK_EQUAL("remaining", mock_transport->read_buf);
+}
+
+BOOST_AUTO_TEST_CASE(test_unsupported_auth_method) {
+  AuthMethodSelectPacket p2;
+  p2.method = AuthMethod::kNotSupported;
+
+  Address target;
+  target.type = AddressType::kDomainName;
+  target.host = "richardtsai.me";
+  target.port = 54321;
+
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto upstream =
+      SocksTcpUpstreamFactory::New(transport_factory, "127.0.0.1", 57824);
+  transport_factory->NewMockTransport(p2.Serialize());
+
+  bool called = false;
+  upstream->StartRequest(
+      target,
+      [&](const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+        called = true;
+        BOOST_CHECK(ec);
+        BOOST_CHECK(!transport);
+      });
+  io_service->run();
+
+  BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_CASE(test_connect_error) {
+  AuthMethodSelectPacket p2;
+  p2.method = AuthMethod::kNoAuth;
+
+  Address target;
+  target.type = AddressType::kDomainName;
+  target.host = "richardtsai.me";
+  target.port = 54321;
+
+  ResponsePacket p4;
+  p4.header.response_code = ResponseCode::kSuccess;
+  p4.body.type = AddressType::kIPv4;
+  p4.body.host = "\xab\xcd\xef\x12";
+  p4.body.port = 12345;
+
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto upstream =
+      SocksTcpUpstreamFactory::New(transport_factory, "127.0.0.1", 57821);
+  transport_factory->NewMockTransport(
+      "", boost::asio::error::make_error_code(
+              boost::asio::error::connection_refused));
+  transport_factory->NewMockTransport(p2.Serialize() + p4.Serialize());
+
+  // both requests wait for the same resolution, the first connection fails
+  int n_failed = 0;
+  int n_succeeded = 0;
+  auto callback = [&](const ec_type& ec,
+                      const std::shared_ptr<TransportBase>& transport) {
+    if (ec) {
+      BOOST_CHECK(!transport);
+      ++n_failed;
+    } else {
+      BOOST_CHECK(transport);
+      ++n_succeeded;
+    }
+  };
+  upstream->StartRequest(target, callback);
+  upstream->StartRequest(target, callback);
+  io_service->run();
+
+  BOOST_CHECK_EQUAL(1, n_failed);
+  BOOST_CHECK_EQUAL(1, n_succeeded);
+}
+
+BOOST_AUTO_TEST_CASE(test_connect_failover) {
+  AuthMethodSelectPacket p2;
+  p2.method = AuthMethod::kNoAuth;
+
+  Address target;
+  target.type = AddressType::kDomainName;
+  target.host = "richardtsai.me";
+  target.port = 54321;
+
+  ResponsePacket p4;
+  p4.header.response_code = ResponseCode::kSuccess;
+  p4.body.type = AddressType::kIPv4;
+  p4.body.host = "\xab\xcd\xef\x12";
+  p4.body.port = 12345;
+
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto upstream =
+      SocksTcpUpstreamFactory::New(transport_factory, "upstream", 57821);
+  boost::asio::ip::tcp::endpoint first(
+      boost::asio::ip::address::from_string("127.0.0.2"), 57821);
+  boost::asio::ip::tcp::endpoint second(
+      boost::asio::ip::address::from_string("127.0.0.3"), 57821);
+  testing::TestSocksTcpUpstreamFactory::SetUpstreamEndpoints(
+      upstream, {first, second});
+
+  // the first endpoint refuses, the second accepts
+  transport_factory->NewMockTransport(
+      "", boost::asio::error::make_error_code(
+              boost::asio::error::connection_refused));
+  transport_factory->NewMockTransport(p2.Serialize() + p4.Serialize());
+  bool succeeded = false;
+  upstream->StartRequest(
+      target,
+      [&](const ec_type& ec, const std::shared_ptr<TransportBase>& transport) {
+        BOOST_CHECK(!ec);
+        BOOST_CHECK(transport);
+        succeeded = !ec;
+      });
+  io_service->run();
+  BOOST_CHECK(succeeded);
+  BOOST_CHECK_EQUAL(first, transport_factory->PopEndpoint());
+  BOOST_CHECK_EQUAL(second, transport_factory->PopEndpoint());
+
+  // the next request goes to the endpoint that accepted first
+  io_service->reset();
+  transport_factory->NewMockTransport(p2.Serialize() + p4.Serialize());
+  succeeded = false;
+  upstream->StartRequest(
+      target,
+      [&](const ec_type& ec, const std::shared_ptr<TransportBase>&) {
+        succeeded = !ec;
+      });
+  io_service->run();
+  BOOST_CHECK(succeeded);
+  BOOST_CHECK_EQUAL(second, transport_factory->PopEndpoint());
+}
+
+BOOST_AUTO_TEST_CASE(test_stale_pooled_connection) {
+  AuthMethodSelectPacket p2;
+  p2.method = AuthMethod::kNoAuth;
+
+  Address target;
+  target.type = AddressType::kDomainName;
+  target.host = "richardtsai.me";
+  target.port = 54321;
+
+  ResponsePacket p4;
+  p4.header.response_code = ResponseCode::kSuccess;
+  p4.body.type = AddressType::kIPv4;
+  p4.body.host = "\xab\xcd\xef\x12";
+  p4.body.port = 12345;
+
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto transport_factory =
+      std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto upstream =
+      SocksTcpUpstreamFactory::New(transport_factory, "upstream", 57821);
+  testing::TestSocksTcpUpstreamFactory::SetUpstreamEndpoints(
+      upstream, {boost::asio::ip::tcp::endpoint(
+                    boost::asio::ip::address::from_string("127.0.0.2"),
+                    57821)});
+  upstream->SetPool(1, std::chrono::minutes(1));
+
+  // the pool fills itself with a connection the upstream has given up on
+  // while the first request connects by itself
+  auto stale = transport_factory->NewMockTransport();
+  transport_factory->NewMockTransport(p2.Serialize() + p4.Serialize());
+  int n_called = 0;
+  auto callback = [&](const ec_type& ec,
+                      const std::shared_ptr<TransportBase>& transport) {
+    BOOST_CHECK(!ec);
+    BOOST_CHECK(transport);
+    ++n_called;
+  };
+  // the pool keeps the io_service busy with its expiry timer
+  upstream->StartRequest(target, callback);
+  while (n_called < 1) {
+    io_service->run_one();
+  }
+
+  // the second request takes the stale connection and retries on a new one,
+  // after the one refilling the pool
+  transport_factory->NewMockTransport();
+  auto fresh =
+      transport_factory->NewMockTransport(p2.Serialize() + p4.Serialize());
+  upstream->StartRequest(target, callback);
+  while (n_called < 2) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(stale->closed);
+  BOOST_CHECK(!fresh->write_buf.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 }  // namespace socks
@@ -0,0 +1,129 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the splice relay.
+#include "splice_relay.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "mocks.h"
+#include "tcp_transport.h"
+
+#define TRANSPORT_CALLBACK(...)    \
+  [__VA_ARGS__](const ec_type& ec, \
+                const std::shared_ptr<TransportBase>& transport)
+#define BYTES_CALLBACK(...) [__VA_ARGS__](const ec_type& ec, size_t n_bytes)
+
+namespace thestral {
+
+BOOST_AUTO_TEST_SUITE(test_splice_relay);
+
+BOOST_AUTO_TEST_CASE(test_not_applicable) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto from = testing::MockTransport::New(io_service);
+  auto to = testing::MockTransport::New(io_service);
+  BOOST_CHECK(!SpliceRelay::IsApplicable(from, to));
+
+  ec_type ec;
+  BOOST_CHECK(!SpliceRelay::New(from, to, io_service, ec));
+  BOOST_CHECK(ec);
+}
+
+#if defined(THESTRAL_HAVE_SPLICE)
+BOOST_AUTO_TEST_CASE(test_relay) {
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 47929);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = TcpTransportFactory::New(io_service);
+
+  // large enough to fill up the intermediate pipe several times
+  std::string data;
+  for (int i = 0; data.size() < 1024 * 1024; ++i) {
+    data += std::to_string(i);
+  }
+  std::vector<char> read_buf(data.size() + 1);
+
+  std::vector<std::shared_ptr<TransportBase>> accepted;
+  std::shared_ptr<TransportBase> receiver;
+  ec_type relay_ec;
+  bool relay_done = false;
+  bool read_done = false;
+
+  factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    accepted.push_back(transport);
+    if (accepted.size() == 1) {
+      // the first accepted connection is the sender, now connect the receiver
+      factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+        BOOST_REQUIRE(!ec);
+        receiver = transport;
+        receiver->StartRead(&read_buf[0], data.size(), BYTES_CALLBACK(&) {
+          BOOST_CHECK(!ec);
+          BOOST_CHECK_EQUAL(data.size(), n_bytes);
+          BOOST_CHECK(std::string(read_buf.data(), n_bytes) == data);
+          // the relay should close the connection after the sender's EOF
+          receiver->StartRead(&read_buf[0], 1, [&](const ec_type& ec, size_t) {
+            BOOST_CHECK_EQUAL(boost::asio::error::eof, ec);
+            read_done = true;
+            receiver->StartClose();
+          });
+        });
+      });
+      return true;
+    }
+
+    BOOST_REQUIRE(SpliceRelay::IsApplicable(accepted[0], accepted[1]));
+    ec_type error_code;
+    auto relay =
+        SpliceRelay::New(accepted[0], accepted[1], io_service, error_code);
+    BOOST_REQUIRE(relay);
+    BOOST_CHECK(!error_code);
+    relay->Start([&](const ec_type& ec) {
+      relay_ec = ec;
+      relay_done = true;
+      accepted[0]->StartClose();
+      accepted[1]->StartClose();
+    });
+    return false;
+  });
+
+  std::shared_ptr<TransportBase> sender;
+  factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    sender = transport;
+    sender->StartWrite(data, BYTES_CALLBACK(&) {
+      BOOST_CHECK(!ec);
+      BOOST_CHECK_EQUAL(data.size(), n_bytes);
+      auto tcp_sender = std::static_pointer_cast<TcpTransport>(sender);
+      tcp_sender->GetUnderlyingSocket().shutdown(
+          boost::asio::ip::tcp::socket::shutdown_send);
+    });
+  });
+
+  io_service->run();
+  BOOST_CHECK(relay_done);
+  BOOST_CHECK_EQUAL(boost::asio::error::eof, relay_ec);
+  BOOST_CHECK(read_done);
+}
+#endif  // defined(THESTRAL_HAVE_SPLICE)
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
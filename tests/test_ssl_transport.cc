@@ -16,12 +16,20 @@
 /// Tests for SSL transport.
 #include "ssl.h"
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include "splice_relay.h"
 #include "tcp_transport.h"
 
 #define TRANSPORT_CALLBACK(...)    \
@@ -84,7 +92,12 @@ BOOST_AUTO_TEST_CASE(test_ssl_transport) {
           read_buf->at(n_bytes) = '\0';
           BOOST_CHECK_EQUAL(data_to_server, read_buf->data());
 
-          transport->StartWrite(data_to_client, BYTES_CALLBACK(&, transport) {
+          // gathered into one record
+          TransportBase::ConstBufferSequence buffers{
+              boost::asio::buffer(data_to_client.data(), 5),
+              boost::asio::buffer(data_to_client.data() + 5,
+                                  data_to_client.size() - 5)};
+          transport->StartWrite(buffers, BYTES_CALLBACK(&, transport) {
             BOOST_CHECK(!ec);
             BOOST_CHECK_EQUAL(data_to_client.size(), n_bytes);
 
@@ -190,6 +203,378 @@ BOOST_AUTO_TEST_CASE(test_verify_host) {
   BOOST_CHECK(client_called);
 }
 
+BOOST_AUTO_TEST_CASE(test_session_resumption) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto server_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.server.pem")
+                                      .LoadPrivateKey("test.server.key.pem")
+                                      .LoadDhParams("dh2048.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetTicketKeyRotation(
+                                          std::chrono::seconds(3600))
+                                      .Build(io_service);
+  auto client_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.pem")
+                                      .LoadPrivateKey("test.key.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetVerifyHost("127.0.0.1")
+                                      .SetSessionCache(true)
+                                      .Build(io_service);
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 51896);
+
+  std::string data = "data to client";
+  int n_accepted = 0;
+  server_transport_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    transport->StartWrite(data, [transport](const ec_type& ec, size_t) {
+      BOOST_CHECK(!ec);
+    });
+    return ++n_accepted < 2;
+  });
+
+  std::vector<bool> reused;
+  std::function<void()> connect = [&]() {
+    client_transport_factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+      BOOST_REQUIRE(!ec);
+      reused.push_back(
+          std::static_pointer_cast<impl::SslTransportImpl>(transport)
+              ->IsSessionReused());
+      // the session ticket of TLS 1.3 arrives after the handshake
+      auto read_buf = std::make_shared<std::array<char, 64>>();
+      transport->StartRead(
+          *read_buf, data.size(), BYTES_CALLBACK(&, read_buf, transport) {
+            BOOST_CHECK(!ec);
+            BOOST_CHECK_EQUAL(data.size(), n_bytes);
+            transport->StartClose();
+            if (reused.size() < 2) {
+              connect();
+            }
+          });
+    });
+  };
+  connect();
+  io_service->run();
+
+  BOOST_REQUIRE_EQUAL(2, reused.size());
+  BOOST_CHECK(!reused[0]);
+  BOOST_CHECK(reused[1]);
+}
+
+BOOST_AUTO_TEST_CASE(test_kernel_tls) {
+  // works whether or not the kernel takes over the records
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto server_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.server.pem")
+                                      .LoadPrivateKey("test.server.key.pem")
+                                      .LoadDhParams("dh2048.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetKernelTls(true)
+                                      .Build(io_service);
+  auto client_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.pem")
+                                      .LoadPrivateKey("test.key.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetVerifyHost("127.0.0.1")
+                                      .SetKernelTls(true)
+                                      .Build(io_service);
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 51897);
+
+  // larger than a record, so that reads and writes take several rounds
+  std::string data;
+  for (int i = 0; data.size() < 0x40000; ++i) {
+    data += std::to_string(i);
+  }
+
+  auto server_buf = std::make_shared<std::vector<char>>(data.size());
+  server_transport_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    auto ssl_transport =
+        std::static_pointer_cast<impl::SslTransportImpl>(transport);
+    BOOST_CHECK_EQUAL(ssl_transport->IsKernelTlsSendActive(),
+                      ssl_transport->IsPlainForWriting());
+    transport->StartRead(
+        boost::asio::buffer(*server_buf), BYTES_CALLBACK(&, transport) {
+          BOOST_REQUIRE(!ec);
+          BOOST_CHECK_EQUAL(data.size(), n_bytes);
+          transport->StartWrite(boost::asio::buffer(*server_buf),
+                                [transport](const ec_type& ec, size_t) {
+                                  BOOST_CHECK(!ec);
+                                  transport->StartClose();
+                                });
+        });
+    return false;
+  });
+
+  bool echoed = false;
+  auto client_buf = std::make_shared<std::vector<char>>(data.size());
+  client_transport_factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    auto ssl_transport =
+        std::static_pointer_cast<impl::SslTransportImpl>(transport);
+    BOOST_CHECK_EQUAL(ssl_transport->IsKernelTlsSendActive() &&
+                          ssl_transport->IsKernelTlsReceiveActive(),
+                      SpliceRelay::IsApplicable(transport, transport));
+    transport->StartWrite(data, [&, transport](const ec_type& ec, size_t) {
+      BOOST_REQUIRE(!ec);
+      transport->StartRead(
+          boost::asio::buffer(*client_buf), BYTES_CALLBACK(&, transport) {
+            BOOST_CHECK(!ec);
+            BOOST_CHECK_EQUAL(data.size(), n_bytes);
+            echoed = std::equal(data.cbegin(), data.cend(),
+                                client_buf->cbegin());
+            transport->StartClose();
+          });
+    });
+  });
+  io_service->run();
+
+  BOOST_CHECK(echoed);
+}
+
+BOOST_AUTO_TEST_CASE(test_cipher_suites) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto server_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.server.pem")
+                                      .LoadPrivateKey("test.server.key.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetMinProtocolVersion(TLS1_3_VERSION)
+                                      .SetCipherSuites(
+                                          "TLS_CHACHA20_POLY1305_SHA256")
+                                      .SetGroups("X25519:P-256")
+                                      .Build(io_service);
+  auto make_client_transport_factory = [&](const std::string& suites) {
+    return SslTransportFactoryBuilder()
+        .LoadCaFile("ca.pem")
+        .LoadCertChain("test.pem")
+        .LoadPrivateKey("test.key.pem")
+        .SetVerifyPeer(true)
+        .SetVerifyHost("127.0.0.1")
+        .SetMinProtocolVersion(TLS1_3_VERSION)
+        .SetCipherSuites(suites)
+        .Build(io_service);
+  };
+  auto mismatched_factory =
+      make_client_transport_factory("TLS_AES_128_GCM_SHA256");
+  auto matched_factory = make_client_transport_factory(
+      "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256");
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 51898);
+
+  std::vector<bool> accepted;
+  server_transport_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    accepted.push_back(!ec);
+    if (transport) {
+      transport->StartClose();
+    }
+    return accepted.size() < 2;
+  });
+
+  bool mismatched_failed = false;
+  bool matched_succeeded = false;
+  mismatched_factory->StartConnect(
+      endpoint,
+      [&](const ec_type& ec, const std::shared_ptr<TransportBase>&) {
+        mismatched_failed = static_cast<bool>(ec);
+        matched_factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+          matched_succeeded = !ec;
+          if (transport) {
+            transport->StartClose();
+          }
+        });
+      });
+  io_service->run();
+
+  BOOST_CHECK(mismatched_failed);
+  BOOST_CHECK(matched_succeeded);
+  BOOST_REQUIRE_EQUAL(2, accepted.size());
+  BOOST_CHECK(!accepted[0]);
+  BOOST_CHECK(accepted[1]);
+}
+
+BOOST_AUTO_TEST_CASE(test_invalid_ciphers) {
+  SslTransportFactoryBuilder builder;
+  BOOST_CHECK_THROW(builder.SetCipherList("NO-SUCH-CIPHER"),
+                    boost::system::system_error);
+  BOOST_CHECK_THROW(builder.SetGroups("no-such-group"),
+                    boost::system::system_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_handshake_pool) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto pool = HandshakePool::New(2, 16);
+  auto server_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.server.pem")
+                                      .LoadPrivateKey("test.server.key.pem")
+                                      .LoadDhParams("dh2048.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetHandshakeTimeout(
+                                          std::chrono::seconds(10))
+                                      .SetHandshakePool(pool)
+                                      .Build(io_service);
+  auto client_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.pem")
+                                      .LoadPrivateKey("test.key.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetVerifyHost("127.0.0.1")
+                                      .SetSessionCache(true)
+                                      .SetHandshakePool(pool)
+                                      .Build(io_service);
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 51910);
+
+  // the transports are back on the io_service of their factories
+  auto thread_id = std::this_thread::get_id();
+  std::string data = "data to client";
+  int n_accepted = 0;
+  server_transport_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    BOOST_CHECK(std::this_thread::get_id() == thread_id);
+    transport->StartWrite(data, [transport](const ec_type& ec, size_t) {
+      BOOST_CHECK(!ec);
+    });
+    return ++n_accepted < 4;
+  });
+
+  int n_received = 0;
+  for (int i = 0; i < 4; ++i) {
+    client_transport_factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+      BOOST_REQUIRE(!ec);
+      BOOST_CHECK(std::this_thread::get_id() == thread_id);
+      auto read_buf = std::make_shared<std::array<char, 64>>();
+      transport->StartRead(
+          *read_buf, data.size(), BYTES_CALLBACK(&, read_buf, transport) {
+            BOOST_CHECK(!ec);
+            BOOST_CHECK_EQUAL(data, std::string(read_buf->data(), n_bytes));
+            ++n_received;
+            transport->StartClose();
+          });
+    });
+  }
+  io_service->run();
+
+  BOOST_CHECK_EQUAL(4, n_accepted);
+  BOOST_CHECK_EQUAL(4, n_received);
+  BOOST_CHECK_EQUAL(0, pool->GetPendingCount());
+}
+
+BOOST_AUTO_TEST_CASE(test_handshake_pool_error) {
+  namespace ip = boost::asio::ip;
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto pool = HandshakePool::New(1, 16);
+  auto server_transport_factory = SslTransportFactoryBuilder()
+                                      .LoadCaFile("ca.pem")
+                                      .LoadCertChain("test.server.pem")
+                                      .LoadPrivateKey("test.server.key.pem")
+                                      .LoadDhParams("dh2048.pem")
+                                      .SetVerifyPeer(true)
+                                      .SetHandshakeTimeout(
+                                          std::chrono::seconds(10))
+                                      .SetHandshakePool(pool)
+                                      .Build(io_service);
+  AcceptLimits limits;
+  limits.max_connections = 1;
+  server_transport_factory->SetAcceptLimits(limits);
+  ip::tcp::endpoint endpoint(ip::address::from_string("127.0.0.1"), 51915);
+
+  // each failed handshake gives its connection back on this thread, letting
+  // the next one in
+  auto thread_id = std::this_thread::get_id();
+  int n_failed = 0;
+  bool accepted = false;
+  server_transport_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_CHECK(std::this_thread::get_id() == thread_id);
+    if (ec) {
+      ++n_failed;
+      return true;
+    }
+    accepted = true;
+    transport->StartClose();
+    return false;
+  });
+
+  std::vector<ip::tcp::socket> clients;
+  for (int i = 0; i < 3; ++i) {
+    clients.emplace_back(*io_service);
+    clients.back().connect(endpoint);
+    boost::asio::write(clients.back(),
+                       boost::asio::buffer(std::string("not a handshake")));
+  }
+  auto client_transport_factory = MakeClientTransportFactory(io_service);
+  bool connected = false;
+  client_transport_factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_CHECK(!ec);
+    connected = true;
+    if (transport) {
+      transport->StartClose();
+    }
+  });
+  io_service->run();
+
+  BOOST_CHECK_EQUAL(3, n_failed);
+  BOOST_CHECK(connected);
+  BOOST_CHECK(accepted);
+  BOOST_CHECK_EQUAL(0, pool->GetPendingCount());
+}
+
+BOOST_AUTO_TEST_CASE(test_handshake_pool_full) {
+  auto pool = HandshakePool::New(1, 2);
+  BOOST_CHECK(pool->Acquire());
+  BOOST_CHECK(pool->Acquire());
+  BOOST_CHECK(!pool->Acquire());
+  pool->Release();
+  BOOST_CHECK(pool->Acquire());
+  BOOST_CHECK_EQUAL(2, pool->GetPendingCount());
+
+  pool->Stop();
+  pool->Release();
+  BOOST_CHECK(!pool->Acquire());
+}
+
+BOOST_AUTO_TEST_CASE(test_stalled_handshake) {
+  namespace ip = boost::asio::ip;
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto server_transport_factory = MakeServerTransportFactory(io_service);
+  auto client_transport_factory = MakeClientTransportFactory(io_service);
+  ip::tcp::endpoint endpoint(ip::address::from_string("127.0.0.1"), 51919);
+
+  // a client sending nothing doesn't hold up the handshake of the next one
+  bool accepted = false;
+  server_transport_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    accepted = true;
+    transport->StartClose();
+    return false;
+  });
+  ip::tcp::socket silent(*io_service);
+  silent.connect(endpoint);
+  bool connected = false;
+  client_transport_factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_CHECK(!ec);
+    connected = true;
+    if (transport) {
+      transport->StartClose();
+    }
+  });
+
+  boost::asio::steady_timer deadline(*io_service, std::chrono::seconds(5));
+  bool timed_out = false;
+  deadline.async_wait([&timed_out](const ec_type& ec) { timed_out = !ec; });
+  while (!(accepted && connected) && !timed_out) {
+    io_service->run_one();
+  }
+  BOOST_CHECK(accepted);
+  BOOST_CHECK(connected);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 }  // namespace ssl
@@ -16,6 +16,12 @@
 /// Tests for tcp transport related classes.
 #include "tcp_transport.h"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <array>
 #include <chrono>
 #include <memory>
@@ -83,6 +89,37 @@ BOOST_FIXTURE_TEST_CASE(test_connect, WithEchoServer) {
   BOOST_CHECK(done);
 }
 
+BOOST_FIXTURE_TEST_CASE(test_gathered_write, WithEchoServer) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = TcpTransportFactory::New(io_service);
+
+  std::string header("header "), payload("and payload");
+  std::string data = header + payload;
+  char read_buf[64];
+
+  bool done = false;
+  factory->StartConnect(server.GetEndpoint(), TRANSPORT_CALLBACK(&) {
+    BOOST_CHECK(!ec);
+    transport->StartWrite(
+        {boost::asio::buffer(header), boost::asio::buffer(payload)},
+        BYTES_CALLBACK(&, transport) {
+          BOOST_CHECK(!ec);
+          BOOST_CHECK_EQUAL(data.size(), n_bytes);
+          transport->StartRead(read_buf, data.size(),
+                               BYTES_CALLBACK(&, transport) {
+                                 BOOST_CHECK(!ec);
+                                 BOOST_CHECK_EQUAL(
+                                     data, std::string(read_buf, n_bytes));
+                                 transport->StartClose();
+                                 done = true;
+                               });
+        });
+  });
+
+  io_service->run();
+  BOOST_CHECK(done);
+}
+
 BOOST_AUTO_TEST_CASE(test_accept) {
   boost::asio::ip::tcp::endpoint endpoint(
       boost::asio::ip::address::from_string("127.0.0.1"), 47919);
@@ -136,6 +173,54 @@ BOOST_AUTO_TEST_CASE(test_accept) {
   }
 }
 
+BOOST_FIXTURE_TEST_CASE(test_reuse_port, testing::TestTcpTransportFactory) {
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 51911);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto first = TcpTransportFactory::New(io_service);
+  auto second = TcpTransportFactory::New(io_service);
+  first->SetReusePort(true);
+  second->SetReusePort(true);
+
+  // both factories listen on the same port and share its connections
+  const int n_clients = 20;
+  int n_accepted = 0;
+  auto accept = TRANSPORT_CALLBACK(&) {
+    if (ec) {
+      return false;
+    }
+    transport->StartClose();
+    if (++n_accepted == n_clients) {
+      GetLastAcceptor(first).lock()->close();
+      GetLastAcceptor(second).lock()->close();
+    }
+    return true;
+  };
+  first->StartAccept(endpoint, accept);
+  BOOST_CHECK_NO_THROW(second->StartAccept(endpoint, accept));
+
+  std::thread client([&endpoint]() {
+    boost::asio::io_service client_service;
+    for (int i = 0; i < n_clients; ++i) {
+      boost::asio::ip::tcp::socket s(client_service);
+      s.connect(endpoint);
+    }
+  });
+  io_service->run();
+  client.join();
+  BOOST_CHECK_EQUAL(n_clients, n_accepted);
+
+  // without SO_REUSEPORT the port is taken by the first one
+  io_service->reset();
+  auto plain_first = TcpTransportFactory::New(io_service);
+  auto plain_second = TcpTransportFactory::New(io_service);
+  plain_first->StartAccept(endpoint, accept);
+  BOOST_CHECK_THROW(plain_second->StartAccept(endpoint, accept),
+                    boost::system::system_error);
+  GetLastAcceptor(plain_first).lock()->close();
+  io_service->run();
+}
+
 BOOST_FIXTURE_TEST_CASE(test_accept_error, testing::TestTcpTransportFactory) {
   boost::asio::ip::tcp::endpoint endpoint(
       boost::asio::ip::address::from_string("127.0.0.1"), 47999);
@@ -155,6 +240,176 @@ BOOST_FIXTURE_TEST_CASE(test_accept_error, testing::TestTcpTransportFactory) {
   BOOST_CHECK(called);
 }
 
+BOOST_AUTO_TEST_CASE(test_take_over_listening_sockets) {
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 47998);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto old_factory = TcpTransportFactory::New(io_service);
+  auto new_factory = TcpTransportFactory::New(io_service);
+
+  bool is_old_stopped = false;
+  old_factory->StartAccept(
+      endpoint, [&](const ec_type& ec, const std::shared_ptr<TransportBase>&) {
+        BOOST_CHECK_EQUAL(boost::asio::error::operation_aborted, ec.value());
+        is_old_stopped = true;
+        return false;
+      });
+  auto sockets = old_factory->GetListeningSockets();
+  BOOST_REQUIRE_EQUAL(1, sockets.size());
+
+  // a client connecting meanwhile is queued rather than refused
+  boost::asio::ip::tcp::socket client(*io_service);
+  client.connect(endpoint);
+
+  new_factory->AdoptListeningSockets({dup(sockets.front())});
+  bool is_accepted = false;
+  new_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_CHECK(!ec);
+    is_accepted = true;
+    transport->StartClose();
+    return false;
+  });
+  old_factory->StopAccepting();
+  BOOST_CHECK(old_factory->GetListeningSockets().empty());
+
+  io_service->run();
+  BOOST_CHECK(is_old_stopped);
+  BOOST_CHECK(is_accepted);
+}
+
+BOOST_AUTO_TEST_CASE(test_tcp_options) {
+  namespace ip = boost::asio::ip;
+  ip::tcp::endpoint endpoint(ip::address::from_string("127.0.0.1"), 47997);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  TcpOptions options;
+  options.fast_open = 16;
+  options.keepalive_idle = 30;
+  options.keepalive_interval = 5;
+  options.keepalive_count = 3;
+  options.notsent_lowat = 16384;
+  options.congestion = "reno";
+  auto server_factory = TcpTransportFactory::New(io_service);
+  server_factory->SetTcpOptions(options);
+  options.fast_open = 1;
+  auto client_factory = TcpTransportFactory::New(io_service);
+  client_factory->SetTcpOptions(options);
+
+  auto check_options = [](const std::shared_ptr<TransportBase>& transport) {
+    auto& socket = std::static_pointer_cast<TcpTransport>(transport)
+                       ->GetUnderlyingSocket();
+    boost::asio::socket_base::keep_alive keep_alive;
+    socket.get_option(keep_alive);
+    BOOST_CHECK(keep_alive.value());
+    int value = 0;
+    socklen_t size = sizeof(value);
+    getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_KEEPIDLE, &value,
+               &size);
+    BOOST_CHECK_EQUAL(30, value);
+    getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value,
+               &size);
+    BOOST_CHECK_EQUAL(16384, value);
+    char congestion[16] = {};
+    size = sizeof(congestion);
+    getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_CONGESTION, congestion,
+               &size);
+    BOOST_CHECK_EQUAL("reno", std::string(congestion));
+  };
+
+  // the accepted connection inherits the options of the listening socket
+  std::string received(5, '\0');
+  server_factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    check_options(transport);
+    transport->StartRead(
+        boost::asio::buffer(&received[0], received.size()),
+        [transport](const ec_type&, size_t) { transport->StartClose(); });
+    return false;
+  });
+  client_factory->StartConnect(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    check_options(transport);
+    transport->StartWrite(boost::asio::buffer("hello", 5),
+                          [transport](const ec_type& ec, size_t) {
+                            BOOST_CHECK(!ec);
+                            transport->StartClose();
+                          });
+  });
+  io_service->run();
+  BOOST_CHECK_EQUAL("hello", received);
+}
+
+BOOST_AUTO_TEST_CASE(test_accept_limits) {
+  namespace ip = boost::asio::ip;
+  ip::tcp::endpoint endpoint(ip::address::from_string("127.0.0.1"), 47996);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = TcpTransportFactory::New(io_service);
+  AcceptLimits limits;
+  limits.max_connections = 1;
+  factory->SetAcceptLimits(limits);
+
+  // the connections wait in the backlog until the accepted one is gone
+  std::shared_ptr<TransportBase> accepted;
+  boost::asio::steady_timer timer(*io_service);
+  int n_accepted = 0;
+  factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    BOOST_CHECK(!accepted);
+    accepted = transport;
+    timer.expires_from_now(std::chrono::milliseconds(20));
+    timer.async_wait([&accepted](const ec_type&) {
+      accepted->StartClose();
+      accepted.reset();
+    });
+    return ++n_accepted < 3;
+  });
+
+  std::vector<ip::tcp::socket> clients;
+  for (int i = 0; i < 3; ++i) {
+    clients.emplace_back(*io_service);
+    clients.back().connect(endpoint);
+  }
+  io_service->run();
+  BOOST_CHECK_EQUAL(3, n_accepted);
+}
+
+BOOST_AUTO_TEST_CASE(test_accept_backoff) {
+  namespace ip = boost::asio::ip;
+  ip::tcp::endpoint endpoint(ip::address::from_string("127.0.0.1"), 47995);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = TcpTransportFactory::New(io_service);
+
+  // the connection is accepted once descriptors are available again, rather
+  // than the accepting ending with EMFILE
+  boost::asio::steady_timer restore_timer(*io_service);
+  auto restore_time = std::chrono::steady_clock::time_point::max();
+  bool accepted = false;
+  factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    BOOST_CHECK(std::chrono::steady_clock::now() >= restore_time);
+    accepted = true;
+    transport->StartClose();
+    return false;
+  });
+  ip::tcp::socket client(*io_service);
+  client.connect(endpoint);
+
+  rlimit original;
+  BOOST_REQUIRE_EQUAL(0, getrlimit(RLIMIT_NOFILE, &original));
+  auto lowered = original;
+  lowered.rlim_cur = static_cast<rlim_t>(dup(0));  // lowest free descriptor
+  close(static_cast<int>(lowered.rlim_cur));
+  BOOST_REQUIRE_EQUAL(0, setrlimit(RLIMIT_NOFILE, &lowered));
+  restore_timer.expires_from_now(std::chrono::milliseconds(120));
+  restore_timer.async_wait([&](const ec_type&) {
+    restore_time = std::chrono::steady_clock::now();
+    setrlimit(RLIMIT_NOFILE, &original);
+  });
+  io_service->run();
+  setrlimit(RLIMIT_NOFILE, &original);
+
+  BOOST_CHECK(accepted);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 }  // namespace thestral
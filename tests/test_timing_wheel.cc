@@ -0,0 +1,163 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Tests for the timing wheel.
+#include "timing_wheel.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace thestral {
+
+namespace {
+typedef TimingWheel::ClockType ClockType;
+
+std::chrono::milliseconds ElapsedSince(ClockType::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      ClockType::now() - start);
+}
+}  // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(test_timing_wheel);
+
+BOOST_AUTO_TEST_CASE(test_expire) {
+  boost::asio::io_service io_service;
+  auto& wheel = boost::asio::use_service<TimingWheel>(io_service);
+
+  auto start = ClockType::now();
+  std::vector<int> fired;
+  std::vector<std::chrono::milliseconds> elapsed;
+  auto t1 = wheel.Start(std::chrono::milliseconds(300), [&]() {
+    fired.push_back(1);
+    elapsed.push_back(ElapsedSince(start));
+  });
+  auto t2 = wheel.Start(std::chrono::milliseconds(100), [&]() {
+    fired.push_back(2);
+    elapsed.push_back(ElapsedSince(start));
+  });
+  BOOST_CHECK_EQUAL(2, wheel.GetPendingCount());
+  BOOST_CHECK(t1.IsPending());
+
+  io_service.run();  // returns once no timer is pending
+  BOOST_CHECK_EQUAL(0, wheel.GetPendingCount());
+  BOOST_CHECK(!t1.IsPending());
+  BOOST_REQUIRE_EQUAL(2, fired.size());
+  BOOST_CHECK_EQUAL(2, fired[0]);
+  BOOST_CHECK_EQUAL(1, fired[1]);
+  // never early, and at most two ticks late
+  BOOST_CHECK_GE(elapsed[0].count(), 100);
+  BOOST_CHECK_GE(elapsed[1].count(), 300);
+  BOOST_CHECK_LE(elapsed[1].count(), 300 + 2 * 100 + 50);
+}
+
+BOOST_AUTO_TEST_CASE(test_cancel) {
+  boost::asio::io_service io_service;
+  auto& wheel = boost::asio::use_service<TimingWheel>(io_service);
+
+  bool fired = false;
+  auto t1 = wheel.Start(std::chrono::milliseconds(100),
+                        [&fired]() { fired = true; });
+  {
+    // cancelled by destruction
+    auto t2 = wheel.Start(std::chrono::milliseconds(100),
+                          [&fired]() { fired = true; });
+  }
+  BOOST_CHECK_EQUAL(1, wheel.GetPendingCount());
+  TimingWheel::Timer moved(std::move(t1));
+  BOOST_CHECK(!t1.IsPending());
+  BOOST_CHECK(moved.IsPending());
+  moved.Cancel();
+  BOOST_CHECK_EQUAL(0, wheel.GetPendingCount());
+
+  io_service.run();
+  BOOST_CHECK(!fired);
+}
+
+BOOST_AUTO_TEST_CASE(test_cancel_from_callback) {
+  boost::asio::io_service io_service;
+  auto& wheel = boost::asio::use_service<TimingWheel>(io_service);
+
+  // both expire in the same tick, whichever fires first cancels the other
+  int n_fired = 0;
+  std::unique_ptr<TimingWheel::Timer> t1(new TimingWheel::Timer);
+  std::unique_ptr<TimingWheel::Timer> t2(new TimingWheel::Timer);
+  *t1 = wheel.Start(std::chrono::milliseconds(100), [&]() {
+    ++n_fired;
+    t2.reset();
+  });
+  *t2 = wheel.Start(std::chrono::milliseconds(100), [&]() {
+    ++n_fired;
+    t1.reset();
+  });
+
+  io_service.run();
+  BOOST_CHECK_EQUAL(1, n_fired);
+}
+
+BOOST_AUTO_TEST_CASE(test_touch) {
+  boost::asio::io_service io_service;
+  auto& wheel = boost::asio::use_service<TimingWheel>(io_service);
+
+  auto start = ClockType::now();
+  std::chrono::milliseconds elapsed(0);
+  auto timer = wheel.Start(std::chrono::milliseconds(200),
+                           [&]() { elapsed = ElapsedSince(start); });
+
+  // keep the timer alive for a while longer than its timeout
+  boost::asio::steady_timer toucher(io_service);
+  int n_touches = 0;
+  std::function<void()> touch = [&]() {
+    toucher.expires_from_now(std::chrono::milliseconds(100));
+    toucher.async_wait([&](const boost::system::error_code&) {
+      timer.Touch();
+      if (++n_touches < 5) {
+        touch();
+      }
+    });
+  };
+  touch();
+
+  io_service.run();
+  BOOST_CHECK_GE(elapsed.count(), 500 + 200);
+}
+
+BOOST_AUTO_TEST_CASE(test_long_timeout) {
+  boost::asio::io_service io_service;
+  auto& wheel = boost::asio::use_service<TimingWheel>(io_service);
+
+  // further than a full turn of the wheel
+  auto timeout = TimingWheel::kTickInterval * (TimingWheel::kNumSlots + 3);
+  bool fired = false;
+  auto timer = wheel.Start(timeout, [&fired]() { fired = true; });
+  auto timer2 = wheel.Start(TimingWheel::kTickInterval * 3, [&]() {
+    // fires in the same slot, one turn before the long timer
+    BOOST_CHECK(timer.IsPending());
+    timer.Cancel();
+  });
+
+  io_service.run();
+  BOOST_CHECK(!fired);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
@@ -0,0 +1,134 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+/// @file
+/// Tests for tracing sessions.
+#include "trace.h"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+namespace thestral {
+namespace trace {
+
+namespace {
+
+/// Returns the line of the trace `id` in the output of RenderText(), or an
+/// empty string if there is none.
+std::string FindTrace(uint64_t id) {
+  char prefix[32];
+  std::snprintf(prefix, sizeof(prefix), "trace=%016llx ",
+                static_cast<unsigned long long>(id));
+  auto text = RenderText();
+  auto begin = text.find(prefix);
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  return text.substr(begin, text.find('\n', begin) - begin);
+}
+
+bool Contains(const std::string& text, const std::string& part) {
+  return text.find(part) != std::string::npos;
+}
+
+struct WithSampling {
+  WithSampling() { SetSampling(1); }
+  ~WithSampling() { SetSampling(0); }
+};
+
+}  // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(test_trace);
+
+BOOST_AUTO_TEST_CASE(test_disabled) {
+  SetSampling(0);
+  BOOST_CHECK(!IsEnabled());
+  BOOST_CHECK(!Trace::StartSampled(Trace::ClockType::now()));
+  BOOST_CHECK(!Trace::StartForwarded(42, Trace::ClockType::now()));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_sampling, WithSampling) {
+  SetSampling(4);
+  BOOST_CHECK(IsEnabled());
+  int n_sampled = 0;
+  for (int i = 0; i < 40; ++i) {
+    if (Trace::StartSampled(Trace::ClockType::now())) {
+      ++n_sampled;
+    }
+  }
+  BOOST_CHECK_EQUAL(10, n_sampled);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_record, WithSampling) {
+  auto trace = Trace::StartSampled(Trace::ClockType::now());
+  BOOST_REQUIRE(trace);
+  auto id = trace->GetId();
+  BOOST_CHECK_NE(0, id);
+  trace->Record(Event::kGreeting);
+  trace->Record(Event::kRequest);
+  trace->Record(Event::kGreeting);
+  trace->SetDescription("127.0.0.1:1 -> \"example.com\":80\n");
+  BOOST_CHECK(FindTrace(id).empty());
+
+  trace.reset();
+  auto line = FindTrace(id);
+  BOOST_TEST_MESSAGE(line);
+  BOOST_CHECK(Contains(line, " forwarded=0 "));
+  BOOST_CHECK(Contains(line, " session=\"127.0.0.1:1 -> ?example.com?:80?\" "));
+  BOOST_CHECK(!Contains(line, " greeting=- "));
+  BOOST_CHECK(!Contains(line, " request=- "));
+  BOOST_CHECK(Contains(line, " dns=- "));
+  BOOST_CHECK(Contains(line, " first_down=- "));
+  BOOST_CHECK(!Contains(line, " close=-"));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_forwarded, WithSampling) {
+  auto trace = Trace::StartForwarded(0x0123456789abcdef,
+                                     Trace::ClockType::now());
+  BOOST_REQUIRE(trace);
+  BOOST_CHECK_EQUAL(0x0123456789abcdef, trace->GetId());
+  trace.reset();
+  BOOST_CHECK(Contains(FindTrace(0x0123456789abcdef), " forwarded=1 "));
+
+  trace = Trace::StartSampled(Trace::ClockType::now());
+  BOOST_REQUIRE(trace);
+  trace->SetForwardedId(0xfedcba9876543210);
+  trace.reset();
+  BOOST_CHECK(Contains(FindTrace(0xfedcba9876543210), " forwarded=1 "));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_scope, WithSampling) {
+  BOOST_CHECK(!Current());
+  auto outer = Trace::StartSampled(Trace::ClockType::now());
+  auto inner = Trace::StartSampled(Trace::ClockType::now());
+  {
+    Scope outer_scope(outer);
+    BOOST_CHECK_EQUAL(outer, Current());
+    {
+      Scope inner_scope(inner);
+      BOOST_CHECK_EQUAL(inner, Current());
+    }
+    BOOST_CHECK_EQUAL(outer, Current());
+  }
+  BOOST_CHECK(!Current());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace trace
+}  // namespace thestral
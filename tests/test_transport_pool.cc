@@ -0,0 +1,82 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the pool of pre-established transports.
+#include "transport_pool.h"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "mocks.h"
+
+namespace thestral {
+
+BOOST_AUTO_TEST_SUITE(test_transport_pool);
+
+BOOST_AUTO_TEST_CASE(test_take_and_refill) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  std::vector<std::shared_ptr<testing::MockTransport>> transports;
+  for (int i = 0; i < 3; ++i) {
+    transports.push_back(factory->NewMockTransport());
+  }
+
+  auto pool = TransportPool::New(factory, 2, std::chrono::hours(1));
+  BOOST_CHECK(!pool->Take());  // not started yet
+
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 41829);
+  pool->Start(endpoint);
+  io_service->poll();
+  BOOST_CHECK_EQUAL(2, pool->GetIdleCount());
+  BOOST_CHECK(endpoint == factory->PopEndpoint());
+
+  // the oldest transport is taken first and replaced in the background
+  BOOST_CHECK(transports[0] == pool->Take());
+  io_service->poll();
+  BOOST_CHECK_EQUAL(2, pool->GetIdleCount());
+  BOOST_CHECK(transports[1] == pool->Take());
+  BOOST_CHECK(transports[2] == pool->Take());
+
+  // failing connections are not retried until the next use
+  io_service->poll();
+  BOOST_CHECK_EQUAL(0, pool->GetIdleCount());
+  BOOST_CHECK(!pool->Take());
+  BOOST_CHECK(!transports[0]->closed);
+}
+
+BOOST_AUTO_TEST_CASE(test_idle_timeout) {
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = std::make_shared<testing::MockTcpTransportFactory>(io_service);
+  auto transport1 = factory->NewMockTransport();
+  auto transport2 = factory->NewMockTransport();
+
+  auto pool = TransportPool::New(factory, 2, std::chrono::milliseconds(20));
+  pool->Start(boost::asio::ip::tcp::endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 41829));
+  io_service->run();  // returns once the idle transports have expired
+
+  BOOST_CHECK_EQUAL(0, pool->GetIdleCount());
+  BOOST_CHECK(transport1->closed);
+  BOOST_CHECK(transport2->closed);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
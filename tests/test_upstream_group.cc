@@ -0,0 +1,203 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for UpstreamGroup.
+#include "upstream_group.h"
+
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "mocks.h"
+#include "socks.h"
+
+namespace thestral {
+
+namespace {
+/// An upstream replying to requests with the queued errors, or with new
+/// transports once the queue is empty. A queued success comes without a
+/// transport. Like a SOCKS upstream, SOCKS replies are not its failures.
+class ScriptedUpstream : public UpstreamFactoryBase {
+ public:
+  explicit ScriptedUpstream(
+      const std::shared_ptr<boost::asio::io_service>& io_service_ptr)
+      : io_service_ptr_(io_service_ptr) {}
+
+  void StartRequest(const Address&,
+                    const RequestCallbackType& callback) override {
+    ++n_requests;
+    std::shared_ptr<TransportBase> transport;
+    ec_type ec;
+    if (errors.empty()) {
+      transport = testing::MockTransport::New(io_service_ptr_);
+    } else {
+      ec = errors.front();
+      errors.pop();
+    }
+    io_service_ptr_->post([callback, ec, transport]() {
+      callback(ec, transport);
+    });
+  }
+
+  std::shared_ptr<boost::asio::io_service> get_io_service_ptr() const override {
+    return io_service_ptr_;
+  }
+
+  bool IsUpstreamFailure(const ec_type& ec) const override {
+    return ec.category() != socks::error::GetSocksCategory();
+  }
+
+  bool CanHealthCheck() const override { return can_health_check; }
+
+  std::queue<ec_type> errors;
+  int n_requests = 0;
+  bool can_health_check = true;
+
+ private:
+  std::shared_ptr<boost::asio::io_service> io_service_ptr_;
+};
+
+struct WithTwoMembers {
+  WithTwoMembers()
+      : io_service(std::make_shared<boost::asio::io_service>()),
+        first(std::make_shared<ScriptedUpstream>(io_service)),
+        second(std::make_shared<ScriptedUpstream>(io_service)),
+        group(UpstreamGroup::New(
+            io_service, UpstreamGroup::Policy::kLeastOutstanding)) {
+    group->AddMember("first", first);
+    group->AddMember("second", second);
+  }
+
+  /// Makes a request and returns the resulting transport, if any.
+  std::shared_ptr<TransportBase> Request(ec_type* result = nullptr) {
+    typedef std::shared_ptr<TransportBase> TransportPtr;
+    TransportPtr transport;
+    group->StartRequest(
+        Address(), [&transport, result](const ec_type& ec, TransportPtr t) {
+          transport = t;
+          if (result) {
+            *result = ec;
+          }
+        });
+    io_service->reset();
+    io_service->run();
+    return transport;
+  }
+
+  std::shared_ptr<boost::asio::io_service> io_service;
+  std::shared_ptr<ScriptedUpstream> first;
+  std::shared_ptr<ScriptedUpstream> second;
+  std::shared_ptr<UpstreamGroup> group;
+};
+}  // anonymous namespace
+
+BOOST_FIXTURE_TEST_SUITE(test_upstream_group, WithTwoMembers);
+
+BOOST_AUTO_TEST_CASE(test_least_outstanding) {
+  auto session1 = Request();
+  auto session2 = Request();
+  BOOST_REQUIRE(session1 && session2);
+  BOOST_CHECK_EQUAL(1, first->n_requests);
+  BOOST_CHECK_EQUAL(1, second->n_requests);
+
+  // the member whose session has ended is preferred
+  session1.reset();
+  auto session3 = Request();
+  auto session4 = Request();
+  BOOST_CHECK_EQUAL(first->n_requests + second->n_requests, 4);
+  BOOST_CHECK_EQUAL(first->n_requests, second->n_requests);
+}
+
+BOOST_AUTO_TEST_CASE(test_retry_and_ejection) {
+  group->SetEjection(2, std::chrono::seconds(60));
+  for (int i = 0; i < 3; ++i) {
+    first->errors.push(boost::asio::error::connection_refused);
+  }
+
+  // the failures are hidden by retrying on the other member
+  for (int i = 0; i < 4; ++i) {
+    ec_type ec;
+    BOOST_CHECK(Request(&ec));
+    BOOST_CHECK(!ec);
+  }
+  BOOST_CHECK_EQUAL(1, group->CountAvailableMembers());
+  BOOST_CHECK_EQUAL(2, first->n_requests);
+  BOOST_CHECK_EQUAL(4, second->n_requests);
+}
+
+BOOST_AUTO_TEST_CASE(test_reply_is_not_member_failure) {
+  group->SetEjection(1, std::chrono::seconds(60));
+  auto refused =
+      socks::error::make_error_code(socks::ResponseCode::kConnectionRefused);
+  first->errors.push(refused);
+  second->errors.push(refused);
+
+  ec_type ec;
+  BOOST_CHECK(!Request(&ec));
+  BOOST_CHECK(ec == refused);
+  BOOST_CHECK_EQUAL(1, first->n_requests + second->n_requests);
+  BOOST_CHECK_EQUAL(2, group->CountAvailableMembers());
+}
+
+BOOST_AUTO_TEST_CASE(test_no_transport_is_member_failure) {
+  group->SetEjection(1, std::chrono::seconds(60));
+  first->errors.push(ec_type());
+  second->errors.push(ec_type());
+
+  ec_type ec;
+  BOOST_CHECK(!Request(&ec));
+  BOOST_CHECK(ec);
+  BOOST_CHECK_EQUAL(0, group->CountAvailableMembers());
+}
+
+BOOST_AUTO_TEST_CASE(test_health_check) {
+  group->SetEjection(1, std::chrono::seconds(60));
+  group->SetHealthCheck(Address(), std::chrono::milliseconds(50),
+                        std::chrono::seconds(5));
+  first->errors.push(boost::asio::error::timed_out);
+
+  auto run_for = [this](std::chrono::milliseconds duration) {
+    boost::asio::steady_timer timer(*io_service, duration);
+    timer.async_wait([this](const ec_type&) { io_service->stop(); });
+    io_service->reset();
+    io_service->run();
+  };
+  // ejected by the first check, then back after the next one
+  run_for(std::chrono::milliseconds(80));
+  BOOST_CHECK_EQUAL(1, group->CountAvailableMembers());
+  run_for(std::chrono::milliseconds(60));
+  BOOST_CHECK_EQUAL(2, group->CountAvailableMembers());
+  BOOST_CHECK_EQUAL(first->n_requests, 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_health_check_skipped) {
+  first->can_health_check = false;
+  group->SetHealthCheck(Address(), std::chrono::milliseconds(20),
+                        std::chrono::seconds(5));
+  boost::asio::steady_timer timer(*io_service, std::chrono::milliseconds(70));
+  timer.async_wait([this](const ec_type&) { io_service->stop(); });
+  io_service->run();
+  BOOST_CHECK_EQUAL(0, first->n_requests);
+  BOOST_CHECK_GE(second->n_requests, 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral
@@ -0,0 +1,263 @@
+// Copyright 2016 Richard Tsai
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+/// Tests for the transports doing their I/O through io_uring.
+#include "uring_transport.h"
+
+#if defined(THESTRAL_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#endif  // defined(THESTRAL_HAVE_IO_URING)
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "mocks.h"
+
+#define TRANSPORT_CALLBACK(...)    \
+  [__VA_ARGS__](const ec_type& ec, \
+                const std::shared_ptr<TransportBase>& transport)
+#define BYTES_CALLBACK(...) [__VA_ARGS__](const ec_type& ec, size_t n_bytes)
+
+namespace thestral {
+
+struct WithEchoServer {
+  testing::MockServer server;
+};
+
+BOOST_AUTO_TEST_SUITE(test_uring_transport);
+
+BOOST_FIXTURE_TEST_CASE(test_connect, WithEchoServer) {
+  if (!UringTransportFactory::IsSupported()) {
+    BOOST_TEST_MESSAGE("io_uring unsupported, skipped");
+    return;
+  }
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = UringTransportFactory::New(io_service);
+
+  std::string header("some data "), payload("some more data");
+  std::string data = header + payload;
+  char read_buf[64];
+
+  bool done = false;
+  factory->StartConnect(server.GetEndpoint(), TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    transport->StartWrite(
+        {boost::asio::buffer(header), boost::asio::buffer(payload)},
+        BYTES_CALLBACK(&, transport) {
+          BOOST_CHECK(!ec);
+          BOOST_CHECK_EQUAL(data.size(), n_bytes);
+
+          // read the first 10 bytes, then the rest with a short read
+          transport->StartRead(read_buf, 10, BYTES_CALLBACK(&, transport) {
+            BOOST_CHECK(!ec);
+            BOOST_CHECK_EQUAL(10, n_bytes);
+            transport->StartRead(
+                read_buf + n_bytes, sizeof(read_buf) - n_bytes,
+                BYTES_CALLBACK(&, transport) {
+                  BOOST_CHECK(!ec);
+                  BOOST_CHECK_EQUAL(data.size() - 10, n_bytes);
+                  BOOST_CHECK_EQUAL(data, std::string(read_buf, data.size()));
+                  transport->StartClose([&](const ec_type& ec) {
+                    BOOST_CHECK(!ec);
+                    done = true;
+                  });
+                },
+                true);
+          });
+        });
+  });
+
+  io_service->run();
+  BOOST_CHECK(done);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_close_aborts_read, WithEchoServer) {
+  if (!UringTransportFactory::IsSupported()) {
+    BOOST_TEST_MESSAGE("io_uring unsupported, skipped");
+    return;
+  }
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = UringTransportFactory::New(io_service);
+
+  // the echo server sends nothing unless asked
+  char read_buf[16];
+  bool done = false;
+  factory->StartConnect(server.GetEndpoint(), TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    transport->StartRead(read_buf, [&](const ec_type& ec, size_t) {
+      BOOST_CHECK(ec);
+      done = true;
+    });
+    transport->StartClose();
+  });
+
+  io_service->run();
+  BOOST_CHECK(done);
+}
+
+BOOST_AUTO_TEST_CASE(test_accept) {
+  if (!UringTransportFactory::IsSupported()) {
+    BOOST_TEST_MESSAGE("io_uring unsupported, skipped");
+    return;
+  }
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 47995);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = UringTransportFactory::New(io_service);
+
+  int n_clients = 20;
+  factory->StartAccept(endpoint, TRANSPORT_CALLBACK(&) {
+    BOOST_REQUIRE(!ec);
+    auto buf = std::make_shared<std::array<char, 64>>();
+    transport->StartRead(
+        *buf,
+        BYTES_CALLBACK(transport, buf) {
+          BOOST_CHECK(!ec);
+          transport->StartWrite(*buf, n_bytes,
+                                [transport](const ec_type& ec, size_t) {
+                                  BOOST_CHECK(!ec);
+                                  transport->StartClose();
+                                });
+        },
+        true);
+    return --n_clients > 0;
+  });
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < n_clients; ++i) {
+    threads.emplace_back([&endpoint, i]() {
+      boost::asio::io_service client_service;
+      boost::asio::ip::tcp::socket s(client_service);
+      s.connect(endpoint);
+      auto data = std::to_string(i);
+      auto len = boost::asio::write(s, boost::asio::buffer(data));
+      std::string received(len, '\0');
+      boost::asio::read(s, boost::asio::buffer(&received[0], len));
+      BOOST_CHECK_EQUAL(data, received);
+    });
+  }
+
+  io_service->run();
+  BOOST_CHECK_EQUAL(0, n_clients);
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_stop_accepting) {
+  if (!UringTransportFactory::IsSupported()) {
+    BOOST_TEST_MESSAGE("io_uring unsupported, skipped");
+    return;
+  }
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string("127.0.0.1"), 47994);
+  auto io_service = std::make_shared<boost::asio::io_service>();
+  auto factory = UringTransportFactory::New(io_service);
+
+  bool called = false;
+  factory->StartAccept(
+      endpoint, [&](const ec_type& ec, const std::shared_ptr<TransportBase>&) {
+        BOOST_CHECK_EQUAL(boost::asio::error::operation_aborted, ec.value());
+        called = true;
+        return true;
+      });
+  io_service->post([&factory]() { factory->StopAccepting(); });
+
+  io_service->run();
+  BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_CASE(test_fixed_file_reuse) {
+  if (!UringTransportFactory::IsSupported()) {
+    BOOST_TEST_MESSAGE("io_uring unsupported, skipped");
+    return;
+  }
+  boost::asio::io_service io_service;
+  auto& ring = boost::asio::use_service<impl::IoUring>(io_service);
+  boost::asio::ip::tcp::socket first(io_service), second(io_service);
+  first.open(boost::asio::ip::tcp::v4());
+  second.open(boost::asio::ip::tcp::v4());
+  auto index = ring.RegisterFile(first.native_handle());
+  if (index < 0) {
+    BOOST_TEST_MESSAGE("fixed files unavailable, skipped");
+    return;
+  }
+
+  // an index removed is not handed out again until released
+  BOOST_CHECK(ring.UnregisterFile(index));
+  auto other = ring.RegisterFile(second.native_handle());
+  BOOST_CHECK(other >= 0);
+  BOOST_CHECK_NE(index, other);
+  BOOST_CHECK(ring.UnregisterFile(other));
+  ring.ReleaseFile(other);
+  ring.ReleaseFile(index);
+  BOOST_CHECK_EQUAL(index, ring.RegisterFile(second.native_handle()));
+}
+
+#if defined(THESTRAL_HAVE_IO_URING)
+BOOST_AUTO_TEST_CASE(test_prepare_on_completion) {
+  if (!UringTransportFactory::IsSupported()) {
+    BOOST_TEST_MESSAGE("io_uring unsupported, skipped");
+    return;
+  }
+  struct NopOperation : impl::IoUring::Operation {
+    int n_completed = 0;
+    std::function<void()> on_complete;
+
+    void Complete(int, bool) override {
+      ++n_completed;
+      if (on_complete) {
+        decltype(on_complete) callback;
+        callback.swap(on_complete);
+        callback();
+      }
+    }
+  };
+
+  boost::asio::io_service io_service;
+  auto& ring = boost::asio::use_service<impl::IoUring>(io_service);
+  auto owner = std::make_shared<int>(0);
+  // more than both queues hold, so that the ring is full of completions
+  // while the completion of the first one is still preparing the others
+  std::vector<NopOperation> ops(impl::IoUring::kQueueDepth * 4);
+  ops[0].on_complete = [&]() {
+    for (std::size_t i = 1; i < ops.size(); ++i) {
+      ring.Prepare(&ops[i], IORING_OP_NOP, owner);
+    }
+  };
+  ring.Prepare(&ops[0], IORING_OP_NOP, owner);
+  io_service.run();
+
+  for (auto& op : ops) {
+    if (op.n_completed != 1) {
+      BOOST_ERROR("operation completed " << op.n_completed << " times");
+      break;
+    }
+  }
+  BOOST_CHECK_EQUAL(1, owner.use_count());
+}
+#endif  // defined(THESTRAL_HAVE_IO_URING)
+
+BOOST_AUTO_TEST_SUITE_END();
+
+}  // namespace thestral